@@ -2,9 +2,11 @@
 #define FCAM_ASYNCFILE_H
 
 #include <queue>
-#include <semaphore.h>
 #include <string>
+#include <vector>
 #include <pthread.h>
+#include <stddef.h>
+#include <tr1/memory>
 
 #include "Frame.h"
 
@@ -16,32 +18,133 @@ namespace FCam {
     class Lens;
     class Flash;
 
-    /** The AsyncFileWriter saves frames in a low priority background
-     * thread */
+    /** Options controlling how an \ref AsyncFileWriter spreads its
+     * work and how much memory it may hold on to. The defaults
+     * behave like a single background thread with an unbounded
+     * queue. */
+    struct AsyncFileWriterOptions {
+        /** What to do with a save request that would take the
+         * writer over its byte budget. */
+        enum Overflow {
+            /** Wait in the save call until enough earlier requests
+             * have finished. */
+            Block,
+            /** Drop the request, post a warning, and return false
+             * from the save call. */
+            Drop
+        };
+
+        AsyncFileWriterOptions() : workers(1), maxBytesPending(0), overflow(Block) {}
+
+        /** How many low priority threads save files at once. Zero
+         * means one per online CPU. */
+        int workers;
+        /** The most image data, in bytes, that may be queued or
+         * being saved at any one time. Zero means no limit. A single
+         * request larger than this is still accepted when nothing
+         * else is pending. */
+        size_t maxBytesPending;
+        /** What to do when a request doesn't fit in maxBytesPending. */
+        Overflow overflow;
+    };
+
+    /** A handle on the outcome of one save request made through an
+     * \ref AsyncFileWriter. Copies of a handle refer to the same
+     * request, and stay usable after the writer is gone. */
+    class AsyncSave {
+      public:
+        /** Where a save request has got to. */
+        enum Status {
+            Pending = 0, //!< Queued, or being saved
+            Saved,       //!< The file was written
+            Failed,      //!< The file wasn't written. The reason is posted as a FileSaveError event.
+            Dropped,     //!< Turned away because the writer was full
+            Cancelled    //!< Removed from the queue before it was saved
+        };
+
+        /** Make a handle that refers to no request, which reports
+         * itself as dropped */
+        AsyncSave();
+
+        /** Does this handle refer to a request? */
+        bool valid() const {return (bool)state;}
+
+        /** The file the request saves to */
+        const std::string &filename() const;
+
+        /** Where the request has got to. */
+        Status status() const;
+
+        /** Has the request reached its final status? */
+        bool done() const {return status() != Pending;}
+
+        /** Wait until the request reaches its final status, and
+         * return it. */
+        Status wait() const;
+
+        /** The size of the file written, in bytes, or zero if it
+         * wasn't saved. */
+        size_t bytesWritten() const;
+
+        /** How long the request took, in microseconds, from the save
+         * call until it reached its final status. */
+        int elapsed() const;
+
+      private:
+        friend class AsyncFileWriter;
+        struct State;
+        std::tr1::shared_ptr<State> state;
+    };
+
+    /** A function to call when a save request reaches its final
+     * status, along with the context pointer passed to the save
+     * call. */
+    typedef void (*AsyncSaveCallback)(AsyncSave save, void *context);
+
+    /** The AsyncFileWriter saves frames in low priority background
+     * threads. Each save call returns an \ref AsyncSave handle on
+     * its outcome, and can also take a callback. The callback of a
+     * request that is saved runs on the writer thread that saved it,
+     * once the handle is done, so it should hand any lengthy work
+     * on. Dropped and cancelled requests have their callbacks run by
+     * the save call or \ref cancel respectively. */
     class AsyncFileWriter {
       public:
         AsyncFileWriter();
+        AsyncFileWriter(const AsyncFileWriterOptions &options);
         ~AsyncFileWriter();
 
         /** Save a DNG in a background thread. */
-        void saveDNG(Frame, std::string filename);
-        void saveDNG(Image, std::string filename);
+        AsyncSave saveDNG(Frame, std::string filename,
+                          AsyncSaveCallback callback = NULL, void *context = NULL);
+        AsyncSave saveDNG(Image, std::string filename,
+                          AsyncSaveCallback callback = NULL, void *context = NULL);
 
         /** Save a JPEG in a background thread. You can optionally
          * pass a jpeg quality (0-100). */
-        void saveJPEG(Frame, std::string filename, int quality = 75);
-        void saveJPEG(Image, std::string filename, int quality = 75);
+        AsyncSave saveJPEG(Frame, std::string filename, int quality = 75,
+                           AsyncSaveCallback callback = NULL, void *context = NULL);
+        AsyncSave saveJPEG(Image, std::string filename, int quality = 75,
+                           AsyncSaveCallback callback = NULL, void *context = NULL);
 
         /** Save a raw dump in a background thread. */
-        void saveDump(Frame, std::string filename);
-        void saveDump(Image, std::string filename);
+        AsyncSave saveDump(Frame, std::string filename,
+                           AsyncSaveCallback callback = NULL, void *context = NULL);
+        AsyncSave saveDump(Image, std::string filename,
+                           AsyncSaveCallback callback = NULL, void *context = NULL);
+
+        /** How many save requests are pending (including the ones
+         * currently saving). A request stops counting, and gives
+         * back its bytes, just before its handle is done and its
+         * callback runs, so that the callback can save again. */
+        int savesPending();
 
-        /** How many save requests are pending (including the one
-         * currently saving) */
-        int savesPending() {return pending;}        
+        /** How many bytes of image data the pending save requests
+         * hold on to */
+        size_t bytesPending();
 
         /** Cancel all outstanding requests. The writer will finish
-         * saving the current request, but not save any more */
+         * saving the requests in progress, but not save any more */
         void cancel();
 
       private:
@@ -56,18 +159,31 @@ namespace FCam {
             std::string filename;
             enum {DNGFrame = 0, JPEGFrame, JPEGImage, DumpFrame, DumpImage} fileType;
             int quality;
+            size_t bytes;
+            AsyncSave handle;
         };
 
+        AsyncFileWriterOptions options;
+
         std::queue<SaveRequest> saveQueue;
         pthread_mutex_t saveQueueMutex;
-        sem_t *saveQueueSemaphore;
-
-        bool running, stop;
-        pthread_t thread;
-
+        // Signalled when a request is queued, or when stopping
+        pthread_cond_t requestQueued;
+        // Signalled when a request finishes or is cancelled
+        pthread_cond_t requestDone;
+
+        bool stop;
+        std::vector<pthread_t> threads;
+
+        void start();
+        void complete(SaveRequest &r, AsyncSave::Status status, size_t bytes);
+        AsyncSave enqueue(SaveRequest &r, Image im,
+                          AsyncSaveCallback callback, void *context);
         void run();
 
-        int pending;
+        // Changed atomically, so they can be read without the lock
+        volatile int pending;
+        volatile size_t pendingBytes;
     };
 
 }
@@ -110,7 +110,9 @@ while (FCam::getNextEvent(&event)) {
     bool getNextEvent(Event *);
     /** Get the next event of a given type. Returns false and does not
      * alter the Event argument if no events of that type are
-     * currently in the event queue. */
+     * currently in the event queue. This and the other filtered forms
+     * find the oldest matching event without looking at the others,
+     * so they stay fast however many other events are pending. */
     bool getNextEvent(Event *, int type);
     /** Get the next event of a given type and with a specific data
      * field. Returns false and does not alter the Event argument if
@@ -149,9 +151,6 @@ while (FCam::getNextEvent(&event)) {
 
     /** Post a warning event with no creator, using printf-style arguments. */
     void warning(int code, const char *fmt, ...);    
-
-    /** The global event queue */
-    extern TSQueue<Event> _eventQueue;
 }
 
 #endif
@@ -54,6 +54,11 @@ namespace FCam {
         // platform data necessary for interpreting this frame.
         virtual const Platform &platform() const = 0;
 
+        // Frames that read their image data on demand, such as DNG
+        // files opened with \ref loadDNGMetadata, override this to
+        // fill in image the first time it is asked for.
+        virtual void loadImage() {}
+
         /** A Frame debugging dump function. Prints out all Frame
          * fields and details of the included Image */
         virtual void debug(const char *name="") const;
@@ -89,7 +94,7 @@ namespace FCam {
 
         /** The actual image data. Check image().valid() before using
          * it, image data can be dropped in a variety of cases. */
-        Image image() const {return ptr->image;}
+        Image image() const {ptr->loadImage(); return ptr->image;}
         
         /** The time the earliest pixel in the image started exposing. */
         Time exposureStartTime() const {return ptr->exposureStartTime;}
@@ -11,6 +11,8 @@
 
 namespace FCam {
 
+    class FrameBufferPool;
+
     /** A reference-counted Image object.
      *
      * Images are stored in row-major order, with the origin is the
@@ -21,7 +23,9 @@ namespace FCam {
      * If you instantiate an image using one of the constructors that
      * allocates data, the result will be a reference counted image
      * object, that automatically deletes the data when the last
-     * reference to it is destroyed.
+     * reference to it is destroyed. References are counted
+     * atomically, so copies of an image may be made and dropped from
+     * different threads at once.
      * 
      * If you use a constructor that sets the data field, you're
      * telling the image class that someone else is managing that
@@ -171,6 +175,15 @@ namespace FCam {
 	 * changing the image data also changes the file. */
 	Image(int fd, int offset, Size, ImageFormat, bool writeThrough = false);
 
+        /** Set how much memory the buffers of destroyed images may
+         * hold on to. The allocating constructors take their buffers
+         * from, and return them to, a cache sorted into size classes,
+         * so that a stream of same-sized frames doesn't go back to
+         * the system allocator for every one. The default is 32
+         * MB. Zero turns the cache off and frees what it holds.
+         */
+        static void setBufferCacheLimit(size_t bytes);
+
         /** Returns an Image containing a copy of the current Image's
          * data. Useful for converting an Image with a weak reference
          * to an Image with a strong reference to its data.  This
@@ -216,6 +229,18 @@ namespace FCam {
          */
         Image subImage(unsigned int x, unsigned int y, Size) const;
 
+        /** Returns an image of any size and format that points into
+         *  the buffer of the current image, starting a number of
+         *  bytes after its first pixel, with rows srcBytesPerRow
+         *  apart (tightly packed by default). Like a subimage, it
+         *  shares the underlying buffer, which stays alive as long
+         *  as either image does. This is how the images inside a
+         *  memory mapped file are handed out without copying
+         *  them. Returns an invalid image if the view would not fit
+         *  inside the current image.
+         */
+        Image view(unsigned int offset, Size, ImageFormat, int srcBytesPerRow=-1) const;
+
         /** Become a new reference to an existing image. This never
          * copies image data. It just produces a new reference to the
          * same data, with the same properties. 
@@ -348,32 +373,29 @@ namespace FCam {
          */
         unsigned char *data;
         
-        /** A pointer to the start of the memory buffer storing the
-         * image data.  In case of windowed images, this is not equal
-         * to data.
-         */
-        unsigned char *buffer;
-        unsigned int bytesAllocated;
-
-        // Reference counting mechanisms
-        unsigned int *refCount;
-        pthread_mutex_t *mutex; 
-
-        // Is this a weak reference to somebody else's data?
-        bool weak() {
-            return (buffer == NULL);
-        }
-
-	// Is this a memory mapped image?
-	bool memMapped;
+        // The reference count, lock, and memory of the image
+        // buffer, shared by every reference to it. For images that
+        // allocate their own data it lives in the same allocation as
+        // the pixels, so making and dropping references never touches
+        // the heap. NULL for Discard and AutoAllocate images.
+        struct Buffer;
+        Buffer *shared;
 
         // Does this reference currently have the image locked?
         bool holdingLock;
 
-        /** Make the image refer to data stored elsewhere. Internally
-         *  used by the constructors to centralize some common operations
+        /** Make the image a reference to a different buffer, with
+         *  its data starting at d. Internally used by the
+         *  constructors to centralize some common operations.
          */         
-        void setBuffer(unsigned char *b, unsigned char *d=NULL);
+        void setBuffer(Buffer *b, unsigned char *d);
+
+        // Give a new image its own buffer
+        void allocate();
+
+        // Sensors hand out frames in buffers from their pool
+        friend class FrameBufferPool;
+        Image(Size, ImageFormat, Buffer *);
 
     };
 
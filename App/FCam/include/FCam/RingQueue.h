@@ -0,0 +1,501 @@
+#ifndef FCAM_RINGQUEUE_H
+#define FCAM_RINGQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#if !defined(FCAM_PLATFORM_OSX) && !defined(FCAM_PLATFORM_CYGWIN)
+#define FCAM_RINGQUEUE_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifndef FUTEX_WAIT_PRIVATE
+#define FUTEX_WAIT_PRIVATE FUTEX_WAIT
+#define FUTEX_WAKE_PRIVATE FUTEX_WAKE
+#endif
+#endif
+
+/** \file
+ * Bounded lock-free queues, for passing items such as frame requests
+ * between threads without taking a lock on every push and pull. They
+ * are alternatives to \ref FCam::TSQueue for queues that only need to
+ * be pushed to at the back and pulled from the front. Items are
+ * stored in a fixed ring of slots, so pushing to a full queue fails
+ * or waits, rather than growing it. Waiting for an item or for room
+ * sleeps in the kernel (on a futex where there is one), and a push or
+ * pull only makes a system call when some thread is actually
+ * waiting. */
+
+namespace FCam {
+
+    /** Lets threads sleep until some condition on a lock-free
+     * structure might have become true, without the threads making
+     * it true having to take a lock. Used by the ring queues. */
+    class QueueSignal {
+      public:
+        QueueSignal() : generation(0), waiters(0) {
+#ifndef FCAM_RINGQUEUE_FUTEX
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+#endif
+        }
+
+        ~QueueSignal() {
+#ifndef FCAM_RINGQUEUE_FUTEX
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+#endif
+        }
+
+        /** Wake every thread waiting in waitUntil. Call after making
+         * the condition true. Cheap when nobody is waiting. */
+        void notify() {
+            // The barrier orders the change to the condition before
+            // the check for waiters, just as a waiter registers
+            // before checking the condition. So either we see the
+            // waiter, or it sees the change.
+            __sync_synchronize();
+            if (!waiters) return;
+#ifdef FCAM_RINGQUEUE_FUTEX
+            __sync_fetch_and_add(&generation, 1);
+            syscall(SYS_futex, &generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+            pthread_mutex_lock(&mutex);
+            generation++;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+#endif
+        }
+
+        /** Wait until ready(context) returns true, or until timeout
+         * microseconds have passed. Zero means no timeout. Returns
+         * whether the condition was seen to be true. */
+        bool waitUntil(bool (*ready)(const void *), const void *context, unsigned timeout = 0) {
+            if (ready(context)) return true;
+
+            struct timeval deadline;
+            if (timeout) {
+                gettimeofday(&deadline, NULL);
+                deadline.tv_usec += timeout % 1000000;
+                deadline.tv_sec += timeout / 1000000 + deadline.tv_usec / 1000000;
+                deadline.tv_usec %= 1000000;
+            }
+
+            while (1) {
+                int key = generation;
+                __sync_fetch_and_add(&waiters, 1);
+                if (ready(context)) {
+                    __sync_fetch_and_sub(&waiters, 1);
+                    return true;
+                }
+
+                long remaining = 0;
+                if (timeout) {
+                    struct timeval now;
+                    gettimeofday(&now, NULL);
+                    remaining = (deadline.tv_sec - now.tv_sec) * 1000000L + (deadline.tv_usec - now.tv_usec);
+                    if (remaining <= 0) {
+                        __sync_fetch_and_sub(&waiters, 1);
+                        return ready(context);
+                    }
+                }
+
+                block(key, remaining);
+                __sync_fetch_and_sub(&waiters, 1);
+            }
+        }
+
+      private:
+        volatile int generation;
+        volatile int waiters;
+#ifndef FCAM_RINGQUEUE_FUTEX
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+#endif
+
+        // Sleep until the generation moves on from key, for at most
+        // the given number of microseconds if it's not zero. May
+        // return early.
+        void block(int key, long usecs) {
+#ifdef FCAM_RINGQUEUE_FUTEX
+            struct timespec timeout;
+            timeout.tv_sec = usecs / 1000000;
+            timeout.tv_nsec = (usecs % 1000000) * 1000;
+            syscall(SYS_futex, &generation, FUTEX_WAIT_PRIVATE, key, usecs ? &timeout : NULL, NULL, 0);
+#else
+            struct timeval now;
+            struct timespec deadline;
+            gettimeofday(&now, NULL);
+            long usec = now.tv_usec + usecs % 1000000;
+            deadline.tv_sec = now.tv_sec + usecs / 1000000 + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+            pthread_mutex_lock(&mutex);
+            if (generation == key) {
+                if (usecs) pthread_cond_timedwait(&cond, &mutex, &deadline);
+                else pthread_cond_wait(&cond, &mutex);
+            }
+            pthread_mutex_unlock(&mutex);
+#endif
+        }
+
+        QueueSignal(const QueueSignal &);
+        QueueSignal &operator=(const QueueSignal &);
+    };
+
+    /** The size of a cache line, which the ring queues keep the
+     * indices written by different threads apart by, so that they
+     * don't bounce the same line between cores. */
+    enum {QueueCacheLine = 64};
+
+    /** A bounded lock-free queue for exactly one producer thread and
+     * one consumer thread at a time. push, tryPush and waitForRoom
+     * may only be called by the producer, and the rest of the
+     * methods other than size, empty and capacity only by the
+     * consumer. */
+    template<typename T>
+    class SPSCQueue {
+      public:
+        /** Make a queue that holds up to capacity items, rounded up
+         * to a power of two. */
+        explicit SPSCQueue(size_t capacity = 256);
+        ~SPSCQueue();
+
+        /** Add a copy of an item to the back of the queue, if it
+         * isn't full. Returns whether it was added. */
+        bool tryPush(const T &val);
+        /** Add a copy of an item to the back of the queue, waiting
+         * for room if it is full. */
+        void push(const T &val);
+
+        /** Remove the frontmost item from the queue into *val, if
+         * there is one. Returns whether there was. */
+        bool tryPull(T *val);
+        /** Wait for the queue not to be empty, then remove and
+         * return its frontmost item. */
+        T pull();
+
+        /** The frontmost item of the queue, which stays there. Behavior
+         * not defined if the queue is empty. */
+        T &front();
+        /** Remove the frontmost item. Behavior not defined if the
+         * queue is empty. */
+        void pop();
+
+        /** Waits until there are items in the queue. The optional
+         * timeout is in microseconds, zero means no timeout. Returns
+         * whether there are. */
+        bool wait(unsigned timeout = 0);
+        /** Waits until the queue is not full, with a timeout as for
+         * wait. */
+        bool waitForRoom(unsigned timeout = 0);
+
+        /** The number of items in the queue. Only a snapshot if other
+         * threads are using the queue. */
+        size_t size() const;
+        bool empty() const {return size() == 0;}
+        size_t capacity() const {return mask + 1;}
+
+      private:
+        T *slots;
+        size_t mask;
+
+        char pad0[QueueCacheLine];
+        // The next slot to pull from, and the consumer's last look at
+        // tail
+        volatile size_t head;
+        size_t tailSeen;
+        char pad1[QueueCacheLine];
+        // The next slot to push to, and the producer's last look at
+        // head
+        volatile size_t tail;
+        size_t headSeen;
+        char pad2[QueueCacheLine];
+
+        QueueSignal notEmpty, notFull;
+
+        static bool hasItems(const void *q) {return !((const SPSCQueue *)q)->empty();}
+        static bool hasRoom(const void *q) {
+            const SPSCQueue *self = (const SPSCQueue *)q;
+            return self->size() <= self->mask;
+        }
+
+        SPSCQueue(const SPSCQueue &);
+        SPSCQueue &operator=(const SPSCQueue &);
+    };
+
+    /** A bounded lock-free queue for any number of producer and
+     * consumer threads. Each slot carries a sequence number that
+     * says whether it is ready to be pushed to or pulled from on the
+     * current lap of the ring, so producers only contend with each
+     * other on the index of the back of the queue, and consumers on
+     * that of the front. */
+    template<typename T>
+    class MPMCQueue {
+      public:
+        /** Make a queue that holds up to capacity items, rounded up
+         * to a power of two of at least two. */
+        explicit MPMCQueue(size_t capacity = 256);
+        ~MPMCQueue();
+
+        /** Add a copy of an item to the back of the queue, if it
+         * isn't full. Returns whether it was added. */
+        bool tryPush(const T &val);
+        /** Add a copy of an item to the back of the queue, waiting
+         * for room if it is full. */
+        void push(const T &val);
+
+        /** Remove the frontmost item from the queue into *val, if
+         * there is one. Returns whether there was. */
+        bool tryPull(T *val);
+        /** Wait for the queue not to be empty, then remove and
+         * return its frontmost item. */
+        T pull();
+
+        /** Waits until there are items in the queue. The optional
+         * timeout is in microseconds, zero means no timeout. Returns
+         * whether there are, though another consumer may take them
+         * first. */
+        bool wait(unsigned timeout = 0);
+        /** Waits until the queue is not full, with a timeout as for
+         * wait. */
+        bool waitForRoom(unsigned timeout = 0);
+
+        /** The number of items in the queue. Only a snapshot if other
+         * threads are using the queue. */
+        size_t size() const;
+        bool empty() const {return size() == 0;}
+        size_t capacity() const {return mask + 1;}
+
+      private:
+        struct Slot {
+            volatile size_t sequence;
+            T value;
+        };
+        Slot *slots;
+        size_t mask;
+
+        char pad0[QueueCacheLine];
+        volatile size_t head;
+        char pad1[QueueCacheLine];
+        volatile size_t tail;
+        char pad2[QueueCacheLine];
+
+        QueueSignal notEmpty, notFull;
+
+        static bool hasItems(const void *q) {return !((const MPMCQueue *)q)->empty();}
+        static bool hasRoom(const void *q) {
+            const MPMCQueue *self = (const MPMCQueue *)q;
+            return self->size() <= self->mask;
+        }
+
+        MPMCQueue(const MPMCQueue &);
+        MPMCQueue &operator=(const MPMCQueue &);
+    };
+
+    inline size_t queueCapacity(size_t capacity) {
+        size_t c = 2;
+        while (c < capacity) c *= 2;
+        return c;
+    }
+
+    template<typename T>
+    SPSCQueue<T>::SPSCQueue(size_t capacity) :
+        head(0), tailSeen(0), tail(0), headSeen(0) {
+        capacity = queueCapacity(capacity);
+        slots = new T[capacity];
+        mask = capacity - 1;
+    }
+
+    template<typename T>
+    SPSCQueue<T>::~SPSCQueue() {
+        delete[] slots;
+    }
+
+    template<typename T>
+    bool SPSCQueue<T>::tryPush(const T &val) {
+        size_t t = tail;
+        if (t - headSeen > mask) {
+            headSeen = head;
+            if (t - headSeen > mask) return false;
+            // Don't overwrite the slot until the consumer is done
+            // reading it
+            __sync_synchronize();
+        }
+        slots[t & mask] = val;
+        // Publish the item before the index that makes it visible
+        __sync_synchronize();
+        tail = t + 1;
+        notEmpty.notify();
+        return true;
+    }
+
+    template<typename T>
+    void SPSCQueue<T>::push(const T &val) {
+        while (!tryPush(val)) notFull.waitUntil(hasRoom, this);
+    }
+
+    template<typename T>
+    bool SPSCQueue<T>::tryPull(T *val) {
+        if (head == tailSeen) {
+            tailSeen = tail;
+            if (head == tailSeen) return false;
+            __sync_synchronize();
+        }
+        *val = front();
+        pop();
+        return true;
+    }
+
+    template<typename T>
+    T SPSCQueue<T>::pull() {
+        T val;
+        while (!tryPull(&val)) notEmpty.waitUntil(hasItems, this);
+        return val;
+    }
+
+    template<typename T>
+    T &SPSCQueue<T>::front() {
+        if (head == tailSeen) {
+            tailSeen = tail;
+            __sync_synchronize();
+        }
+        return slots[head & mask];
+    }
+
+    template<typename T>
+    void SPSCQueue<T>::pop() {
+        size_t h = head;
+        // Let go of whatever the item refers to now, not when the
+        // slot is next reused
+        slots[h & mask] = T();
+        __sync_synchronize();
+        head = h + 1;
+        notFull.notify();
+    }
+
+    template<typename T>
+    bool SPSCQueue<T>::wait(unsigned timeout) {
+        return notEmpty.waitUntil(hasItems, this, timeout);
+    }
+
+    template<typename T>
+    bool SPSCQueue<T>::waitForRoom(unsigned timeout) {
+        return notFull.waitUntil(hasRoom, this, timeout);
+    }
+
+    template<typename T>
+    size_t SPSCQueue<T>::size() const {
+        // Read head first, so that a racing pull can't make the
+        // difference negative
+        size_t h = head;
+        __sync_synchronize();
+        return tail - h;
+    }
+
+    template<typename T>
+    MPMCQueue<T>::MPMCQueue(size_t capacity) : head(0), tail(0) {
+        capacity = queueCapacity(capacity);
+        slots = new Slot[capacity];
+        mask = capacity - 1;
+        for (size_t i = 0; i < capacity; i++) slots[i].sequence = i;
+    }
+
+    template<typename T>
+    MPMCQueue<T>::~MPMCQueue() {
+        delete[] slots;
+    }
+
+    template<typename T>
+    bool MPMCQueue<T>::tryPush(const T &val) {
+        size_t pos = tail;
+        Slot *slot;
+        while (1) {
+            slot = &slots[pos & mask];
+            // A slot is free for the push at pos once its sequence
+            // has caught up with pos, and still full from the last
+            // lap if it's behind.
+            intptr_t lag = (intptr_t)(slot->sequence - pos);
+            if (lag == 0) {
+                // The compare and swap is a full barrier, so nothing
+                // below happens before it
+                if (__sync_bool_compare_and_swap(&tail, pos, pos + 1)) break;
+                pos = tail;
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = tail;
+            }
+        }
+        slot->value = val;
+        __sync_synchronize();
+        slot->sequence = pos + 1;
+        notEmpty.notify();
+        return true;
+    }
+
+    template<typename T>
+    void MPMCQueue<T>::push(const T &val) {
+        while (!tryPush(val)) notFull.waitUntil(hasRoom, this);
+    }
+
+    template<typename T>
+    bool MPMCQueue<T>::tryPull(T *val) {
+        size_t pos = head;
+        Slot *slot;
+        while (1) {
+            slot = &slots[pos & mask];
+            // A slot holds the item for the pull at pos once its
+            // sequence is one past pos
+            intptr_t lag = (intptr_t)(slot->sequence - (pos + 1));
+            if (lag == 0) {
+                if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) break;
+                pos = head;
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = head;
+            }
+        }
+        *val = slot->value;
+        slot->value = T();
+        __sync_synchronize();
+        // Ready for the push one lap later
+        slot->sequence = pos + mask + 1;
+        notFull.notify();
+        return true;
+    }
+
+    template<typename T>
+    T MPMCQueue<T>::pull() {
+        T val;
+        while (!tryPull(&val)) notEmpty.waitUntil(hasItems, this);
+        return val;
+    }
+
+    template<typename T>
+    bool MPMCQueue<T>::wait(unsigned timeout) {
+        return notEmpty.waitUntil(hasItems, this, timeout);
+    }
+
+    template<typename T>
+    bool MPMCQueue<T>::waitForRoom(unsigned timeout) {
+        return notFull.waitUntil(hasRoom, this, timeout);
+    }
+
+    template<typename T>
+    size_t MPMCQueue<T>::size() const {
+        // Read head first, so that a racing pull can't make the
+        // difference negative
+        size_t h = head;
+        __sync_synchronize();
+        return tail - h;
+    }
+
+}
+
+#endif
@@ -6,12 +6,14 @@
 
 #include "Base.h"
 #include <vector>
+#include <pthread.h>
 #include "Device.h"
 #include "Frame.h"
 
 namespace FCam {
 
     class Shot;
+    class FrameBufferPool;
 
     /** A base class for image sensors. Takes shots via \ref Sensor::capture and \ref Sensor::stream, and returns frames via \ref Sensor::getFrame. */
     class Sensor : public Device {
@@ -69,6 +71,47 @@ namespace FCam {
         /** Get which frames will be dropped if the frame limit is exceeded. */
         DropPolicy getDropPolicy();
 
+        /** Keep a pool of image buffers for the frames of shots whose
+         * image is AutoAllocate, instead of allocating a new buffer
+         * for every frame. \a count page-aligned buffers, each big
+         * enough for an image of the given size and format, are
+         * allocated and touched up front, and locked into memory if
+         * \a lockMemory is set (which may need extra privileges; a
+         * warning is posted if it fails). A buffer goes back to the
+         * pool when the last Image referring to it, including those in
+         * Frames, is destroyed, so hold on to as few frames as you
+         * can. If every buffer is out when a frame arrives, the sensor
+         * waits up to \a waitTimeout microseconds for one to come
+         * back, and then falls back to allocating the image
+         * normally. Frames that don't fit in a buffer are also
+         * allocated normally. A count of zero removes the pool.
+         * Frames already handed out keep their buffers until they're
+         * destroyed. */
+        void setBufferPool(int count, Size size, ImageFormat format, 
+                           bool lockMemory = false, int waitTimeout = 10000);
+
+        /** Statistics on the buffer pool set with \ref
+         * FCam::Sensor::setBufferPool "setBufferPool". */
+        struct BufferPoolStats {
+            BufferPoolStats() : buffers(0), available(0), hits(0), waits(0), misses(0) {}
+            /** The number of buffers in the pool. */
+            int buffers;
+            /** How many of them are free right now. */
+            int available;
+            /** The number of AutoAllocate frames given a pool buffer. */
+            unsigned hits;
+            /** How many times the sensor had to wait for a buffer to
+             * come back. */
+            unsigned waits;
+            /** The number of AutoAllocate frames that had to be
+             * allocated normally. */
+            unsigned misses;
+        };
+
+        /** Get statistics on the current buffer pool. They start
+         * from zero every time the pool is set. */
+        BufferPoolStats bufferPoolStats();
+
         /** Get the next frame. We promise that precisely one frame
          * will come back per time capture is called. A
          * reference-counted shared pointer object is returned, so you
@@ -148,6 +191,15 @@ namespace FCam {
         virtual void enforceDropPolicy() = 0;
         DropPolicy dropPolicy;
         size_t frameLimit;
+
+        // Make the image for a frame of an AutoAllocate shot, from
+        // the buffer pool if there is one.
+        Image allocateFrameImage(Size, ImageFormat);
+
+    private:
+        FrameBufferPool *bufferPool;
+        int bufferPoolTimeout;
+        pthread_mutex_t bufferPoolMutex;
     };
 
 }
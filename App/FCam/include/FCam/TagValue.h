@@ -53,6 +53,10 @@ namespace FCam {
         TagValue(std::vector<std::string>);
         TagValue(std::vector<FCam::Time>);
         TagValue(const TagValue &);
+#if __cplusplus >= 201103L
+        /** Take over the value of another TagValue, leaving it Null. */
+        TagValue(TagValue &&);
+#endif
         //@}
 
         /** @name Assignment
@@ -72,7 +76,15 @@ namespace FCam {
         const TagValue &operator=(const std::vector<std::string> &);
         const TagValue &operator=(const std::vector<FCam::Time> &);
         const TagValue &operator=(const TagValue &);
+#if __cplusplus >= 201103L
+        const TagValue &operator=(TagValue &&);
+#endif
         //@}
+
+        /** Exchange values with another TagValue. This never copies
+         * or allocates, so it's the cheap way to move a large value
+         * (a long vector, say) into or out of a TagMap. */
+        void swap(TagValue &);
         
         /** @name Cast Operators
          * 
@@ -154,12 +166,36 @@ tag.asIntVector().push_back(3);
         /** The type of this tag. */
         Type type;
 
-        /** A pointer to the actual value of this tag. */
+        /** A pointer to the actual value of this tag. The value is
+         * stored inside the TagValue itself, so this is only valid
+         * for as long as the TagValue is, and a copy of the TagValue
+         * has its own. */
         void *data;
 
     private:
         void nullify();
 
+        // Hand our value over to a Null TagValue without copying it,
+        // leaving us Null
+        void moveTo(TagValue &empty);
+
+        // Every type of value is constructed in place in here, so
+        // scalars, Times and short strings never touch the heap
+        union {
+            char intBytes[sizeof(int)];
+            char doubleBytes[sizeof(double)];
+            char timeBytes[sizeof(FCam::Time)];
+            char stringBytes[sizeof(std::string)];
+            char intVectorBytes[sizeof(std::vector<int>)];
+            char floatVectorBytes[sizeof(std::vector<float>)];
+            char doubleVectorBytes[sizeof(std::vector<double>)];
+            char stringVectorBytes[sizeof(std::vector<std::string>)];
+            char timeVectorBytes[sizeof(std::vector<FCam::Time>)];
+            double alignDouble;
+            long alignLong;
+            void *alignPointer;
+        } storage;
+
 
         // Dummy objects to return references to. Set them to zero or
         // clear them before returning a reference to them.
@@ -3,6 +3,7 @@
 
 #include "../Frame.h"
 #include <string>
+#include <pthread.h>
 
 /** \file 
  * Loading and saving DNG files. All metadata, including all
@@ -56,6 +57,14 @@ namespace FCam {
         const std::string &manufacturer() const {return dng.manufacturer;}
         const std::string &model() const {return dng.model;}
 
+        /** Reads in the RAW image of a frame loaded with \ref
+         * loadDNGMetadata, the first time it's asked for. */
+        void loadImage();
+
+        // The IFD holding the RAW image, until it has been read
+        TiffIfd *pendingImage;
+        pthread_mutex_t imageMutex;
+
         /** A debugging dump function. Prints out all
          * DNGFrame-specific fields, and then calls
          * FCam::_Frame::debug to print the base fields and tags.
@@ -86,14 +95,61 @@ namespace FCam {
         Image thumbnail();
     };
 
+    /** Parameters for \ref saveDNG. */
+    struct DNGOptions {
+        DNGOptions() : compress(false), pack(false), tileWidth(0), tileHeight(0),
+                       threads(1), directIO(false) {}
+
+        /** Store the RAW image with lossless JPEG compression (DNG
+         * compression type 7), which about halves the size of a
+         * typical 10-bit capture. \ref loadDNG reads either kind. */
+        bool compress;
+        /** Store each uncompressed RAW sample in 10 or 12 bits
+         * instead of 16, whichever is the fewest that hold the
+         * platform's \ref Platform::maxRawValue. Samples too large
+         * for that are clamped. Ignored if compress is set. */
+        bool pack;
+        /** Store the RAW image in tiles of this size instead of in
+         * strips, so that \ref loadDNGRegion can decode a part of it
+         * without reading the rest. Both must be multiples of 16, or
+         * zero for strips. Tiles at the right and bottom edges are
+         * padded out to full size. */
+        int tileWidth, tileHeight;
+        /** How many threads to spread the compression across,
+         * counting the calling thread. Zero means one per online
+         * CPU. */
+        int threads;
+        /** Write the file with direct IO, bypassing the page cache,
+         * where the platform and file system support it. This keeps
+         * a burst of captures from evicting everything else from
+         * memory, at the cost of waiting for the disk. */
+        bool directIO;
+    };
+
     /** Save a DNG file. The frame must have an image in RAW format.
      * All FCam::Frame fields and the tag map are saved in the DNG, along with
      * a thumbnail of the image.
      */
-    void saveDNG(Frame frame, const std::string &filename);
+    void saveDNG(Frame frame, const std::string &filename,
+                 const DNGOptions &options = DNGOptions());
     /** Load a DNG file. Only DNG files saved by FCam are properly supported.
      */
     DNGFrame loadDNG(const std::string &filename);
+    /** Load the metadata and thumbnail of a DNG file, leaving its RAW
+     * image data untouched until \ref Frame::image is first
+     * called. This is much faster than \ref loadDNG when only the
+     * thumbnail, tags, or frame parameters are needed, such as when
+     * browsing a directory of captures. The file stays open until the
+     * frame is destroyed.
+     */
+    DNGFrame loadDNGMetadata(const std::string &filename);
+    /** Load part of the RAW image of a DNG file, reading and decoding
+     * only the strips or tiles the region overlaps. The region is
+     * clipped to the image. To keep the bayer pattern of the full
+     * image, its corner should be at even coordinates. Returns an
+     * invalid image on failure.
+     */
+    Image loadDNGRegion(const std::string &filename, Rect region);
 }
 
 #endif
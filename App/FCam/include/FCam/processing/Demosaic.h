@@ -4,6 +4,8 @@
 /** \file
  * Converting RAW data to RGB24 by demosiacking and gamma correcting. */
 
+#include <vector>
+
 #include "../Frame.h"
 
 namespace FCam {
@@ -22,14 +24,158 @@ namespace FCam {
                    bool denoise = true, int blackLevel = 25, 
                    float gamma = 2.2f);
 
+    /** The interpolation algorithms \ref demosaic can use. */
+    enum DemosaicMethod {
+        /** Interpolates each 2x2 bayer block from its immediate
+         * neighbourhood, choosing between horizontal and vertical
+         * green at each pixel. This is the fastest method. */
+        DemosaicFast = 0,
+        /** Adaptive homogeneity-directed interpolation. This makes
+         * fewer zipper and color fringing artifacts along edges than
+         * the fast method, at about 5.2 times its cost on x86. */
+        DemosaicAHD,
+        /** Variable number of gradients interpolation, which averages
+         * over whichever of the eight directions around each pixel
+         * are smooth. This does well on fine textures, at about 4.5
+         * times the cost of the fast method on x86.
+         *
+         * Both costs were measured on a 2592x1968 frame, with one
+         * thread and the AVX2 kernels, as the median ratio over 21
+         * interleaved runs of each method. */
+        DemosaicVNG
+    };
+
+    /** Parameters for \ref demosaic. The defaults match those of
+     * the other form of \ref demosaic. */
+    struct DemosaicOptions {
+        DemosaicOptions() : 
+            contrast(50.0f), denoise(true), blackLevel(25), gamma(2.2f),
+            threads(1), fixedPoint(false), method(DemosaicFast) {}
+
+        /** The strength of the contrast curve applied after gamma
+         * correction. */
+        float contrast;
+        /** Whether to suppress hot pixels before demosaicking. */
+        bool denoise;
+        /** The raw value to treat as black, on top of the
+         * platform's \ref Platform::minRawValue. */
+        int blackLevel;
+        /** The gamma to correct for. */
+        float gamma;
+        /** How many threads to spread the work across, counting the
+         * calling thread. Zero means one per online CPU. The output
+         * does not depend on the number of threads. */
+        int threads;
+        /** Do the color conversion in fixed point instead of
+         * floating point. This is faster on CPUs without vector
+         * floating point, but the linear value fed to the gamma
+         * curve may be off by one from the floating point
+         * result. Only the fast method uses this; AHD and VNG always
+         * convert in floating point. On x86 CPUs with SSE4.1, where
+         * floating point is the faster of the two, the fast method
+         * ignores this and converts in floating point too. The ARM
+         * implementation of the fast method, which only handles GRBG
+         * sensors, always uses fixed point. */
+        bool fixedPoint;
+        /** The interpolation algorithm. All methods produce an image
+         * of the same size, and color and gamma correct it the same
+         * way. The ARM implementation only vectorizes the fast
+         * method, and only for GRBG sensors. */
+        DemosaicMethod method;
+    };
+
+    /** Demosaic, white balance, and gamma correct a raw frame, as
+     * above, with the parameters given in a \ref DemosaicOptions. */
+    Image demosaic(Frame src, const DemosaicOptions &options);
+
+    /** Demosaic, white balance, and gamma correct only a region of
+     * interest of a raw frame. The region is in the coordinates of
+     * the output of the full \ref demosaic, and is clipped to it.
+     * Only the blocks of output that touch the region are computed,
+     * and the result is identical to the same crop of the full
+     * demosaic. */
+    Image demosaic(Frame src, Rect roi, const DemosaicOptions &options = DemosaicOptions());
+
+    /** Demosaics a raw frame a strip of rows at a time, so that the
+     * whole RGB24 image never has to exist at once. The output is
+     * identical to that of \ref demosaic with the same options. For
+     * example, to process a frame using a buffer of two strips:
+     *
+     * \code
+     * DemosaicStream stream(frame);
+     * Image ring(stream.size().width, 2*stream.stripHeight(), RGB24);
+     * while (int rows = stream.next(ring)) {
+     *     // use the rows just written into ring
+     * }
+     * \endcode
+     */
+    class DemosaicStream {
+      public:
+        /** Prepare to demosaic a raw frame. Strips are stripHeight
+         * rows tall, rounded up to a multiple of 24. If it is zero,
+         * each strip is 24 rows for each thread the options ask
+         * for. */
+        DemosaicStream(Frame src,
+                       const DemosaicOptions &options = DemosaicOptions(),
+                       int stripHeight = 0);
+        ~DemosaicStream();
+
+        /** Whether the frame can be demosaicked. If not, an error
+         * has been posted, and next will produce nothing. */
+        bool valid() const;
+
+        /** The size of the whole output image. */
+        Size size() const;
+
+        /** The number of rows in every strip but possibly the last,
+         * which may be shorter. */
+        int stripHeight() const;
+
+        /** The output row that the next strip starts at. */
+        int row() const;
+
+        /** Demosaic the next strip into ring, which must be an RGB24
+         * image as wide as the output with a height that is a
+         * multiple of \ref stripHeight. Strips are written one after
+         * the other, wrapping around to the top of ring, so the
+         * strip starting at output row y lands at row y %
+         * ring.height(). Returns the number of rows written, which is
+         * zero once the whole frame has been produced. */
+        int next(Image ring);
+
+      private:
+        struct State;
+        State *state;
+
+        DemosaicStream(const DemosaicStream &);
+        DemosaicStream &operator=(const DemosaicStream &);
+    };
+
 
     /** Create a low-resolution representation of the input image
      * frame. For a RAW image, this means a fast combined
      * demosaic/downsample and the application of the full
-     * post-processing pipeline to create a representative image. */
+     * post-processing pipeline to create a representative image.
+     * For RAW images, the work can be spread across several threads,
+     * counting the calling thread. Zero threads means one per online
+     * CPU. */
     Image makeThumbnail(Frame src, const Size &thumbSize = Size(640,480),
                         float contrast = 50.0f, int blackLevel = 25, 
-                        float gamma = 2.2f);
+                        float gamma = 2.2f, int threads = 1);
+
+    /** Make a pyramid of progressively smaller RGB24 versions of a
+     * RAW frame, at 1/2, 1/4, 1/8, and so on of its size, with up to
+     * the given number of levels. Each 2x2 bayer block becomes one
+     * pixel of the first level, and each 2x2 block of a level
+     * becomes one pixel of the next. Averaging is done on linear
+     * values, which are color and gamma corrected as in \ref
+     * makeThumbnail. The whole pyramid is made in a single pass over
+     * the raw data, spread across the given number of threads, where
+     * zero means one per online CPU. Levels that would be empty are
+     * left out. */
+    std::vector<Image> makePyramid(Frame src, int levels,
+                                   float contrast = 50.0f, int blackLevel = 25,
+                                   float gamma = 2.2f, int threads = 1);
 }
 
 #endif
@@ -17,14 +17,21 @@ namespace FCam {
      *
      *  - 2 = 8-bit data, such as UYVY or RGB24 data.
      *  - 4 = 16-bit, such as RAW sensor pixel values, in a Bayer mosaic.
+     *  - 10 or 12 = RAW sensor pixel values packed into 10 or 12
+     *    bits each, most significant bit first, with each row
+     *    starting on a byte boundary.
      *
      *  Channels will be 3 for RGB24, 2 for UYVY, 1 for RAW data.
+     *
+     *  RAW data is packed if bitsPerSample is 10 or 12, and samples
+     *  too large for that are clamped. It is ignored for other
+     *  images.
      */
 
-    void saveDump(Frame frame, std::string filename);
-    void saveDump(Image frame, std::string filename);
+    void saveDump(Frame frame, std::string filename, int bitsPerSample = 16);
+    void saveDump(Image frame, std::string filename, int bitsPerSample = 16);
 
-    /** Load a UYVY, RGB24, or RAW dump file. */
+    /** Load a UYVY, RGB24, or RAW dump file, packed or not. */
     Image loadDump(std::string filename);
 
 }
@@ -12,13 +12,21 @@ namespace FCam {
      * or RGB format.  The frame and frame.sensor are queried for all
      * relevant data to put in the EXIF tags. You can also pass in a
      * jpeg quality level between 0 and 100.
+     *
+     * The compression can be spread across several threads, counting
+     * the calling thread, where zero means one per online CPU. With
+     * more than one, the image is compressed as horizontal bands that
+     * are joined with restart markers, which any JPEG decoder
+     * handles. The decoded image is the same either way. A RAW image
+     * is demosaicked with the same number of threads.
      */
-    void saveJPEG(Frame, std::string filename, int quality=80);       
+    void saveJPEG(Frame, std::string filename, int quality=80, int threads=1);
 
     /** Save an image as a JPEG file. The image must be in UYVY or RGB
      * format. No EXIF tags are saved. You can also pass in a jpeg
-     * quality level between 0 and 100. */
-    void saveJPEG(Image, std::string filename, int quality=80); 
+     * quality level between 0 and 100, and a number of threads as
+     * above. UYVY images keep their 4:2:2 chroma. */
+    void saveJPEG(Image, std::string filename, int quality=80, int threads=1);
 }
 
 #endif
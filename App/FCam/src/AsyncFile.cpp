@@ -8,186 +8,323 @@
 #include "FCam/processing/Dump.h"
 
 #include "Debug.h"
+#include "processing/Parallel.h"
+#include "processing/Save_Internal.h"
 
 using namespace std;
 
 namespace FCam {
+
+    struct AsyncSave::State {
+        State(const std::string &f, AsyncSaveCallback cb, void *ctx) :
+            filename(f), callback(cb), context(ctx),
+            status(AsyncSave::Pending), bytes(0), elapsed(0), requested(Time::now()) {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&finished, NULL);
+        }
+        ~State() {
+            pthread_cond_destroy(&finished);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        std::string filename;
+        AsyncSaveCallback callback;
+        void *context;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t finished;
+        AsyncSave::Status status;
+        size_t bytes;
+        int elapsed;
+        Time requested;
+    };
+
+    AsyncSave::AsyncSave() {}
+
+    const std::string &AsyncSave::filename() const {
+        static const std::string none;
+        return state ? state->filename : none;
+    }
+
+    AsyncSave::Status AsyncSave::status() const {
+        if (!state) return Dropped;
+        pthread_mutex_lock(&state->mutex);
+        Status s = state->status;
+        pthread_mutex_unlock(&state->mutex);
+        return s;
+    }
+
+    AsyncSave::Status AsyncSave::wait() const {
+        if (!state) return Dropped;
+        pthread_mutex_lock(&state->mutex);
+        while (state->status == Pending) {
+            pthread_cond_wait(&state->finished, &state->mutex);
+        }
+        Status s = state->status;
+        pthread_mutex_unlock(&state->mutex);
+        return s;
+    }
+
+    size_t AsyncSave::bytesWritten() const {
+        if (!state) return 0;
+        pthread_mutex_lock(&state->mutex);
+        size_t b = state->bytes;
+        pthread_mutex_unlock(&state->mutex);
+        return b;
+    }
+
+    int AsyncSave::elapsed() const {
+        if (!state) return 0;
+        pthread_mutex_lock(&state->mutex);
+        int e = state->status == Pending ? Time::now() - state->requested : state->elapsed;
+        pthread_mutex_unlock(&state->mutex);
+        return e;
+    }
+
     void *launch_async_file_writer_thread_(void *arg) {
         AsyncFileWriter *d = (AsyncFileWriter *)arg;
         d->run();    
-        d->running = false;    
         pthread_exit(NULL);
         return NULL;
     }
 
 
     AsyncFileWriter::AsyncFileWriter() {
+        start();
+    }
+
+    AsyncFileWriter::AsyncFileWriter(const AsyncFileWriterOptions &opts) : options(opts) {
+        start();
+    }
+
+    void AsyncFileWriter::start() {
         pthread_attr_t attr;
         struct sched_param param;
 
         pending = 0;
-        
-        // make the thread
+        pendingBytes = 0;
+        stop = false;
+
+        pthread_mutex_init(&saveQueueMutex, NULL);
+        pthread_cond_init(&requestQueued, NULL);
+        pthread_cond_init(&requestDone, NULL);
+
+        // make the threads
         
         param.sched_priority = sched_get_priority_min(SCHED_OTHER);
         
         pthread_attr_init(&attr);
 
-        running = false;
-        stop = false;
-
-#ifdef FCAM_PLATFORM_OSX
-        // unnamed semaphores not supported on OSX
-        char semName[256];
-        // Create a unique semaphore name for this TSQueue using its pointer value
-        snprintf(semName, 256, "FCam::AsyncFile::sem::%llx", (long long unsigned)this);
-        saveQueueSemaphore = sem_open(semName, O_CREAT, 666, 0);
-#else
-        saveQueueSemaphore = new sem_t;
-        sem_init(saveQueueSemaphore, 0, 0);
-#endif
-        pthread_mutex_init(&saveQueueMutex, NULL);
+        int workers = parallelThreads(options.workers);
+        for (int i = 0; i < workers; i++) {
+            pthread_t thread;
+            if ((errno =
+                 -(pthread_attr_setschedparam(&attr, &param) ||
+                   pthread_attr_setschedpolicy(&attr, SCHED_OTHER) ||
+                   pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
+                   pthread_create(&thread, &attr, launch_async_file_writer_thread_, this)))) {
+                error(Event::InternalError, "Error creating async file writer thread");
+                break;
+            } 
+            threads.push_back(thread);
+        }
 
-        if ((errno =
-             -(pthread_attr_setschedparam(&attr, &param) ||
-               pthread_attr_setschedpolicy(&attr, SCHED_OTHER) ||
-               pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
-               pthread_create(&thread, &attr, launch_async_file_writer_thread_, this)))) {
-            error(Event::InternalError, "Error creating async file writer thread");
-            return;
-        } else {
-            running = true;
-        }        
+        pthread_attr_destroy(&attr);
     }
 
     AsyncFileWriter::~AsyncFileWriter() {
+        pthread_mutex_lock(&saveQueueMutex);
         stop = true;
-        sem_post(saveQueueSemaphore);
-        if (running) {
-            pthread_join(thread, NULL);
+        pthread_cond_broadcast(&requestQueued);
+        pthread_cond_broadcast(&requestDone);
+        pthread_mutex_unlock(&saveQueueMutex);
+
+        for (size_t i = 0; i < threads.size(); i++) {
+            pthread_join(threads[i], NULL);
         }
-#ifdef FCAM_PLATFORM_OSX
-        sem_close(saveQueueSemaphore);
-        char semName[256];
-        // Recreate the unique semaphore name for this AsyncFileWriter using its pointer value
-        snprintf(semName, 256, "FCam::AsyncFile::sem::%llx", (long long unsigned)this);
-        sem_unlink(semName);
-#else
-        sem_destroy(saveQueueSemaphore);
-        delete saveQueueSemaphore;
-#endif
 
+        // Anyone waiting on a request that will now never be saved
+        // needs to hear about it
+        cancel();
+
+        pthread_cond_destroy(&requestQueued);
+        pthread_cond_destroy(&requestDone);
+        pthread_mutex_destroy(&saveQueueMutex);
+    }
+
+    int AsyncFileWriter::savesPending() {
+        return __sync_fetch_and_add(&pending, 0);
+    }
+
+    size_t AsyncFileWriter::bytesPending() {
+        return __sync_fetch_and_add(&pendingBytes, 0);
     }
 
-    void AsyncFileWriter::saveDNG(Frame f, std::string filename) {
-        pending++;
+    void AsyncFileWriter::complete(SaveRequest &r, AsyncSave::Status status, size_t bytes) {
+        AsyncSave::State *state = r.handle.state.get();
+        pthread_mutex_lock(&state->mutex);
+        state->status = status;
+        state->bytes = bytes;
+        state->elapsed = Time::now() - state->requested;
+        pthread_cond_broadcast(&state->finished);
+        pthread_mutex_unlock(&state->mutex);
+        if (state->callback) state->callback(r.handle, state->context);
+    }
+
+    AsyncSave AsyncFileWriter::enqueue(SaveRequest &r, Image im,
+                                       AsyncSaveCallback callback, void *context) {
+        r.handle.state.reset(new AsyncSave::State(r.filename, callback, context));
+        r.bytes = im.valid() ? (size_t)im.bytesPerRow() * im.height() : 0;
+
+        pthread_mutex_lock(&saveQueueMutex);
+        // A request that doesn't fit the budget waits for (or is
+        // dropped in favour of) the ones ahead of it, unless there
+        // aren't any, in which case it could never fit.
+        size_t limit = options.maxBytesPending;
+        if (limit && pendingBytes && pendingBytes + r.bytes > limit) {
+            if (options.overflow == AsyncFileWriterOptions::Drop) {
+                pthread_mutex_unlock(&saveQueueMutex);
+                warning(Event::FileSaveWarning, 
+                        "AsyncFileWriter: Dropping save of %s, %d bytes already pending",
+                        r.filename.c_str(), (int)bytesPending());
+                complete(r, AsyncSave::Dropped, 0);
+                return r.handle;
+            }
+            while (!stop && pendingBytes && pendingBytes + r.bytes > limit) {
+                pthread_cond_wait(&requestDone, &saveQueueMutex);
+            }
+        }
+        __sync_fetch_and_add(&pending, 1);
+        __sync_fetch_and_add(&pendingBytes, r.bytes);
+        saveQueue.push(r);
+        pthread_cond_signal(&requestQueued);
+        pthread_mutex_unlock(&saveQueueMutex);
+        return r.handle;
+    }
+
+    AsyncSave AsyncFileWriter::saveDNG(Frame f, std::string filename,
+                                       AsyncSaveCallback callback, void *context) {
         SaveRequest r;
         r.frame = f;
         r.filename = filename;
         r.fileType = SaveRequest::DNGFrame;
         r.quality = 0; // meaningless for DNG
-
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, f.valid() ? f.image() : Image(), callback, context);
     }
 
-    void AsyncFileWriter::saveJPEG(Frame f, std::string filename, int quality) {
-        pending++;
+    AsyncSave AsyncFileWriter::saveJPEG(Frame f, std::string filename, int quality,
+                                        AsyncSaveCallback callback, void *context) {
         SaveRequest r;
         r.frame = f;
         r.filename = filename;
         r.quality = quality;
         r.fileType = SaveRequest::JPEGFrame;
-
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, f.valid() ? f.image() : Image(), callback, context);
     }
 
-    void AsyncFileWriter::saveJPEG(Image im, std::string filename, int quality) {
-        pending++;
+    AsyncSave AsyncFileWriter::saveJPEG(Image im, std::string filename, int quality,
+                                        AsyncSaveCallback callback, void *context) {
         SaveRequest r;
         r.image = im;
         r.filename = filename;
         r.quality = quality;
         r.fileType = SaveRequest::JPEGImage;
-
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, im, callback, context);
     }
 
-    void AsyncFileWriter::saveDump(Frame f, std::string filename) {
-        pending++;
+    AsyncSave AsyncFileWriter::saveDump(Frame f, std::string filename,
+                                        AsyncSaveCallback callback, void *context) {
         SaveRequest r;
         r.frame = f;
         r.filename = filename;
         r.quality = 0;
         r.fileType = SaveRequest::DumpFrame;
-
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, f.valid() ? f.image() : Image(), callback, context);
     }
 
-    void AsyncFileWriter::saveDump(Image im, std::string filename) {
-        pending++;
+    AsyncSave AsyncFileWriter::saveDump(Image im, std::string filename,
+                                        AsyncSaveCallback callback, void *context) {
         SaveRequest r;
         r.image = im;
         r.filename = filename;
         r.quality = 0;
         r.fileType = SaveRequest::DumpImage;
-
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, im, callback, context);
     }
 
     void AsyncFileWriter::cancel() {
+        std::vector<SaveRequest> cancelled;
         pthread_mutex_lock(&saveQueueMutex);
         while (saveQueue.size()) {
+            __sync_fetch_and_sub(&pending, 1);
+            __sync_fetch_and_sub(&pendingBytes, saveQueue.front().bytes);
+            cancelled.push_back(saveQueue.front());
             saveQueue.pop();
         };
+        pthread_cond_broadcast(&requestDone);
         pthread_mutex_unlock(&saveQueueMutex);
+
+        for (size_t i = 0; i < cancelled.size(); i++) {
+            complete(cancelled[i], AsyncSave::Cancelled, 0);
+        }
     }
 
     void AsyncFileWriter::run() {
-        while (!stop) {
-            sem_wait(saveQueueSemaphore);
-            if (stop) return;
+        while (1) {
             SaveRequest r;
             pthread_mutex_lock(&saveQueueMutex);
+            while (!stop && saveQueue.empty()) {
+                pthread_cond_wait(&requestQueued, &saveQueueMutex);
+            }
+            if (stop) {
+                pthread_mutex_unlock(&saveQueueMutex);
+                return;
+            }
             r = saveQueue.front();
             saveQueue.pop();
             pthread_mutex_unlock(&saveQueueMutex);            
+
+            bool saved = false;
+            size_t bytes = 0;
             switch (r.fileType) {
             case SaveRequest::DNGFrame:                    
-                FCam::saveDNG(r.frame, r.filename);
+                saved = writeDNG(r.frame, r.filename, DNGOptions(), &bytes);
                 break;
             case SaveRequest::JPEGFrame:
-                FCam::saveJPEG(r.frame, r.filename, r.quality);
+                saved = writeJPEG(r.frame, r.filename, r.quality, 1, &bytes);
                 break;
             case SaveRequest::JPEGImage:
-                FCam::saveJPEG(r.image, r.filename, r.quality);
+                saved = writeJPEG(r.image, r.filename, r.quality, 1, &bytes);
                 break;
             case SaveRequest::DumpFrame:
-                FCam::saveDump(r.frame, r.filename);
+                saved = writeDump(r.frame, r.filename, 16, &bytes);
                 break;
             case SaveRequest::DumpImage:
-                FCam::saveDump(r.image, r.filename);
+                saved = writeDump(r.image, r.filename, 16, &bytes);
                 break;
             default:
                 cerr << "Corrupted entry in async file writer save queue." << endl;
             }
 
-            pending--;
+            // Let go of the image data before waking anyone waiting
+            // for room.
+            r.frame = Frame();
+            r.image = Image();
+
+            // Give the room back before completing the request, so
+            // that a callback or waiter that saves again doesn't block
+            // on the budget this request still holds.
+            pthread_mutex_lock(&saveQueueMutex);
+            __sync_fetch_and_sub(&pending, 1);
+            __sync_fetch_and_sub(&pendingBytes, r.bytes);
+            pthread_cond_broadcast(&requestDone);
+            pthread_mutex_unlock(&saveQueueMutex);
+
+            if (saved) {
+                complete(r, AsyncSave::Saved, bytes);
+            } else {
+                complete(r, AsyncSave::Failed, 0);
+            }
         }
     }
 }
-    
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "BufferPool.h"
+#include "Debug.h"
+
+namespace FCam {
+
+    namespace {
+        // floor(log2(x)) for x > 0
+        int log2Floor(size_t x) {
+            int k = 0;
+            while (x >>= 1) k++;
+            return k;
+        }
+    }
+
+    BufferPool::BufferPool(size_t l) : limit(l) {
+        pthread_mutex_init(&mutex, NULL);
+        for (int i = 0; i < Classes; i++) freeLists[i] = NULL;
+    }
+
+    BufferPool::~BufferPool() {
+        trim();
+        pthread_mutex_destroy(&mutex);
+    }
+
+    size_t BufferPool::classSize(size_t bytes) {
+        if (bytes <= 64) return 64;
+        // 2^k < bytes <= 2^(k+1), split into four steps
+        int k = log2Floor(bytes-1);
+        size_t step = ((size_t)1 << k) / 4;
+        if (step < 64) step = 64;
+        return (bytes + step - 1) / step * step;
+    }
+
+    int BufferPool::classIndex(size_t reserved) {
+        int k = log2Floor(reserved-1);
+        return k*4 + (int)((reserved - 1 - ((size_t)1 << k)) >> (k-2));
+    }
+
+    void *BufferPool::allocate(size_t bytes, size_t *reserved) {
+        size_t size = classSize(bytes);
+        int c = classIndex(size);
+
+        pthread_mutex_lock(&mutex);
+        FreeBlock *block = freeLists[c];
+        if (block) {
+            freeLists[c] = block->next;
+            counts.hits++;
+            counts.cachedBytes -= size;
+            counts.cachedBuffers--;
+        } else {
+            counts.misses++;
+        }
+        pthread_mutex_unlock(&mutex);
+
+        if (!block) {
+            static const size_t pageSize = getpagesize();
+            void *mem;
+            if (posix_memalign(&mem, size >= pageSize ? pageSize : 64, size) != 0) return NULL;
+            block = (FreeBlock *)mem;
+            dprintf(5, "BufferPool: Allocated a new block of %d bytes for a request of %d\n", (int)size, (int)bytes);
+        }
+
+        *reserved = size;
+        return block;
+    }
+
+    void BufferPool::release(void *mem, size_t reserved) {
+        if (!mem) return;
+        int c = classIndex(reserved);
+
+        pthread_mutex_lock(&mutex);
+        bool keep = counts.cachedBytes + reserved <= limit;
+        if (keep) {
+            FreeBlock *block = (FreeBlock *)mem;
+            block->next = freeLists[c];
+            freeLists[c] = block;
+            counts.cachedBytes += reserved;
+            counts.cachedBuffers++;
+        }
+        pthread_mutex_unlock(&mutex);
+
+        if (!keep) ::free(mem);
+    }
+
+    void BufferPool::setLimit(size_t l) {
+        pthread_mutex_lock(&mutex);
+        limit = l;
+        pthread_mutex_unlock(&mutex);
+        trimTo(l);
+    }
+
+    void BufferPool::trim() {
+        trimTo(0);
+    }
+
+    void BufferPool::trimTo(size_t l) {
+        // Unlink the blocks to be freed under the lock, then free them
+        // without it. Large blocks go first.
+        FreeBlock *doomed = NULL;
+        pthread_mutex_lock(&mutex);
+        for (int c = Classes-1; c >= 0 && counts.cachedBytes > l; c--) {
+            while (freeLists[c] && counts.cachedBytes > l) {
+                size_t size = ((size_t)1 << (c/4)) + ((size_t)((c%4)+1) << (c/4 - 2));
+                FreeBlock *block = freeLists[c];
+                freeLists[c] = block->next;
+                block->next = doomed;
+                doomed = block;
+                counts.cachedBytes -= size;
+                counts.cachedBuffers--;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+
+        while (doomed) {
+            FreeBlock *next = doomed->next;
+            ::free(doomed);
+            doomed = next;
+        }
+    }
+
+    BufferPool::Stats BufferPool::stats() {
+        pthread_mutex_lock(&mutex);
+        Stats s = counts;
+        pthread_mutex_unlock(&mutex);
+        return s;
+    }
+
+    BufferPool &imageBufferPool() {
+        // Enough to keep a couple of full-resolution raw frames
+        // around. Never destroyed, so that images that outlive static
+        // destruction can still hand their buffers back.
+        static BufferPool *pool = new BufferPool(32*1024*1024);
+        return *pool;
+    }
+
+}
@@ -0,0 +1,75 @@
+#ifndef FCAM_BUFFER_POOL_H
+#define FCAM_BUFFER_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// A cache of freed memory blocks, sorted into size classes, so that a
+// stream of same-sized allocations (one image buffer per frame, say)
+// is served from recently freed blocks instead of going back to the
+// system allocator each time.
+
+namespace FCam {
+
+    class BufferPool {
+    public:
+        struct Stats {
+            Stats() : hits(0), misses(0), cachedBytes(0), cachedBuffers(0) {}
+            // Allocations served from the cache
+            unsigned hits;
+            // Allocations that went to the system allocator
+            unsigned misses;
+            // Memory currently held in the cache
+            size_t cachedBytes;
+            unsigned cachedBuffers;
+        };
+
+        // Keep at most limit bytes of freed blocks around.
+        BufferPool(size_t limit);
+        ~BufferPool();
+
+        // Get a block of at least the given size. The size of the
+        // class it came from is returned in reserved, and must be
+        // passed back to release. Blocks of a page or more are page
+        // aligned, smaller ones are cache-line aligned. Returns NULL
+        // if the system is out of memory.
+        void *allocate(size_t bytes, size_t *reserved);
+
+        // Hand a block back, to be reused or freed
+        void release(void *block, size_t reserved);
+
+        // Change the cache limit, freeing blocks that no longer fit
+        void setLimit(size_t limit);
+
+        // Free all cached blocks
+        void trim();
+
+        Stats stats();
+
+        // The size class a request for the given number of bytes
+        // falls into. Classes are a quarter of a power of two apart,
+        // so at most a fifth of a block goes unused.
+        static size_t classSize(size_t bytes);
+
+    private:
+        // Freed blocks are chained through their first word
+        struct FreeBlock {
+            FreeBlock *next;
+        };
+
+        enum {Classes = 4*8*sizeof(size_t)};
+        static int classIndex(size_t reserved);
+        void trimTo(size_t limit);
+
+        pthread_mutex_t mutex;
+        FreeBlock *freeLists[Classes];
+        size_t limit;
+        Stats counts;
+    };
+
+    // The pool that backs the buffers of allocating Image constructors
+    BufferPool &imageBufferPool();
+
+}
+
+#endif
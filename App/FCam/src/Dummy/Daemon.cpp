@@ -6,20 +6,54 @@
 
 namespace FCam { namespace Dummy {
 
-    Daemon::Daemon(Sensor *sensor): sensor(sensor), stop(false), running(false) {
+    Daemon::Daemon(Sensor *sensor): 
+        requestQueue(1024), frameQueue(256), 
+        sensor(sensor), overflowSize(0), stop(false), running(false), launched(0) {
+        pthread_mutex_init(&overflowMutex, NULL);
     }
 
     Daemon::~Daemon() {
         stop = true;
 
-        if (running) 
+        if (launched) 
             pthread_join(simThread, NULL);
 
+        for (size_t i = 0; i < requestOverflow.size(); i++) {
+            delete requestOverflow[i];
+        }
+        pthread_mutex_destroy(&overflowMutex);
+    }
+
+    void Daemon::queueRequest(_Frame *f) {
+        pthread_mutex_lock(&overflowMutex);
+        // Once anything has overflowed, later requests queue up
+        // behind it to keep them in order
+        if (!requestOverflow.size() && requestQueue.tryPush(f)) {
+            pthread_mutex_unlock(&overflowMutex);
+            return;
+        }
+        requestOverflow.push_back(f);
+        overflowSize = requestOverflow.size();
+        pthread_mutex_unlock(&overflowMutex);
+    }
+
+    void Daemon::drainOverflow() {
+        if (!overflowSize) return;
+        pthread_mutex_lock(&overflowMutex);
+        while (requestOverflow.size() && requestQueue.tryPush(requestOverflow.front())) {
+            requestOverflow.pop_front();
+        }
+        overflowSize = requestOverflow.size();
+        pthread_mutex_unlock(&overflowMutex);
     }
 
     void Daemon::launchThreads() {
+        // More than one simulator thread would pull requests
+        // concurrently and hand back frames out of order
+        if (!__sync_bool_compare_and_swap(&launched, 0, 1)) return;
         int err = pthread_create(&simThread, NULL, daemon_launch_thread_, this);
         if (err) { 
+            launched = 0;
             error(Event::InternalError, sensor, "Dummy::Sensor::Daemon: Can't launch simulation thread\n");
             return;
         }
@@ -27,6 +61,8 @@ namespace FCam { namespace Dummy {
 
     void Daemon::run() {
         while (!stop) {
+            drainOverflow();
+
             if (!requestQueue.size()) {
                 sensor->generateRequest();
             }
@@ -63,7 +99,7 @@ namespace FCam { namespace Dummy {
 
             f->image = f->shot().image;
             if (f->image.autoAllocate()) {
-                f->image = Image(f->image.size(), f->image.type());
+                f->image = sensor->allocateFrameImage(f->image.size(), f->image.type());
             }
             
             switch(f->testPattern) {
@@ -276,7 +312,15 @@ namespace FCam { namespace Dummy {
                     }
                 }                
             }
-            frameQueue.push(f);
+            // Like a real sensor, stall while nobody is collecting
+            // frames, but give up if we're told to stop
+            while (!frameQueue.tryPush(f)) {
+                if (stop) {
+                    delete f;
+                    return;
+                }
+                frameQueue.waitForRoom(100000);
+            }
         }
     }
 
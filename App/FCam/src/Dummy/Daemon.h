@@ -2,8 +2,9 @@
 #define FCAM_DUMMY_DAEMON_H
 
 #include <pthread.h>
+#include <deque>
 
-#include <FCam/TSQueue.h>
+#include <FCam/RingQueue.h>
 #include <FCam/Dummy/Sensor.h>
 
 namespace FCam { namespace Dummy {
@@ -12,19 +13,38 @@ namespace FCam { namespace Dummy {
 
     class Daemon {
     public:
-        TSQueue<_Frame *> requestQueue;
-        TSQueue<_Frame *> frameQueue;
+        // Requests come from any thread that calls capture or stream,
+        // and frames may be collected by any thread, so both queues
+        // allow several of each
+        MPMCQueue<_Frame *> requestQueue;
+        MPMCQueue<_Frame *> frameQueue;
         
         Daemon(Sensor *sensor);
         ~Daemon();
 
         void launchThreads();
+
+        // Add a request to the back of requestQueue without
+        // blocking. Requests that don't fit wait in order in
+        // requestOverflow until the simulator thread makes room, so
+        // neither a long burst nor the simulator thread itself can
+        // get stuck waiting on the ring.
+        void queueRequest(_Frame *f);
     private:
         Sensor *sensor;
+
+        pthread_mutex_t overflowMutex;
+        std::deque<_Frame *> requestOverflow;
+        volatile size_t overflowSize;
+        // Move as many overflowed requests into requestQueue as fit
+        void drainOverflow();
         
         bool stop;
 
         bool running;
+        // Set once the simulator thread has been started, since
+        // launchThreads is called on every capture
+        volatile int launched;
         void run();
 
         pthread_t simThread;
@@ -41,7 +41,7 @@ namespace FCam { namespace Dummy {
 
         pthread_mutex_lock(&requestMutex);
         shotsPending_++;
-        daemon->requestQueue.push(f);
+        daemon->queueRequest(f);
         pthread_mutex_unlock(&requestMutex);
 
         daemon->launchThreads();
@@ -74,7 +74,7 @@ namespace FCam { namespace Dummy {
         pthread_mutex_lock(&requestMutex);
         for (size_t i=0; i < frames.size(); i++) {
             shotsPending_++;
-            daemon->requestQueue.push(frames[i]);
+            daemon->queueRequest(frames[i]);
         }
         pthread_mutex_unlock(&requestMutex);
 
@@ -180,7 +180,7 @@ namespace FCam { namespace Dummy {
                 f->_shot = streamingShot[i];        
                 f->_shot.id = streamingShot[i].id;                
                 shotsPending_++;
-                daemon->requestQueue.push(f);
+                daemon->queueRequest(f);
             }
         }
         pthread_mutex_unlock(&requestMutex);
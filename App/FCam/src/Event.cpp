@@ -1,103 +1,195 @@
 #include <sstream>
 #include <stdarg.h>
+#include <pthread.h>
+#include <list>
+#include <map>
 
 #include "FCam/Event.h"
 #include "Debug.h"
 
 namespace FCam {
 
+    // The pending events, in the order they were posted, indexed by
+    // type, by type and data, by creator, and by type and creator, so
+    // that every kind of filtered getNextEvent finds its event
+    // without walking past the others. Each index is a map from key
+    // to the events with that key, oldest first.
+    class EventBus {
+      public:
+        EventBus() {
+            pthread_mutex_init(&mutex, NULL);
+        }
+
+        ~EventBus() {
+            pthread_mutex_destroy(&mutex);
+        }
+
+        void push(const Event &e) {
+            pthread_mutex_lock(&mutex);
+            Pending::iterator i = events.insert(events.end(), Entry(e));
+            i->byType = insert(byType, e.type, i);
+            i->byTypeData = insert(byTypeData, std::make_pair(e.type, e.data), i);
+            i->byCreator = insert(byCreator, e.creator, i);
+            i->byTypeCreator = insert(byTypeCreator, std::make_pair(e.type, e.creator), i);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        bool pull(Event *e) {
+            pthread_mutex_lock(&mutex);
+            bool found = !events.empty();
+            if (found) take(events.begin(), e);
+            pthread_mutex_unlock(&mutex);
+            return found;
+        }
+
+        bool pullType(Event *e, int type) {
+            return pullFirst(byType, type, e);
+        }
+
+        bool pullTypeData(Event *e, int type, int data) {
+            return pullFirst(byTypeData, std::make_pair(type, data), e);
+        }
+
+        bool pullCreator(Event *e, EventGenerator *creator) {
+            return pullFirst(byCreator, creator, e);
+        }
+
+        bool pullTypeCreator(Event *e, int type, EventGenerator *creator) {
+            return pullFirst(byTypeCreator, std::make_pair(type, creator), e);
+        }
+
+        bool pullTypeDataCreator(Event *e, int type, int data, EventGenerator *creator) {
+            // Look through whichever of the two narrower indices is
+            // shorter
+            pthread_mutex_lock(&mutex);
+            TypeDataIndex::iterator td = byTypeData.find(std::make_pair(type, data));
+            TypeCreatorIndex::iterator tc = byTypeCreator.find(std::make_pair(type, creator));
+            bool found = false;
+            if (td != byTypeData.end() && tc != byTypeCreator.end()) {
+                if (td->second.size() <= tc->second.size()) {
+                    for (Refs::iterator r = td->second.begin(); !found && r != td->second.end(); r++) {
+                        if ((*r)->event.creator == creator) {
+                            take(*r, e);
+                            found = true;
+                        }
+                    }
+                } else {
+                    for (Refs::iterator r = tc->second.begin(); !found && r != tc->second.end(); r++) {
+                        if ((*r)->event.data == data) {
+                            take(*r, e);
+                            found = true;
+                        }
+                    }
+                }
+            }
+            pthread_mutex_unlock(&mutex);
+            return found;
+        }
+
+      private:
+        struct Entry;
+        typedef std::list<Entry> Pending;
+        typedef std::list<Pending::iterator> Refs;
+        typedef std::map<int, Refs> TypeIndex;
+        typedef std::map<std::pair<int, int>, Refs> TypeDataIndex;
+        typedef std::map<EventGenerator *, Refs> CreatorIndex;
+        typedef std::map<std::pair<int, EventGenerator *>, Refs> TypeCreatorIndex;
+
+        // An event, and where it is in each index
+        struct Entry {
+            Entry(const Event &e) : event(e) {}
+            Event event;
+            Refs::iterator byType, byTypeData, byCreator, byTypeCreator;
+        };
+
+        pthread_mutex_t mutex;
+        Pending events;
+        TypeIndex byType;
+        TypeDataIndex byTypeData;
+        CreatorIndex byCreator;
+        TypeCreatorIndex byTypeCreator;
+
+        template<typename Index>
+        static Refs::iterator insert(Index &index, const typename Index::key_type &key, 
+                                     Pending::iterator i) {
+            Refs &refs = index[key];
+            return refs.insert(refs.end(), i);
+        }
+
+        // Remove an event from an index, dropping its key if that was
+        // the last event with it, so that the indices don't keep
+        // growing with every creator ever seen
+        template<typename Index>
+        static void remove(Index &index, const typename Index::key_type &key, 
+                           Refs::iterator r) {
+            typename Index::iterator i = index.find(key);
+            i->second.erase(r);
+            if (i->second.empty()) index.erase(i);
+        }
+
+        // Copy out an event and remove it from everywhere. Called
+        // with the lock held.
+        void take(Pending::iterator i, Event *e) {
+            *e = i->event;
+            remove(byType, e->type, i->byType);
+            remove(byTypeData, std::make_pair(e->type, e->data), i->byTypeData);
+            remove(byCreator, e->creator, i->byCreator);
+            remove(byTypeCreator, std::make_pair(e->type, e->creator), i->byTypeCreator);
+            events.erase(i);
+        }
+
+        template<typename Index>
+        bool pullFirst(Index &index, const typename Index::key_type &key, Event *e) {
+            pthread_mutex_lock(&mutex);
+            typename Index::iterator i = index.find(key);
+            bool found = i != index.end();
+            if (found) take(i->second.front(), e);
+            pthread_mutex_unlock(&mutex);
+            return found;
+        }
+    };
+
+    // Made on first use, so that events can be posted from static
+    // constructors
+    static EventBus &eventBus() {
+        static EventBus bus;
+        return bus;
+    }
+
     // Gets the next pending event. Returns false if there are no
     // outstanding events. 
     bool getNextEvent(Event *e) {        
-        return _eventQueue.tryPull(e);
+        return eventBus().pull(e);
     }
 
-    // Filter the event queue for specific types of events, several variants
+    // Filter the event queue for specific types of events, several
+    // variants. Each finds the oldest matching event directly from an
+    // index.
     bool getNextEvent(Event *e, int type) {
-        TSQueue<Event>::locking_iterator i = _eventQueue.begin();
-        for (; i != _eventQueue.end(); i++) {
-            if (i->type == type) {
-                Event eTemp = *i;
-                if (!_eventQueue.erase(i)) {
-                    dprintf(4, "getNextEvent: Skipping 'reserved' event.\n");
-                    return false;
-                }
-                *e = eTemp;
-                return true;
-            }
-        }
-        return false;
+        return eventBus().pullType(e, type);
     }
 
     bool getNextEvent(Event *e, int type, int data) {
-        TSQueue<Event>::locking_iterator i = _eventQueue.begin();
-        for (; i != _eventQueue.end(); i++) {
-            if (i->type == type && i->data == data) {
-                Event eTemp = *i;
-                if (!_eventQueue.erase(i)) {
-                    dprintf(4, "getNextEvent: Skipping 'reserved' event.\n");
-                    return false; // Can't erase == 'doesn't actually exist'
-                }
-                *e = eTemp;
-                return true;
-            }
-        }
-        return false;
+        return eventBus().pullTypeData(e, type, data);
     }
 
     bool getNextEvent(Event *e, int type, EventGenerator *creator) {
-        TSQueue<Event>::locking_iterator i = _eventQueue.begin();
-        for (; i != _eventQueue.end(); i++) {
-            if (i->type == type && i->creator == creator) {
-                Event eTemp = *i;
-                if (!_eventQueue.erase(i)) {
-                    dprintf(4, "getNextEvent: Skipping 'reserved' event.\n");
-                    return false;
-                }
-                *e = eTemp;
-                return true;
-            }
-        }
-        return false;
+        return eventBus().pullTypeCreator(e, type, creator);
     }
 
     bool getNextEvent(Event *e, int type, int data, EventGenerator *creator) {
-        TSQueue<Event>::locking_iterator i = _eventQueue.begin();
-        for (; i != _eventQueue.end(); i++) {
-            if (i->type == type && i->data == data && i->creator == creator) {
-                Event eTemp = *i;
-                if (!_eventQueue.erase(i)) {
-                    dprintf(4, "getNextEvent: Skipping 'reserved' event.\n");
-                    return false; // Can't erase == 'doesn't actually exist'
-                }
-                *e = eTemp;
-                return true;
-            }
-        }
-        return false;
+        return eventBus().pullTypeDataCreator(e, type, data, creator);
     }
 
     bool getNextEvent(Event *e, EventGenerator *creator) {
-        TSQueue<Event>::locking_iterator i = _eventQueue.begin();
-        for (; i != _eventQueue.end(); i++) {
-            if (i->creator == creator) {
-                Event eTemp = *i;
-                if (!_eventQueue.erase(i)) {
-                    dprintf(4, "getNextEvent: Skipping 'reserved' event.\n");
-                    return false; // Can't erase == 'doesn't actually exist'
-                }
-                *e = eTemp;
-                return true;
-            }
-        }
-        return false;
+        return eventBus().pullCreator(e, creator);
     }
 
     void postEvent(Event e) {        
         if (e.type == Event::Error) _dprintf(DBG_ERROR, "Error (Event)", "%s\n", e.description.c_str());
         else if (e.type == Event::Warning) _dprintf(DBG_WARN, "Warning (Event)", "%s\n", e.description.c_str());
         else _dprintf(DBG_MINOR, "Event", "%s\n", e.description.c_str());
-        _eventQueue.push(e);
+        eventBus().push(e);
     }
 
     void postEvent(int type, int data, const std::string &msg, EventGenerator *creator) {
@@ -145,8 +237,6 @@ namespace FCam {
         va_end(arglist);
         postEvent(Event::Warning, code, buf, creator);        
     }
-
-    TSQueue<Event> _eventQueue;
 }
 
 
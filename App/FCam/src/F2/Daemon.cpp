@@ -673,12 +673,7 @@ namespace FCam { namespace F2 {
                     // there's no request for this frame - probably coming up
                     // from a mode switch or starting up
                     //printf("Handler: Got a frame without an outstanding request. Waiting some for one.\n");
-                    int timeout = 5;
-                    while (timeout > 0 && (inFlightQueue.size()==0) ) {
-                        timeout--;
-                        usleep(1000);
-                    }
-                    if (timeout > 0) {
+                    if (inFlightQueue.wait(5000)) {
                         req = inFlightQueue.pull();
                     } else {
                         printf("  Giving up on waiting for request\n");
@@ -733,7 +728,8 @@ namespace FCam { namespace F2 {
                     if (f->length < bytes) bytes = f->length;
                 
                     if (req->shot().image.autoAllocate()) {
-                        req->image = Image(req->image.size(), req->image.type(),f->data).copy();
+                        req->image = sensor->allocateFrameImage(req->image.size(), req->image.type());
+                        req->image.copyFrom(Image(req->image.size(), req->image.type(), f->data));
                         dprintf(2,"Autoallocate: %d x %d, %d\n", 
                                 req->image.width(), req->image.height(), req->image(0,0));
                     } else if (req->shot().image.discard()) {
@@ -8,6 +8,7 @@
 #include "FCam/F2/Sensor.h"
 #include "FCam/F2/Frame.h"
 #include "FCam/TSQueue.h"
+#include "FCam/RingQueue.h"
 
 #include "V4L2Sensor.h"
 
@@ -89,8 +90,9 @@ namespace FCam { namespace F2 {
         void enforceDropPolicy();   
             
         // The setter thread puts in flight requests on this queue, which
-        // is consumed by the handler thread
-        TSQueue<_Frame *> inFlightQueue;
+        // is consumed by the handler thread. Those are the only two
+        // threads that touch it, so it needs no lock.
+        SPSCQueue<_Frame *> inFlightQueue;
 
         // Sometimes the setter needs to access the camera exclusively
         // (e.g. to do a pipeline flush). This mutex and flag are used for
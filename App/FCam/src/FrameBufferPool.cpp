@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "FCam/Event.h"
+#include "FCam/Time.h"
+#include "FrameBufferPool.h"
+#include "ImageBuffer.h"
+#include "Debug.h"
+
+namespace FCam {
+
+    FrameBufferPool::FrameBufferPool(int count, size_t b, bool lockMemory)
+        : bytes(b), locked(lockMemory), refs(1) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&returned, NULL);
+
+        size_t pageSize = getpagesize();
+        blockBytes = Image::Buffer::offset(bytes) + sizeof(Image::Buffer);
+        blockBytes = (blockBytes + pageSize - 1) / pageSize * pageSize;
+
+        blocks.reserve(count);
+        available.reserve(count);
+        for (int i = 0; i < count; i++) {
+            void *block;
+            if (posix_memalign(&block, pageSize, blockBytes) != 0) {
+                error(Event::InternalError, "Sensor: Unable to allocate frame buffer %d of %d (%d bytes)",
+                      i+1, count, blockBytes);
+                break;
+            }
+            // Fault every page in now rather than during a burst
+            memset(block, 0, blockBytes);
+            if (locked && mlock(block, blockBytes) != 0) {
+                warning(Event::InternalError, "Sensor: Unable to lock frame buffers into memory: %s",
+                        strerror(errno));
+                locked = false;
+                for (size_t j = 0; j < blocks.size(); j++) munlock(blocks[j], blockBytes);
+            }
+            blocks.push_back((unsigned char *)block);
+            available.push_back((unsigned char *)block);
+        }
+        counts.buffers = blocks.size();
+        counts.available = blocks.size();
+    }
+
+    FrameBufferPool::~FrameBufferPool() {
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (locked) munlock(blocks[i], blockBytes);
+            free(blocks[i]);
+        }
+        pthread_cond_destroy(&returned);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    Image FrameBufferPool::take(Size s, ImageFormat f, int timeout) {
+        size_t needed = (size_t)s.width * s.height * bytesPerPixel(f);
+
+        pthread_mutex_lock(&mutex);
+        if (needed > bytes || blocks.empty()) {
+            counts.misses++;
+            pthread_mutex_unlock(&mutex);
+            return Image();
+        }
+        if (available.empty()) {
+            counts.waits++;
+            struct timespec deadline = (struct timespec)(Time::now() + timeout);
+            while (available.empty()) {
+                if (pthread_cond_timedwait(&returned, &mutex, &deadline) == ETIMEDOUT) break;
+            }
+            if (available.empty()) {
+                counts.misses++;
+                pthread_mutex_unlock(&mutex);
+                return Image();
+            }
+        }
+        unsigned char *block = available.back();
+        available.pop_back();
+        counts.hits++;
+        refs++;
+        pthread_mutex_unlock(&mutex);
+
+        Image::Buffer *b = new (block + Image::Buffer::offset(bytes))
+            Image::Buffer(Image::Buffer::Pooled, block, bytes, block, blockBytes);
+        b->pool = this;
+        return Image(s, f, b);
+    }
+
+    void FrameBufferPool::giveBack(Image::Buffer *b) {
+        pthread_mutex_lock(&mutex);
+        available.push_back((unsigned char *)b->block);
+        pthread_cond_signal(&returned);
+        pthread_mutex_unlock(&mutex);
+        release();
+    }
+
+    void FrameBufferPool::acquire() {
+        pthread_mutex_lock(&mutex);
+        refs++;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void FrameBufferPool::release() {
+        pthread_mutex_lock(&mutex);
+        bool last = (--refs == 0);
+        pthread_mutex_unlock(&mutex);
+        if (last) delete this;
+    }
+
+    Sensor::BufferPoolStats FrameBufferPool::stats() {
+        pthread_mutex_lock(&mutex);
+        Sensor::BufferPoolStats s = counts;
+        s.available = available.size();
+        pthread_mutex_unlock(&mutex);
+        return s;
+    }
+
+}
@@ -0,0 +1,55 @@
+#ifndef FCAM_FRAME_BUFFER_POOL_H
+#define FCAM_FRAME_BUFFER_POOL_H
+
+#include <pthread.h>
+#include <vector>
+
+#include "FCam/Image.h"
+#include "FCam/Sensor.h"
+
+// A fixed set of page-aligned frame buffers that a sensor hands out
+// for AutoAllocate shots. A buffer comes back to the pool when the
+// last Image referring to it is destroyed.
+
+namespace FCam {
+
+    class FrameBufferPool {
+    public:
+        // Allocate count buffers of the given size up front, touching
+        // every page, and optionally locking them into memory.
+        FrameBufferPool(int count, size_t bytes, bool lockMemory);
+
+        // An image of the given size and format in a free buffer,
+        // waiting up to timeout microseconds for one to come back if
+        // none are free. Returns an invalid image if the frame doesn't
+        // fit in a buffer, or none came back in time.
+        Image take(Size, ImageFormat, int timeout);
+
+        // Reference counting for the pool itself. The owning sensor
+        // and every buffer that's out hold one, so the pool outlives
+        // the sensor if frames do.
+        void acquire();
+        void release();
+
+        // Called by the last image referring to a buffer
+        void giveBack(Image::Buffer *);
+
+        Sensor::BufferPoolStats stats();
+
+    private:
+        ~FrameBufferPool();
+
+        pthread_mutex_t mutex;
+        pthread_cond_t returned;
+
+        std::vector<unsigned char *> blocks;
+        std::vector<unsigned char *> available;
+        size_t bytes, blockBytes;
+        bool locked;
+        int refs;
+        Sensor::BufferPoolStats counts;
+    };
+
+}
+
+#endif
@@ -1,11 +1,15 @@
 //#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <algorithm>
 
 #include "FCam/Image.h"
 #include "FCam/Time.h"
 #include "FCam/Event.h"
+#include "ImageBuffer.h"
+#include "FrameBufferPool.h"
 #include "Debug.h"
 
 namespace FCam {
@@ -13,11 +17,29 @@ namespace FCam {
     unsigned char *Image::Discard = (unsigned char *)(0);
     unsigned char *Image::AutoAllocate = (unsigned char *)(-1);
 
+    void Image::Buffer::release() {
+        if (__sync_sub_and_fetch(&refs, 1) > 0) return;
+
+        pthread_mutex_destroy(&mutex);
+        if (kind == Mapped && munmap(memory, bytes) == -1) {
+            error(Event::InternalError, 
+                  "Image: Unable to unmap memory mapped region starting at %x of size %d: %s", 
+                  memory, bytes, strerror(errno));
+        }
+        if (kind == Pooled) {
+            pool->giveBack(this);
+        } else {
+            imageBufferPool().release(block, reserved);
+        }
+    }
+
+    void Image::setBufferCacheLimit(size_t bytes) {
+        imageBufferPool().setLimit(bytes);
+    }
+
     Image::Image()
         : _size(0, 0), _type(UNKNOWN), _bytesPerPixel(0), _bytesPerRow(0), 
-          data(Image::Discard), buffer(NULL), bytesAllocated(0),
-          refCount(NULL), mutex(NULL), 
-          memMapped(false), holdingLock(false) {                
+          data(Image::Discard), shared(NULL), holdingLock(false) {                
     }
     
     Image::Image(int w, int h, ImageFormat f) 
@@ -25,17 +47,9 @@ namespace FCam {
           _type(f), 
           _bytesPerPixel(FCam::bytesPerPixel(f)), 
           _bytesPerRow(bytesPerPixel()*width()),
-          data(NULL), buffer(NULL), bytesAllocated(0),
-          refCount(NULL), mutex(NULL), 
-          memMapped(false),
+          data(NULL), shared(NULL), 
           holdingLock(false) {
-        
-        bytesAllocated = bytesPerRow()*height();
-        setBuffer(new unsigned char[bytesAllocated]);
-        refCount = new unsigned;
-        *refCount = 1; // only I know about this data
-        mutex = new pthread_mutex_t;
-        pthread_mutex_init(mutex, NULL);
+        allocate();
     }
     
     Image::Image(Size s, ImageFormat f) 
@@ -43,17 +57,29 @@ namespace FCam {
           _type(f), 
           _bytesPerPixel(FCam::bytesPerPixel(f)), 
           _bytesPerRow(bytesPerPixel()*width()),
-          data(NULL), buffer(NULL), bytesAllocated(0),
-          refCount(NULL), mutex(NULL), 
-          memMapped(false),
+          data(NULL), shared(NULL), 
           holdingLock(false) {
+        allocate();
+    }
+
+    Image::Image(Size s, ImageFormat f, Buffer *b) 
+        : _size(s), 
+          _type(f), 
+          _bytesPerPixel(FCam::bytesPerPixel(f)), 
+          _bytesPerRow(bytesPerPixel()*width()),
+          data(b->memory), shared(b), 
+          holdingLock(false) {
+    }
 
-        bytesAllocated = bytesPerRow()*height();
-        setBuffer(new unsigned char[bytesAllocated]);        
-        refCount = new unsigned;
-        *refCount = 1; // only I know about this data
-        mutex = new pthread_mutex_t;
-        pthread_mutex_init(mutex, NULL);
+    void Image::allocate() {
+        size_t bytes = (size_t)bytesPerRow()*height();
+        shared = Buffer::allocate(bytes);
+        if (!shared) {
+            error(Event::InternalError, "Image: Unable to allocate %d bytes for a %dx%d image", 
+                  bytes, width(), height());
+            return;
+        }
+        data = shared->memory;
     }
 
     Image::Image(int fd, int offset, Size s, ImageFormat f, bool writeThrough) 
@@ -61,9 +87,7 @@ namespace FCam {
           _type(f), 
           _bytesPerPixel(FCam::bytesPerPixel(f)),
           _bytesPerRow(bytesPerPixel()*width()),
-          data(NULL), buffer(NULL), bytesAllocated(0),
-          refCount(NULL), mutex(NULL),
-          memMapped(true),
+          data(NULL), shared(NULL),
           holdingLock(false) {
         
         unsigned char *mappedBuffer;
@@ -79,7 +103,7 @@ namespace FCam {
         int mapOffset = offset-startOfMap;
         // Make mapping size a multiple of page size, rounding up
         int bytesToMap = bytesPerRow()*height()+mapOffset; 
-        bytesAllocated = ((bytesToMap-1)/pageSize+1) *pageSize;
+        int bytesAllocated = ((bytesToMap-1)/pageSize+1) *pageSize;
         dprintf(5, 
                 "Image::Image(): Mapping image from file %d. "
                 "Requsted start %x, length %x. "
@@ -121,30 +145,28 @@ namespace FCam {
         }
 #endif
 
-        setBuffer(mappedBuffer, mappedBuffer+mapOffset);
-        refCount = new unsigned;
-        *refCount = 1; // only I know about this data
-        mutex = new pthread_mutex_t;
-        pthread_mutex_init(mutex, NULL);
+        shared = Buffer::wrap(Buffer::Mapped, mappedBuffer, bytesAllocated);
+        if (!shared) {
+            error(Event::InternalError, "Image: Unable to allocate a control block for a mapped image");
+            munmap(mappedBuffer, bytesAllocated);
+            return;
+        }
+        data = mappedBuffer+mapOffset;
     }
 
     Image::Image(Size s, ImageFormat f, unsigned char *d, int srcBytesPerRow) 
         : _size(s), 
           _type(f), 
           _bytesPerPixel(FCam::bytesPerPixel(f)), 
-          data(NULL), buffer(NULL), bytesAllocated(0),
-          refCount(NULL), mutex(NULL), 
-          memMapped(false),
+          data(d), shared(NULL),
           holdingLock(false) {
 
         _bytesPerRow = (srcBytesPerRow == -1) ? (bytesPerPixel() * width()) : srcBytesPerRow;
-        setBuffer(NULL, d);
 
+        // The real owner of this data frees it, but the references to
+        // it still need a lock to share.
         if (valid()) {
-            refCount = new unsigned;
-            *refCount = 2; // there's me, and then there's the real owner of this data
-            mutex = new pthread_mutex_t;
-            pthread_mutex_init(mutex, NULL);
+            shared = Buffer::wrap(Buffer::External, d, (size_t)bytesPerRow()*height());
         }
     }
     
@@ -152,24 +174,20 @@ namespace FCam {
         : _size(w, h), 
           _type(f), 
           _bytesPerPixel(FCam::bytesPerPixel(f)),
-          data(NULL), buffer(NULL), bytesAllocated(0),
-          refCount(NULL), mutex(NULL), 
-          memMapped(false),
+          data(d), shared(NULL),
           holdingLock(false) {
 
         _bytesPerRow = (srcBytesPerRow == -1) ? (bytesPerPixel() * width()) : srcBytesPerRow;
-        setBuffer(NULL, d);
 
+        // The real owner of this data frees it, but the references to
+        // it still need a lock to share.
         if (valid()) {
-            refCount = new unsigned;
-            *refCount = 2; // there's me, and then there's the real owner of this data
-            mutex = new pthread_mutex_t;
-            pthread_mutex_init(mutex, NULL);
+            shared = Buffer::wrap(Buffer::External, d, (size_t)bytesPerRow()*height());
         }
     }
 
     Image::~Image() {
-        setBuffer(NULL);        
+        setBuffer(NULL, NULL);        
     }
 
     Image::Image(const Image &other) 
@@ -177,22 +195,19 @@ namespace FCam {
           _type(other.type()), 
           _bytesPerPixel(other.bytesPerPixel()),
           _bytesPerRow(other.bytesPerRow()),
-          data(other.data), buffer(other.buffer),
-          bytesAllocated(other.bytesAllocated),
-          refCount(other.refCount),
-          mutex(other.mutex), 
-          memMapped(other.memMapped), 
+          data(other.data), shared(other.shared),
           holdingLock(false) {
-        if (refCount) {
-            (*refCount)++;
-        }
+        if (shared) shared->acquire();
     };
 
     const Image &Image::operator=(const Image &other) {
         if (this == &other) return (*this);
-        if (refCount && 
-            refCount == other.refCount &&
-            data == other.data) {
+        if (shared && 
+            shared == other.shared &&
+            data == other.data && 
+            size() == other.size() &&
+            type() == other.type() &&
+            bytesPerRow() == other.bytesPerRow()) {
             return (*this);
         }
 
@@ -200,14 +215,7 @@ namespace FCam {
         _type = other.type();
         _bytesPerPixel = other.bytesPerPixel();
         _bytesPerRow = other.bytesPerRow();
-        setBuffer(other.buffer, other.data);
-        bytesAllocated = other.bytesAllocated;
-        
-        refCount = other.refCount;
-        mutex = other.mutex;
-        if (refCount) (*refCount)++;
-        memMapped = other.memMapped;
-        holdingLock = false;
+        setBuffer(other.shared, other.data);
 
         return (*this);
     }
@@ -231,17 +239,32 @@ namespace FCam {
         sub = Image(s, type(), Image::Discard, bytesPerRow());
 
         unsigned int offset = x*bytesPerPixel()+y*bytesPerRow();
-        sub.setBuffer(buffer, data+offset);
-        sub.bytesAllocated = bytesAllocated;
-        sub.refCount = refCount;
-        sub.mutex = mutex;
-        sub.memMapped = memMapped;
-
-        if (refCount) (*refCount)++;
+        sub.setBuffer(shared, data+offset);
         
         return sub;
     }
 
+    Image Image::view(unsigned int offset, Size s, ImageFormat f, int srcBytesPerRow) const {
+        Image v;
+        unsigned int rowBytes = s.width * FCam::bytesPerPixel(f);
+        if (srcBytesPerRow < 0) srcBytesPerRow = rowBytes;
+        if (!valid() ||
+            s.width == 0 || s.height == 0 ||
+            (unsigned int)srcBytesPerRow < rowBytes) {
+            return v;
+        }
+        // Check bounds against the last byte of the current image
+        size_t available = (size_t)bytesPerRow() * (height() - 1) + width() * bytesPerPixel();
+        size_t needed = offset + (size_t)srcBytesPerRow * (s.height - 1) + rowBytes;
+        if (needed > available) return v;
+
+        v = Image(s, f, Image::Discard, srcBytesPerRow);
+
+        v.setBuffer(shared, data+offset);
+
+        return v;
+    }
+
     Image Image::copy() const {
         Image duplicate;
         if (!valid()) {
@@ -274,45 +297,18 @@ namespace FCam {
         }
     }
 
-    void Image::setBuffer(unsigned char *b, unsigned char *d) {
-        if (holdingLock) pthread_mutex_unlock(mutex);
+    void Image::setBuffer(Buffer *b, unsigned char *d) {
+        if (holdingLock) pthread_mutex_unlock(&shared->mutex);
         holdingLock = false;
 
-        if (refCount) {
-            (*refCount)--;
-
-            if (mutex && (*refCount == 0 || (weak() && *refCount == 1))) {
-                pthread_mutex_destroy(mutex);
-                delete mutex;
-                mutex = NULL;
-            }
-
-            if (*refCount == 0) {
-                delete refCount;
-                if (memMapped) {
-                    int success = munmap(buffer, bytesAllocated);
-                    if (success == -1) {
-                        error(Event::InternalError, 
-                              "Image::setBuffer: Unable to unmap memory mapped region starting at %x of size %d: %s", 
-                              buffer, bytesAllocated, strerror(errno));
-                    }
-                } else {
-                    delete[] buffer;
-                }
-            }
-            refCount = NULL;
-            mutex = NULL;
-        }
-
-        if (b == Image::Discard ||
-            b == Image::AutoAllocate) {
-            buffer = NULL;
-        } else {
-            buffer = b;
-        } 
-        if (d == NULL) d = b;
+        // Take the new reference first, in case b is the buffer we
+        // already hold the last reference to
+        if (b) b->acquire();
+        if (shared) shared->release();
+        shared = b;
 
-        // This is the only place we're allowed to set the data field
+        // This is the only place other than the constructors we're
+        // allowed to set the data field
         data = d;
     }
 
@@ -320,22 +316,22 @@ namespace FCam {
         if (holdingLock) {
             error(Event::ImageLockError, "Image reference trying to acquire lock it's already "
                   "holding. Make a separate image reference per thread.\n");
-        } else if (!mutex) {
+        } else if (!shared) {
             error(Event::InternalError, "Locking an image with no mutex\n");
             holdingLock = false;
         } else if (timeout < 0) {
-            pthread_mutex_lock(mutex);
+            pthread_mutex_lock(&shared->mutex);
             holdingLock = true;
         } else if (timeout == 0) {
-            int ret = pthread_mutex_trylock(mutex);
+            int ret = pthread_mutex_trylock(&shared->mutex);
             holdingLock = (ret == 0);
         } else {
             struct timespec t = (struct timespec)(Time::now() + timeout);
 //! \todo fix the timedlock issue
 #ifdef FCAM_ARCH_X86 
-            int ret = pthread_mutex_trylock(mutex); // Temporary hack to compile on Cygwin, breaks semantics
+            int ret = pthread_mutex_trylock(&shared->mutex); // Temporary hack to compile on Cygwin, breaks semantics
 #else
-            int ret = pthread_mutex_timedlock(mutex, &t);
+            int ret = pthread_mutex_timedlock(&shared->mutex, &t);
 #endif
             holdingLock = (ret == 0);
         }
@@ -348,12 +344,12 @@ namespace FCam {
             error(Event::ImageLockError, "Cannot unlock a lock not held by this image reference");
             return;
         }
-        if (!mutex) {
+        if (!shared) {
             error(Event::InternalError, "Unlocking an image with no mutex");
             debug();
             return;
         }
-        pthread_mutex_unlock(mutex);
+        pthread_mutex_unlock(&shared->mutex);
         holdingLock = false;
     }
 
@@ -367,7 +363,8 @@ namespace FCam {
     }
 
     void Image::debug(const char *name) const {
-        printf("\tImage %s at %llx with dimensions %d %d type %d\n\t  bytes per pixel %d bytes per row %d\n\t  data %llx buffer %llx\n\t  refCount %llx = (%d), mutex %llx, memmapped %s, holdingLock %s\n",
+        static const char *kinds[] = {"owned", "memory mapped", "external", "pooled"};
+        printf("\tImage %s at %llx with dimensions %d %d type %d\n\t  bytes per pixel %d bytes per row %d\n\t  data %llx buffer %llx\n\t  shared %llx = (%d), %s, holdingLock %s\n",
                name,
                (long long unsigned)this,
                width(), height(),
@@ -375,16 +372,11 @@ namespace FCam {
                bytesPerPixel(),
                bytesPerRow(),
                (long long unsigned)data,
-               (long long unsigned)buffer,
-               (long long unsigned)refCount,
-               refCount ? *refCount : 0,
-               (long long unsigned)mutex,
-               (memMapped ? "true" : "false"),
+               (long long unsigned)(shared ? shared->memory : NULL),
+               (long long unsigned)shared,
+               shared ? shared->refs : 0,
+               shared ? kinds[shared->kind] : "no buffer",
                (holdingLock ? "true" : "false"));
     }
    
 }
-
-
-
-
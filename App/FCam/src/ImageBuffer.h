@@ -0,0 +1,72 @@
+#ifndef FCAM_IMAGE_BUFFER_H
+#define FCAM_IMAGE_BUFFER_H
+
+#include <pthread.h>
+#include <new>
+
+#include "FCam/Image.h"
+#include "BufferPool.h"
+
+namespace FCam {
+
+    class FrameBufferPool;
+
+    // The control block shared by all references to one buffer. It
+    // lives right after the pixels for images that own their data,
+    // either in a block from the image buffer pool or in one of a
+    // sensor's frame buffers, and in a small pool block of its own
+    // for mapped files and other people's memory.
+    struct Image::Buffer {
+        enum Kind {Owned, Mapped, External, Pooled};
+
+        volatile int refs;
+        Kind kind;
+        pthread_mutex_t mutex;
+        // The pixel memory, or the whole mapping of a Mapped buffer
+        unsigned char *memory;
+        size_t bytes;
+        // The block this control block lives in, and the frame
+        // buffer pool it goes back to if it's Pooled
+        void *block;
+        size_t reserved;
+        FrameBufferPool *pool;
+
+        Buffer(Kind k, unsigned char *m, size_t n, void *b, size_t r)
+            : refs(1), kind(k), memory(m), bytes(n), block(b), reserved(r), pool(NULL) {
+            pthread_mutex_init(&mutex, NULL);
+        }
+
+        // Where the control block goes in a block that also holds n
+        // bytes of pixels: after them, on its own cache line
+        static size_t offset(size_t n) {
+            return (n + 63) & ~(size_t)63;
+        }
+
+        // A new buffer of the given size. Returns NULL if we're out
+        // of memory.
+        static Buffer *allocate(size_t n) {
+            size_t r;
+            unsigned char *b = (unsigned char *)imageBufferPool().allocate(offset(n) + sizeof(Buffer), &r);
+            if (!b) return NULL;
+            return new (b + offset(n)) Buffer(Owned, b, n, b, r);
+        }
+
+        // A control block for memory managed elsewhere
+        static Buffer *wrap(Kind k, unsigned char *m, size_t n) {
+            size_t r;
+            void *b = imageBufferPool().allocate(sizeof(Buffer), &r);
+            if (!b) return NULL;
+            return new (b) Buffer(k, m, n, b, r);
+        }
+
+        void acquire() {
+            __sync_fetch_and_add(&refs, 1);
+        }
+
+        // Drop a reference, cleaning up after the last one
+        void release();
+    };
+
+}
+
+#endif
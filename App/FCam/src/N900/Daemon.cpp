@@ -579,7 +579,8 @@ namespace FCam { namespace N900 {
                     if (f->length < bytes) bytes = f->length;
 
                     if (req->shot().image.autoAllocate()) {
-                        req->image = Image(req->image.size(), req->image.type(), f->data).copy();
+                        req->image = sensor->allocateFrameImage(req->image.size(), req->image.type());
+                        req->image.copyFrom(Image(req->image.size(), req->image.type(), f->data));
                     } else if (req->shot().image.discard()) {
                         req->image = Image(req->image.size(), req->image.type(), Image::Discard);
                     } else {
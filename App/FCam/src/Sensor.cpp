@@ -2,6 +2,7 @@
 #include "FCam/Lens.h"
 #include "FCam/Shot.h"
 
+#include "FrameBufferPool.h"
 #include "Debug.h"
 
 namespace FCam {
@@ -14,9 +15,16 @@ namespace FCam {
         attach(this);
         dropPolicy = Sensor::DropOldest;
         frameLimit = 128;
+        bufferPool = NULL;
+        bufferPoolTimeout = 0;
+        pthread_mutex_init(&bufferPoolMutex, NULL);
     }
 
-    Sensor::~Sensor() {}
+    Sensor::~Sensor() {
+        // Frames still out keep the pool alive until they're gone
+        if (bufferPool) bufferPool->release();
+        pthread_mutex_destroy(&bufferPoolMutex);
+    }
 
     void Sensor::attach(Device *d) {
         devices.push_back(d);
@@ -39,4 +47,45 @@ namespace FCam {
         return dropPolicy;
     }
 
+    void Sensor::setBufferPool(int count, Size size, ImageFormat format, 
+                               bool lockMemory, int waitTimeout) {
+        FrameBufferPool *pool = NULL;
+        if (count > 0) {
+            size_t bytes = (size_t)size.width * size.height * bytesPerPixel(format);
+            pool = new FrameBufferPool(count, bytes, lockMemory);
+        }
+
+        pthread_mutex_lock(&bufferPoolMutex);
+        FrameBufferPool *old = bufferPool;
+        bufferPool = pool;
+        bufferPoolTimeout = waitTimeout;
+        pthread_mutex_unlock(&bufferPoolMutex);
+
+        if (old) old->release();
+    }
+
+    Sensor::BufferPoolStats Sensor::bufferPoolStats() {
+        BufferPoolStats stats;
+        pthread_mutex_lock(&bufferPoolMutex);
+        if (bufferPool) stats = bufferPool->stats();
+        pthread_mutex_unlock(&bufferPoolMutex);
+        return stats;
+    }
+
+    Image Sensor::allocateFrameImage(Size size, ImageFormat format) {
+        pthread_mutex_lock(&bufferPoolMutex);
+        FrameBufferPool *pool = bufferPool;
+        int timeout = bufferPoolTimeout;
+        if (pool) pool->acquire();
+        pthread_mutex_unlock(&bufferPoolMutex);
+
+        Image image;
+        if (pool) {
+            image = pool->take(size, format, timeout);
+            pool->release();
+        }
+        if (!image.valid()) image = Image(size, format);
+        return image;
+    }
+
 }
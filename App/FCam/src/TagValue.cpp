@@ -1,11 +1,31 @@
 #include "FCam/TagValue.h"
 
+#include <new>
 #include <sstream>
 #include <iomanip>
 #include <iostream>
 
 namespace FCam {
 
+    namespace {
+        // Destroy a value of type T that was constructed in place
+        template<typename T>
+        void destroy(void *data) {
+            ((T *)data)->~T();
+        }
+
+        // Move a value of type T from one TagValue's storage into
+        // another's without copying the contents. Containers and
+        // strings are default-constructed and then swapped, which
+        // never allocates.
+        template<typename T>
+        void *moveInto(void *storage, void *from) {
+            T *to = new (storage) T();
+            std::swap(*to, *(T *)from);
+            return to;
+        }
+    }
+
     TagValue::TagValue() : type(Null), data(NULL) {
 
     }
@@ -15,123 +35,142 @@ namespace FCam {
     }
 
     void TagValue::nullify() {
+        switch (type) {
+        case Null:
+        case Int:
+        case Float:
+        case Double:
+        case Time:
+            break;
+        case String:
+            destroy<std::string >(data);
+            break;
+        case IntVector:
+            destroy<std::vector<int> >(data);
+            break;
+        case FloatVector:
+            destroy<std::vector<float> >(data);
+            break;
+        case DoubleVector:
+            destroy<std::vector<double> >(data);
+            break;
+        case StringVector:
+            destroy<std::vector<std::string> >(data);
+            break;
+        case TimeVector:
+            destroy<std::vector<FCam::Time> >(data);
+            break;
+        }
+        type = Null;
+        data = NULL;
+    }
+
+    void TagValue::moveTo(TagValue &empty) {
         switch (type) {
         case Null:
             break;
         case Int:
-            delete (int *)data;
+            empty.data = moveInto<int >(&empty.storage, data);
             break;
         case Float:
-            delete (float *)data;
+            empty.data = moveInto<float >(&empty.storage, data);
             break;
         case Double:
-            delete (double *)data;
+            empty.data = moveInto<double >(&empty.storage, data);
             break;
         case String:
-            delete (std::string *)data;
+            empty.data = moveInto<std::string >(&empty.storage, data);
             break;
         case Time:
-            delete (FCam::Time *)data;
+            empty.data = moveInto<FCam::Time >(&empty.storage, data);
             break;
         case IntVector:
-            delete (std::vector<int> *)data;
+            empty.data = moveInto<std::vector<int> >(&empty.storage, data);
             break;
         case FloatVector:
-            delete (std::vector<float> *)data;
+            empty.data = moveInto<std::vector<float> >(&empty.storage, data);
             break;
         case DoubleVector:
-            delete (std::vector<double> *)data;
+            empty.data = moveInto<std::vector<double> >(&empty.storage, data);
             break;
         case StringVector:
-            delete (std::vector<std::string> *)data;
+            empty.data = moveInto<std::vector<std::string> >(&empty.storage, data);
             break;
         case TimeVector:
-            delete (std::vector<FCam::Time> *)data;
+            empty.data = moveInto<std::vector<FCam::Time> >(&empty.storage, data);
             break;
         }
-        type = Null;
-        data = NULL;
+        empty.type = type;
+        nullify();
+    }
+
+    void TagValue::swap(TagValue &other) {
+        if (this == &other) return;
+        TagValue temp;
+        moveTo(temp);
+        other.moveTo(*this);
+        temp.moveTo(other);
     }
 
     TagValue::TagValue(int x) {
         type = Int;
-        int *ptr = new int;
-        *ptr = x;
-        data = (void *)ptr;
+        data = new (&storage) int(x);
     }
 
     TagValue::TagValue(float x) {
         type = Float;
-        float *ptr = new float;
-        *ptr = x;
-        data = (void *)ptr;
+        data = new (&storage) float(x);
     }
 
     TagValue::TagValue(double x) {
         type = Double;
-        double *ptr = new double;
-        *ptr = x;
-        data = (void *)ptr;
+        data = new (&storage) double(x);
     }
 
     TagValue::TagValue(std::string x) {
         type = String;
-        std::string *ptr = new std::string;
-        *ptr = x;
-        data = (void *)ptr;
+        // x is our own copy already, so take its contents
+        data = moveInto<std::string >(&storage, &x);
     }
 
     TagValue::TagValue(FCam::Time x) {
         type = Time;
-        FCam::Time *ptr = new FCam::Time;
-        *ptr = x;
-        data = (void *)ptr;
+        data = new (&storage) FCam::Time(x);
     }
 
     TagValue::TagValue(std::vector<int> x) {
         type = IntVector;
-        std::vector<int> *ptr = new std::vector<int>;
-        *ptr = x;
-        data = (void *)ptr;
+        data = moveInto<std::vector<int> >(&storage, &x);
     }
 
     TagValue::TagValue(std::vector<float> x) {
         type = FloatVector;
-        std::vector<float> *ptr = new std::vector<float>;
-        *ptr = x;
-        data = (void *)ptr;
+        data = moveInto<std::vector<float> >(&storage, &x);
     }
 
     TagValue::TagValue(std::vector<double> x) {
         type = DoubleVector;
-        std::vector<double> *ptr = new std::vector<double>;
-        *ptr = x;
-        data = (void *)ptr;
+        data = moveInto<std::vector<double> >(&storage, &x);
     }
 
     TagValue::TagValue(std::vector<std::string> x) {
         type = StringVector;
-        std::vector<std::string> *ptr = new std::vector<std::string>;
-        *ptr = x;
-        data = (void *)ptr;
+        data = moveInto<std::vector<std::string> >(&storage, &x);
     }
 
     TagValue::TagValue(std::vector<FCam::Time> x) {
         type = TimeVector;
-        std::vector<FCam::Time> *ptr = new std::vector<FCam::Time>;
-        *ptr = x;
-        data = (void *)ptr;
+        data = moveInto<std::vector<FCam::Time> >(&storage, &x);
     }
 
     const TagValue &TagValue::operator=(const int &x) {
         if (type == Int) {
             ((int *)data)[0] = x;
         } else {
-            nullify();
-            type = Int;
-            int *ptr = new int;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -140,11 +179,10 @@ namespace FCam {
         if (type == Float) {
             ((float *)data)[0] = x;
         } else {
-            nullify();
-            type = Float;
-            float *ptr = new float;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -153,11 +191,10 @@ namespace FCam {
         if (type == Double) {
             ((double *)data)[0] = x;
         } else {
-            nullify();
-            type = Double;
-            double *ptr = new double;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -166,11 +203,10 @@ namespace FCam {
         if (type == String) {
             ((std::string *)data)[0] = x;
         } else {
-            nullify();
-            type = String;
-            std::string *ptr = new std::string;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -179,11 +215,10 @@ namespace FCam {
         if (type == Time) {
             ((FCam::Time *)data)[0] = x;
         } else {
-            nullify();
-            type = Time;
-            FCam::Time *ptr = new FCam::Time;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -192,11 +227,10 @@ namespace FCam {
         if (type == IntVector) {
             ((std::vector<int> *)data)[0] = x;
         } else {
-            nullify();
-            type = IntVector;
-            std::vector<int> *ptr = new std::vector<int>;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -205,11 +239,10 @@ namespace FCam {
         if (type == FloatVector) {
             ((std::vector<float> *)data)[0] = x;
         } else {
-            nullify();
-            type = FloatVector;
-            std::vector<float> *ptr = new std::vector<float>;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -218,11 +251,10 @@ namespace FCam {
         if (type == DoubleVector) {
             ((std::vector<double> *)data)[0] = x;
         } else {
-            nullify();
-            type = DoubleVector;
-            std::vector<double> *ptr = new std::vector<double>;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -231,11 +263,10 @@ namespace FCam {
         if (type == StringVector) {
             ((std::vector<std::string> *)data)[0] = x;
         } else {
-            nullify();
-            type = StringVector;
-            std::vector<std::string> *ptr = new std::vector<std::string>;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
@@ -244,67 +275,105 @@ namespace FCam {
         if (type == TimeVector) {
             ((std::vector<FCam::Time> *)data)[0] = x;
         } else {
-            nullify();
-            type = TimeVector;
-            std::vector<FCam::Time> *ptr = new std::vector<FCam::Time>;
-            ptr[0] = x;
-            data = (void *)ptr;
+            // x may live inside our current value, so build the new
+            // value before letting go of the old one
+            TagValue temp(x);
+            swap(temp);
         }
         return *this;
     }
 
     const TagValue &TagValue::operator=(const TagValue &other) {
+        if (this == &other) return *this;
         switch(other.type) {
         case Null:
             nullify();
             return *this;
         case Int:
-            *this = (int)other;
+            *this = (int &)other;
             return *this;
         case Float:
-            *this = (float)other;
+            *this = (float &)other;
             return *this;
         case Double:
-            *this = (double)other;
+            *this = (double &)other;
             return *this;
         case String:
-            *this = (std::string)other;
+            *this = (std::string &)other;
             return *this;
         case Time:
-            *this = (FCam::Time)other;
+            *this = (FCam::Time &)other;
             return *this;
-        case IntVector: {
-            std::vector<int> temp = other;
-            *this = temp;
+        case IntVector:
+            *this = (std::vector<int> &)other;
             return *this;
-        }
-        case FloatVector: {
-            std::vector<float> temp = other;
-            *this = temp;
+        case FloatVector:
+            *this = (std::vector<float> &)other;
             return *this;
-        }
-        case DoubleVector: {
-            std::vector<double> temp = other;
-            *this = temp;
+        case DoubleVector:
+            *this = (std::vector<double> &)other;
             return *this;
-        }
-        case StringVector: {
-            std::vector<std::string> temp = other;
-            *this = temp;
+        case StringVector:
+            *this = (std::vector<std::string> &)other;
             return *this;
-        }
-        case TimeVector: {
-            std::vector<FCam::Time> temp = other;
-            *this = temp;
+        case TimeVector:
+            *this = (std::vector<FCam::Time> &)other;
             return *this;
         }
-        }
         return *this;
     }
 
     TagValue::TagValue(const TagValue &other) : type(Null), data(NULL) {
-        *this = other;
+        switch(other.type) {
+        case Null:
+            break;
+        case Int:
+            data = new (&storage) int((int &)other);
+            break;
+        case Float:
+            data = new (&storage) float((float &)other);
+            break;
+        case Double:
+            data = new (&storage) double((double &)other);
+            break;
+        case String:
+            data = new (&storage) std::string((std::string &)other);
+            break;
+        case Time:
+            data = new (&storage) FCam::Time((FCam::Time &)other);
+            break;
+        case IntVector:
+            data = new (&storage) std::vector<int>((std::vector<int> &)other);
+            break;
+        case FloatVector:
+            data = new (&storage) std::vector<float>((std::vector<float> &)other);
+            break;
+        case DoubleVector:
+            data = new (&storage) std::vector<double>((std::vector<double> &)other);
+            break;
+        case StringVector:
+            data = new (&storage) std::vector<std::string>((std::vector<std::string> &)other);
+            break;
+        case TimeVector:
+            data = new (&storage) std::vector<FCam::Time>((std::vector<FCam::Time> &)other);
+            break;
+        }
+        type = other.type;
+    }
+
+#if __cplusplus >= 201103L
+    TagValue::TagValue(TagValue &&other) : type(Null), data(NULL) {
+        other.moveTo(*this);
+    }
+
+    const TagValue &TagValue::operator=(TagValue &&other) {
+        if (this != &other) {
+            nullify();
+            other.moveTo(*this);
+        }
+        return *this;
     }
+#endif
 
     TagValue::operator int &() const {
         switch (type) {
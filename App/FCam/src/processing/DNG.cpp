@@ -15,18 +15,31 @@
 #include <FCam/Platform.h>
 
 #include "TIFF.h"
+#include "Save_Internal.h"
 #include "../Debug.h"
 
 namespace FCam {
 
-    _DNGFrame::_DNGFrame(): dngFile(NULL) {
+    _DNGFrame::_DNGFrame(): dngFile(NULL), pendingImage(NULL) {
         dngFile = new TiffFile;
+        pthread_mutex_init(&imageMutex, NULL);
     }
 
     _DNGFrame::~_DNGFrame() {
+        pthread_mutex_destroy(&imageMutex);
         delete dngFile;
     }
 
+    void _DNGFrame::loadImage() {
+        pthread_mutex_lock(&imageMutex);
+        if (pendingImage) {
+            dprintf(4, "DNGFrame::loadImage: %s: Reading RAW image\n", dngFile->filename().c_str());
+            image = pendingImage->getImage();
+            pendingImage = NULL;
+        }
+        pthread_mutex_unlock(&imageMutex);
+    }
+
     void _DNGFrame::rawToRGBColorMatrix(int kelvin, float *matrix) const {
         if (dng.numIlluminants == 1) {
             for (int i=0;i < 12; i++) matrix[i] = dng.colorMatrix1[i];
@@ -159,7 +172,7 @@ namespace FCam {
         }
     }
 
-    void saveDNG(Frame frame, const std::string &filename) {
+    bool writeDNG(Frame frame, const std::string &filename, const DNGOptions &options, size_t *bytes) {
         dprintf(DBG_MINOR, "saveDNG: Starting to write %s\n", filename.c_str());
 
         // Initial error checking
@@ -167,22 +180,22 @@ namespace FCam {
         if (!frame.valid()) {
             error(Event::FileSaveError, frame,
                   "saveDNG: Cannot save invalid frame as %s.", filename.c_str());
-            return;
+            return false;
         }
         if (!frame.image().valid()) {
             error(Event::FileSaveError, frame,
                   "saveDNG: Cannot save frame with no valid image as %s.", filename.c_str());
-            return;
+            return false;
         }
         if (frame.image().type() != RAW) {
             error(Event::FileSaveError, frame,
                   "saveDNG: Cannot save a non-RAW frame as a DNG %s", filename.c_str());
-            return;
+            return false;
         }
         if (frame.platform().bayerPattern() == NotBayer) {
             error(Event::FileSaveError, frame,
                   "saveDNG: Cannot save non-Bayer pattern RAW data as %s", filename.c_str());
-            return;
+            return false;
         }
 
         // Figure out the color matrices for this sensor
@@ -397,9 +410,10 @@ namespace FCam {
             blackLevelPattern.push_back(blackLevel[2]);
             blackLevelPattern.push_back(blackLevel[0]);
             blackLevelPattern.push_back(blackLevel[1]);
+            break;
         default:
             error(Event::FileSaveError, "saveDNG: %s: Can't handle non-bayer RAW images", filename.c_str());
-            return;
+            return false;
             break;
         }
         rawIfd->add(TIFFEP_TAG_CFAPattern, CFAPattern);
@@ -422,13 +436,29 @@ namespace FCam {
         rawIfd->add(DNG_TAG_DefaultCropSize, cropSize);
 
         dprintf(4, "saveDNG: Adding RAW image\n");
-        rawIfd->setImage(frame.image());
+        TiffStorage storage;
+        if (options.compress) {
+            storage.compression = TIFF_Compression_JPEG;
+        } else if (options.pack) {
+            // The fewest bits that hold the largest raw value
+            int maxRawValue = frame.platform().maxRawValue();
+            storage.bitsPerSample = maxRawValue < 1024 ? 10 : maxRawValue < 4096 ? 12 : 16;
+        }
+        storage.tileWidth = options.tileWidth;
+        storage.tileHeight = options.tileHeight;
+        storage.threads = options.threads;
+        rawIfd->setImage(frame.image(), storage);
 
         dprintf(4, "saveDNG: Beginning write to disk\n");
         // Constructed all DNG fields, write it to disk
-        dng.writeTo(filename);
+        if (!dng.writeTo(filename, options.directIO, bytes)) return false;
 
         dprintf(DBG_MINOR, "saveDNG: Done writing %s\n", filename.c_str());
+        return true;
+    }
+
+    void saveDNG(Frame frame, const std::string &filename, const DNGOptions &options) {
+        writeDNG(frame, filename, options, NULL);
     }
 
     void loadDNGPrivateData_v1(_DNGFrame *_f, std::stringstream &privateData) {
@@ -482,7 +512,7 @@ namespace FCam {
         TagValue key;
         while ((privateData >> key).good()) {
             privateData >> val;
-            _f->tags[key] = val;
+            _f->tags[key].swap(val);
         }
     }
 
@@ -492,7 +522,7 @@ namespace FCam {
         TagValue key, val;
         while ((privateData >> key).good()) {
             privateData >> val;
-            _f->tags[key] = val;
+            _f->tags[key].swap(val);
         }
 
         // And then look for special frame fields and parse them out
@@ -555,7 +585,41 @@ namespace FCam {
     }
 
 
-    DNGFrame loadDNG(const std::string &filename) {
+    // Find the IFD holding the full RAW image: IFD0, or one of its subIFDs
+    static TiffIfd *findRawIfd(TiffFile &dng) {
+        const TiffIfdEntry *entry;
+        entry = dng.ifds(0)->find(TIFF_TAG_NewSubFileType);
+        int ifdType = TIFF_NewSubfileType_DEFAULT;
+        if (entry) {
+            ifdType = entry->value();
+        }
+
+        TiffIfd *rawIfd = NULL;
+        if (ifdType == (int)TIFF_NewSubfileType_FullRAW) {
+            // Main IFD has RAW data
+            dprintf(4, "loadDNG: RAW data found in IFD0\n");
+            rawIfd = dng.ifds(0);
+        } else {
+            // Search subIFDs for RAW data
+            for (size_t i=0; i < dng.ifds(0)->subIfds().size(); i++) {
+                ifdType = TIFF_NewSubfileType_DEFAULT;
+                entry = dng.ifds(0)->subIfds(i)->find(TIFF_TAG_NewSubFileType);
+                if (entry) {
+                    ifdType = entry->value();
+                }
+                if (ifdType == (int)TIFF_NewSubfileType_FullRAW) {
+                    dprintf(4, "loadDNG: RAW data found in subIFD %d\n", i);
+                    rawIfd = dng.ifds(0)->subIfds(i);
+                    break;
+                }
+            }
+        }
+
+        return rawIfd;
+    }
+
+    // Load a DNG, reading in the RAW image now or, if lazy, on demand
+    static DNGFrame loadDNGFile(const std::string &filename, bool lazy) {
         // Construct DNG Frame
         _DNGFrame *_f = new _DNGFrame;
         DNGFrame f(_f);
@@ -614,38 +678,18 @@ namespace FCam {
         //
         // Let's find the RAW IFD
 
+        TiffIfd *rawIfd = findRawIfd(dng);
+        if (!rawIfd) fatalError("loadDNG: %s: Can't find RAW data!", filename.c_str());
+
         const TiffIfdEntry *entry;
-        entry = dng.ifds(0)->find(TIFF_TAG_NewSubFileType);
-        int ifdType = TIFF_NewSubfileType_DEFAULT;
-        if (entry) {
-            ifdType = entry->value();
-        }
 
-        TiffIfd *rawIfd = NULL;
-        if (ifdType == (int)TIFF_NewSubfileType_FullRAW) {
-            // Main IFD has RAW data
-            dprintf(4, "loadDNG: RAW data found in IFD0\n");
-            rawIfd = dng.ifds(0);
+        //
+        // Read in RAW image data, or just remember where it is
+        if (lazy) {
+            _f->pendingImage = rawIfd;
         } else {
-            // Search subIFDs for RAW data
-            for (size_t i=0; i < dng.ifds(0)->subIfds().size(); i++) {
-                ifdType = TIFF_NewSubfileType_DEFAULT;
-                entry = dng.ifds(0)->subIfds(i)->find(TIFF_TAG_NewSubFileType);
-                if (entry) {
-                    ifdType = entry->value();
-                }
-                if (ifdType == (int)TIFF_NewSubfileType_FullRAW) {
-                    dprintf(4, "loadDNG: RAW data found in subIFD %d\n", i);
-                    rawIfd = dng.ifds(0)->subIfds(i);
-                    break;
-                }
-            }
-            if (!rawIfd) fatalError("loadDNG: %s: Can't find RAW data!", filename.c_str());
+            _f->image = rawIfd->getImage();
         }
-
-        //
-        // Read in RAW image data 
-        _f->image = rawIfd->getImage();
         
         //
         // Ok, now to parse the RAW metadata
@@ -765,7 +809,7 @@ namespace FCam {
         TiffIfd *thumbIfd = NULL;
 
         entry = dng.ifds(0)->find(TIFF_TAG_NewSubFileType);
-        ifdType = TIFF_NewSubfileType_DEFAULT;
+        int ifdType = TIFF_NewSubfileType_DEFAULT;
         if (entry) {
             ifdType = entry->value();
         }
@@ -950,4 +994,35 @@ namespace FCam {
         return f;
     }
 
+    DNGFrame loadDNG(const std::string &filename) {
+        return loadDNGFile(filename, false);
+    }
+
+    DNGFrame loadDNGMetadata(const std::string &filename) {
+        return loadDNGFile(filename, true);
+    }
+
+    Image loadDNGRegion(const std::string &filename, Rect region) {
+        TiffFile dng;
+        dng.readFrom(filename);
+        if (!dng.valid) {
+            postEvent(dng.lastEvent);
+            return Image();
+        }
+
+        TiffIfd *rawIfd = findRawIfd(dng);
+        if (!rawIfd) {
+            error(Event::FileLoadError, "loadDNGRegion: %s: Can't find RAW data!", filename.c_str());
+            return Image();
+        }
+
+        // Only the strips or tiles under the region are read
+        Image img = rawIfd->getRegion(region);
+        if (!img.valid()) {
+            error(Event::FileLoadError, "loadDNGRegion: %s: Can't read region %d,%d %dx%d.",
+                  filename.c_str(), region.x, region.y, region.width, region.height);
+        }
+        return img;
+    }
+
 }
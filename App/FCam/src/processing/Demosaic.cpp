@@ -7,6 +7,12 @@
 #ifdef FCAM_ARCH_ARM
 #include "Demosaic_ARM.h"
 #endif
+#ifdef FCAM_ARCH_X86
+#include "Demosaic_X86.h"
+#endif
+
+#include "Demosaic_Internal.h"
+#include "Parallel.h"
 
 #include <FCam/processing/Demosaic.h>
 #include <FCam/Sensor.h>
@@ -53,49 +59,616 @@ namespace FCam {
         }
     }
 
+    bool makeFixedColorMatrix(const float *colorMatrix, unsigned short maxRaw, 
+                              FixedColorMatrix *fixedMatrix) {
+        // Interpolated values can overshoot the raw range by up to
+        // maxRaw in either direction
+        double maxInput = 2.0*maxRaw + 1;
+        for (int i = 0; i < 3; i++) {
+            double bound = (1 << (FIXED_SHIFT-1));
+            for (int j = 0; j < 4; j++) {
+                fixedMatrix->m[i*4+j] = (int)floorf(colorMatrix[i*4+j] * (1 << FIXED_SHIFT) + 0.5f);
+                bound += fabs((double)fixedMatrix->m[i*4+j]) * (j < 3 ? maxInput : 1);
+            }
+            if (bound >= 2147483647.0) return false;
+        }
+        return true;
+    }
+
+    void makeFixedLUT(const unsigned char *lut, unsigned char *fixedLut, 
+                      FixedColorMatrix *fixedMatrix) {
+        for (int i = FIXED_LUT_MIN; i <= FIXED_LUT_MAX; i++) {
+            fixedLut[i - FIXED_LUT_MIN] = lut[i < 0 ? 0 : (i > 1023 ? 1023 : i)];
+        }
+        fixedMatrix->steepMin = 1;
+        fixedMatrix->steepMax = 0;
+        for (int i = 0; i < 1023; i++) {
+            if (abs(lut[i+1] - lut[i]) > 1) {
+                if (fixedMatrix->steepMin > fixedMatrix->steepMax) fixedMatrix->steepMin = i;
+                fixedMatrix->steepMax = i+1;
+            }
+        }
+    }
+
+    // Get the color matrix for a frame. This is the shot's custom
+    // color matrix if there is one, and otherwise the platform's
+    // matrix for the shot's white balance.
+    static void getColorMatrix(const Frame &src, float *colorMatrix) {
+        if (src.shot().colorMatrix().size() == 12) {
+            for (int i = 0; i < 12; i++) {
+                colorMatrix[i] = src.shot().colorMatrix()[i];
+            }
+        } else {
+            src.platform().rawToRGBColorMatrix(src.shot().whiteBalance, colorMatrix);
+        }
+    }
+
+    // Find which row and column of each 2x2 block of a bayer pattern
+    // is red. Blue is at the other row and column, and green is
+    // everywhere else. Returns false for non-bayer patterns.
+    static bool redPosition(BayerPattern pattern, int *row, int *col) {
+        switch (pattern) {
+        case RGGB:
+            *row = 0; *col = 0;
+            return true;
+        case BGGR:
+            *row = 1; *col = 1;
+            return true;
+        case GRBG:
+            *row = 0; *col = 1;
+            return true;
+        case GBRG:
+            *row = 1; *col = 0;
+            return true;
+        default:
+            return false;
+        }
+    }
+
     // Some functions used by demosaic
     inline short max(short a, short b) {return a>b ? a : b;}
     inline short max(short a, short b, short c, short d) {return max(max(a, b), max(c, d));}
     inline short min(short a, short b) {return a<b ? a : b;}
 
+    // The demosaic works on blocks of this size, and channels named thus
+    const int BLOCK_WIDTH = 40;
+    const int BLOCK_HEIGHT = 24;
+    const int G = 0, GR = 0, R = 1, B = 2, GB = 3;        
+
+    // The demosaic is written for GRBG. The other bayer patterns are
+    // GRBG mirrored horizontally, vertically, or both, so they're
+    // demosaicked by reading the input and writing the output
+    // mirrored. This says which way each pattern is mirrored.
+    template<BayerPattern PATTERN> struct BayerFlip;
+    template<> struct BayerFlip<GRBG> {static const bool x = false, y = false;};
+    template<> struct BayerFlip<RGGB> {static const bool x = true,  y = false;};
+    template<> struct BayerFlip<BGGR> {static const bool x = false, y = true;};
+    template<> struct BayerFlip<GBRG> {static const bool x = true,  y = true;};
+
+    // The address of pixel (x, y) of an image, as seen mirrored into GRBG order
+    template<BayerPattern PATTERN>
+    inline unsigned char *bayerPixel(const Image &im, int x, int y) {
+        return im(BayerFlip<PATTERN>::x ? (int)im.width()-1-x : x,
+                  BayerFlip<PATTERN>::y ? (int)im.height()-1-y : y);
+    }
+
+    // Demosaic one BLOCK_WIDTH x BLOCK_HEIGHT block of output, at
+    // (bx, by) in the output and in the input, which has a four
+    // pixel apron relative to the output. Coordinates are those of
+    // the GRBG-ordered view of both images. If fixedMatrix is set, it
+    // is used instead of colorMatrix outside its steep range, and lut
+    // is a table from makeFixedLUT, pointing at the entry for zero.
+    template<BayerPattern PATTERN>
+    static void demosaicBlock(const Image &input, Image &out, int bx, int by, bool denoise,
+                              const float *colorMatrix, const FixedColorMatrix *fixedMatrix, 
+                              const unsigned char *lut) {
+        #define IN(x, y) ((short *)bayerPixel<PATTERN>(input, x, y))[0]
+        #define OUT(x, y) bayerPixel<PATTERN>(out, x, y)
+
+        /*
+          Stage 1: Load a block of input, treat it as 4-channel gr, r, b, gb
+        */
+        short inBlock[4][BLOCK_HEIGHT/2+4][BLOCK_WIDTH/2+4];
+
+        for (int y = 0; y < BLOCK_HEIGHT/2+4; y++) {
+            for (int x = 0; x < BLOCK_WIDTH/2+4; x++) {
+                inBlock[GR][y][x] = IN(bx + 2*x, by + 2*y);
+                inBlock[R][y][x] = IN(bx + 2*x+1, by + 2*y);
+                inBlock[B][y][x] = IN(bx + 2*x, by + 2*y+1);
+                inBlock[GB][y][x] = IN(bx + 2*x+1, by + 2*y+1);
+            }
+        }
+
+        // linear luminance outputs
+        short linear[3][4][BLOCK_HEIGHT/2+4][BLOCK_WIDTH/2+4];
+
+        /*                  
+
+        Stage 1.5: Suppress hot pixels
+
+        gr[HERE] = min(gr[HERE], max(gr[UP], gr[LEFT], gr[RIGHT], gr[DOWN]));
+        r[HERE]  = min(r[HERE], max(r[UP], r[LEFT], r[RIGHT], r[DOWN]));
+        b[HERE]  = min(b[HERE], max(b[UP], b[LEFT], b[RIGHT], b[DOWN]));
+        gb[HERE] = min(gb[HERE], max(gb[UP], gb[LEFT], gb[RIGHT], gb[DOWN]));
+
+        */
+
+        if (denoise) {
+            for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
+                for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
+                    linear[G][GR][y][x] = min(inBlock[GR][y][x],
+                                              max(inBlock[GR][y-1][x],
+                                                  inBlock[GR][y+1][x],
+                                                  inBlock[GR][y][x+1],
+                                                  inBlock[GR][y][x-1]));
+                    linear[R][R][y][x] = min(inBlock[R][y][x],
+                                             max(inBlock[R][y-1][x],
+                                                 inBlock[R][y+1][x],
+                                                 inBlock[R][y][x+1],
+                                                 inBlock[R][y][x-1]));
+                    linear[B][B][y][x] = min(inBlock[B][y][x],
+                                             max(inBlock[B][y-1][x],
+                                                 inBlock[B][y+1][x],
+                                                 inBlock[B][y][x+1],
+                                                 inBlock[B][y][x-1]));
+                    linear[G][GB][y][x] = min(inBlock[GB][y][x],
+                                              max(inBlock[GB][y-1][x],
+                                                  inBlock[GB][y+1][x],
+                                                  inBlock[GB][y][x+1],
+                                                  inBlock[GB][y][x-1]));
+                }
+            }
+        } else {
+            for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
+                for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
+                    linear[G][GR][y][x] = inBlock[GR][y][x];
+                    linear[R][R][y][x] = inBlock[R][y][x];
+                    linear[B][B][y][x] = inBlock[B][y][x];
+                    linear[G][GB][y][x] = inBlock[GB][y][x];
+                }
+            }                    
+        }
+        
+
+        /*
+          2: Interpolate g at r 
+          
+          gv_r = (gb[UP] + gb[HERE])/2;
+          gvd_r = |gb[UP] - gb[HERE]|;
+          
+          gh_r = (gr[HERE] + gr[RIGHT])/2;
+          ghd_r = |gr[HERE] - gr[RIGHT]|;
+          
+          g_r = ghd_r < gvd_r ? gh_r : gv_r;
+          
+          3: Interpolate g at b
+          
+          gv_b = (gr[DOWN] + gr[HERE])/2;
+          gvd_b = |gr[DOWN] - gr[HERE]|;
+          
+          gh_b = (gb[LEFT] + gb[HERE])/2;
+          ghd_b = |gb[LEFT] - gb[HERE]|;
+          
+          g_b = ghd_b < gvd_b ? gh_b : gv_b;
+
+        */
+
+        for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
+            for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
+                short gv_r = (linear[G][GB][y-1][x] + linear[G][GB][y][x])/2;
+                short gvd_r = abs(linear[G][GB][y-1][x] - linear[G][GB][y][x]);
+                short gh_r = (linear[G][GR][y][x] + linear[G][GR][y][x+1])/2;
+                short ghd_r = abs(linear[G][GR][y][x] - linear[G][GR][y][x+1]);
+                linear[G][R][y][x] = ghd_r < gvd_r ? gh_r : gv_r;
+
+                short gv_b = (linear[G][GR][y+1][x] + linear[G][GR][y][x])/2;
+                short gvd_b = abs(linear[G][GR][y+1][x] - linear[G][GR][y][x]);
+                short gh_b = (linear[G][GB][y][x] + linear[G][GB][y][x-1])/2;
+                short ghd_b = abs(linear[G][GB][y][x] - linear[G][GB][y][x-1]);
+                linear[G][B][y][x] = ghd_b < gvd_b ? gh_b : gv_b;                        
+            }
+        }
+
+        /*
+          4: Interpolate r at gr
+          
+          r_gr = (r[LEFT] + r[HERE])/2 + gr[HERE] - (g_r[LEFT] + g_r[HERE])/2;
+          
+          5: Interpolate b at gr
+          
+          b_gr = (b[UP] + b[HERE])/2 + gr[HERE] - (g_b[UP] + g_b[HERE])/2;
+          
+          6: Interpolate r at gb
+          
+          r_gb = (r[HERE] + r[DOWN])/2 + gb[HERE] - (g_r[HERE] + g_r[DOWN])/2;
+          
+          7: Interpolate b at gb
+          
+          b_gb = (b[HERE] + b[RIGHT])/2 + gb[HERE] - (g_b[HERE] + g_b[RIGHT])/2;
+        */
+        for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
+            for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
+                linear[R][GR][y][x] = ((linear[R][R][y][x-1] + linear[R][R][y][x])/2 +
+                                       linear[G][GR][y][x] - 
+                                       (linear[G][R][y][x-1] + linear[G][R][y][x])/2);
+
+                linear[B][GR][y][x] = ((linear[B][B][y-1][x] + linear[B][B][y][x])/2 +
+                                       linear[G][GR][y][x] - 
+                                       (linear[G][B][y-1][x] + linear[G][B][y][x])/2);
+
+                linear[R][GB][y][x] = ((linear[R][R][y][x] + linear[R][R][y+1][x])/2 +
+                                       linear[G][GB][y][x] - 
+                                       (linear[G][R][y][x] + linear[G][R][y+1][x])/2);
+
+                linear[B][GB][y][x] = ((linear[B][B][y][x] + linear[B][B][y][x+1])/2 +
+                                       linear[G][GB][y][x] - 
+                                       (linear[G][B][y][x] + linear[G][B][y][x+1])/2);
+
+            }
+        }       
+
+
+        /*
+          
+        8: Interpolate r at b
+        
+        rp_b = (r[DOWNLEFT] + r[HERE])/2 + g_b[HERE] - (g_r[DOWNLEFT] + g_r[HERE])/2;
+        rn_b = (r[LEFT] + r[DOWN])/2 + g_b[HERE] - (g_r[LEFT] + g_r[DOWN])/2;
+        rpd_b = (r[DOWNLEFT] - r[HERE]);
+        rnd_b = (r[LEFT] - r[DOWN]);    
+        
+        r_b = rpd_b < rnd_b ? rp_b : rn_b;
+        
+        9: Interpolate b at r
+        
+        bp_r = (b[UPRIGHT] + b[HERE])/2 + g_r[HERE] - (g_b[UPRIGHT] + g_b[HERE])/2;
+        bn_r = (b[RIGHT] + b[UP])/2 + g_r[HERE] - (g_b[RIGHT] + g_b[UP])/2;     
+        bpd_r = |b[UPRIGHT] - b[HERE]|;
+        bnd_r = |b[RIGHT] - b[UP]|;     
+        
+        b_r = bpd_r < bnd_r ? bp_r : bn_r;             
+        
+        */
+        for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
+            for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
+                short rp_b = ((linear[R][R][y+1][x-1] + linear[R][R][y][x])/2 +
+                              linear[G][B][y][x] - 
+                              (linear[G][R][y+1][x-1] + linear[G][R][y][x])/2);
+                short rpd_b = abs(linear[R][R][y+1][x-1] - linear[R][R][y][x]);
+                
+                short rn_b = ((linear[R][R][y][x-1] + linear[R][R][y+1][x])/2 +
+                              linear[G][B][y][x] - 
+                              (linear[G][R][y][x-1] + linear[G][R][y+1][x])/2);
+                short rnd_b = abs(linear[R][R][y][x-1] - linear[R][R][y+1][x]);
+                
+                linear[R][B][y][x] = rpd_b < rnd_b ? rp_b : rn_b;
+
+                short bp_r = ((linear[B][B][y-1][x+1] + linear[B][B][y][x])/2 +
+                              linear[G][R][y][x] - 
+                              (linear[G][B][y-1][x+1] + linear[G][B][y][x])/2);
+                short bpd_r = abs(linear[B][B][y-1][x+1] - linear[B][B][y][x]);
+                
+                short bn_r = ((linear[B][B][y][x+1] + linear[B][B][y-1][x])/2 +
+                              linear[G][R][y][x] - 
+                              (linear[G][B][y][x+1] + linear[G][B][y-1][x])/2);
+                short bnd_r = abs(linear[B][B][y][x+1] - linear[B][B][y-1][x]);
+                
+                linear[B][R][y][x] = bpd_r < bnd_r ? bp_r : bn_r;                       
+            }
+        }
+
+        /*
+          10: Color matrix
+            
+          11: Gamma correct
+   
+        */
+
+        if (fixedMatrix) {
+            // As below, but in fixed point, with the clamp done by the lut
+            for (int y = 2; y < BLOCK_HEIGHT/2+2; y++) {
+                for (int x = 2; x < BLOCK_WIDTH/2+2; x++) {
+                    for (int l = 0; l < 4; l++) {
+                        int rl = linear[R][l][y][x];
+                        int gl = linear[G][l][y][x];
+                        int bl = linear[B][l][y][x];
+                        unsigned char *px = OUT(bx+(x-2)*2+(l == R || l == GB), 
+                                                by+(y-2)*2+(l == B || l == GB));
+                        for (int c = 0; c < 3; c++) {
+                            const int *m = fixedMatrix->m + c*4;
+                            int v = (m[0]*rl + m[1]*gl + m[2]*bl + m[3] + 
+                                     (1 << (FIXED_SHIFT-1))) >> FIXED_SHIFT;
+                            v = v < FIXED_LUT_MIN ? FIXED_LUT_MIN : (v > FIXED_LUT_MAX ? FIXED_LUT_MAX : v);
+                            if (v >= fixedMatrix->steepMin && v <= fixedMatrix->steepMax) {
+                                const float *f = colorMatrix + c*4;
+                                float fv = f[0]*rl + f[1]*gl + f[2]*bl + f[3];
+                                v = fv < 0 ? 0 : (fv > 1023 ? 1023 : (unsigned short)(fv+0.5f));
+                            }
+                            px[c] = lut[v];
+                        }
+                    }
+                }
+            }
+            return;
+        }
+
+        float r, g, b;
+        unsigned short ri, gi, bi;
+        for (int y = 2; y < BLOCK_HEIGHT/2+2; y++) {
+            for (int x = 2; x < BLOCK_WIDTH/2+2; x++) {
+
+                // Convert from sensor rgb to srgb
+                r = colorMatrix[0]*linear[R][GR][y][x] +
+                    colorMatrix[1]*linear[G][GR][y][x] +
+                    colorMatrix[2]*linear[B][GR][y][x] +
+                    colorMatrix[3];
+
+                g = colorMatrix[4]*linear[R][GR][y][x] +
+                    colorMatrix[5]*linear[G][GR][y][x] +
+                    colorMatrix[6]*linear[B][GR][y][x] +
+                    colorMatrix[7];
+
+                b = colorMatrix[8]*linear[R][GR][y][x] +
+                    colorMatrix[9]*linear[G][GR][y][x] +
+                    colorMatrix[10]*linear[B][GR][y][x] +
+                    colorMatrix[11];
+
+                // Clamp
+                ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
+                gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
+                bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
+               
+                // Gamma correct and store
+                OUT(bx+(x-2)*2, by+(y-2)*2)[0] = lut[ri];
+                OUT(bx+(x-2)*2, by+(y-2)*2)[1] = lut[gi];
+                OUT(bx+(x-2)*2, by+(y-2)*2)[2] = lut[bi];
+
+                // Convert from sensor rgb to srgb
+                r = colorMatrix[0]*linear[R][R][y][x] +
+                    colorMatrix[1]*linear[G][R][y][x] +
+                    colorMatrix[2]*linear[B][R][y][x] +
+                    colorMatrix[3];
+
+                g = colorMatrix[4]*linear[R][R][y][x] +
+                    colorMatrix[5]*linear[G][R][y][x] +
+                    colorMatrix[6]*linear[B][R][y][x] +
+                    colorMatrix[7];
+
+                b = colorMatrix[8]*linear[R][R][y][x] +
+                    colorMatrix[9]*linear[G][R][y][x] +
+                    colorMatrix[10]*linear[B][R][y][x] +
+                    colorMatrix[11];
+
+                // Clamp
+                ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
+                gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
+                bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
+                
+                // Gamma correct and store
+                OUT(bx+(x-2)*2+1, by+(y-2)*2)[0] = lut[ri];
+                OUT(bx+(x-2)*2+1, by+(y-2)*2)[1] = lut[gi];
+                OUT(bx+(x-2)*2+1, by+(y-2)*2)[2] = lut[bi];
+                
+                // Convert from sensor rgb to srgb
+                r = colorMatrix[0]*linear[R][B][y][x] +
+                    colorMatrix[1]*linear[G][B][y][x] +
+                    colorMatrix[2]*linear[B][B][y][x] +
+                    colorMatrix[3];
+
+                g = colorMatrix[4]*linear[R][B][y][x] +
+                    colorMatrix[5]*linear[G][B][y][x] +
+                    colorMatrix[6]*linear[B][B][y][x] +
+                    colorMatrix[7];
+
+                b = colorMatrix[8]*linear[R][B][y][x] +
+                    colorMatrix[9]*linear[G][B][y][x] +
+                    colorMatrix[10]*linear[B][B][y][x] +
+                    colorMatrix[11];
+
+                // Clamp
+                ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
+                gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
+                bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
+               
+                // Gamma correct and store
+                OUT(bx+(x-2)*2, by+(y-2)*2+1)[0] = lut[ri];
+                OUT(bx+(x-2)*2, by+(y-2)*2+1)[1] = lut[gi];
+                OUT(bx+(x-2)*2, by+(y-2)*2+1)[2] = lut[bi];
+                
+                // Convert from sensor rgb to srgb
+                r = colorMatrix[0]*linear[R][GB][y][x] +
+                    colorMatrix[1]*linear[G][GB][y][x] +
+                    colorMatrix[2]*linear[B][GB][y][x] +
+                    colorMatrix[3];
+
+                g = colorMatrix[4]*linear[R][GB][y][x] +
+                    colorMatrix[5]*linear[G][GB][y][x] +
+                    colorMatrix[6]*linear[B][GB][y][x] +
+                    colorMatrix[7];
+
+                b = colorMatrix[8]*linear[R][GB][y][x] +
+                    colorMatrix[9]*linear[G][GB][y][x] +
+                    colorMatrix[10]*linear[B][GB][y][x] +
+                    colorMatrix[11];
+
+                // Clamp
+                ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
+                gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
+                bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
+               
+                // Gamma correct and store
+                OUT(bx+(x-2)*2+1, by+(y-2)*2+1)[0] = lut[ri];
+                OUT(bx+(x-2)*2+1, by+(y-2)*2+1)[1] = lut[gi];
+                OUT(bx+(x-2)*2+1, by+(y-2)*2+1)[2] = lut[bi];
+                
+            }
+        }                
+
+        #undef IN
+        #undef OUT
+    }
+
+    // The state shared by the threads demosaicking a frame
+    struct DemosaicJob {
+        Image input, out;
+        // How much more input there is past the apron of the region
+        // being demosaicked, on each side, for methods that look
+        // further afield
+        int left, top, right, bottom;
+        DemosaicMethod method;
+        // How many rows of blocks each task does
+        int blockRows;
+        bool denoise;
+        const float *colorMatrix;
+        const FixedColorMatrix *fixedMatrix;
+        const unsigned char *lut;
+        #ifdef FCAM_ARCH_X86
+        DemosaicKernel_X86 kernel;
+        #endif
+    };
+
+    // Demosaic one task's worth of rows of blocks, counting rows in
+    // the GRBG-ordered view
+    template<BayerPattern PATTERN>
+    static void demosaicBlockRow(void *context, int task) {
+        DemosaicJob *job = (DemosaicJob *)context;
+        int by = task*job->blockRows*BLOCK_HEIGHT;
+        int height = std::min(job->blockRows*BLOCK_HEIGHT, (int)job->out.height() - by);
+        const bool flipX = BayerFlip<PATTERN>::x, flipY = BayerFlip<PATTERN>::y;
+
+        if (job->method != DemosaicFast) {
+            // The high quality methods read past the apron, so tell
+            // them how much input surrounds these rows of blocks in the
+            // mirrored view
+            int inStride = flipY ? -(int)job->input.bytesPerRow() : job->input.bytesPerRow();
+            int outStride = flipY ? -(int)job->out.bytesPerRow() : job->out.bytesPerRow();
+            int left = flipX ? job->right : job->left;
+            int right = flipX ? job->left : job->right;
+            int top = (flipY ? job->bottom : job->top) + by;
+            int bottom = (flipY ? job->top : job->bottom) + job->out.height() - by - height;
+            void (*hq)(const unsigned char *, int, int, int, int, int,
+                       unsigned char *, int, int, int, bool, bool,
+                       const float *, const unsigned char *) = 
+                job->method == DemosaicAHD ? demosaicAHD : demosaicVNG;
+            hq(bayerPixel<PATTERN>(job->input, 0, by), inStride, left, top, right, bottom,
+               bayerPixel<PATTERN>(job->out, 0, by), outStride,
+               job->out.width(), height, flipX, job->denoise,
+               job->colorMatrix, job->lut);
+            return;
+        }
+
+        #ifdef FCAM_ARCH_X86
+        if (job->kernel) {
+            // Point the kernel at the first pixel of the mirrored view
+            // of each image, and step backwards through any flipped
+            // axes.
+            int inStride = flipY ? -(int)job->input.bytesPerRow() : job->input.bytesPerRow();
+            int outStride = flipY ? -(int)job->out.bytesPerRow() : job->out.bytesPerRow();
+            job->kernel(bayerPixel<PATTERN>(job->input, 0, by), inStride, 
+                        bayerPixel<PATTERN>(job->out, 0, by), outStride,
+                        job->out.width(), height, flipX, job->denoise, 
+                        job->colorMatrix, job->lut);
+            return;
+        }
+        #endif
+
+        for (int y = by; y < by + height; y += BLOCK_HEIGHT) {
+            for (unsigned bx = 0; bx < job->out.width(); bx += BLOCK_WIDTH) {
+                demosaicBlock<PATTERN>(job->input, job->out, bx, y, job->denoise, 
+                                       job->colorMatrix, job->fixedMatrix, job->lut);
+            }
+        }
+    }
+
     Image demosaic(Frame src, float contrast, bool denoise, int blackLevel, float gamma) {
+        DemosaicOptions options;
+        options.contrast = contrast;
+        options.denoise = denoise;
+        options.blackLevel = blackLevel;
+        options.gamma = gamma;
+        return demosaic(src, options);
+    }
+
+    // Check a frame is something demosaic can handle, and post an
+    // error if it isn't
+    static bool checkDemosaicInput(const Frame &src) {
         if (!src.image().valid()) {
             error(Event::DemosaicError, "Cannot demosaic an invalid image");
-            return Image();
+            return false;
         }
         if (src.image().bytesPerRow() % 2 == 1) {
             error(Event::DemosaicError, "Cannot demosaic an image with bytesPerRow not divisible by 2");
-            return Image();
+            return false;
         }
-       
-        // We've vectorized this code for arm
+        return true;
+    }
+
+    // Everything needed to demosaic a frame, worked out once up front
+    struct DemosaicPlan {
+        // The raw input, cropped to the output plus a four pixel apron
+        Image input;
+        Size size;
+        int threads;
+
+        // The demosaic for the frame's bayer pattern, and its arguments
+        void (*demosaicRow)(void *, int);
+        DemosaicJob job;
+
+        unsigned char lut[4096];
+        float colorMatrix[12];
+        FixedColorMatrix fixedMatrix;
+        unsigned char fixedLut[FIXED_LUT_SIZE];
+
         #ifdef FCAM_ARCH_ARM
-        return demosaic_ARM(src, contrast, denoise, blackLevel, gamma);
+        // The ARM demosaic only does whole frames, so pieces of
+        // output are copied out of this
+        Image whole;
         #endif
 
-        Image input = src.image();
+        // Prepare to demosaic src. Returns false if it can't be.
+        bool init(Frame src, const DemosaicOptions &options);
+
+        // Demosaic the region of output at (x, y) the size of out.
+        // The region must be made of whole blocks.
+        void run(Image out, int x, int y);
+    };
+
+    bool DemosaicPlan::init(Frame src, const DemosaicOptions &options) {
+        if (!checkDemosaicInput(src)) return false;
+        threads = options.threads;
 
-        // First check we're the right bayer pattern. If not crop and continue.
+        #ifdef FCAM_ARCH_ARM
+        // The NEON code only handles GRBG, and crops other patterns
+        // to it, so they take the mirrored generic path below to
+        // keep the same output size
+        if (options.method == DemosaicFast && src.platform().bayerPattern() == GRBG) {
+            whole = demosaic_ARM(src, options.contrast, options.denoise, options.blackLevel, options.gamma);
+            size = whole.size();
+            return whole.valid();
+        }
+        #endif
+
+        input = src.image();
+
+        // Pick the version of the demosaic for this bayer pattern
         switch((int)src.platform().bayerPattern()) {
         case GRBG:
+            demosaicRow = demosaicBlockRow<GRBG>;
             break;
         case RGGB:
-            input = input.subImage(1, 0, Size(input.width()-2, input.height()));
+            demosaicRow = demosaicBlockRow<RGGB>;
             break;
         case BGGR:
-            input = input.subImage(0, 1, Size(input.width(), input.height()-2));
+            demosaicRow = demosaicBlockRow<BGGR>;
             break;
         case GBRG:
-            input = input.subImage(1, 1, Size(input.width()-2, input.height()-2));
+            demosaicRow = demosaicBlockRow<GBRG>;
+            break;
         default:
             error(Event::DemosaicError, "Can't demosaic from a non-bayer sensor\n");
-            return Image();
+            return false;
         }
 
-        const int BLOCK_WIDTH = 40;
-        const int BLOCK_HEIGHT = 24;
-        const int G = 0, GR = 0, R = 1, B = 2, GB = 3;        
-
         int rawWidth = input.width();
         int rawHeight = input.height();
         int outWidth = rawWidth-8;
@@ -105,7 +678,13 @@ namespace FCam {
         outHeight /= BLOCK_HEIGHT;
         outHeight *= BLOCK_HEIGHT;
 
-        Image out(outWidth, outHeight, RGB24);               
+        if (outWidth <= 0 || outHeight <= 0) {
+            error(Event::DemosaicError, "Cannot demosaic an image smaller than %dx%d",
+                  BLOCK_WIDTH+8, BLOCK_HEIGHT+8);
+            return false;
+        }
+
+        size = Size(outWidth, outHeight);
 
         // Check we're the right size, if not, crop center
         if (((input.width() - 8) != (unsigned)outWidth) ||
@@ -115,347 +694,301 @@ namespace FCam {
             offX -= offX&1;
             offY -= offY&1;
             
-            if (offX || offY) {
-                input = input.subImage(offX, offY, Size(outWidth+8, outHeight+8));
-            }
+            // Crop even if the offset is zero, because mirroring
+            // the input relies on its size exactly
+            input = input.subImage(offX, offY, Size(outWidth+8, outHeight+8));
         }           
 
         // Prepare the lookup table
-        unsigned char lut[4096];
-        makeLUT(src, contrast, blackLevel, gamma, lut);
+        makeLUT(src, options.contrast, options.blackLevel, options.gamma, lut);
 
         // Grab the color matrix
-        float colorMatrix[12];
-        // Check if there's a custom color matrix
-        if (src.shot().colorMatrix().size() == 12) {
-            for (int i = 0; i < 12; i++) {
-                colorMatrix[i] = src.shot().colorMatrix()[i];
+        getColorMatrix(src, colorMatrix);
+
+        job.method = options.method;
+        // The high quality methods have a wider apron, which costs
+        // less over taller tasks
+        job.blockRows = options.method == DemosaicFast ? 1 : 4;
+        job.denoise = options.denoise;
+        job.colorMatrix = colorMatrix;
+        job.fixedMatrix = NULL;
+        job.lut = lut;
+
+        // We've vectorized this code for x86 too, but which
+        // instructions we can use depends on the CPU
+        bool vectorized = false;
+        #ifdef FCAM_ARCH_X86
+        job.kernel = demosaicKernel_X86();
+        vectorized = job.kernel != NULL;
+        #endif
+
+        // Optionally do the color conversion in fixed point. The
+        // high quality methods interpolate in floating point anyway,
+        // so they gain nothing from it and always use floating
+        // point. Neither do the SSE4.1 and AVX2 kernels: they convert
+        // eight or sixteen pixels at once in floating point, and the
+        // 32 bit integer multiplies fixed point needs are slower than
+        // that, so they ignore it too.
+        if (options.fixedPoint && options.method == DemosaicFast && !vectorized) {
+            if (makeFixedColorMatrix(colorMatrix, src.platform().maxRawValue(), &fixedMatrix)) {
+                makeFixedLUT(lut, fixedLut, &fixedMatrix);
+                job.fixedMatrix = &fixedMatrix;
+                job.lut = fixedLut - FIXED_LUT_MIN;
+            } else {
+                warning(Event::DemosaicError, 
+                        "Color matrix too large for fixed point demosaic, using floating point instead");
             }
-        } else {
-            // Otherwise use the platform version
-            src.platform().rawToRGBColorMatrix(src.shot().whiteBalance, colorMatrix);
         }
 
-        for (int by = 0; by < rawHeight-8-BLOCK_HEIGHT+1; by += BLOCK_HEIGHT) {
-            for (int bx = 0; bx < rawWidth-8-BLOCK_WIDTH+1; bx += BLOCK_WIDTH) {
-                /*
-                  Stage 1: Load a block of input, treat it as 4-channel gr, r, b, gb
-                */
-                short inBlock[4][BLOCK_HEIGHT/2+4][BLOCK_WIDTH/2+4];
+        return true;
+    }
 
-                for (int y = 0; y < BLOCK_HEIGHT/2+4; y++) {
-                    for (int x = 0; x < BLOCK_WIDTH/2+4; x++) {
-                        inBlock[GR][y][x] = ((short *)input(bx + 2*x, by + 2*y))[0];
-                        inBlock[R][y][x] = ((short *)input(bx + 2*x+1, by + 2*y))[0];
-                        inBlock[B][y][x] = ((short *)input(bx + 2*x, by + 2*y+1))[0];
-                        inBlock[GB][y][x] = ((short *)input(bx + 2*x+1, by + 2*y+1))[0];
-                    }
-                }
+    void DemosaicPlan::run(Image out, int x, int y) {
+        #ifdef FCAM_ARCH_ARM
+        if (whole.valid()) {
+            out.copyFrom(whole.subImage(x, y, out.size()));
+            return;
+        }
+        #endif
 
-                // linear luminance outputs
-                short linear[3][4][BLOCK_HEIGHT/2+4][BLOCK_WIDTH/2+4];
-
-                /*                  
-
-                Stage 1.5: Suppress hot pixels
-
-                gr[HERE] = min(gr[HERE], max(gr[UP], gr[LEFT], gr[RIGHT], gr[DOWN]));
-                r[HERE]  = min(r[HERE], max(r[UP], r[LEFT], r[RIGHT], r[DOWN]));
-                b[HERE]  = min(b[HERE], max(b[UP], b[LEFT], b[RIGHT], b[DOWN]));
-                gb[HERE] = min(gb[HERE], max(gb[UP], gb[LEFT], gb[RIGHT], gb[DOWN]));
- 
-                */
-
-                if (denoise) {
-                    for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
-                        for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
-                            linear[G][GR][y][x] = min(inBlock[GR][y][x],
-                                                      max(inBlock[GR][y-1][x],
-                                                          inBlock[GR][y+1][x],
-                                                          inBlock[GR][y][x+1],
-                                                          inBlock[GR][y][x-1]));
-                            linear[R][R][y][x] = min(inBlock[R][y][x],
-                                                     max(inBlock[R][y-1][x],
-                                                         inBlock[R][y+1][x],
-                                                         inBlock[R][y][x+1],
-                                                         inBlock[R][y][x-1]));
-                            linear[B][B][y][x] = min(inBlock[B][y][x],
-                                                     max(inBlock[B][y-1][x],
-                                                         inBlock[B][y+1][x],
-                                                         inBlock[B][y][x+1],
-                                                         inBlock[B][y][x-1]));
-                            linear[G][GB][y][x] = min(inBlock[GB][y][x],
-                                                      max(inBlock[GB][y-1][x],
-                                                          inBlock[GB][y+1][x],
-                                                          inBlock[GB][y][x+1],
-                                                          inBlock[GB][y][x-1]));
-                        }
-                    }
-                } else {
-                    for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
-                        for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
-                            linear[G][GR][y][x] = inBlock[GR][y][x];
-                            linear[R][R][y][x] = inBlock[R][y][x];
-                            linear[B][B][y][x] = inBlock[B][y][x];
-                            linear[G][GB][y][x] = inBlock[GB][y][x];
-                        }
-                    }                    
-                }
-                
+        // The apron is the same on every side, so a region of output
+        // needs the matching region of input plus four pixels all
+        // around it, however the bayer pattern is mirrored.
+        job.input = input.subImage(x, y, Size(out.width()+8, out.height()+8));
+        job.out = out;
+        job.left = x;
+        job.top = y;
+        job.right = input.width() - job.input.width() - x;
+        job.bottom = input.height() - job.input.height() - y;
+
+        // Rows of blocks are independent, so hand them out to threads
+        int rows = out.height()/BLOCK_HEIGHT;
+        parallelFor((rows + job.blockRows - 1)/job.blockRows, threads, demosaicRow, &job);
+    }
 
-                /*
-                  2: Interpolate g at r 
-                  
-                  gv_r = (gb[UP] + gb[HERE])/2;
-                  gvd_r = |gb[UP] - gb[HERE]|;
-                  
-                  gh_r = (gr[HERE] + gr[RIGHT])/2;
-                  ghd_r = |gr[HERE] - gr[RIGHT]|;
-                  
-                  g_r = ghd_r < gvd_r ? gh_r : gv_r;
-                  
-                  3: Interpolate g at b
-                  
-                  gv_b = (gr[DOWN] + gr[HERE])/2;
-                  gvd_b = |gr[DOWN] - gr[HERE]|;
-                  
-                  gh_b = (gb[LEFT] + gb[HERE])/2;
-                  ghd_b = |gb[LEFT] - gb[HERE]|;
-                  
-                  g_b = ghd_b < gvd_b ? gh_b : gv_b;
-
-                */
-
-                for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
-                    for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
-                        short gv_r = (linear[G][GB][y-1][x] + linear[G][GB][y][x])/2;
-                        short gvd_r = abs(linear[G][GB][y-1][x] - linear[G][GB][y][x]);
-                        short gh_r = (linear[G][GR][y][x] + linear[G][GR][y][x+1])/2;
-                        short ghd_r = abs(linear[G][GR][y][x] - linear[G][GR][y][x+1]);
-                        linear[G][R][y][x] = ghd_r < gvd_r ? gh_r : gv_r;
-
-                        short gv_b = (linear[G][GR][y+1][x] + linear[G][GR][y][x])/2;
-                        short gvd_b = abs(linear[G][GR][y+1][x] - linear[G][GR][y][x]);
-                        short gh_b = (linear[G][GB][y][x] + linear[G][GB][y][x-1])/2;
-                        short ghd_b = abs(linear[G][GB][y][x] - linear[G][GB][y][x-1]);
-                        linear[G][B][y][x] = ghd_b < gvd_b ? gh_b : gv_b;                        
-                    }
-                }
+    Image demosaic(Frame src, const DemosaicOptions &options) {
+        // We've vectorized this code for arm, for GRBG sensors
+        #ifdef FCAM_ARCH_ARM
+        if (options.method == DemosaicFast && src.platform().bayerPattern() == GRBG) {
+            if (!checkDemosaicInput(src)) return Image();
+            return demosaic_ARM(src, options.contrast, options.denoise, options.blackLevel, options.gamma);
+        }
+        #endif
 
-                /*
-                  4: Interpolate r at gr
-                  
-                  r_gr = (r[LEFT] + r[HERE])/2 + gr[HERE] - (g_r[LEFT] + g_r[HERE])/2;
-                  
-                  5: Interpolate b at gr
-                  
-                  b_gr = (b[UP] + b[HERE])/2 + gr[HERE] - (g_b[UP] + g_b[HERE])/2;
-                  
-                  6: Interpolate r at gb
-                  
-                  r_gb = (r[HERE] + r[DOWN])/2 + gb[HERE] - (g_r[HERE] + g_r[DOWN])/2;
-                  
-                  7: Interpolate b at gb
-                  
-                  b_gb = (b[HERE] + b[RIGHT])/2 + gb[HERE] - (g_b[HERE] + g_b[RIGHT])/2;
-                */
-                for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
-                    for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
-                        linear[R][GR][y][x] = ((linear[R][R][y][x-1] + linear[R][R][y][x])/2 +
-                                               linear[G][GR][y][x] - 
-                                               (linear[G][R][y][x-1] + linear[G][R][y][x])/2);
-
-                        linear[B][GR][y][x] = ((linear[B][B][y-1][x] + linear[B][B][y][x])/2 +
-                                               linear[G][GR][y][x] - 
-                                               (linear[G][B][y-1][x] + linear[G][B][y][x])/2);
-
-                        linear[R][GB][y][x] = ((linear[R][R][y][x] + linear[R][R][y+1][x])/2 +
-                                               linear[G][GB][y][x] - 
-                                               (linear[G][R][y][x] + linear[G][R][y+1][x])/2);
-
-                        linear[B][GB][y][x] = ((linear[B][B][y][x] + linear[B][B][y][x+1])/2 +
-                                               linear[G][GB][y][x] - 
-                                               (linear[G][B][y][x] + linear[G][B][y][x+1])/2);
+        DemosaicPlan plan;
+        if (!plan.init(src, options)) return Image();
 
-                    }
-                }       
+        Image out(plan.size, RGB24);
+        plan.run(out, 0, 0);
+        return out;
+    }
 
+    Image demosaic(Frame src, Rect roi, const DemosaicOptions &options) {
+        DemosaicPlan plan;
+        if (!plan.init(src, options)) return Image();
+
+        // Clip the region to the output
+        int x0 = std::max(roi.x, 0);
+        int y0 = std::max(roi.y, 0);
+        int x1 = std::min(roi.x + roi.width, plan.size.width);
+        int y1 = std::min(roi.y + roi.height, plan.size.height);
+        if (x0 >= x1 || y0 >= y1) {
+            error(Event::DemosaicError, "Region of interest (%d, %d) %dx%d does not overlap the %dx%d output",
+                  roi.x, roi.y, roi.width, roi.height, plan.size.width, plan.size.height);
+            return Image();
+        }
 
-                /*
-                  
-                8: Interpolate r at b
-                
-                rp_b = (r[DOWNLEFT] + r[HERE])/2 + g_b[HERE] - (g_r[DOWNLEFT] + g_r[HERE])/2;
-                rn_b = (r[LEFT] + r[DOWN])/2 + g_b[HERE] - (g_r[LEFT] + g_r[DOWN])/2;
-                rpd_b = (r[DOWNLEFT] - r[HERE]);
-                rnd_b = (r[LEFT] - r[DOWN]);    
-                
-                r_b = rpd_b < rnd_b ? rp_b : rn_b;
-                
-                9: Interpolate b at r
-                
-                bp_r = (b[UPRIGHT] + b[HERE])/2 + g_r[HERE] - (g_b[UPRIGHT] + g_b[HERE])/2;
-                bn_r = (b[RIGHT] + b[UP])/2 + g_r[HERE] - (g_b[RIGHT] + g_b[UP])/2;     
-                bpd_r = |b[UPRIGHT] - b[HERE]|;
-                bnd_r = |b[RIGHT] - b[UP]|;     
-                
-                b_r = bpd_r < bnd_r ? bp_r : bn_r;             
-                
-                */
-                for (int y = 1; y < BLOCK_HEIGHT/2+3; y++) {
-                    for (int x = 1; x < BLOCK_WIDTH/2+3; x++) {
-                        short rp_b = ((linear[R][R][y+1][x-1] + linear[R][R][y][x])/2 +
-                                      linear[G][B][y][x] - 
-                                      (linear[G][R][y+1][x-1] + linear[G][R][y][x])/2);
-                        short rpd_b = abs(linear[R][R][y+1][x-1] - linear[R][R][y][x]);
-                        
-                        short rn_b = ((linear[R][R][y][x-1] + linear[R][R][y+1][x])/2 +
-                                      linear[G][B][y][x] - 
-                                      (linear[G][R][y][x-1] + linear[G][R][y+1][x])/2);
-                        short rnd_b = abs(linear[R][R][y][x-1] - linear[R][R][y+1][x]);
-                        
-                        linear[R][B][y][x] = rpd_b < rnd_b ? rp_b : rn_b;
-
-                        short bp_r = ((linear[B][B][y-1][x+1] + linear[B][B][y][x])/2 +
-                                      linear[G][R][y][x] - 
-                                      (linear[G][B][y-1][x+1] + linear[G][B][y][x])/2);
-                        short bpd_r = abs(linear[B][B][y-1][x+1] - linear[B][B][y][x]);
-                        
-                        short bn_r = ((linear[B][B][y][x+1] + linear[B][B][y-1][x])/2 +
-                                      linear[G][R][y][x] - 
-                                      (linear[G][B][y][x+1] + linear[G][B][y-1][x])/2);
-                        short bnd_r = abs(linear[B][B][y][x+1] - linear[B][B][y-1][x]);
-                        
-                        linear[B][R][y][x] = bpd_r < bnd_r ? bp_r : bn_r;                       
-                    }
-                }
+        // Demosaic just the blocks that touch it. The output doesn't
+        // depend on which blocks are demosaicked together, so this
+        // matches a full demosaic exactly.
+        int bx0 = (x0 / BLOCK_WIDTH) * BLOCK_WIDTH;
+        int by0 = (y0 / BLOCK_HEIGHT) * BLOCK_HEIGHT;
+        int bx1 = ((x1 + BLOCK_WIDTH - 1) / BLOCK_WIDTH) * BLOCK_WIDTH;
+        int by1 = ((y1 + BLOCK_HEIGHT - 1) / BLOCK_HEIGHT) * BLOCK_HEIGHT;
+        Image blocks(bx1 - bx0, by1 - by0, RGB24);
+        plan.run(blocks, bx0, by0);
 
-                /*
-                  10: Color matrix
-                    
-                  11: Gamma correct
-           
-                */
-
-                float r, g, b;
-                unsigned short ri, gi, bi;
-                for (int y = 2; y < BLOCK_HEIGHT/2+2; y++) {
-                    for (int x = 2; x < BLOCK_WIDTH/2+2; x++) {
-
-                        // Convert from sensor rgb to srgb
-                        r = colorMatrix[0]*linear[R][GR][y][x] +
-                            colorMatrix[1]*linear[G][GR][y][x] +
-                            colorMatrix[2]*linear[B][GR][y][x] +
-                            colorMatrix[3];
-
-                        g = colorMatrix[4]*linear[R][GR][y][x] +
-                            colorMatrix[5]*linear[G][GR][y][x] +
-                            colorMatrix[6]*linear[B][GR][y][x] +
-                            colorMatrix[7];
-
-                        b = colorMatrix[8]*linear[R][GR][y][x] +
-                            colorMatrix[9]*linear[G][GR][y][x] +
-                            colorMatrix[10]*linear[B][GR][y][x] +
-                            colorMatrix[11];
-
-                        // Clamp
-                        ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
-                        gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
-                        bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
-                       
-                        // Gamma correct and store
-                        out(bx+(x-2)*2, by+(y-2)*2)[0] = lut[ri];
-                        out(bx+(x-2)*2, by+(y-2)*2)[1] = lut[gi];
-                        out(bx+(x-2)*2, by+(y-2)*2)[2] = lut[bi];
-
-                        // Convert from sensor rgb to srgb
-                        r = colorMatrix[0]*linear[R][R][y][x] +
-                            colorMatrix[1]*linear[G][R][y][x] +
-                            colorMatrix[2]*linear[B][R][y][x] +
-                            colorMatrix[3];
-
-                        g = colorMatrix[4]*linear[R][R][y][x] +
-                            colorMatrix[5]*linear[G][R][y][x] +
-                            colorMatrix[6]*linear[B][R][y][x] +
-                            colorMatrix[7];
-
-                        b = colorMatrix[8]*linear[R][R][y][x] +
-                            colorMatrix[9]*linear[G][R][y][x] +
-                            colorMatrix[10]*linear[B][R][y][x] +
-                            colorMatrix[11];
-
-                        // Clamp
-                        ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
-                        gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
-                        bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
-                        
-                        // Gamma correct and store
-                        out(bx+(x-2)*2+1, by+(y-2)*2)[0] = lut[ri];
-                        out(bx+(x-2)*2+1, by+(y-2)*2)[1] = lut[gi];
-                        out(bx+(x-2)*2+1, by+(y-2)*2)[2] = lut[bi];
-                        
-                        // Convert from sensor rgb to srgb
-                        r = colorMatrix[0]*linear[R][B][y][x] +
-                            colorMatrix[1]*linear[G][B][y][x] +
-                            colorMatrix[2]*linear[B][B][y][x] +
-                            colorMatrix[3];
-
-                        g = colorMatrix[4]*linear[R][B][y][x] +
-                            colorMatrix[5]*linear[G][B][y][x] +
-                            colorMatrix[6]*linear[B][B][y][x] +
-                            colorMatrix[7];
-
-                        b = colorMatrix[8]*linear[R][B][y][x] +
-                            colorMatrix[9]*linear[G][B][y][x] +
-                            colorMatrix[10]*linear[B][B][y][x] +
-                            colorMatrix[11];
-
-                        // Clamp
-                        ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
-                        gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
-                        bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
-                       
-                        // Gamma correct and store
-                        out(bx+(x-2)*2, by+(y-2)*2+1)[0] = lut[ri];
-                        out(bx+(x-2)*2, by+(y-2)*2+1)[1] = lut[gi];
-                        out(bx+(x-2)*2, by+(y-2)*2+1)[2] = lut[bi];
-                        
-                        // Convert from sensor rgb to srgb
-                        r = colorMatrix[0]*linear[R][GB][y][x] +
-                            colorMatrix[1]*linear[G][GB][y][x] +
-                            colorMatrix[2]*linear[B][GB][y][x] +
-                            colorMatrix[3];
-
-                        g = colorMatrix[4]*linear[R][GB][y][x] +
-                            colorMatrix[5]*linear[G][GB][y][x] +
-                            colorMatrix[6]*linear[B][GB][y][x] +
-                            colorMatrix[7];
-
-                        b = colorMatrix[8]*linear[R][GB][y][x] +
-                            colorMatrix[9]*linear[G][GB][y][x] +
-                            colorMatrix[10]*linear[B][GB][y][x] +
-                            colorMatrix[11];
-
-                        // Clamp
-                        ri = r < 0 ? 0 : (r > 1023 ? 1023 : (unsigned short)(r+0.5f));
-                        gi = g < 0 ? 0 : (g > 1023 ? 1023 : (unsigned short)(g+0.5f));
-                        bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
-                       
-                        // Gamma correct and store
-                        out(bx+(x-2)*2+1, by+(y-2)*2+1)[0] = lut[ri];
-                        out(bx+(x-2)*2+1, by+(y-2)*2+1)[1] = lut[gi];
-                        out(bx+(x-2)*2+1, by+(y-2)*2+1)[2] = lut[bi];
-                        
-                    }
-                }                
+        if (bx0 == x0 && by0 == y0 && bx1 == x1 && by1 == y1) return blocks;
+
+        Image out(x1 - x0, y1 - y0, RGB24);
+        out.copyFrom(blocks.subImage(x0 - bx0, y0 - by0, out.size()));
+        return out;
+    }
+
+    struct DemosaicStream::State : public DemosaicPlan {
+        int stripHeight;
+        int row;
+    };
+
+    DemosaicStream::DemosaicStream(Frame src, const DemosaicOptions &options, int stripHeight) {
+        state = new State;
+        state->row = 0;
+        if (!state->init(src, options)) {
+            delete state;
+            state = NULL;
+            return;
+        }
+
+        if (stripHeight <= 0) {
+            stripHeight = BLOCK_HEIGHT * parallelThreads(options.threads);
+        }
+        stripHeight = std::min(stripHeight, state->size.height);
+        state->stripHeight = ((stripHeight + BLOCK_HEIGHT - 1)/BLOCK_HEIGHT)*BLOCK_HEIGHT;
+    }
+
+    DemosaicStream::~DemosaicStream() {
+        delete state;
+    }
+
+    bool DemosaicStream::valid() const {
+        return state != NULL;
+    }
+
+    Size DemosaicStream::size() const {
+        return state ? state->size : Size();
+    }
+
+    int DemosaicStream::stripHeight() const {
+        return state ? state->stripHeight : 0;
+    }
+
+    int DemosaicStream::row() const {
+        return state ? state->row : 0;
+    }
+
+    int DemosaicStream::next(Image ring) {
+        if (!state || state->row >= state->size.height) return 0;
+
+        if (ring.type() != RGB24 || 
+            ring.width() != (unsigned)state->size.width ||
+            ring.height() == 0 ||
+            ring.height() % state->stripHeight) {
+            error(Event::DemosaicError, 
+                  "DemosaicStream: Ring buffer must be a %d pixel wide RGB24 image "
+                  "with a multiple of %d rows", state->size.width, state->stripHeight);
+            return 0;
+        }
+
+        int rows = std::min(state->stripHeight, state->size.height - state->row);
+        Image strip = ring.subImage(0, state->row % ring.height(), Size(ring.width(), rows));
+        state->run(strip, 0, state->row);
+        state->row += rows;
+        return rows;
+    }
+
+    // Convert one pixel of linear sensor rgb to gamma-corrected srgb
+    inline void colorCorrect(float r_sensor, float g_sensor, float b_sensor,
+                             const float *colorMatrix, const unsigned char *lut,
+                             unsigned char *dst) {
+        float r_srgb = (r_sensor * colorMatrix[0] +
+                        g_sensor * colorMatrix[1] +
+                        b_sensor * colorMatrix[2] +
+                        colorMatrix[3]);
+        float g_srgb = (r_sensor * colorMatrix[4] +
+                        g_sensor * colorMatrix[5] +
+                        b_sensor * colorMatrix[6] +
+                        colorMatrix[7]);
+        float b_srgb = (r_sensor * colorMatrix[8] +
+                        g_sensor * colorMatrix[9] +
+                        b_sensor * colorMatrix[10] +
+                        colorMatrix[11]);
+        // Clamp and round. The values are non-negative by then, so
+        // truncation rounds.
+        r_srgb = std::min(1023.0f, std::max(0.0f, r_srgb));
+        g_srgb = std::min(1023.0f, std::max(0.0f, g_srgb));
+        b_srgb = std::min(1023.0f, std::max(0.0f, b_srgb));
+        dst[0] = lut[(int)(r_srgb+0.5f)];
+        dst[1] = lut[(int)(g_srgb+0.5f)];
+        dst[2] = lut[(int)(b_srgb+0.5f)];
+    }
+
+    // The state shared by the threads making a thumbnail
+    struct ThumbnailJob {
+        // The input, cropped to the region under the thumbnail
+        Image input, thumb;
+        // Thumbnail pixels are scale input pixels apart, and average
+        // a box x box block of input, which is the same unless that
+        // would leave out a color
+        int scale, box;
+        // Which row and column of each 2x2 bayer block is red
+        int redRow, redCol;
+        const float *colorMatrix;
+        const unsigned char *lut;
+    };
+
+    // Make one row of a thumbnail by averaging each color channel
+    // over the block of input under each thumbnail pixel. The inner
+    // loops have no per-pixel branches on the bayer pattern, so they
+    // vectorize.
+    static void thumbnailRow(void *context, int ty) {
+        ThumbnailJob *job = (ThumbnailJob *)context;
+        const int box = job->box;
+        const int width = job->input.width();
+        const int y0 = std::min(ty*job->scale, (int)job->input.height() - box);
+
+        // Sum down the columns of the block, keeping even and odd
+        // input rows separate
+        std::vector<unsigned int> columnSums(2*width, 0);
+        unsigned int *sums[2] = {&columnSums[0], &columnSums[width]};
+        for (int i = 0; i < box; i++) {
+            const unsigned short *px = (const unsigned short *)job->input(0, y0+i);
+            unsigned int *sum = sums[(y0+i) & 1];
+            for (int x = 0; x < width; x++) {
+                sum[x] += px[x];
             }
         }
 
-        return out;
+        // How many of the rows are even and odd
+        int rowCount[2];
+        rowCount[y0 & 1] = (box+1)/2;
+        rowCount[(y0 & 1) ^ 1] = box/2;
+
+        unsigned char *tpix = job->thumb(0, ty);
+        for (unsigned int tx = 0; tx < job->thumb.width(); tx++) {
+            const int x0 = std::min((int)tx*job->scale, width - box);
+
+            // Sum across the block, keeping the columns at even and odd
+            // offsets from its left edge separate
+            unsigned int even[2] = {0, 0}, odd[2] = {0, 0};
+            const unsigned int *s0 = sums[0] + x0, *s1 = sums[1] + x0;
+            int j = 0;
+            for (; j+1 < box; j += 2) {
+                even[0] += s0[j];
+                odd[0] += s0[j+1];
+                even[1] += s1[j];
+                odd[1] += s1[j+1];
+            }
+            if (j < box) {
+                even[0] += s0[j];
+                even[1] += s1[j];
+            }
+
+            // Put them back in terms of the parity of the input row
+            // and column
+            unsigned int total[2][2];
+            int colCount[2];
+            const int p = x0 & 1;
+            total[0][p] = even[0];
+            total[0][p^1] = odd[0];
+            total[1][p] = even[1];
+            total[1][p^1] = odd[1];
+            colCount[p] = (box+1)/2;
+            colCount[p^1] = box/2;
+
+            const int rr = job->redRow, rc = job->redCol;
+            float r_sensor = ((float)total[rr][rc] / (rowCount[rr]*colCount[rc]));
+            float g_sensor = ((float)(total[rr][rc^1] + total[rr^1][rc]) / 
+                              (rowCount[rr]*colCount[rc^1] + rowCount[rr^1]*colCount[rc]));
+            float b_sensor = ((float)total[rr^1][rc^1] / (rowCount[rr^1]*colCount[rc^1]));
+
+            colorCorrect(r_sensor, g_sensor, b_sensor, job->colorMatrix, job->lut, tpix);
+            tpix += 3;
+        }
     }
 
     // Generic RAW to thumbnail converter
-    Image makeThumbnailRAW(Frame src, const Size &thumbSize, float contrast, int blackLevel, float gamma) {
+    Image makeThumbnailRAW(Frame src, const Size &thumbSize, float contrast, int blackLevel, float gamma, 
+                           int threads) {
         
         // Special-case the N900's common case for speed (5 MP GRGB -> 640x480 RGB24 on ARM)
         #ifdef FCAM_ARCH_ARM
@@ -468,138 +1001,180 @@ namespace FCam {
         }
         #endif
 
-        // Make the response curve
-        unsigned char lut[4096];
-        makeLUT(src, contrast, blackLevel, gamma, lut);
-
-        Image thumb;
-        //!TODO: Add thumbnailing support for other Bayer patterns 
-        bool redRowEven, blueRowGreenPixelEven;
-        switch (src.platform().bayerPattern()) {
-        case RGGB:
-            redRowEven = true;
-            blueRowGreenPixelEven = true;
-            break;
-        case BGGR:
-            redRowEven = false;
-            blueRowGreenPixelEven = false;
-            break;
-        case GRBG:
-            redRowEven = true;
-            blueRowGreenPixelEven = false;
-            break;
-        case GBRG:
-            redRowEven = false;
-            blueRowGreenPixelEven = true;
-            break;
-        default:
-            return thumb;
-            break;
+        ThumbnailJob job;
+        if (!redPosition(src.platform().bayerPattern(), &job.redRow, &job.redCol)) {
+            return Image();
         }
 
-        Time startTime = Time::now();
-
-        thumb = Image(thumbSize, RGB24);
-
         unsigned int w = src.image().width();
         unsigned int h = src.image().height();
         unsigned int tw = thumbSize.width;
         unsigned int th = thumbSize.height;
-        short maxPixel = 1023;
-        short minPixel = 0;
-        unsigned int scaleX = (int)std::floor((float)w / tw);
-        unsigned int scaleY = (int)std::floor((float)h / th);
+        unsigned int scaleX = w / tw;
+        unsigned int scaleY = h / th;
         unsigned int scale = std::min(scaleX, scaleY); // Maintain aspect ratio
+
+        if (scale < 1 || w < 2 || h < 2) {
+            error(Event::DemosaicError, "makeThumbnail: Cannot make a %dx%d thumbnail from a %dx%d image",
+                  tw, th, w, h);
+            return Image();
+        }
         
         int cropX = (w-scale*tw)/2;
         if (cropX % 2 == 1) cropX--; // Ensure we're at start of 2x2 block
         int cropY = (h-scale*th)/2;
         if (cropY % 2 == 1) cropY--; // Ensure we're at start of 2x2 block
 
+        // Make the response curve
+        unsigned char lut[4096];
+        makeLUT(src, contrast, blackLevel, gamma, lut);
+
         float colorMatrix[12];
-        // Check if there's a custom color matrix
-        if (src.shot().colorMatrix().size() == 12) {
-            for (int i = 0; i < 12; i++) {
-                colorMatrix[i] = src.shot().colorMatrix()[i];
-            }
-        } else {
-            // Otherwise use the platform version
-            src.platform().rawToRGBColorMatrix(src.shot().whiteBalance, colorMatrix);
-        }
+        getColorMatrix(src, colorMatrix);
 
         /* A fast downsampling/demosaicing - average down color
            channels over the whole source pixel block under a single
            thumbnail pixel, and just use those colors directly as the
            pixel colors. */        
 
-        for (unsigned int ty=0; ty < th; ty++) {
-            unsigned char *tpix = thumb(0,ty); // Get a pointer to the beginning of the row
-            for (unsigned int tx=0; tx < tw; tx++) {
-                unsigned int r=0,g=0,b=0;
-                unsigned int rc=0,gc=0,bc=0;
-
-                unsigned char *rowStart = src.image()(cropX + tx*scale, cropY + ty*scale);
-
-                bool isRedRow = ((ty*scale % 2 == 0) == redRowEven);
-
-                for(unsigned int i=0; i<scale; i++, rowStart+=src.image().bytesPerRow(), isRedRow = !isRedRow) {                    
-                    unsigned short *px = (unsigned short *)rowStart;
-                    if (isRedRow) {
-                        bool isRed=((tx*scale)%2==0) == blueRowGreenPixelEven;
-                        for (unsigned int j=0; j < scale; j++, isRed=!isRed) {
-                            if (isRed) {
-                                r += *(px++);
-                                rc++;
-                            } else {
-                                g += *(px++);
-                                gc++;
-                            }
-                        }
-                    } else {
-                        bool isGreen=((tx*scale)%2==0) == blueRowGreenPixelEven;
-                        for (unsigned int j=0; j < scale; j++, isGreen=!isGreen) {
-                            if (isGreen) {
-                                g += *(px++);
-                                gc++;
-                            } else {
-                                b += *(px++);
-                                bc++;
-                            }
-                            
-                        }
+        // Every thumbnail pixel needs at least one pixel of each color
+        job.scale = scale;
+        job.box = std::max(scale, 2u);
+        job.input = src.image().subImage(cropX, cropY, 
+                                         Size(std::min(w - cropX, scale*tw + job.box - scale),
+                                              std::min(h - cropY, scale*th + job.box - scale)));
+        job.thumb = Image(thumbSize, RGB24);
+        job.colorMatrix = colorMatrix;
+        job.lut = lut;
+
+        // Thumbnail rows are independent, so hand them out to threads
+        parallelFor(th, threads, thumbnailRow, &job);
+
+        return job.thumb;
+    }
+
+    // The state shared by the threads making a pyramid
+    struct PyramidJob {
+        Image input;
+        std::vector<Image> levels;
+        int redRow, redCol;
+        const float *colorMatrix;
+        const unsigned char *lut;
+    };
+
+    // Color and gamma correct a row of linear pixels, stored as
+    // interleaved rgb scaled up by four
+    static void pyramidEmit(const PyramidJob *job, const unsigned short *linear, 
+                            unsigned char *dst, int width) {
+        for (int x = 0; x < width; x++) {
+            colorCorrect(linear[0]*0.25f, linear[1]*0.25f, linear[2]*0.25f, 
+                         job->colorMatrix, job->lut, dst);
+            linear += 3;
+            dst += 3;
+        }
+    }
+
+    // Make one band of every level of a pyramid. A band is one row of
+    // the smallest level, and the rows of each larger level above it,
+    // so each band can be made independently of the others. Each row
+    // of linear values is reduced into the next level as soon as its
+    // partner row exists, so the raw data is only read once.
+    static void pyramidBand(void *context, int band) {
+        PyramidJob *job = (PyramidJob *)context;
+        const int levels = job->levels.size();
+        const int width = job->levels[0].width();
+        const int rowsPerBand = 1 << (levels-1);
+
+        // An even and an odd row of linear rgb for each level
+        std::vector<unsigned short> buffer(levels*2*width*3);
+        #define LINEAR(l, y) (&buffer[((l)*2 + ((y) & 1))*width*3])
+
+        for (int i = 0; i < rowsPerBand; i++) {
+            int y = band*rowsPerBand + i;
+            if (y >= (int)job->levels[0].height()) break;
+
+            // Take each 2x2 bayer block as one pixel of the first
+            // level, with green averaged
+            const unsigned short *redRow = 
+                (const unsigned short *)job->input(0, 2*y + job->redRow);
+            const unsigned short *blueRow = 
+                (const unsigned short *)job->input(0, 2*y + (job->redRow ^ 1));
+            const int rc = job->redCol, bc = job->redCol ^ 1;
+            unsigned short *linear = LINEAR(0, y);
+            for (int x = 0; x < width; x++) {
+                linear[3*x+0] = redRow[2*x+rc] << 2;
+                linear[3*x+1] = (redRow[2*x+bc] + blueRow[2*x+rc]) << 1;
+                linear[3*x+2] = blueRow[2*x+bc] << 2;
+            }
+            pyramidEmit(job, linear, job->levels[0](0, y), width);
+
+            // Each odd row completes a row of the next level down
+            for (int l = 1; l < levels && (y & 1); l++) {
+                y >>= 1;
+                if (y >= (int)job->levels[l].height()) break;
+                const unsigned short *even = LINEAR(l-1, 0);
+                const unsigned short *odd = LINEAR(l-1, 1);
+                linear = LINEAR(l, y);
+                int levelWidth = job->levels[l].width();
+                for (int x = 0; x < levelWidth; x++) {
+                    for (int c = 0; c < 3; c++) {
+                        linear[3*x+c] = (even[6*x+c] + even[6*x+3+c] + 
+                                         odd[6*x+c] + odd[6*x+3+c] + 2) >> 2;
                     }
                 }
-                float r_sensor = ((float)r / rc);
-                float g_sensor = ((float)g / gc);
-                float b_sensor = ((float)b / bc);
-                float r_srgb = (r_sensor * colorMatrix[0] +
-                                g_sensor * colorMatrix[1] +
-                                b_sensor * colorMatrix[2] +
-                                colorMatrix[3]);
-                float g_srgb = (r_sensor * colorMatrix[4] +
-                                g_sensor * colorMatrix[5] +
-                                b_sensor * colorMatrix[6] +
-                                colorMatrix[7]);
-                float b_srgb = (r_sensor * colorMatrix[8] +
-                                g_sensor * colorMatrix[9] +
-                                b_sensor * colorMatrix[10] +
-                                colorMatrix[11]);
-                unsigned short r_linear = std::min(maxPixel,std::max(minPixel,(short int)std::floor(r_srgb+0.5)));
-                unsigned short g_linear = std::min(maxPixel,std::max(minPixel,(short int)std::floor(g_srgb+0.5)));
-                unsigned short b_linear = std::min(maxPixel,std::max(minPixel,(short int)std::floor(b_srgb+0.5)));
-                *(tpix++) = lut[r_linear];
-                *(tpix++) = lut[g_linear];
-                *(tpix++) = lut[b_linear];
+                pyramidEmit(job, linear, job->levels[l](0, y), levelWidth);
             }
         }
 
-        //std::cout << "Done creating thumbnail. time = " << ((Time::now()-startTime)/1000) << std::endl;
+        #undef LINEAR
+    }
+
+    std::vector<Image> makePyramid(Frame src, int levels, float contrast, int blackLevel, float gamma,
+                                   int threads) {
+        std::vector<Image> pyramid;
+
+        // Sanity checks
+        if (!src.image().valid() || src.image().type() != RAW) {
+            error(Event::DemosaicError, "makePyramid: Can only make a pyramid from a valid RAW image");
+            return pyramid;
+        }
+
+        PyramidJob job;
+        if (!redPosition(src.platform().bayerPattern(), &job.redRow, &job.redCol)) {
+            error(Event::DemosaicError, "makePyramid: Can't make a pyramid from a non-bayer sensor");
+            return pyramid;
+        }
 
-        return thumb;
+        // Stop before any level would be empty
+        int width = src.image().width()/2;
+        int height = src.image().height()/2;
+        for (int l = 0; l < levels && width > 0 && height > 0; l++) {
+            job.levels.push_back(Image(width, height, RGB24));
+            width /= 2;
+            height /= 2;
+        }
+        if (job.levels.empty()) return pyramid;
+
+        unsigned char lut[4096];
+        makeLUT(src, contrast, blackLevel, gamma, lut);
+
+        float colorMatrix[12];
+        getColorMatrix(src, colorMatrix);
+
+        job.input = src.image();
+        job.colorMatrix = colorMatrix;
+        job.lut = lut;
+
+        int rowsPerBand = 1 << (job.levels.size()-1);
+        int bands = (job.levels[0].height() + rowsPerBand - 1) / rowsPerBand;
+        parallelFor(bands, threads, pyramidBand, &job);
 
+        pyramid.swap(job.levels);
+        return pyramid;
     }
 
-    Image makeThumbnail(Frame src, const Size &thumbSize, float contrast, int blackLevel, float gamma) {
+    Image makeThumbnail(Frame src, const Size &thumbSize, float contrast, int blackLevel, float gamma, 
+                        int threads) {
         Image thumb;
 
         // Sanity checks
@@ -608,7 +1183,7 @@ namespace FCam {
 
         switch (src.image().type()) {
         case RAW:
-            thumb = makeThumbnailRAW(src, thumbSize, contrast, blackLevel, gamma);
+            thumb = makeThumbnailRAW(src, thumbSize, contrast, blackLevel, gamma, threads);
             break;
         case RGB24:
         case RGB16:
@@ -26,6 +26,7 @@ namespace FCam {
             break;
         case GBRG:
             input = input.subImage(1, 1, Size(input.width()-2, input.height()-2));
+            break;
         default:
             error(Event::DemosaicError, "Can't demosaic from a non-bayer sensor\n");
             return Image();
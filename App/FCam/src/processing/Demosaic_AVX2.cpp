@@ -0,0 +1,64 @@
+#ifdef FCAM_ARCH_X86
+#include <string.h>
+#include <immintrin.h>
+#include "Demosaic_X86.h"
+
+// AVX2 vector primitives for the x86 demosaic kernel. This file is
+// compiled with -mavx2, so it must not use any inline code shared
+// with the rest of the library.
+
+namespace {
+
+    typedef __m256i vec;
+    const int LANES = 16;
+
+    inline vec vload(const short *p) {return _mm256_loadu_si256((const __m256i *)p);}
+    inline void vstore(short *p, vec v) {_mm256_storeu_si256((__m256i *)p, v);}
+    inline vec vadd(vec a, vec b) {return _mm256_add_epi16(a, b);}
+    inline vec vsub(vec a, vec b) {return _mm256_sub_epi16(a, b);}
+    inline vec vmin(vec a, vec b) {return _mm256_min_epi16(a, b);}
+    inline vec vmax(vec a, vec b) {return _mm256_max_epi16(a, b);}
+    inline vec vabs(vec a) {return _mm256_abs_epi16(a);}
+    // vpavgw rounds up, so take off the carry to match integer division
+    inline vec vavg(vec a, vec b) {
+        return _mm256_sub_epi16(_mm256_avg_epu16(a, b),
+                                _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi16(1)));
+    }
+    inline vec vpick(vec da, vec db, vec a, vec b) {
+        return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi16(db, da));
+    }
+
+    // One row of the color matrix on eight pixels, clamped and rounded
+    // the same way as the scalar code
+    inline __m256i colorRow(__m256 r, __m256 g, __m256 b, const float *m) {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[0]), r),
+                                 _mm256_mul_ps(_mm256_set1_ps(m[1]), g));
+        v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_set1_ps(m[2]), b));
+        v = _mm256_add_ps(v, _mm256_set1_ps(m[3]));
+        v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1023.0f));
+        return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(0.5f)));
+    }
+
+    // Pack two vectors of eight ints to sixteen shorts, undoing the
+    // per-lane interleave of vpackssdw
+    inline vec pack(__m256i lo, __m256i hi) {
+        return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+    }
+
+    inline void vcolor(vec r, vec g, vec b, const float *m, short *ri, short *gi, short *bi) {
+        __m256 rLo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(r)));
+        __m256 gLo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(g)));
+        __m256 bLo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(b)));
+        __m256 rHi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(r, 1)));
+        __m256 gHi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(g, 1)));
+        __m256 bHi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(b, 1)));
+        vstore(ri, pack(colorRow(rLo, gLo, bLo, m+0), colorRow(rHi, gHi, bHi, m+0)));
+        vstore(gi, pack(colorRow(rLo, gLo, bLo, m+4), colorRow(rHi, gHi, bHi, m+4)));
+        vstore(bi, pack(colorRow(rLo, gLo, bLo, m+8), colorRow(rHi, gHi, bHi, m+8)));
+    }
+}
+
+#define DEMOSAIC_X86_KERNEL demosaic_AVX2
+#include "Demosaic_X86_Kernel.h"
+
+#endif
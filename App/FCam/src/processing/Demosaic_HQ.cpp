@@ -0,0 +1,39 @@
+#include "Demosaic_HQ_Kernel.h"
+#ifdef FCAM_ARCH_X86
+#include "Demosaic_X86.h"
+#endif
+
+namespace FCam {
+
+    void demosaicVNG(const unsigned char *in, int inBytesPerRow,
+                     int left, int top, int right, int bottom,
+                     unsigned char *out, int outBytesPerRow,
+                     int width, int height, bool flipX, bool denoise,
+                     const float *colorMatrix, const unsigned char *lut) {
+        #ifdef FCAM_ARCH_X86
+        if (hasAVX2_X86()) {
+            demosaicVNG_AVX2(in, inBytesPerRow, left, top, right, bottom, out, outBytesPerRow,
+                             width, height, flipX, denoise, colorMatrix, lut);
+            return;
+        }
+        #endif
+        demosaicHQ<VNG>(in, inBytesPerRow, left, top, right, bottom, out, outBytesPerRow,
+                        width, height, flipX, denoise, colorMatrix, lut);
+    }
+
+    void demosaicAHD(const unsigned char *in, int inBytesPerRow,
+                     int left, int top, int right, int bottom,
+                     unsigned char *out, int outBytesPerRow,
+                     int width, int height, bool flipX, bool denoise,
+                     const float *colorMatrix, const unsigned char *lut) {
+        #ifdef FCAM_ARCH_X86
+        if (hasAVX2_X86()) {
+            demosaicAHD_AVX2(in, inBytesPerRow, left, top, right, bottom, out, outBytesPerRow,
+                             width, height, flipX, denoise, colorMatrix, lut);
+            return;
+        }
+        #endif
+        demosaicHQ<AHD>(in, inBytesPerRow, left, top, right, bottom, out, outBytesPerRow,
+                        width, height, flipX, denoise, colorMatrix, lut);
+    }
+}
@@ -0,0 +1,30 @@
+#ifdef FCAM_ARCH_X86
+#include "Demosaic_HQ_Kernel.h"
+#include "Demosaic_X86.h"
+
+// The high quality demosaics again, compiled with -mavx2 so that the
+// compiler vectorizes them eight floats at a time.
+
+namespace FCam {
+
+    void demosaicVNG_AVX2(const unsigned char *in, int inBytesPerRow,
+                          int left, int top, int right, int bottom,
+                          unsigned char *out, int outBytesPerRow,
+                          int width, int height, bool flipX, bool denoise,
+                          const float *colorMatrix, const unsigned char *lut) {
+        demosaicHQ<VNG>(in, inBytesPerRow, left, top, right, bottom, out, outBytesPerRow,
+                        width, height, flipX, denoise, colorMatrix, lut);
+    }
+
+    void demosaicAHD_AVX2(const unsigned char *in, int inBytesPerRow,
+                          int left, int top, int right, int bottom,
+                          unsigned char *out, int outBytesPerRow,
+                          int width, int height, bool flipX, bool denoise,
+                          const float *colorMatrix, const unsigned char *lut) {
+        demosaicHQ<AHD>(in, inBytesPerRow, left, top, right, bottom, out, outBytesPerRow,
+                        width, height, flipX, denoise, colorMatrix, lut);
+    }
+
+}
+
+#endif
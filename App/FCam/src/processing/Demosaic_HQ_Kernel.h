@@ -0,0 +1,582 @@
+#ifndef FCAM_DEMOSAIC_HQ_KERNEL_H
+#define FCAM_DEMOSAIC_HQ_KERNEL_H
+
+/* The body of the high quality demosaics: adaptive
+ * homogeneity-directed (AHD) and variable number of gradients (VNG)
+ * interpolation. Both work on tiles of output, copying the raw data
+ * for a tile plus a generous apron into planes of floats, and then
+ * run each stage of the algorithm a whole row at a time with no
+ * data-dependent branches, so that the compiler can vectorize the
+ * inner loops. They only see the GRBG-ordered view of the raw data,
+ * like the x86 kernels.
+ *
+ * This is included by Demosaic_HQ.cpp, and on x86 also by
+ * Demosaic_HQ_AVX2.cpp, which compiles it for wider vectors. Each gets
+ * its own copy of everything here, in an anonymous namespace, so this
+ * must not use any inline code shared with the rest of the library,
+ * such as the standard containers. Vector width doesn't change the
+ * result of any float operation, so both copies produce identical
+ * output.
+ *
+ * These were meant to cost at most three times the fast method, and
+ * they miss that. With the AVX2 build, on one thread and a 2592x1968
+ * frame, AHD costs 5.2 times the fast method and VNG 4.5 times (the
+ * median ratio over 21 interleaved runs of each method). No single
+ * stage dominates: VNG's time goes mostly to its eight-direction
+ * interpolation, and AHD's is spread over the red/blue interpolation,
+ * the Lab conversion and the homogeneity map. Reaching 3x would take
+ * rewriting the stages in 16 bit integers and fusing them. */
+
+#include <math.h>
+#include "Demosaic_Internal.h"
+
+namespace FCam {
+
+    namespace {
+
+        // Output is made a tile at a time. The apron is wide enough for
+        // the hot pixel suppression followed by the widest stencil,
+        // which is AHD's homogeneity map.
+        const int TILE_WIDTH = 128;
+        const int TILE_HEIGHT = 48;
+        const int APRON = 8;
+        const int PLANE_WIDTH = TILE_WIDTH + 2*APRON;
+        const int PLANE_HEIGHT = TILE_HEIGHT + 2*APRON;
+
+        // Clamp a coordinate to [lo, hi) without changing its parity,
+        // so that it stays on the same color channel
+        inline int clampParity(int x, int lo, int hi) {
+            if (x < lo) return lo + ((x - lo) & 1);
+            if (x >= hi) return hi - 1 - ((hi - 1 - x) & 1);
+            return x;
+        }
+
+        inline int mini(int a, int b) {return a < b ? a : b;}
+        inline float minf(float a, float b) {return a < b ? a : b;}
+        inline float maxf(float a, float b) {return a > b ? a : b;}
+
+        // A tile-sized plane of floats. Row y starts at the first pixel
+        // of output in the tile, and the apron is at negative
+        // coordinates.
+        struct Plane {
+            float data[PLANE_HEIGHT][PLANE_WIDTH];
+
+            float *operator[](int y) {return &data[y + APRON][APRON];}
+        };
+
+        // Where the raw data and the output are, and the range of raw
+        // coordinates that may be read, all in the GRBG-ordered view
+        struct Region {
+            const unsigned char *in;
+            int inBytesPerRow;
+            unsigned char *out;
+            int outBytesPerRow;
+            int dx;
+            int xMin, xMax, yMin, yMax;
+            bool denoise;
+            const float *colorMatrix;
+            const unsigned char *lut;
+        };
+
+        // The buffers and the loading and storing of tiles common to
+        // both methods. Values are floats rather than shorts so that
+        // the compiler has native min, max, abs, and division to work
+        // with when vectorizing. Colors at odd and even columns differ,
+        // so loops pick between them with masks rather than branches.
+        class Tiler {
+          protected:
+            Plane raw, m, out[3];
+            int columns[PLANE_WIDTH], indices[3][TILE_WIDTH];
+            float evenColumns[PLANE_WIDTH], oddColumns[PLANE_WIDTH], noColumns[PLANE_WIDTH];
+
+            // Which pixels of a row are each color of the mosaic, as
+            // masks of ones and zeros
+            struct Sites {
+                const float *gr, *r, *b, *gb;
+            };
+
+            Tiler() {
+                for (int x = -APRON; x < TILE_WIDTH + APRON; x++) {
+                    oddColumns[x + APRON] = x & 1;
+                    evenColumns[x + APRON] = 1 - (x & 1);
+                    noColumns[x + APRON] = 0;
+                }
+            }
+
+            Sites sites(int y) const {
+                const float *even = &evenColumns[APRON], *odd = &oddColumns[APRON];
+                const float *none = &noColumns[APRON];
+                Sites s;
+                s.gr = (y & 1) ? none : even;
+                s.r = (y & 1) ? none : odd;
+                s.b = (y & 1) ? even : none;
+                s.gb = (y & 1) ? odd : none;
+                return s;
+            }
+
+            // Copy the raw data for the w x h tile of output at (u0,
+            // v0) into m, clamping reads to the valid region. The input
+            // has a four pixel apron relative to the output. Optionally
+            // suppress hot pixels by clamping each value to the largest
+            // of its four nearest neighbours of the same color, like
+            // the fast demosaic does.
+            void load(const Region &r, int u0, int v0, int w, int h) {
+                int *col = &columns[APRON];
+                #pragma GCC ivdep
+                for (int x = -APRON; x < w + APRON; x++) {
+                    col[x] = r.dx * clampParity(u0 + x + 4, r.xMin, r.xMax);
+                }
+                // Away from the edges of the frame, rows are contiguous
+                bool inside = u0 - APRON + 4 >= r.xMin && u0 + w + APRON + 4 <= r.xMax;
+
+                Plane &dst = r.denoise ? raw : m;
+                for (int y = -APRON; y < h + APRON; y++) {
+                    int iy = clampParity(v0 + y + 4, r.yMin, r.yMax);
+                    const unsigned short *in = (const unsigned short *)(r.in + iy*r.inBytesPerRow);
+                    const unsigned short *start = in + col[0];
+                    float *row = dst[y];
+                    if (inside && r.dx > 0) {
+                        #pragma GCC ivdep
+                        for (int x = -APRON; x < w + APRON; x++) row[x] = start[x];
+                    } else if (inside) {
+                        #pragma GCC ivdep
+                        for (int x = -APRON; x < w + APRON; x++) row[x] = start[-x];
+                    } else {
+                        for (int x = -APRON; x < w + APRON; x++) row[x] = in[col[x]];
+                    }
+                }
+
+                if (!r.denoise) return;
+
+                for (int y = 2-APRON; y < h + APRON-2; y++) {
+                    const float *up = raw[y-2], *here = raw[y], *down = raw[y+2];
+                    float *row = m[y];
+                    #pragma GCC ivdep
+                    for (int x = 2-APRON; x < w + APRON-2; x++) {
+                        float neighbours = maxf(maxf(up[x], down[x]), maxf(here[x-2], here[x+2]));
+                        row[x] = minf(here[x], neighbours);
+                    }
+                }
+            }
+
+            // Color correct, gamma correct, and store the tile of
+            // linear rgb in out, with the same arithmetic as the fast
+            // demosaic
+            void store(const Region &r, int u0, int v0, int w, int h) {
+                int *ri = indices[0], *gi = indices[1], *bi = indices[2];
+                for (int y = 0; y < h; y++) {
+                    const float *rr = out[0][y], *gg = out[1][y], *bb = out[2][y];
+                    const float *mat = r.colorMatrix;
+                    #pragma GCC ivdep
+                    for (int x = 0; x < w; x++) {
+                        float v[3];
+                        for (int c = 0; c < 3; c++) {
+                            v[c] = mat[c*4+0]*rr[x] + mat[c*4+1]*gg[x] + mat[c*4+2]*bb[x] + mat[c*4+3];
+                            v[c] = minf(maxf(v[c], 0.0f), 1023.0f);
+                        }
+                        ri[x] = (int)(v[0] + 0.5f);
+                        gi[x] = (int)(v[1] + 0.5f);
+                        bi[x] = (int)(v[2] + 0.5f);
+                    }
+
+                    // Gamma correct and store
+                    unsigned char *px = r.out + (v0 + y)*r.outBytesPerRow + r.dx*3*u0;
+                    int step = r.dx*3;
+                    for (int x = 0; x < w; x++, px += step) {
+                        px[0] = r.lut[ri[x]];
+                        px[1] = r.lut[gi[x]];
+                        px[2] = r.lut[bi[x]];
+                    }
+                }
+            }
+        };
+
+        /* Variable number of gradients. For each pixel, eight
+         * gradients are measured, one towards each neighbour, from
+         * differences of same-colored pixels along that direction and
+         * along the lines beside it. The directions with small
+         * gradients are those along which the image is smooth, and
+         * are averaged: each such direction contributes the bilinear
+         * color of the neighbouring pixel, with the pixel's own
+         * channel taken as the mean of it and the next same-colored
+         * pixel out. The missing channels are then the pixel's own
+         * value plus the average color difference.
+         *
+         * Neighbouring gradients share most of their terms, so each
+         * difference of same-colored pixels is worked out once, into
+         * a plane, and the gradients are sums over those planes. */
+        class VNG : public Tiler {
+          public:
+            void tile(const Region &r, int u0, int v0, int w, int h) {
+                load(r, u0, v0, w, h);
+                interpolateBilinear(w, h);
+                measureDifferences(w, h);
+                for (int y = 0; y < h; y++) interpolateRow(y, w);
+                store(r, u0, v0, w, h);
+            }
+
+          private:
+            // Absolute differences between same-colored pixels. The
+            // centered ones are across the pixel, from one neighbour to
+            // the opposite one, and the others are from the pixel to
+            // the one two steps back along an axis or diagonal.
+            enum {
+                VERTICAL_CENTERED, VERTICAL,
+                HORIZONTAL_CENTERED, HORIZONTAL,
+                DIAGONAL_CENTERED, DIAGONAL,
+                ANTIDIAGONAL_CENTERED, ANTIDIAGONAL,
+                DIFFERENCES
+            };
+
+            Plane bilinear[3], differences[DIFFERENCES];
+
+            // Bilinear interpolation, with a margin of one pixel
+            // around the tile
+            void interpolateBilinear(int w, int h) {
+                for (int y = -1; y < h+1; y++) {
+                    const float *up = m[y-1], *here = m[y], *down = m[y+1];
+                    float *rr = bilinear[0][y], *gg = bilinear[1][y], *bb = bilinear[2][y];
+                    Sites s = sites(y);
+                    #pragma GCC ivdep
+                    for (int x = -1; x < w+1; x++) {
+                        float self = here[x];
+                        float horiz = 0.5f*(here[x-1] + here[x+1]);
+                        float vert = 0.5f*(up[x] + down[x]);
+                        float axes = 0.25f*(here[x-1] + here[x+1] + up[x] + down[x]);
+                        float diag = 0.25f*(up[x-1] + up[x+1] + down[x-1] + down[x+1]);
+                        // GR sites have red neighbours to the sides
+                        // and blue above and below, and so on
+                        rr[x] = s.r[x] != 0 ? self : (s.gr[x] != 0 ? horiz : (s.gb[x] != 0 ? vert : diag));
+                        gg[x] = s.gr[x] + s.gb[x] != 0 ? self : axes;
+                        bb[x] = s.b[x] != 0 ? self : (s.gr[x] != 0 ? vert : (s.gb[x] != 0 ? horiz : diag));
+                    }
+                }
+            }
+
+            // Every difference the gradients of the tile need, which
+            // is one row above it, two below, and two pixels to either
+            // side
+            void measureDifferences(int w, int h) {
+                for (int y = -1; y < h+2; y++) {
+                    const float *m0 = m[y-2], *m1 = m[y-1], *m2 = m[y], *m3 = m[y+1];
+                    float *vc = differences[VERTICAL_CENTERED][y], *v = differences[VERTICAL][y];
+                    float *hc = differences[HORIZONTAL_CENTERED][y], *hd = differences[HORIZONTAL][y];
+                    float *dc = differences[DIAGONAL_CENTERED][y], *d = differences[DIAGONAL][y];
+                    float *ac = differences[ANTIDIAGONAL_CENTERED][y], *a = differences[ANTIDIAGONAL][y];
+                    #pragma GCC ivdep
+                    for (int x = -2; x < w+2; x++) {
+                        vc[x] = fabsf(m1[x] - m3[x]);
+                        v[x] = fabsf(m2[x] - m0[x]);
+                        hc[x] = fabsf(m2[x-1] - m2[x+1]);
+                        hd[x] = fabsf(m2[x] - m2[x-2]);
+                        dc[x] = fabsf(m1[x-1] - m3[x+1]);
+                        d[x] = fabsf(m2[x] - m0[x-2]);
+                        ac[x] = fabsf(m1[x+1] - m3[x-1]);
+                        a[x] = fabsf(m2[x] - m0[x+2]);
+                    }
+                }
+            }
+
+            void interpolateRow(int y, int w) {
+                Sites s = sites(y);
+                // Rows y-2 to y+2 of the mosaic
+                const float *m0 = m[y-2], *m2 = m[y], *m4 = m[y+2];
+                // Rows y-1 to y+1 of the bilinear planes
+                const float *r0 = bilinear[0][y-1], *r1 = bilinear[0][y], *r2 = bilinear[0][y+1];
+                const float *g0 = bilinear[1][y-1], *g1 = bilinear[1][y], *g2 = bilinear[1][y+1];
+                const float *b0 = bilinear[2][y-1], *b1 = bilinear[2][y], *b2 = bilinear[2][y+1];
+                // The differences around row y
+                const float *vc = differences[VERTICAL_CENTERED][y];
+                const float *v = differences[VERTICAL][y], *v2 = differences[VERTICAL][y+2];
+                const float *hc0 = differences[HORIZONTAL_CENTERED][y-1];
+                const float *hc1 = differences[HORIZONTAL_CENTERED][y];
+                const float *hc2 = differences[HORIZONTAL_CENTERED][y+1];
+                const float *hd0 = differences[HORIZONTAL][y-1];
+                const float *hd1 = differences[HORIZONTAL][y];
+                const float *hd2 = differences[HORIZONTAL][y+1];
+                const float *dc0 = differences[DIAGONAL_CENTERED][y-1];
+                const float *dc1 = differences[DIAGONAL_CENTERED][y];
+                const float *dc2 = differences[DIAGONAL_CENTERED][y+1];
+                const float *d = differences[DIAGONAL][y], *d2 = differences[DIAGONAL][y+2];
+                const float *ac0 = differences[ANTIDIAGONAL_CENTERED][y-1];
+                const float *ac1 = differences[ANTIDIAGONAL_CENTERED][y];
+                const float *ac2 = differences[ANTIDIAGONAL_CENTERED][y+1];
+                const float *a = differences[ANTIDIAGONAL][y], *a2 = differences[ANTIDIAGONAL][y+2];
+                float *rr = out[0][y], *gg = out[1][y], *bb = out[2][y];
+
+                #pragma GCC ivdep
+                for (int x = 0; x < w; x++) {
+                    // Gradients, doubled so that the half weights of
+                    // the side lines are whole. Axis directions use
+                    // the lines one pixel to either side, diagonals
+                    // the four lines one pixel off along each axis,
+                    // which are the same for both ends of a diagonal.
+                    float gN = (2*(vc[x] + v[x]) + vc[x-1] + v[x-1] + vc[x+1] + v[x+1]);
+                    float gS = (2*(vc[x] + v2[x]) + vc[x-1] + v2[x-1] + vc[x+1] + v2[x+1]);
+                    float gW = (2*(hc1[x] + hd1[x]) + hc0[x] + hd0[x] + hc2[x] + hd2[x]);
+                    float gE = (2*(hc1[x] + hd1[x+2]) + hc0[x] + hd0[x+2] + hc2[x] + hd2[x+2]);
+                    float diagonalSides = 2*dc1[x] + dc0[x] + dc2[x] + dc1[x-1] + dc1[x+1];
+                    float gNW = diagonalSides + 2*d[x];
+                    float gSE = diagonalSides + 2*d2[x+2];
+                    float antidiagonalSides = 2*ac1[x] + ac0[x] + ac2[x] + ac1[x-1] + ac1[x+1];
+                    float gNE = antidiagonalSides + 2*a[x];
+                    float gSW = antidiagonalSides + 2*a2[x-2];
+
+                    float lo = minf(minf(minf(gN, gS), minf(gW, gE)), minf(minf(gNW, gSE), minf(gNE, gSW)));
+                    float hi = maxf(maxf(maxf(gN, gS), maxf(gW, gE)), maxf(maxf(gNW, gSE), maxf(gNE, gSW)));
+                    float threshold = lo + 0.5f*hi;
+
+                    // Sum the colors of the smooth directions. The
+                    // smallest gradient is always under the threshold,
+                    // so there is at least one. Weighting by zero or
+                    // one rather than skipping keeps the loads
+                    // unconditional, so the loop vectorizes.
+                    float sr = 0, sg = 0, sb = 0, sOwn = 0, n = 0;
+                    #define VNG_DIRECTION(grad, row, dx, far)               \
+                        {                                               \
+                            float use = grad <= threshold ? 1.0f : 0.0f; \
+                            n += use;                                   \
+                            sr += use*r##row[x+dx];                     \
+                            sg += use*g##row[x+dx];                     \
+                            sb += use*b##row[x+dx];                     \
+                            sOwn += use*far;                            \
+                        }
+                    VNG_DIRECTION(gN, 0, 0, m0[x]);
+                    VNG_DIRECTION(gS, 2, 0, m4[x]);
+                    VNG_DIRECTION(gW, 1, -1, m2[x-2]);
+                    VNG_DIRECTION(gE, 1, 1, m2[x+2]);
+                    VNG_DIRECTION(gNW, 0, -1, m0[x-2]);
+                    VNG_DIRECTION(gSE, 2, 1, m4[x+2]);
+                    VNG_DIRECTION(gNE, 0, 1, m0[x+2]);
+                    VNG_DIRECTION(gSW, 2, -1, m4[x-2]);
+                    #undef VNG_DIRECTION
+
+                    float self = m2[x];
+                    float scale = 1.0f / n;
+                    // The own channel of each direction is the mean of
+                    // this pixel and the far one
+                    sOwn = 0.5f*(sOwn*scale + self);
+                    float red = self + sr*scale - sOwn;
+                    float green = self + sg*scale - sOwn;
+                    float blue = self + sb*scale - sOwn;
+                    rr[x] = s.r[x] != 0 ? self : red;
+                    gg[x] = s.gr[x] + s.gb[x] != 0 ? self : green;
+                    bb[x] = s.b[x] != 0 ? self : blue;
+                }
+            }
+        };
+
+        /* Adaptive homogeneity-directed interpolation. Green is
+         * interpolated twice, once along rows and once along columns,
+         * each time from the neighbouring greens with a correction
+         * from the second derivative of the center channel, clamped
+         * to the neighbours. Red and blue are filled in from color
+         * differences against each green. Each pixel then takes
+         * whichever of the two results is more homogeneous: the one
+         * with more nearby pixels that are close to it in both
+         * lightness and color, or the average if they tie.
+         *
+         * Closeness is measured after color correction, but not in
+         * CIELab, whose cube roots are too slow. Instead lightness is
+         * compressed as Y/(Y+K), and color is the difference of red
+         * and blue from green over the same Y+K, so that, as in CIELab,
+         * differences count for less in brighter regions. That takes
+         * one division per pixel, which vectorizes. */
+        class AHD : public Tiler {
+          public:
+
+            void tile(const Region &r, int u0, int v0, int w, int h) {
+                load(r, u0, v0, w, h);
+                interpolateGreen(w, h);
+                for (int d = 0; d < 2; d++) {
+                    interpolateRedBlue(d, w, h);
+                    toLab(d, r.colorMatrix, w, h);
+                }
+                measureHomogeneity(w, h);
+                choose(w, h);
+                store(r, u0, v0, w, h);
+            }
+
+          private:
+            enum {HORIZONTAL = 0, VERTICAL = 1};
+
+            Plane rgb[2][3], lab[2][3], homogeneity[2], difference;
+            float pick[TILE_WIDTH];
+
+            // Green along rows and along columns, with a three pixel
+            // margin around the tile
+            void interpolateGreen(int w, int h) {
+                for (int y = -3; y < h+3; y++) {
+                    const float *m0 = m[y-2], *m1 = m[y-1], *m2 = m[y], *m3 = m[y+1], *m4 = m[y+2];
+                    float *gh = rgb[HORIZONTAL][1][y], *gv = rgb[VERTICAL][1][y];
+                    Sites s = sites(y);
+                    #pragma GCC ivdep
+                    for (int x = -3; x < w+3; x++) {
+                        float l = m2[x-1], r = m2[x+1];
+                        float along = 0.25f*(2*(l + r + m2[x]) - m2[x-2] - m2[x+2]);
+                        along = minf(maxf(along, minf(l, r)), maxf(l, r));
+                        float u = m1[x], d = m3[x];
+                        float down = 0.25f*(2*(u + d + m2[x]) - m0[x] - m4[x]);
+                        down = minf(maxf(down, minf(u, d)), maxf(u, d));
+                        bool green = s.gr[x] + s.gb[x] != 0;
+                        gh[x] = green ? m2[x] : along;
+                        gv[x] = green ? m2[x] : down;
+                    }
+                }
+            }
+
+            // Red and blue from the color differences to one of the
+            // greens, with a two pixel margin around the tile
+            void interpolateRedBlue(int d, int w, int h) {
+                Plane &g = rgb[d][1];
+                for (int y = -3; y < h+3; y++) {
+                    const float *mm = m[y], *gm = g[y];
+                    float *df = difference[y];
+                    #pragma GCC ivdep
+                    for (int x = -3; x < w+3; x++) df[x] = mm[x] - gm[x];
+                }
+                for (int y = -2; y < h+2; y++) {
+                    const float *du = difference[y-1], *dm = difference[y], *dd = difference[y+1];
+                    const float *mm = m[y], *gm = g[y];
+                    float *rr = rgb[d][0][y], *bb = rgb[d][2][y];
+                    Sites s = sites(y);
+                    #pragma GCC ivdep
+                    for (int x = -2; x < w+2; x++) {
+                        float horiz = 0.5f*(dm[x-1] + dm[x+1]);
+                        float vert = 0.5f*(du[x] + dd[x]);
+                        float diag = 0.25f*(du[x-1] + du[x+1] + dd[x-1] + dd[x+1]);
+                        float self = mm[x], green = gm[x];
+                        rr[x] = s.r[x] != 0 ? self : green + (s.gr[x] != 0 ? horiz : (s.gb[x] != 0 ? vert : diag));
+                        bb[x] = s.b[x] != 0 ? self : green + (s.gr[x] != 0 ? vert : (s.gb[x] != 0 ? horiz : diag));
+                    }
+                }
+            }
+
+            // Convert to a compressed lightness and two opponent color
+            // channels, after color correction
+            void toLab(int d, const float *mat, int w, int h) {
+                const float K = 512.0f;
+                for (int y = -2; y < h+2; y++) {
+                    const float *rr = rgb[d][0][y], *gg = rgb[d][1][y], *bb = rgb[d][2][y];
+                    float *ll = lab[d][0][y], *aa = lab[d][1][y], *bo = lab[d][2][y];
+                    #pragma GCC ivdep
+                    for (int x = -2; x < w+2; x++) {
+                        float v[3];
+                        for (int c = 0; c < 3; c++) {
+                            v[c] = mat[c*4+0]*rr[x] + mat[c*4+1]*gg[x] + mat[c*4+2]*bb[x] + mat[c*4+3];
+                            v[c] = minf(maxf(v[c], 0.0f), 1023.0f);
+                        }
+                        float luminance = v[0] + 2*v[1] + v[2];
+                        float scale = 1.0f / (luminance + K);
+                        ll[x] = luminance*scale;
+                        aa[x] = (v[0] - v[1])*scale;
+                        bo[x] = (v[2] - v[1])*scale;
+                    }
+                }
+            }
+
+            // Count how many of each pixel's four neighbours are within
+            // the tolerances, which are set per pixel from the
+            // differences across the direction each green was
+            // interpolated in, with a one pixel margin around the tile
+            void measureHomogeneity(int w, int h) {
+                for (int y = -1; y < h+1; y++) {
+                    const float *lh0 = lab[HORIZONTAL][0][y-1], *lh1 = lab[HORIZONTAL][0][y], *lh2 = lab[HORIZONTAL][0][y+1];
+                    const float *ah0 = lab[HORIZONTAL][1][y-1], *ah1 = lab[HORIZONTAL][1][y], *ah2 = lab[HORIZONTAL][1][y+1];
+                    const float *bh0 = lab[HORIZONTAL][2][y-1], *bh1 = lab[HORIZONTAL][2][y], *bh2 = lab[HORIZONTAL][2][y+1];
+                    const float *lv0 = lab[VERTICAL][0][y-1], *lv1 = lab[VERTICAL][0][y], *lv2 = lab[VERTICAL][0][y+1];
+                    const float *av0 = lab[VERTICAL][1][y-1], *av1 = lab[VERTICAL][1][y], *av2 = lab[VERTICAL][1][y+1];
+                    const float *bv0 = lab[VERTICAL][2][y-1], *bv1 = lab[VERTICAL][2][y], *bv2 = lab[VERTICAL][2][y+1];
+                    float *hh = homogeneity[HORIZONTAL][y], *hv = homogeneity[VERTICAL][y];
+
+                    #define AHD_DL(l, nrow, nx) fabsf(l##1[x] - l##nrow[nx])
+                    #define AHD_DAB(a, b, nrow, nx) ((a##1[x] - a##nrow[nx])*(a##1[x] - a##nrow[nx]) + \
+                                                     (b##1[x] - b##nrow[nx])*(b##1[x] - b##nrow[nx]))
+                    #pragma GCC ivdep
+                    for (int x = -1; x < w+1; x++) {
+                        // Left, right, up, and down
+                        float dlh0 = AHD_DL(lh, 1, x-1), dlh1 = AHD_DL(lh, 1, x+1);
+                        float dlh2 = AHD_DL(lh, 0, x), dlh3 = AHD_DL(lh, 2, x);
+                        float dlv0 = AHD_DL(lv, 1, x-1), dlv1 = AHD_DL(lv, 1, x+1);
+                        float dlv2 = AHD_DL(lv, 0, x), dlv3 = AHD_DL(lv, 2, x);
+                        float dabh0 = AHD_DAB(ah, bh, 1, x-1), dabh1 = AHD_DAB(ah, bh, 1, x+1);
+                        float dabh2 = AHD_DAB(ah, bh, 0, x), dabh3 = AHD_DAB(ah, bh, 2, x);
+                        float dabv0 = AHD_DAB(av, bv, 1, x-1), dabv1 = AHD_DAB(av, bv, 1, x+1);
+                        float dabv2 = AHD_DAB(av, bv, 0, x), dabv3 = AHD_DAB(av, bv, 2, x);
+
+                        float lEps = minf(maxf(dlh0, dlh1), maxf(dlv2, dlv3));
+                        float abEps = minf(maxf(dabh0, dabh1), maxf(dabv2, dabv3));
+
+                        hh[x] = (((dlh0 <= lEps) & (dabh0 <= abEps)) + ((dlh1 <= lEps) & (dabh1 <= abEps)) +
+                                 ((dlh2 <= lEps) & (dabh2 <= abEps)) + ((dlh3 <= lEps) & (dabh3 <= abEps)));
+                        hv[x] = (((dlv0 <= lEps) & (dabv0 <= abEps)) + ((dlv1 <= lEps) & (dabv1 <= abEps)) +
+                                 ((dlv2 <= lEps) & (dabv2 <= abEps)) + ((dlv3 <= lEps) & (dabv3 <= abEps)));
+                    }
+                    #undef AHD_DL
+                    #undef AHD_DAB
+                }
+            }
+
+            // Pick the direction with more homogeneity over a 3x3
+            // neighbourhood, or average the two
+            void choose(int w, int h) {
+                float *p = pick;
+                for (int y = 0; y < h; y++) {
+                    const float *h0 = homogeneity[HORIZONTAL][y-1], *h1 = homogeneity[HORIZONTAL][y];
+                    const float *h2 = homogeneity[HORIZONTAL][y+1];
+                    const float *v0 = homogeneity[VERTICAL][y-1], *v1 = homogeneity[VERTICAL][y];
+                    const float *v2 = homogeneity[VERTICAL][y+1];
+                    #pragma GCC ivdep
+                    for (int x = 0; x < w; x++) {
+                        float sh = (h0[x-1] + h0[x] + h0[x+1] + h1[x-1] + h1[x] + h1[x+1] +
+                                    h2[x-1] + h2[x] + h2[x+1]);
+                        float sv = (v0[x-1] + v0[x] + v0[x+1] + v1[x-1] + v1[x] + v1[x+1] +
+                                    v2[x-1] + v2[x] + v2[x+1]);
+                        // The weight of the horizontal result
+                        p[x] = sh > sv ? 1.0f : (sh < sv ? 0.0f : 0.5f);
+                    }
+                    for (int c = 0; c < 3; c++) {
+                        const float *ch = rgb[HORIZONTAL][c][y], *cv = rgb[VERTICAL][c][y];
+                        float *o = out[c][y];
+                        #pragma GCC ivdep
+                        for (int x = 0; x < w; x++) {
+                            o[x] = cv[x] + p[x]*(ch[x] - cv[x]);
+                        }
+                    }
+                }
+            }
+        };
+
+        template<typename Method>
+        void demosaicHQ(const unsigned char *in, int inBytesPerRow,
+                        int left, int top, int right, int bottom,
+                        unsigned char *out, int outBytesPerRow,
+                        int width, int height, bool flipX, bool denoise,
+                        const float *colorMatrix, const unsigned char *lut) {
+            Region r;
+            r.in = in;
+            r.inBytesPerRow = inBytesPerRow;
+            r.out = out;
+            r.outBytesPerRow = outBytesPerRow;
+            r.dx = flipX ? -1 : 1;
+            r.xMin = -left;
+            r.xMax = width + 8 + right;
+            r.yMin = -top;
+            r.yMax = height + 8 + bottom;
+            r.denoise = denoise;
+            r.colorMatrix = colorMatrix;
+            r.lut = lut;
+
+            // Far too big for the stack
+            Method *method = new Method;
+            for (int v = 0; v < height; v += TILE_HEIGHT) {
+                for (int u = 0; u < width; u += TILE_WIDTH) {
+                    method->tile(r, u, v, mini(TILE_WIDTH, width - u), mini(TILE_HEIGHT, height - v));
+                }
+            }
+            delete method;
+        }
+    }
+}
+
+#endif
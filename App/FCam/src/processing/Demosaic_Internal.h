@@ -0,0 +1,67 @@
+#ifndef FCAM_DEMOSAIC_INTERNAL_H
+#define FCAM_DEMOSAIC_INTERNAL_H
+
+// Helpers shared by the various demosaic implementations. This is
+// also included by the instruction-set specific kernels, so it must
+// not pull in any inline code.
+
+namespace FCam {
+
+    class Frame;
+
+    // Make a linear luminance -> pixel value lookup table
+    void makeLUT(const Frame &f, float contrast, int blackLevel, float gamma, unsigned char *lut);
+
+    // Fixed point color conversion. The color matrix is stored with
+    // FIXED_SHIFT fractional bits, and the rounded result directly
+    // indexes a gamma table that also does the clamp to [0, 1023]. The
+    // table covers linear values from FIXED_LUT_MIN to FIXED_LUT_MAX.
+    const int FIXED_SHIFT = 15;
+    const int FIXED_LUT_MIN = -1024;
+    const int FIXED_LUT_MAX = 2047;
+    const int FIXED_LUT_SIZE = FIXED_LUT_MAX - FIXED_LUT_MIN + 1;
+
+    // Fixed point results are at most one linear value off the
+    // floating point ones, which is at most one LSB of output except
+    // where the lookup table steps by more than one. The default curve
+    // has some such steps just above the black level, so results in
+    // [steepMin, steepMax] are redone in floating point. An empty
+    // range is steepMin = 1, steepMax = 0.
+    struct FixedColorMatrix {
+        int m[12];
+        int steepMin, steepMax;
+    };
+
+    // Convert a 3x4 color matrix to fixed point. Returns false if the
+    // products could overflow for raw values up to maxRaw.
+    bool makeFixedColorMatrix(const float *colorMatrix, unsigned short maxRaw, 
+                              FixedColorMatrix *fixedMatrix);
+
+    // Fold the clamp to [0, 1023] into a lookup table made by
+    // makeLUT. The result has FIXED_LUT_SIZE entries, the first of
+    // which is for FIXED_LUT_MIN. Also fills in the steep range of
+    // fixedMatrix.
+    void makeFixedLUT(const unsigned char *lut, unsigned char *fixedLut, 
+                      FixedColorMatrix *fixedMatrix);
+
+    // The high quality demosaics in Demosaic_HQ.cpp. These take the
+    // same arguments as the x86 kernels in Demosaic_X86.h, and produce
+    // output of the same size from the same GRBG-ordered view of the
+    // input, but their stencils are wider than the four pixel apron.
+    // left, top, right, and bottom say how many more valid pixels of
+    // input there are beyond the apron on each side, in the mirrored
+    // view. Past those, the input is extended by mirroring.
+    void demosaicAHD(const unsigned char *in, int inBytesPerRow,
+                     int left, int top, int right, int bottom,
+                     unsigned char *out, int outBytesPerRow,
+                     int width, int height, bool flipX, bool denoise,
+                     const float *colorMatrix, const unsigned char *lut);
+
+    void demosaicVNG(const unsigned char *in, int inBytesPerRow,
+                     int left, int top, int right, int bottom,
+                     unsigned char *out, int outBytesPerRow,
+                     int width, int height, bool flipX, bool denoise,
+                     const float *colorMatrix, const unsigned char *lut);
+}
+
+#endif
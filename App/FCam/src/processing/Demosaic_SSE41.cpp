@@ -0,0 +1,58 @@
+#ifdef FCAM_ARCH_X86
+#include <string.h>
+#include <smmintrin.h>
+#include "Demosaic_X86.h"
+
+// SSE4.1 vector primitives for the x86 demosaic kernel. This file is
+// compiled with -msse4.1, so it must not use any inline code shared
+// with the rest of the library.
+
+namespace {
+
+    typedef __m128i vec;
+    const int LANES = 8;
+
+    inline vec vload(const short *p) {return _mm_loadu_si128((const __m128i *)p);}
+    inline void vstore(short *p, vec v) {_mm_storeu_si128((__m128i *)p, v);}
+    inline vec vadd(vec a, vec b) {return _mm_add_epi16(a, b);}
+    inline vec vsub(vec a, vec b) {return _mm_sub_epi16(a, b);}
+    inline vec vmin(vec a, vec b) {return _mm_min_epi16(a, b);}
+    inline vec vmax(vec a, vec b) {return _mm_max_epi16(a, b);}
+    inline vec vabs(vec a) {return _mm_abs_epi16(a);}
+    // pavgw rounds up, so take off the carry to match integer division
+    inline vec vavg(vec a, vec b) {
+        return _mm_sub_epi16(_mm_avg_epu16(a, b),
+                             _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi16(1)));
+    }
+    inline vec vpick(vec da, vec db, vec a, vec b) {
+        return _mm_blendv_epi8(b, a, _mm_cmplt_epi16(da, db));
+    }
+
+    // One row of the color matrix on four pixels, clamped and rounded
+    // the same way as the scalar code
+    inline __m128i colorRow(__m128 r, __m128 g, __m128 b, const float *m) {
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), r),
+                              _mm_mul_ps(_mm_set1_ps(m[1]), g));
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(m[2]), b));
+        v = _mm_add_ps(v, _mm_set1_ps(m[3]));
+        v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1023.0f));
+        return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+    }
+
+    inline void vcolor(vec r, vec g, vec b, const float *m, short *ri, short *gi, short *bi) {
+        __m128 rLo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(r));
+        __m128 gLo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(g));
+        __m128 bLo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(b));
+        __m128 rHi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(r, 8)));
+        __m128 gHi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(g, 8)));
+        __m128 bHi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(b, 8)));
+        vstore(ri, _mm_packs_epi32(colorRow(rLo, gLo, bLo, m+0), colorRow(rHi, gHi, bHi, m+0)));
+        vstore(gi, _mm_packs_epi32(colorRow(rLo, gLo, bLo, m+4), colorRow(rHi, gHi, bHi, m+4)));
+        vstore(bi, _mm_packs_epi32(colorRow(rLo, gLo, bLo, m+8), colorRow(rHi, gHi, bHi, m+8)));
+    }
+}
+
+#define DEMOSAIC_X86_KERNEL demosaic_SSE41
+#include "Demosaic_X86_Kernel.h"
+
+#endif
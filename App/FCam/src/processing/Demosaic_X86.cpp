@@ -0,0 +1,42 @@
+#ifdef FCAM_ARCH_X86
+#include <stdlib.h>
+#include "Demosaic_X86.h"
+
+namespace FCam {
+
+    // Zero-initialized, so ForceDefault_X86 even before static
+    // constructors have run
+    static ForcedDemosaicKernel_X86 forcedKernel;
+
+    DemosaicKernel_X86 demosaicKernel_X86() {
+        switch (forcedKernel) {
+        case ForceScalar_X86: return NULL;
+        case ForceSSE41_X86: return demosaic_SSE41;
+        case ForceAVX2_X86: return demosaic_AVX2;
+        default: break;
+        }
+        // May be called before static constructors have run
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return demosaic_AVX2;
+        if (__builtin_cpu_supports("sse4.1")) return demosaic_SSE41;
+        return NULL;
+    }
+
+    bool forceDemosaicKernel_X86(ForcedDemosaicKernel_X86 kernel) {
+        __builtin_cpu_init();
+        if ((kernel == ForceSSE41_X86 && !__builtin_cpu_supports("sse4.1")) ||
+            (kernel == ForceAVX2_X86 && !__builtin_cpu_supports("avx2"))) {
+            return false;
+        }
+        forcedKernel = kernel;
+        return true;
+    }
+
+    bool hasAVX2_X86() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+
+}
+
+#endif
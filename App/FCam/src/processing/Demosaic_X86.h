@@ -0,0 +1,81 @@
+#ifndef FCAM_DEMOSAIC_X86_H
+#define FCAM_DEMOSAIC_X86_H
+#ifdef FCAM_ARCH_X86
+
+// x86-specific vectorized post-processing routines. The kernels live
+// in their own translation units, each compiled for a particular
+// instruction set, and are selected at runtime based on what the CPU
+// supports. They take raw pointers rather than Images so that no
+// inline FCam code gets compiled with instructions the CPU may lack.
+
+#include "Demosaic_Internal.h"
+
+namespace FCam {
+
+    /* Demosaic, color correct, and gamma correct a width x height
+     * region of RGB24 output. The input points at the top left of
+     * the GRBG raw data needed for that region, which includes a
+     * four pixel apron on each side, so it must have at least
+     * (width+8) x (height+8) valid pixels. Width and height must be
+     * even. The output is identical to that of the scalar demosaic
+     * in Demosaic.cpp, converting colors in floating point. They
+     * have no fixed point path, because on these CPUs it is slower.
+     *
+     * Other bayer patterns are GRBG mirrored. To demosaic a vertically
+     * mirrored region, point in and out at their bottom rows and pass
+     * negative strides. To demosaic a horizontally mirrored region,
+     * point them at their rightmost pixels and set flipX. */
+    typedef void (*DemosaicKernel_X86)(const unsigned char *in, int inBytesPerRow,
+                                       unsigned char *out, int outBytesPerRow,
+                                       int width, int height, bool flipX, bool denoise,
+                                       const float *colorMatrix, const unsigned char *lut);
+
+    void demosaic_SSE41(const unsigned char *in, int inBytesPerRow,
+                        unsigned char *out, int outBytesPerRow,
+                        int width, int height, bool flipX, bool denoise,
+                        const float *colorMatrix, const unsigned char *lut);
+
+    void demosaic_AVX2(const unsigned char *in, int inBytesPerRow,
+                       unsigned char *out, int outBytesPerRow,
+                       int width, int height, bool flipX, bool denoise,
+                       const float *colorMatrix, const unsigned char *lut);
+
+    // Returns the fastest kernel this CPU can run, or NULL if none
+    // can be run and the scalar code should be used instead.
+    DemosaicKernel_X86 demosaicKernel_X86();
+
+    // The kernels demosaicKernel_X86 can pick from. Tests force each
+    // in turn with forceDemosaicKernel_X86 to check that they all
+    // agree with the scalar code, which the dispatch would otherwise
+    // never use on a modern CPU. ForceDefault goes back to picking
+    // the fastest.
+    enum ForcedDemosaicKernel_X86 {
+        ForceDefault_X86, ForceScalar_X86, ForceSSE41_X86, ForceAVX2_X86
+    };
+
+    // Returns false, and changes nothing, if the CPU can't run the
+    // kernel asked for. Not thread safe with respect to demosaics
+    // already running.
+    bool forceDemosaicKernel_X86(ForcedDemosaicKernel_X86 kernel);
+
+    // Whether this CPU can run the AVX2 builds of the high quality
+    // demosaics below
+    bool hasAVX2_X86();
+
+    // The high quality demosaics from Demosaic_Internal.h, compiled
+    // for AVX2
+    void demosaicAHD_AVX2(const unsigned char *in, int inBytesPerRow,
+                          int left, int top, int right, int bottom,
+                          unsigned char *out, int outBytesPerRow,
+                          int width, int height, bool flipX, bool denoise,
+                          const float *colorMatrix, const unsigned char *lut);
+
+    void demosaicVNG_AVX2(const unsigned char *in, int inBytesPerRow,
+                          int left, int top, int right, int bottom,
+                          unsigned char *out, int outBytesPerRow,
+                          int width, int height, bool flipX, bool denoise,
+                          const float *colorMatrix, const unsigned char *lut);
+}
+
+#endif
+#endif
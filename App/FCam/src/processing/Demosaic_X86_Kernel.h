@@ -0,0 +1,270 @@
+#ifndef FCAM_DEMOSAIC_X86_KERNEL_H
+#define FCAM_DEMOSAIC_X86_KERNEL_H
+
+/* The body of the x86 demosaic kernels. This is included by each of
+ * the instruction-set specific translation units (Demosaic_SSE41.cpp
+ * and Demosaic_AVX2.cpp), which first define:
+ *
+ * vec              - a vector of LANES signed shorts
+ * vload/vstore     - unaligned load and store
+ * vadd/vsub        - wrapping add and subtract
+ * vmin/vmax        - signed minimum and maximum
+ * vabs             - absolute value
+ * vavg             - (a+b)/2 for non-negative a and b, without overflow
+ * vpick(da, db, a, b) - da < db ? a : b
+ * vcolor(r, g, b, m, ri, gi, bi) - apply the 3x4 color matrix m, clamp
+ *                    to [0, 1023], round, and store the results
+ * DEMOSAIC_X86_KERNEL - the name of the function to define
+ *
+ * The algorithm is exactly the one in Demosaic.cpp, run over whole
+ * rows of each plane instead of one pixel at a time, so see there
+ * for a description of each stage. Each stage also computes a few
+ * lanes the scalar code doesn't, beyond the edges of a tile. Those
+ * values are garbage, but nothing that reaches the output depends on
+ * them.
+ *
+ * Only the loading and storing of pixels depends on which way the
+ * rows run, so the tile loop is a template on that, and the two
+ * directions each get their own copy of it.
+ */
+
+namespace FCam {
+
+    namespace {
+        // The region of output processed at once. Tiles are larger
+        // than the scalar code's blocks, to amortize the apron and
+        // to give the vector loops some length.
+        const int TILE_WIDTH = 128;
+        const int TILE_HEIGHT = 24;
+
+        // Each plane row is padded on both sides, so that reading
+        // one element past either end of a vector loop stays in
+        // bounds.
+        const int PAD = 16;
+        const int PLANE_WIDTH = TILE_WIDTH/2+4;
+        const int PLANE_HEIGHT = TILE_HEIGHT/2+4;
+        const int PLANE_STRIDE = ((PLANE_WIDTH+PAD-1)/PAD)*PAD + 2*PAD;
+
+        const int G = 0, GR = 0, R = 1, B = 2, GB = 3;
+
+        struct Planes {
+            // The raw gr, r, b, gb channels
+            short in[4][PLANE_HEIGHT][PLANE_STRIDE];
+            // Every color at every location
+            short linear[3][4][PLANE_HEIGHT][PLANE_STRIDE];
+            // Gamma lookup table indices for one row of output
+            short idx[3][PLANE_STRIDE];
+        } __attribute__((aligned(32)));
+
+        inline int tileMin(int a, int b) {return a < b ? a : b;}
+
+        template<bool FLIP_X>
+        void demosaicTiles(const unsigned char *in, int inBytesPerRow,
+                           unsigned char *out, int outBytesPerRow,
+                           int width, int height, bool denoise,
+                           const float *colorMatrix,
+                           const unsigned char *lut, Planes &p) {
+
+            // The step between horizontally adjacent pixels
+            const int dx = FLIP_X ? -1 : 1;
+
+            #define IN(c, y) (&p.in[c][y][PAD])
+            #define LIN(c, l, y) (&p.linear[c][l][y][PAD])
+
+            for (int ty = 0; ty < height; ty += TILE_HEIGHT) {
+                int ph = tileMin(TILE_HEIGHT, height-ty)/2+4;
+
+                for (int tx = 0; tx < width; tx += TILE_WIDTH) {
+                    int pw = tileMin(TILE_WIDTH, width-tx)/2+4;
+
+                    /*
+                      Stage 1: Load a tile of input, treat it as 4-channel gr, r, b, gb
+                    */
+                    const unsigned char *tileIn = in + ty*inBytesPerRow + dx*tx*2;
+                    for (int y = 0; y < ph; y++) {
+                        const short *row0 = (const short *)(tileIn + (2*y)*inBytesPerRow);
+                        const short *row1 = (const short *)(tileIn + (2*y+1)*inBytesPerRow);
+                        short *gr = IN(GR, y), *r = IN(R, y), *b = IN(B, y), *gb = IN(GB, y);
+                        for (int x = 0; x < pw; x++) {
+                            gr[x] = row0[dx*(2*x)];
+                            r[x]  = row0[dx*(2*x+1)];
+                            b[x]  = row1[dx*(2*x)];
+                            gb[x] = row1[dx*(2*x+1)];
+                        }
+                    }
+
+                    /*
+                      Stage 1.5: Suppress hot pixels
+                    */
+                    for (int y = 1; y < ph-1; y++) {
+                        for (int x = 0; x < pw; x += LANES) {
+                            if (denoise) {
+                                for (int c = 0; c < 4; c++) {
+                                    vec here = vload(IN(c, y)+x);
+                                    vec around = vmax(vmax(vload(IN(c, y-1)+x), vload(IN(c, y+1)+x)),
+                                                      vmax(vload(IN(c, y)+x+1), vload(IN(c, y)+x-1)));
+                                    vstore(LIN(c == GB ? G : c, c, y)+x, vmin(here, around));
+                                }
+                            } else {
+                                for (int c = 0; c < 4; c++) {
+                                    vstore(LIN(c == GB ? G : c, c, y)+x, vload(IN(c, y)+x));
+                                }
+                            }
+                        }
+                    }
+
+                    /*
+                      2: Interpolate g at r
+                      3: Interpolate g at b
+                    */
+                    for (int y = 1; y < ph-1; y++) {
+                        for (int x = 0; x < pw; x += LANES) {
+                            vec gbUp = vload(LIN(G, GB, y-1)+x);
+                            vec gbHere = vload(LIN(G, GB, y)+x);
+                            vec gbLeft = vload(LIN(G, GB, y)+x-1);
+                            vec grHere = vload(LIN(G, GR, y)+x);
+                            vec grRight = vload(LIN(G, GR, y)+x+1);
+                            vec grDown = vload(LIN(G, GR, y+1)+x);
+
+                            vec gv_r = vavg(gbUp, gbHere);
+                            vec gvd_r = vabs(vsub(gbUp, gbHere));
+                            vec gh_r = vavg(grHere, grRight);
+                            vec ghd_r = vabs(vsub(grHere, grRight));
+                            vstore(LIN(G, R, y)+x, vpick(ghd_r, gvd_r, gh_r, gv_r));
+
+                            vec gv_b = vavg(grDown, grHere);
+                            vec gvd_b = vabs(vsub(grDown, grHere));
+                            vec gh_b = vavg(gbHere, gbLeft);
+                            vec ghd_b = vabs(vsub(gbHere, gbLeft));
+                            vstore(LIN(G, B, y)+x, vpick(ghd_b, gvd_b, gh_b, gv_b));
+                        }
+                    }
+
+                    /*
+                      4: Interpolate r at gr
+                      5: Interpolate b at gr
+                      6: Interpolate r at gb
+                      7: Interpolate b at gb
+                    */
+                    for (int y = 1; y < ph-1; y++) {
+                        for (int x = 0; x < pw; x += LANES) {
+                            vec rHere = vload(LIN(R, R, y)+x);
+                            vec g_rHere = vload(LIN(G, R, y)+x);
+                            vec bHere = vload(LIN(B, B, y)+x);
+                            vec g_bHere = vload(LIN(G, B, y)+x);
+
+                            vstore(LIN(R, GR, y)+x,
+                                   vsub(vadd(vavg(vload(LIN(R, R, y)+x-1), rHere),
+                                             vload(LIN(G, GR, y)+x)),
+                                        vavg(vload(LIN(G, R, y)+x-1), g_rHere)));
+
+                            vstore(LIN(B, GR, y)+x,
+                                   vsub(vadd(vavg(vload(LIN(B, B, y-1)+x), bHere),
+                                             vload(LIN(G, GR, y)+x)),
+                                        vavg(vload(LIN(G, B, y-1)+x), g_bHere)));
+
+                            vstore(LIN(R, GB, y)+x,
+                                   vsub(vadd(vavg(rHere, vload(LIN(R, R, y+1)+x)),
+                                             vload(LIN(G, GB, y)+x)),
+                                        vavg(g_rHere, vload(LIN(G, R, y+1)+x))));
+
+                            vstore(LIN(B, GB, y)+x,
+                                   vsub(vadd(vavg(bHere, vload(LIN(B, B, y)+x+1)),
+                                             vload(LIN(G, GB, y)+x)),
+                                        vavg(g_bHere, vload(LIN(G, B, y)+x+1))));
+                        }
+                    }
+
+                    /*
+                      8: Interpolate r at b
+                      9: Interpolate b at r
+                    */
+                    for (int y = 1; y < ph-1; y++) {
+                        for (int x = 0; x < pw; x += LANES) {
+                            vec rHere = vload(LIN(R, R, y)+x);
+                            vec rLeft = vload(LIN(R, R, y)+x-1);
+                            vec rDown = vload(LIN(R, R, y+1)+x);
+                            vec rDownLeft = vload(LIN(R, R, y+1)+x-1);
+                            vec g_rHere = vload(LIN(G, R, y)+x);
+                            vec g_bHere = vload(LIN(G, B, y)+x);
+
+                            vec rp_b = vsub(vadd(vavg(rDownLeft, rHere), g_bHere),
+                                            vavg(vload(LIN(G, R, y+1)+x-1), g_rHere));
+                            vec rpd_b = vabs(vsub(rDownLeft, rHere));
+                            vec rn_b = vsub(vadd(vavg(rLeft, rDown), g_bHere),
+                                            vavg(vload(LIN(G, R, y)+x-1), vload(LIN(G, R, y+1)+x)));
+                            vec rnd_b = vabs(vsub(rLeft, rDown));
+                            vstore(LIN(R, B, y)+x, vpick(rpd_b, rnd_b, rp_b, rn_b));
+
+                            vec bHere = vload(LIN(B, B, y)+x);
+                            vec bRight = vload(LIN(B, B, y)+x+1);
+                            vec bUp = vload(LIN(B, B, y-1)+x);
+                            vec bUpRight = vload(LIN(B, B, y-1)+x+1);
+
+                            vec bp_r = vsub(vadd(vavg(bUpRight, bHere), g_rHere),
+                                            vavg(vload(LIN(G, B, y-1)+x+1), g_bHere));
+                            vec bpd_r = vabs(vsub(bUpRight, bHere));
+                            vec bn_r = vsub(vadd(vavg(bRight, bUp), g_rHere),
+                                            vavg(vload(LIN(G, B, y)+x+1), vload(LIN(G, B, y-1)+x)));
+                            vec bnd_r = vabs(vsub(bRight, bUp));
+                            vstore(LIN(B, R, y)+x, vpick(bpd_r, bnd_r, bp_r, bn_r));
+                        }
+                    }
+
+                    /*
+                      10: Color matrix
+                      11: Gamma correct
+                    */
+                    for (int y = 2; y < ph-2; y++) {
+                        for (int l = 0; l < 4; l++) {
+                            for (int x = 2; x < pw-2; x += LANES) {
+                                vcolor(vload(LIN(R, l, y)+x),
+                                       vload(LIN(G, l, y)+x),
+                                       vload(LIN(B, l, y)+x),
+                                       colorMatrix,
+                                       &p.idx[0][x], &p.idx[1][x], &p.idx[2][x]);
+                            }
+
+                            // gr and r land on even rows, b and gb on odd
+                            // rows. gr and b are on even columns, r and gb
+                            // on odd columns.
+                            unsigned char *dst = (out + (ty+(y-2)*2+(l == B || l == GB))*outBytesPerRow +
+                                                  dx*(tx+(l == R || l == GB))*3);
+                            for (int x = 2; x < pw-2; x++) {
+                                dst[0] = lut[p.idx[0][x]];
+                                dst[1] = lut[p.idx[1][x]];
+                                dst[2] = lut[p.idx[2][x]];
+                                dst += dx*6;
+                            }
+                        }
+                    }
+                }
+            }
+
+            #undef IN
+            #undef LIN
+        }
+    }
+
+    void DEMOSAIC_X86_KERNEL(const unsigned char *in, int inBytesPerRow,
+                             unsigned char *out, int outBytesPerRow,
+                             int width, int height, bool flipX, bool denoise,
+                             const float *colorMatrix,
+                             const unsigned char *lut) {
+        Planes p;
+        // Lanes outside the tile are never used, but don't let them
+        // read uninitialized memory either
+        memset(&p, 0, sizeof(p));
+
+        if (flipX) {
+            demosaicTiles<true>(in, inBytesPerRow, out, outBytesPerRow, width, height,
+                                denoise, colorMatrix, lut, p);
+        } else {
+            demosaicTiles<false>(in, inBytesPerRow, out, outBytesPerRow, width, height,
+                                 denoise, colorMatrix, lut, p);
+        }
+    }
+
+}
+
+#endif
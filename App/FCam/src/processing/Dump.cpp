@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <vector>
 
 #include <FCam/Event.h>
 #include <FCam/processing/Dump.h>
 
+#include "Packing.h"
+#include "Save_Internal.h"
 #include "../Debug.h"
 
 namespace FCam {
@@ -36,7 +39,7 @@ namespace FCam {
         // check the number of channels is correct, given the type
         if (header[4] == 2 && header[3] == 2) {
             type = FCam::UYVY;
-        } else if (header[4] == 4 && header[3] == 1) {
+        } else if ((header[4] == 4 || header[4] == 10 || header[4] == 12) && header[3] == 1) {
             type = FCam::RAW;
         } else if (header[4] == 2 && header[3] == 3) {
             type = FCam::RGB24;
@@ -50,6 +53,23 @@ namespace FCam {
         // todo: Allow loading into a preallocated image
         Image im(header[1], header[2], type);
 
+        if (header[4] == 10 || header[4] == 12) {
+            int bits = header[4];
+            std::vector<uint8_t> row(packedBytesPerRow(im.width(), bits));
+            for (size_t y = 0; y < im.height(); y++) {
+                if (fread(&row[0], 1, row.size(), fp) != row.size()) {
+                    error(Event::FileLoadError, 
+                          "loadDump: %s: Unexpected EOF in image data at line %d/%d.", 
+                          filename.c_str(), y, im.height());
+                    fclose(fp);
+                    return Image();
+                }
+                unpackRow(&row[0], (uint16_t *)im(0, y), im.width(), bits);
+            }
+            fclose(fp);
+            return im;
+        }
+
         for (size_t y = 0; y < im.height(); y++) {
             size_t count = fread(im(0, y), bytesPerPixel(type), im.width(), fp);
             if (count != im.width()) {
@@ -61,19 +81,28 @@ namespace FCam {
             }
         }
         
+        fclose(fp);
         return im;
     }
     
-    void saveDump(Frame f, std::string filename) {
-        saveDump(f.image(), filename);
+    void saveDump(Frame f, std::string filename, int bitsPerSample) {
+        writeDump(f.image(), filename, bitsPerSample, NULL);
     }
     
-    void saveDump(Image im, std::string filename) {
+    void saveDump(Image im, std::string filename, int bitsPerSample) {
+        writeDump(im, filename, bitsPerSample, NULL);
+    }
+
+    bool writeDump(Frame f, const std::string &filename, int bitsPerSample, size_t *bytes) {
+        return writeDump(f.image(), filename, bitsPerSample, bytes);
+    }
+
+    bool writeDump(Image im, const std::string &filename, int bitsPerSample, size_t *bytes) {
         dprintf(DBG_MINOR,"saveDump: Saving dump as %s.\n", filename.c_str());
         
         if (!im.valid()) {
             error(Event::FileSaveError, "saveDump: %s: Image to save not valid.", filename.c_str());
-            return;
+            return false;
         }
         
         unsigned int frames = 1;
@@ -91,6 +120,10 @@ namespace FCam {
         case FCam::RAW:
             type = 4;
             channels = 1; 
+            if (bitsPerSample == 10 || bitsPerSample == 12) {
+                type = bitsPerSample;
+                widthBytes = packedBytesPerRow(width, bitsPerSample);
+            }
             break;
         case FCam::RGB24:
             type = 2;
@@ -98,7 +131,7 @@ namespace FCam {
             break;
         default:
             error(Event::FileSaveError, "saveDump: %s: Unknown image type.", filename.c_str());
-            return;
+            return false;
         }
         dprintf(DBG_MINOR,"saveDump: %s: Header: %d %d %d %d %d. Bytes %d\n", filename.c_str(), 
                 frames, width, height, channels, type, widthBytes*height+20);
@@ -106,7 +139,7 @@ namespace FCam {
         FILE *fp = fopen(filename.c_str(), "wb");
         if (!fp) {
             error(Event::FileSaveError, "saveDump: %s: Cannot open file for writing.", filename.c_str());
-            return;
+            return false;
         }
         
         size_t count;
@@ -115,20 +148,33 @@ namespace FCam {
         if (count != 5) {
             error(Event::FileSaveError, "saveDump: %s: Error writing header (out of space?)", filename.c_str());
             fclose(fp);
-            return;
+            return false;
         }
     
+        std::vector<uint8_t> packed(type == 10 || type == 12 ? widthBytes : 0);
         for (unsigned int y=0; y < height; y++) {
-            count = fwrite(im(0,y), sizeof(char), widthBytes, fp);
+            const void *row = im(0,y);
+            if (!packed.empty()) {
+                packRow((const uint16_t *)row, &packed[0], width, bitsPerSample);
+                row = &packed[0];
+            }
+            count = fwrite(row, sizeof(char), widthBytes, fp);
             if (count != widthBytes) {
                 error(Event::FileSaveError, "saveDump: %s: Error writing image data (out of space?)", filename.c_str());
                 fclose(fp);
-                return;
+                return false;
             }
         }
 
+        // Buffered data may only fail to reach the disk on close
+        if (fclose(fp) != 0) {
+            error(Event::FileSaveError, "saveDump: %s: Error writing image data (out of space?)", filename.c_str());
+            return false;
+        }
+
         dprintf(DBG_MINOR,"saveDump: %s: Done.\n", filename.c_str());
-        fclose(fp);
+        if (bytes) *bytes = sizeof(header) + widthBytes*height;
+        return true;
     }
 
 }
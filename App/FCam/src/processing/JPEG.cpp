@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
 
 extern "C" {
 #include <jpeglib.h>
@@ -9,96 +12,463 @@ extern "C" {
 #include <FCam/processing/Demosaic.h>
 
 #include "../Debug.h"
+#include "Packing.h"
+#include "Parallel.h"
+#include "Save_Internal.h"
 
 using namespace std;
 
 
 namespace FCam {
-    void saveJPEG(Image im, string filename, int quality) {
-        struct jpeg_compress_struct cinfo;
-        struct jpeg_error_mgr jerr;
 
-        dprintf(DBG_MINOR, "saveJPEG: Saving JPEG to %s, quality %d\n", filename.c_str(), quality);
+    // libjpeg destination that appends to a vector
+    struct VectorDestination {
+        jpeg_destination_mgr pub;
+        std::vector<uint8_t> *out;
+    };
+
+    static void initVectorDestination(j_compress_ptr cinfo) {
+        VectorDestination *dest = (VectorDestination *)cinfo->dest;
+        dest->out->resize(65536);
+        dest->pub.next_output_byte = &(*dest->out)[0];
+        dest->pub.free_in_buffer = dest->out->size();
+    }
+
+    static boolean growVectorDestination(j_compress_ptr cinfo) {
+        // libjpeg only calls this once the buffer is completely full
+        VectorDestination *dest = (VectorDestination *)cinfo->dest;
+        size_t used = dest->out->size();
+        dest->out->resize(used*2);
+        dest->pub.next_output_byte = &(*dest->out)[used];
+        dest->pub.free_in_buffer = dest->out->size() - used;
+        return TRUE;
+    }
+
+    static void termVectorDestination(j_compress_ptr cinfo) {
+        VectorDestination *dest = (VectorDestination *)cinfo->dest;
+        dest->out->resize(dest->out->size() - dest->pub.free_in_buffer);
+    }
+
+    // Set up the compression of a width x height image of the given
+    // format, which must be RGB24, YUV24 or UYVY
+    static void setupJPEG(jpeg_compress_struct &cinfo, int width, int height,
+                          ImageFormat type, int quality) {
+        cinfo.image_width = width;
+        cinfo.image_height = height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = type == RGB24 ? JCS_RGB : JCS_YCbCr;
+
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, TRUE);
+
+        if (type == UYVY) {
+            // UYVY is already 4:2:2 YCbCr, so hand libjpeg its planes
+            // directly rather than have it color convert and
+            // downsample
+            cinfo.raw_data_in = TRUE;
+            cinfo.comp_info[0].h_samp_factor = 2;
+            cinfo.comp_info[0].v_samp_factor = 1;
+            for (int c = 1; c < 3; c++) {
+                cinfo.comp_info[c].h_samp_factor = 1;
+                cinfo.comp_info[c].v_samp_factor = 1;
+            }
+        }
+    }
+
+    // The number of rows in a row of MCUs, which bands of a
+    // parallel compression must be a multiple of
+    static int mcuRows(const jpeg_compress_struct &cinfo) {
+        int v = 1;
+        for (int c = 0; c < cinfo.num_components; c++) {
+            if (cinfo.comp_info[c].v_samp_factor > v) v = cinfo.comp_info[c].v_samp_factor;
+        }
+        return v * DCTSIZE;
+    }
+
+    // The number of MCUs across a row of an image
+    static int mcuColumns(const jpeg_compress_struct &cinfo) {
+        int h = 1;
+        for (int c = 0; c < cinfo.num_components; c++) {
+            if (cinfo.comp_info[c].h_samp_factor > h) h = cinfo.comp_info[c].h_samp_factor;
+        }
+        return (cinfo.image_width + h * DCTSIZE - 1) / (h * DCTSIZE);
+    }
+
+    // Feed all of im to a started compression
+    static void writeRows(jpeg_compress_struct &cinfo, Image im) {
+        if (im.type() != UYVY) {
+            while (cinfo.next_scanline < cinfo.image_height) {
+                JSAMPLE *row = im(0, cinfo.next_scanline);
+                jpeg_write_scanlines(&cinfo, &row, 1);
+            }
+            return;
+        }
 
+        // Raw data goes in a row of MCUs at a time, padded out to
+        // whole blocks by repeating the last column and row
+        int pairs = im.width()/2;
+        int yWidth = (im.width() + 15) & ~15;
+        int cWidth = yWidth/2;
+        std::vector<JSAMPLE> planes(DCTSIZE * (yWidth + 2*cWidth));
+        JSAMPROW yRows[DCTSIZE], uRows[DCTSIZE], vRows[DCTSIZE];
+        for (int r = 0; r < DCTSIZE; r++) {
+            yRows[r] = &planes[r * yWidth];
+            uRows[r] = &planes[DCTSIZE * yWidth + r * cWidth];
+            vRows[r] = &planes[DCTSIZE * (yWidth + cWidth) + r * cWidth];
+        }
+        JSAMPARRAY rows[3] = {yRows, uRows, vRows};
+
+        while (cinfo.next_scanline < cinfo.image_height) {
+            for (int r = 0; r < DCTSIZE; r++) {
+                unsigned y = cinfo.next_scanline + r;
+                if (y >= im.height()) y = im.height() - 1;
+                splitUYVY(im(0, y), yRows[r], uRows[r], vRows[r], pairs);
+                for (int x = 2*pairs; x < yWidth; x++) yRows[r][x] = yRows[r][2*pairs-1];
+                for (int x = pairs; x < cWidth; x++) {
+                    uRows[r][x] = uRows[r][pairs-1];
+                    vRows[r][x] = vRows[r][pairs-1];
+                }
+            }
+            jpeg_write_raw_data(&cinfo, rows, DCTSIZE);
+        }
+    }
+
+    // Open a file and start compressing a width x height image of
+    // the given format to it. Returns NULL if the file can't be
+    // opened.
+    static FILE *startJPEG(jpeg_compress_struct &cinfo, jpeg_error_mgr &jerr,
+                           string filename, int width, int height,
+                           ImageFormat type, int quality) {
         FILE *f = fopen(filename.c_str(), "wb");
         if (!f) {
             error(Event::FileSaveError, "saveJPEG: %s: Cannot open file for writing", filename.c_str());
-            return;
+            return NULL;
         }
         
         cinfo.err = jpeg_std_error(&jerr);
         jpeg_create_compress(&cinfo);
         jpeg_stdio_dest(&cinfo, f);
 
-        cinfo.image_width = im.width();
-        cinfo.image_height = im.height();
-        cinfo.input_components = 3;
-        if (im.type() == RGB24) {
-            cinfo.in_color_space = JCS_RGB;  
-        } else if (im.type() == YUV24) {
-            cinfo.in_color_space = JCS_YCbCr;
+        setupJPEG(cinfo, width, height, type, quality);
+
+        jpeg_start_compress(&cinfo, TRUE);
+
+        return f;
+    }
+
+    // Close a file a JPEG was written to, checking that all of it got
+    // there. Returns whether it did, with the size of the file in
+    // *bytes unless bytes is NULL.
+    static bool closeJPEG(FILE *f, const string &filename, size_t *bytes) {
+        bool ok = fflush(f) == 0 && !ferror(f);
+        long size = ftell(f);
+        if (fclose(f) != 0) ok = false;
+        if (!ok) {
+            error(Event::FileSaveError, "saveJPEG: %s: Error writing file (out of space?)", filename.c_str());
+            return false;
         }
+        if (bytes) *bytes = size;
+        return true;
+    }
 
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, quality, TRUE);
+    static bool finishJPEG(jpeg_compress_struct &cinfo, FILE *f, const string &filename, size_t *bytes) {
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+        return closeJPEG(f, filename, bytes);
+    }
 
-        jpeg_start_compress(&cinfo, TRUE);
+    // A JPEG compressed in parallel, as horizontal bands of the same
+    // number of rows (except perhaps the last) each compressed on its
+    // own as a complete JPEG. The restart interval is the number of
+    // MCUs in a band, so the entropy coded data of each band is
+    // exactly one restart interval of the whole image. Stitching them
+    // together takes the headers of the first band, with its height
+    // changed to that of the whole image, then the data of each band
+    // in turn, separated by restart markers.
+    class BandedJPEG {
+      public:
+        // Prepare to compress a width x height image in bands of at
+        // most the given height, which is rounded up to whole rows of
+        // MCUs, or down if the restart interval wouldn't fit in 16
+        // bits
+        BandedJPEG(int width, int height, ImageFormat type, int quality, int rows) :
+            width(width), height(height), type(type), quality(quality), bandsWritten(0) {
+            struct jpeg_compress_struct cinfo;
+            struct jpeg_error_mgr jerr;
+            cinfo.err = jpeg_std_error(&jerr);
+            jpeg_create_compress(&cinfo);
+            setupJPEG(cinfo, width, height, type, quality);
 
-        if (im.type() == RGB24 || im.type() == YUV24) {
-            while (cinfo.next_scanline < cinfo.image_height) {
-                JSAMPLE *row = im(0, cinfo.next_scanline);
-                jpeg_write_scanlines(&cinfo, &row, 1);
+            int mcuHeight = mcuRows(cinfo);
+            int columns = mcuColumns(cinfo);
+            int mcus = (rows + mcuHeight - 1) / mcuHeight;
+            if (mcus * columns > 65535) mcus = 65535 / columns;
+            if (mcus < 1) mcus = 1;
+            bandHeight = mcus * mcuHeight;
+            restartInterval = mcus * columns;
+
+            jpeg_destroy_compress(&cinfo);
+        }
+
+        int bandHeight;
+
+        // Compress one band, which must be bandHeight rows except at
+        // the bottom of the image. Safe to call from several threads
+        // at once.
+        void compress(Image band, std::vector<uint8_t> *out) const {
+            struct jpeg_compress_struct cinfo;
+            struct jpeg_error_mgr jerr;
+            VectorDestination dest;
+
+            cinfo.err = jpeg_std_error(&jerr);
+            jpeg_create_compress(&cinfo);
+            dest.pub.init_destination = initVectorDestination;
+            dest.pub.empty_output_buffer = growVectorDestination;
+            dest.pub.term_destination = termVectorDestination;
+            dest.out = out;
+            cinfo.dest = &dest.pub;
+
+            setupJPEG(cinfo, width, band.height(), type, quality);
+            // Every band must use the same, standard, Huffman tables
+            cinfo.optimize_coding = FALSE;
+            cinfo.restart_interval = restartInterval;
+
+            jpeg_start_compress(&cinfo, TRUE);
+            writeRows(cinfo, band);
+            jpeg_finish_compress(&cinfo);
+            jpeg_destroy_compress(&cinfo);
+        }
+
+        // Append the next band, as compressed by compress, to a file.
+        // Returns false if the data isn't what libjpeg should have
+        // written.
+        bool write(const std::vector<uint8_t> &band, FILE *f) {
+            size_t size = band.size();
+            if (size < 4 || band[size-2] != 0xff || band[size-1] != M_EOI) return false;
+            size -= 2;
+
+            if (bandsWritten == 0) {
+                // Keep everything but the end of image marker, with
+                // the height in the frame header corrected
+                std::vector<uint8_t> headers(band.begin(), band.begin() + size);
+                size_t sof;
+                if (!findMarker(headers, M_SOF0, M_SOF2, &sof) || sof + 7 > size) return false;
+                headers[sof + 5] = (uint8_t)(height >> 8);
+                headers[sof + 6] = (uint8_t)(height & 0xff);
+                fwrite(&headers[0], 1, size, f);
+            } else {
+                size_t sos;
+                if (!findMarker(band, M_SOS, M_SOS, &sos) || sos + 4 > size) return false;
+                size_t data = sos + 2 + ((band[sos+2] << 8) | band[sos+3]);
+                if (data > size) return false;
+                uint8_t restart[2] = {0xff, (uint8_t)(M_RST0 + ((bandsWritten - 1) & 7))};
+                fwrite(restart, 1, 2, f);
+                fwrite(&band[data], 1, size - data, f);
             }
-        } else if (im.type() == UYVY) {
-            std::vector<JSAMPLE> row(cinfo.image_width*3);
-            while (cinfo.next_scanline < cinfo.image_height) {
-                // convert the row to YUV
-                JSAMPLE *rowPtr = &row[0];
-                unsigned char *dataPtr = im(0, cinfo.next_scanline);
-                for (size_t i = 0; i < cinfo.image_width/2; i++) {
-                    rowPtr[0] = dataPtr[1];
-                    rowPtr[1] = dataPtr[0];
-                    rowPtr[2] = dataPtr[2];
-                    rowPtr[3] = dataPtr[3];
-                    rowPtr[4] = dataPtr[0];
-                    rowPtr[5] = dataPtr[2];
-                    rowPtr += 6;
-                    dataPtr += 4;
+            bandsWritten++;
+            return true;
+        }
+
+        void finish(FILE *f) {
+            uint8_t eoi[2] = {0xff, M_EOI};
+            fwrite(eoi, 1, 2, f);
+        }
+
+      private:
+        int width, height;
+        ImageFormat type;
+        int quality;
+        int restartInterval;
+        int bandsWritten;
+
+        // libjpeg's marker codes
+        enum {M_SOF0 = 0xc0, M_SOF2 = 0xc2, M_RST0 = 0xd0, M_EOI = 0xd9, M_SOS = 0xda};
+
+        // Find the first marker segment in the headers of a JPEG with
+        // a code from first to last, walking the segments from the
+        // start of image marker
+        static bool findMarker(const std::vector<uint8_t> &jpeg, int first, int last, size_t *at) {
+            size_t i = 2;
+            while (i + 4 <= jpeg.size() && jpeg[i] == 0xff) {
+                int code = jpeg[i+1];
+                if (code >= first && code <= last) {
+                    *at = i;
+                    return true;
                 }
-                rowPtr = &row[0];
-                jpeg_write_scanlines(&cinfo, &rowPtr, 1);
+                if (code == M_SOS) return false;
+                i += 2 + ((jpeg[i+2] << 8) | jpeg[i+3]);
             }
+            return false;
         }
+    };
 
-        jpeg_finish_compress(&cinfo);
-        fclose(f);
-        jpeg_destroy_compress(&cinfo);
+    struct BandJobs {
+        const BandedJPEG *jpeg;
+        std::vector<Image> bands;
+        std::vector<std::vector<uint8_t> > outputs;
+    };
+
+    static void compressBand(void *context, int i) {
+        BandJobs *jobs = (BandJobs *)context;
+        jobs->jpeg->compress(jobs->bands[i], &jobs->outputs[i]);
+    }
+
+    // Compress a set of consecutive bands in parallel, and append
+    // them to a file
+    static bool compressBands(BandedJPEG &jpeg, Image im, int threads, FILE *f) {
+        BandJobs jobs;
+        jobs.jpeg = &jpeg;
+        // Images are made here rather than in the jobs, so that their
+        // reference counts are only touched by this thread
+        for (unsigned y = 0; y < im.height(); y += jpeg.bandHeight) {
+            jobs.bands.push_back(im.subImage(0, y, Size(im.width(), jpeg.bandHeight)));
+        }
+        jobs.outputs.resize(jobs.bands.size());
+        parallelFor(jobs.bands.size(), threads, compressBand, &jobs);
+        for (size_t i = 0; i < jobs.outputs.size(); i++) {
+            if (!jpeg.write(jobs.outputs[i], f)) return false;
+        }
+        return true;
+    }
+
+    bool writeJPEG(Image im, const string &filename, int quality, int threads, size_t *bytes) {
+        dprintf(DBG_MINOR, "saveJPEG: Saving JPEG to %s, quality %d\n", filename.c_str(), quality);
+
+        if (im.type() != RGB24 && im.type() != YUV24 && im.type() != UYVY) {
+            error(Event::FileSaveError, "saveJPEG: %s: Unsupported image format", filename.c_str());
+            return false;
+        }
+
+        threads = parallelThreads(threads);
+        if (threads > 1) {
+            BandedJPEG jpeg(im.width(), im.height(), im.type(), quality,
+                            (im.height() + threads - 1) / threads);
+            FILE *f = fopen(filename.c_str(), "wb");
+            if (!f) {
+                error(Event::FileSaveError, "saveJPEG: %s: Cannot open file for writing", filename.c_str());
+                return false;
+            }
+            bool ok = compressBands(jpeg, im, threads, f);
+            if (!ok) {
+                fclose(f);
+                error(Event::InternalError, "saveJPEG: %s: Unexpected output from libjpeg", filename.c_str());
+                return false;
+            }
+            jpeg.finish(f);
+            if (!closeJPEG(f, filename, bytes)) return false;
+        } else {
+            struct jpeg_compress_struct cinfo;
+            struct jpeg_error_mgr jerr;
+
+            FILE *f = startJPEG(cinfo, jerr, filename, im.width(), im.height(), im.type(), quality);
+            if (!f) return false;
+            writeRows(cinfo, im);
+            if (!finishJPEG(cinfo, f, filename, bytes)) return false;
+        }
+
+        dprintf(DBG_MINOR, "saveJPEG: Done saving JPEG to %s\n", filename.c_str());
+        return true;
+    }
+
+    void saveJPEG(Image im, string filename, int quality, int threads) {
+        writeJPEG(im, filename, quality, threads, NULL);
+    }
+
+    // Demosaic a RAW frame a strip at a time, compressing each strip
+    // as it's produced, so the full RGB24 image is never needed. With
+    // more than one thread, each strip is demosaicked in parallel and
+    // then compressed as one band per thread.
+    static bool saveJPEGRAW(Frame frame, const string &filename, int quality, int threads, size_t *bytes) {
+        threads = parallelThreads(threads);
+
+        DemosaicOptions options;
+        options.threads = threads;
+        // Strips are a band of 192 rows for each thread, which is a
+        // whole number of rows of MCUs, and keeps the strips small.
+        // Frames shorter than that make a single strip, split evenly
+        // between the threads.
+        int bandRows = 192;
+        if (threads > 1) {
+            bandRows = std::min(bandRows, ((int)frame.image().height() + threads - 1) / threads);
+        }
+        DemosaicStream stream(frame, options, threads > 1 ? threads * bandRows : 0);
+        if (!stream.valid()) {
+            error(Event::FileSaveError, frame, "saveJPEG: %s: Cannot demosaic RAW image to save as JPEG.", filename.c_str());
+            return false;
+        }
+
+        dprintf(DBG_MINOR, "saveJPEG: Saving JPEG to %s, quality %d\n", filename.c_str(), quality);
+
+        Image strip(stream.size().width, stream.stripHeight(), RGB24);
+
+        if (threads > 1) {
+            BandedJPEG jpeg(stream.size().width, stream.size().height, RGB24, quality, bandRows);
+            if (stream.stripHeight() % jpeg.bandHeight &&
+                stream.stripHeight() < stream.size().height) {
+                // Bands would straddle strips. Only possible for a
+                // very wide image, which needs shorter bands to fit
+                // the restart interval; fall back to compressing on
+                // one thread
+                return saveJPEGRAW(frame, filename, quality, 1, bytes);
+            }
+            FILE *f = fopen(filename.c_str(), "wb");
+            if (!f) {
+                error(Event::FileSaveError, "saveJPEG: %s: Cannot open file for writing", filename.c_str());
+                return false;
+            }
+            bool ok = true;
+            while (int rows = stream.next(strip)) {
+                if (ok) ok = compressBands(jpeg, strip.subImage(0, 0, Size(strip.width(), rows)), threads, f);
+            }
+            if (!ok) {
+                fclose(f);
+                error(Event::InternalError, "saveJPEG: %s: Unexpected output from libjpeg", filename.c_str());
+                return false;
+            }
+            jpeg.finish(f);
+            if (!closeJPEG(f, filename, bytes)) return false;
+        } else {
+            struct jpeg_compress_struct cinfo;
+            struct jpeg_error_mgr jerr;
+
+            FILE *f = startJPEG(cinfo, jerr, filename, stream.size().width, stream.size().height, 
+                                RGB24, quality);
+            if (!f) return false;
+
+            while (int rows = stream.next(strip)) {
+                for (int y = 0; y < rows; y++) {
+                    JSAMPLE *row = strip(0, y);
+                    jpeg_write_scanlines(&cinfo, &row, 1);
+                }
+            }
+
+            if (!finishJPEG(cinfo, f, filename, bytes)) return false;
+        }
 
         dprintf(DBG_MINOR, "saveJPEG: Done saving JPEG to %s\n", filename.c_str());
+        return true;
     }
 
-    void saveJPEG(Frame frame, string filename, int quality) {
+    bool writeJPEG(Frame frame, const string &filename, int quality, int threads, size_t *bytes) {
         if (!frame.image().valid()) {
             error(Event::FileSaveError, frame, "saveJPEG: %s: No valid image in frame to save.", filename.c_str());
-            return;
+            return false;
         }
 
         Image im = frame.image();
         
         switch (im.type()) {
         case RAW:
-            im = demosaic(frame);
-            if (!im.valid()) {
-                error(Event::FileSaveError, frame, "saveJPEG: %s: Cannot demosaic RAW image to save as JPEG.", filename.c_str());
-                return;
-            }
-            // fall through to rgb24
+            return saveJPEGRAW(frame, filename, quality, threads, bytes);
         case RGB24: case YUV24: case UYVY:
-            saveJPEG(im, filename, quality);
-            break;
+            return writeJPEG(im, filename, quality, threads, bytes);
         default:
             error(Event::FileSaveError, frame, "saveJPEG: %s: Unsupported image format", filename.c_str());
-            break;
+            return false;
         }
     }
+
+    void saveJPEG(Frame frame, string filename, int quality, int threads) {
+        writeJPEG(frame, filename, quality, threads, NULL);
+    }
 };
@@ -0,0 +1,541 @@
+#include <string.h>
+#include <algorithm>
+
+#include "LosslessJPEG.h"
+
+namespace FCam {
+
+    // Marker codes
+    static const uint8_t MARKER_SOI = 0xD8;
+    static const uint8_t MARKER_EOI = 0xD9;
+    static const uint8_t MARKER_SOF3 = 0xC3;
+    static const uint8_t MARKER_DHT = 0xC4;
+    static const uint8_t MARKER_SOS = 0xDA;
+    static const uint8_t MARKER_DRI = 0xDD;
+    static const uint8_t MARKER_RST0 = 0xD0;
+
+    // Differences fall in one of 17 categories, by bit length
+    static const int CATEGORIES = 17;
+
+    inline int bitLength(unsigned v) {return v ? 32 - __builtin_clz(v) : 0;}
+
+    // The category of a difference, which is taken modulo 2^16
+    inline int category(int diff) {
+        if (diff == -32768) return 16;
+        return bitLength(diff < 0 ? -diff : diff);
+    }
+
+namespace {
+
+    //
+    // Encoding
+    //
+
+    // Huffman code lengths and symbols, in the form of a DHT segment
+    struct HuffmanSpec {
+        uint8_t bits[17]; // bits[l] is the number of codes of length l
+        uint8_t vals[CATEGORIES];
+        int count;
+    };
+
+    // Make a length limited optimal Huffman code for the given
+    // symbol frequencies, as in Annex K.2 of the JPEG
+    // specification. A reserved symbol keeps any code from being
+    // all ones.
+    void makeHuffmanSpec(const uint32_t *counts, HuffmanSpec *spec) {
+        const int RESERVED = CATEGORIES;
+        const int MAX_LENGTH = 32;
+        uint32_t freq[CATEGORIES+1];
+        int codeSize[CATEGORIES+1];
+        int others[CATEGORIES+1];
+        for (int i = 0; i < CATEGORIES; i++) freq[i] = counts[i];
+        freq[RESERVED] = 1;
+        for (int i = 0; i <= CATEGORIES; i++) {
+            codeSize[i] = 0;
+            others[i] = -1;
+        }
+
+        // Repeatedly merge the two least frequent trees
+        while (true) {
+            int c1 = -1, c2 = -1;
+            for (int i = 0; i <= CATEGORIES; i++) {
+                if (freq[i] && (c1 < 0 || freq[i] <= freq[c1])) c1 = i;
+            }
+            for (int i = 0; i <= CATEGORIES; i++) {
+                if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2])) c2 = i;
+            }
+            if (c2 < 0) break;
+
+            freq[c1] += freq[c2];
+            freq[c2] = 0;
+            codeSize[c1]++;
+            while (others[c1] >= 0) {
+                c1 = others[c1];
+                codeSize[c1]++;
+            }
+            others[c1] = c2;
+            codeSize[c2]++;
+            while (others[c2] >= 0) {
+                c2 = others[c2];
+                codeSize[c2]++;
+            }
+        }
+
+        int bits[MAX_LENGTH+1];
+        memset(bits, 0, sizeof(bits));
+        for (int i = 0; i <= CATEGORIES; i++) {
+            if (codeSize[i]) bits[codeSize[i]]++;
+        }
+
+        // Shorten codes longer than 16 bits
+        for (int i = MAX_LENGTH; i > 16; i--) {
+            while (bits[i] > 0) {
+                int j = i - 2;
+                while (bits[j] == 0) j--;
+                bits[i] -= 2;
+                bits[i-1]++;
+                bits[j+1] += 2;
+                bits[j]--;
+            }
+        }
+
+        // Drop the reserved symbol, which has the longest code
+        int longest = 16;
+        while (bits[longest] == 0) longest--;
+        bits[longest]--;
+
+        spec->bits[0] = 0;
+        for (int l = 1; l <= 16; l++) spec->bits[l] = bits[l];
+        spec->count = 0;
+        for (int l = 1; l <= MAX_LENGTH; l++) {
+            for (int i = 0; i < CATEGORIES; i++) {
+                if (codeSize[i] == l) spec->vals[spec->count++] = i;
+            }
+        }
+    }
+
+    // Writes bits most significant first, stuffing a zero byte after
+    // each 0xFF. Bytes collect in a buffer until flushed.
+    class BitWriter {
+    public:
+        BitWriter(uint8_t *buffer): buffer(buffer), dst(buffer), acc(0), bits(0) {}
+
+        void put(uint32_t code, int length) {
+            acc = (acc << length) | code;
+            bits += length;
+            while (bits >= 8) {
+                bits -= 8;
+                uint8_t byte = acc >> bits;
+                *dst++ = byte;
+                if (byte == 0xFF) *dst++ = 0;
+            }
+        }
+
+        // Append the completed bytes to out, and empty the buffer
+        void flush(std::vector<uint8_t> *out) {
+            out->insert(out->end(), buffer, dst);
+            dst = buffer;
+        }
+
+        // Pad the last byte with ones, and flush
+        void finish(std::vector<uint8_t> *out) {
+            if (bits) put((1 << (8 - bits)) - 1, 8 - bits);
+            flush(out);
+        }
+
+    private:
+        uint8_t *buffer, *dst;
+        uint64_t acc;
+        int bits;
+    };
+
+    // The differences between a row of samples and their predictions
+    // by the left neighbour of the same component, or the sample
+    // above for the first of each component. The first row is
+    // predicted from the middle of the range instead.
+    void predictRow(const uint16_t *row, const uint16_t *above, int width, int components,
+                    int initial, int16_t *diff) {
+        for (int c = 0; c < components; c++) {
+            diff[c] = (int16_t)(row[c] - (above ? above[c] : initial));
+        }
+        for (int x = components; x < width; x++) {
+            diff[x] = (int16_t)(row[x] - row[x - components]);
+        }
+    }
+
+    void putShort(std::vector<uint8_t> *out, int v) {
+        out->push_back(v >> 8);
+        out->push_back(v & 0xFF);
+    }
+
+    void putMarker(std::vector<uint8_t> *out, uint8_t marker) {
+        out->push_back(0xFF);
+        out->push_back(marker);
+    }
+
+    //
+    // Decoding
+    //
+
+    // A Huffman table for decoding, with a lookup table for short
+    // codes and the canonical code ranges for the rest
+    struct HuffmanTable {
+        static const int LOOKUP_BITS = 10;
+
+        bool defined;
+        // Code length in the high byte, symbol in the low byte. Zero
+        // if the code is longer than LOOKUP_BITS
+        uint16_t lookup[1 << LOOKUP_BITS];
+        int maxCode[18]; // Largest code of each length, or -1
+        int offset[17];  // Index in vals of the first code of each length, minus the code
+        uint8_t vals[256];
+
+        HuffmanTable(): defined(false) {}
+
+        bool build(const uint8_t *bits, const uint8_t *symbols, int count) {
+            memcpy(vals, symbols, count);
+            memset(lookup, 0, sizeof(lookup));
+            int code = 0, k = 0;
+            for (int l = 1; l <= 16; l++) {
+                offset[l] = k - code;
+                for (int i = 0; i < bits[l]; i++, k++, code++) {
+                    if (vals[k] >= CATEGORIES) return false;
+                    if (l <= LOOKUP_BITS) {
+                        int shift = LOOKUP_BITS - l;
+                        for (int j = 0; j < (1 << shift); j++) {
+                            lookup[(code << shift) | j] = (l << 8) | vals[k];
+                        }
+                    }
+                }
+                maxCode[l] = bits[l] ? code - 1 : -1;
+                if (code > (1 << l)) return false;
+                code <<= 1;
+            }
+            maxCode[17] = 0x7fffffff;
+            defined = true;
+            return true;
+        }
+    };
+
+    // Reads bits most significant first, removing stuffed zero
+    // bytes. At a marker, it stops consuming input and supplies
+    // zeros instead.
+    class BitReader {
+    public:
+        BitReader(const uint8_t *p, const uint8_t *end): p(p), end(end), acc(0), bits(0) {}
+
+        // Make sure at least 32 bits are available
+        void fill() {
+            while (bits <= 56) {
+                uint64_t byte = 0;
+                if (p < end && *p != 0xFF) {
+                    byte = *p++;
+                } else if (p + 1 < end && p[1] == 0) {
+                    byte = 0xFF;
+                    p += 2;
+                }
+                acc |= byte << (56 - bits);
+                bits += 8;
+            }
+        }
+
+        uint32_t peek(int n) const {return (uint32_t)(acc >> (64 - n));}
+        void skip(int n) {acc <<= n; bits -= n;}
+
+        // Move past the next marker, which should be the restart
+        // marker expected. Discards any bits left in the current
+        // byte.
+        bool restart(int expected) {
+            acc = 0;
+            bits = 0;
+            while (p < end && *p != 0xFF) p++;
+            while (p < end && *p == 0xFF) p++;
+            if (p >= end || *p != expected) return false;
+            p++;
+            return true;
+        }
+
+        int decode(const HuffmanTable &table) {
+            fill();
+            int s;
+            uint16_t entry = table.lookup[peek(HuffmanTable::LOOKUP_BITS)];
+            if (entry) {
+                skip(entry >> 8);
+                s = entry & 0xFF;
+            } else {
+                int l = HuffmanTable::LOOKUP_BITS + 1;
+                while ((int)peek(l) > table.maxCode[l]) l++;
+                if (l > 16) return INVALID;
+                s = table.vals[table.offset[l] + peek(l)];
+                skip(l);
+            }
+            if (s == 0) return 0;
+            if (s == 16) return 32768;
+            int v = peek(s);
+            skip(s);
+            if (v < (1 << (s - 1))) v -= (1 << s) - 1;
+            return v;
+        }
+
+        static const int INVALID = 0x7fffffff;
+
+    private:
+        const uint8_t *p, *end;
+        uint64_t acc;
+        int bits;
+    };
+
+    inline int predict(int predictor, int a, int b, int c) {
+        switch (predictor) {
+        case 1: return a;
+        case 2: return b;
+        case 3: return c;
+        case 4: return a + b - c;
+        case 5: return a + ((b - c) >> 1);
+        case 6: return b + ((a - c) >> 1);
+        default: return (a + b) >> 1;
+        }
+    }
+
+    int getShort(const uint8_t *p) {return (p[0] << 8) | p[1];}
+
+}
+
+    void encodeLosslessJPEG(const uint16_t *in, int stride, int width, int height,
+                            std::vector<uint8_t> *out) {
+        int components = (width % 2 == 0) ? 2 : 1;
+
+        uint16_t largest = 0;
+        for (int y = 0; y < height; y++) {
+            const uint16_t *row = in + y * stride;
+            for (int x = 0; x < width; x++) {
+                largest = row[x] > largest ? row[x] : largest;
+            }
+        }
+        int precision = bitLength(largest);
+        if (precision < 2) precision = 2;
+        int initial = 1 << (precision - 1);
+
+        // Gather statistics for the Huffman table
+        std::vector<int16_t> diff(width);
+        uint32_t counts[CATEGORIES];
+        memset(counts, 0, sizeof(counts));
+        for (int y = 0; y < height; y++) {
+            const uint16_t *row = in + y * stride;
+            predictRow(row, y ? row - stride : NULL, width, components, initial, &diff[0]);
+            for (int x = 0; x < width; x++) {
+                counts[category(diff[x])]++;
+            }
+        }
+
+        HuffmanSpec spec;
+        makeHuffmanSpec(counts, &spec);
+        uint32_t codes[CATEGORIES];
+        int lengths[CATEGORIES];
+        memset(lengths, 0, sizeof(lengths));
+        uint32_t code = 0;
+        for (int l = 1, k = 0; l <= 16; l++) {
+            for (int i = 0; i < spec.bits[l]; i++, k++) {
+                codes[spec.vals[k]] = code++;
+                lengths[spec.vals[k]] = l;
+            }
+            code <<= 1;
+        }
+
+        // Headers
+        putMarker(out, MARKER_SOI);
+
+        putMarker(out, MARKER_DHT);
+        putShort(out, 2 + 1 + 16 + spec.count);
+        out->push_back(0x00); // DC table 0
+        out->insert(out->end(), spec.bits + 1, spec.bits + 17);
+        out->insert(out->end(), spec.vals, spec.vals + spec.count);
+
+        putMarker(out, MARKER_SOF3);
+        putShort(out, 8 + 3 * components);
+        out->push_back(precision);
+        putShort(out, height);
+        putShort(out, width / components);
+        out->push_back(components);
+        for (int c = 0; c < components; c++) {
+            out->push_back(c);
+            out->push_back(0x11); // No subsampling
+            out->push_back(0);
+        }
+
+        putMarker(out, MARKER_SOS);
+        putShort(out, 6 + 2 * components);
+        out->push_back(components);
+        for (int c = 0; c < components; c++) {
+            out->push_back(c);
+            out->push_back(0x00); // Huffman table 0
+        }
+        out->push_back(1); // Predict from the left
+        out->push_back(0);
+        out->push_back(0); // No point transform
+
+        // Entropy coded rows. Each sample takes at most 32 bits, or
+        // twice that with byte stuffing.
+        std::vector<uint8_t> buffer(width * 8 + 8);
+        BitWriter writer(&buffer[0]);
+        for (int y = 0; y < height; y++) {
+            const uint16_t *row = in + y * stride;
+            predictRow(row, y ? row - stride : NULL, width, components, initial, &diff[0]);
+            for (int x = 0; x < width; x++) {
+                int d = diff[x];
+                int s = category(d);
+                // Category 16 has no extra bits
+                int extraBits = s & 15;
+                uint32_t extra = (d < 0 ? d - 1 : d) & ((1 << extraBits) - 1);
+                writer.put((codes[s] << extraBits) | extra, lengths[s] + extraBits);
+            }
+            writer.flush(out);
+        }
+        writer.finish(out);
+
+        putMarker(out, MARKER_EOI);
+    }
+
+
+    bool decodeLosslessJPEG(const uint8_t *data, size_t size,
+                            uint16_t *out, int stride, int width, int height) {
+        const uint8_t *p = data, *end = data + size;
+
+        HuffmanTable tables[4];
+        int precision = 0, frameWidth = 0, frameHeight = 0, components = 0;
+        int componentIds[4];
+        int restartInterval = 0;
+        const uint8_t *scan = NULL;
+        int scanLength = 0;
+
+        if (size < 2 || p[0] != 0xFF || p[1] != MARKER_SOI) return false;
+        p += 2;
+
+        // Read segments up to the start of the scan
+        while (!scan) {
+            while (p < end && *p != 0xFF) p++;
+            while (p < end && *p == 0xFF) p++;
+            if (p + 3 > end) return false;
+            uint8_t marker = *p++;
+            if (marker == MARKER_EOI) return false;
+            int length = getShort(p);
+            if (length < 2 || p + length > end) return false;
+            const uint8_t *segment = p + 2, *segmentEnd = p + length;
+            p = segmentEnd;
+
+            if (marker == MARKER_SOF3) {
+                if (length < 8) return false;
+                precision = segment[0];
+                frameHeight = getShort(segment + 1);
+                frameWidth = getShort(segment + 3);
+                components = segment[5];
+                if (components < 1 || components > 4 || length != 8 + 3 * components) return false;
+                for (int c = 0; c < components; c++) {
+                    componentIds[c] = segment[6 + 3*c];
+                    // Subsampling is never used for raw data
+                    if (segment[7 + 3*c] != 0x11) return false;
+                }
+            } else if (marker >= 0xC0 && marker <= 0xCF &&
+                       marker != MARKER_DHT && marker != 0xC8 && marker != 0xCC) {
+                // Some other coding process
+                return false;
+            } else if (marker == MARKER_DHT) {
+                while (segment < segmentEnd) {
+                    if (segment + 17 > segmentEnd) return false;
+                    int index = segment[0] & 0x0F;
+                    if (index > 3) return false;
+                    int count = 0;
+                    uint8_t bits[17];
+                    bits[0] = 0;
+                    for (int l = 1; l <= 16; l++) {
+                        bits[l] = segment[l];
+                        count += bits[l];
+                    }
+                    if (count > 256 || segment + 17 + count > segmentEnd) return false;
+                    if (!tables[index].build(bits, segment + 17, count)) return false;
+                    segment += 17 + count;
+                }
+            } else if (marker == MARKER_DRI) {
+                if (length != 4) return false;
+                restartInterval = getShort(segment);
+            } else if (marker == MARKER_SOS) {
+                scan = segment;
+                scanLength = length - 2;
+            }
+        }
+
+        if (!components) return false;
+        if (precision < 2 || precision > 16) return false;
+        if ((long)frameWidth * frameHeight * components != (long)width * height) return false;
+
+        // The scan must cover all the components, in one pass
+        if (scanLength < 1 || scan[0] != components || scanLength != 4 + 2 * components) return false;
+        const HuffmanTable *componentTables[4];
+        for (int c = 0; c < components; c++) {
+            if (scan[1 + 2*c] != componentIds[c]) return false;
+            // The selector must name a table that a DHT defined
+            int selector = scan[2 + 2*c] >> 4;
+            if (selector > 3 || !tables[selector].defined) return false;
+            componentTables[c] = &tables[selector];
+        }
+        int predictor = scan[1 + 2*components];
+        int pointTransform = scan[3 + 2*components] & 0x0F;
+        if (predictor < 1 || predictor > 7 || pointTransform >= precision) return false;
+
+        // Restarts reset prediction as if starting the frame again,
+        // which only makes sense at the start of a row
+        int rowsPerRestart = frameHeight;
+        if (restartInterval) {
+            if (restartInterval % frameWidth) return false;
+            rowsPerRestart = restartInterval / frameWidth;
+        }
+
+        int rowSamples = frameWidth * components;
+        std::vector<uint16_t> rows(2 * rowSamples);
+        uint16_t *above = &rows[0], *row = &rows[rowSamples];
+        int initial = 1 << (precision - pointTransform - 1);
+        int mask = 0xFFFF;
+
+        BitReader reader(p, end);
+        int restart = 0;
+        long sample = 0;
+        for (int y = 0; y < frameHeight; y++) {
+            bool first = y % rowsPerRestart == 0;
+            if (first && y) {
+                if (!reader.restart(MARKER_RST0 + (restart & 7))) return false;
+                restart++;
+            }
+            for (int x = 0; x < frameWidth; x++) {
+                for (int c = 0; c < components; c++) {
+                    int i = x * components + c;
+                    int predicted;
+                    if (x == 0) {
+                        predicted = first ? initial : above[c];
+                    } else if (first) {
+                        predicted = row[i - components];
+                    } else {
+                        predicted = predict(predictor, row[i - components], above[i],
+                                            above[i - components]);
+                    }
+                    int diff = reader.decode(*componentTables[c]);
+                    if (diff == BitReader::INVALID) return false;
+                    row[i] = (predicted + diff) & mask;
+                }
+            }
+
+            // Hand the row out to the block in raster order
+            if (rowSamples == width) {
+                uint16_t *dst = out + y * stride;
+                for (int i = 0; i < rowSamples; i++) dst[i] = row[i] << pointTransform;
+            } else {
+                for (int i = 0; i < rowSamples; i++, sample++) {
+                    out[(sample / width) * stride + sample % width] = row[i] << pointTransform;
+                }
+            }
+            std::swap(above, row);
+        }
+
+        return true;
+    }
+
+}
@@ -0,0 +1,34 @@
+#ifndef FCAM_LOSSLESS_JPEG_H
+#define FCAM_LOSSLESS_JPEG_H
+
+// Lossless JPEG (ITU T.81 process 14, SOF3), as used by DNG for
+// compressed RAW data (TIFF Compression = 7).
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace FCam {
+
+    // Compress a block of 16-bit samples into a single lossless JPEG
+    // stream, appended to out. Rows are stride samples apart. As DNG
+    // writers do, an even width is coded as two interleaved
+    // components of half the width, so that each sample is predicted
+    // from the nearest one of the same bayer color. The precision is
+    // the smallest that holds the largest sample, and the Huffman
+    // table is optimal for the block.
+    void encodeLosslessJPEG(const uint16_t *in, int stride, int width, int height,
+                            std::vector<uint8_t> *out);
+
+    // Decompress a lossless JPEG stream of size bytes into a block of
+    // 16-bit samples, with rows stride samples apart. The decoded
+    // samples fill the block in raster order, whatever the number of
+    // components and width of the JPEG frame, which must hold exactly
+    // width x height samples. Returns false if the stream is
+    // malformed or uses an unsupported feature, such as subsampling.
+    bool decodeLosslessJPEG(const uint8_t *data, size_t size,
+                            uint16_t *out, int stride, int width, int height);
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include "Packing.h"
+#ifdef FCAM_ARCH_X86
+#include <emmintrin.h>
+#endif
+#ifdef FCAM_ARCH_ARM
+#include <arm_neon.h>
+#endif
+
+namespace FCam {
+
+#ifdef FCAM_ARCH_X86
+    static bool useSSE41() {
+        // May be called before static constructors have run
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1");
+    }
+#endif
+
+    void packRow(const uint16_t *in, uint8_t *out, int width, int bits) {
+        int x = 0;
+#ifdef FCAM_ARCH_X86
+        if (useSSE41()) x = packRow_SSE41(in, out, width, bits);
+#endif
+        // The vector code does whole groups of eight samples, which
+        // end on a byte boundary
+        out += (size_t)x * bits / 8;
+        uint16_t largest = (1 << bits) - 1;
+
+        // Whole groups of samples that fill a number of bytes
+        if (bits == 10) {
+            for (; x + 4 <= width; x += 4, out += 5) {
+                uint64_t v = 0;
+                for (int i = 0; i < 4; i++) {
+                    v = (v << 10) | (in[x+i] < largest ? in[x+i] : largest);
+                }
+                for (int i = 0; i < 5; i++) out[i] = v >> (32 - 8*i);
+            }
+        } else if (bits == 12) {
+            for (; x + 2 <= width; x += 2, out += 3) {
+                uint32_t v = ((in[x] < largest ? in[x] : largest) << 12) |
+                    (in[x+1] < largest ? in[x+1] : largest);
+                out[0] = v >> 16;
+                out[1] = v >> 8;
+                out[2] = v;
+            }
+        }
+
+        // And any left over
+        uint32_t acc = 0;
+        int count = 0;
+        for (; x < width; x++) {
+            uint16_t s = in[x] < largest ? in[x] : largest;
+            acc = (acc << bits) | s;
+            count += bits;
+            while (count >= 8) {
+                count -= 8;
+                *out++ = acc >> count;
+            }
+        }
+        if (count) *out = acc << (8 - count);
+    }
+
+    void unpackRow(const uint8_t *in, uint16_t *out, int width, int bits) {
+        int x = 0;
+#ifdef FCAM_ARCH_X86
+        if (useSSE41()) x = unpackRow_SSE41(in, out, width, bits);
+#endif
+        in += (size_t)x * bits / 8;
+        uint32_t mask = (1 << bits) - 1;
+
+        if (bits == 10) {
+            for (; x + 4 <= width; x += 4, in += 5) {
+                uint64_t v = 0;
+                for (int i = 0; i < 5; i++) v = (v << 8) | in[i];
+                for (int i = 0; i < 4; i++) out[x+i] = (v >> (30 - 10*i)) & mask;
+            }
+        } else if (bits == 12) {
+            for (; x + 2 <= width; x += 2, in += 3) {
+                uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+                out[x] = v >> 12;
+                out[x+1] = v & mask;
+            }
+        }
+
+        uint32_t acc = 0;
+        int count = 0;
+        for (; x < width; x++) {
+            while (count < bits) {
+                acc = (acc << 8) | *in++;
+                count += 8;
+            }
+            count -= bits;
+            out[x] = (acc >> count) & mask;
+        }
+    }
+
+    void swapBytes16(const uint16_t *in, uint16_t *out, size_t count) {
+        size_t i = 0;
+#ifdef FCAM_ARCH_X86
+        // SSE2 is always there, and this is limited by memory
+        // bandwidth anyway
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *)(out + i), v);
+        }
+#endif
+#ifdef FCAM_ARCH_ARM
+        for (; i + 8 <= count; i += 8) {
+            uint8x16_t v = vld1q_u8((const uint8_t *)(in + i));
+            vst1q_u8((uint8_t *)(out + i), vrev16q_u8(v));
+        }
+#endif
+        for (; i < count; i++) {
+            out[i] = (uint16_t)((in[i] << 8) | (in[i] >> 8));
+        }
+    }
+
+    void splitUYVY(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v, int pairs) {
+        int i = 0;
+#ifdef FCAM_ARCH_X86
+        // 16 pairs at a time. The even bytes of UYVY are chroma and
+        // the odd ones luma, so masking and shifting 16-bit lanes
+        // and packing them back down separates the two, and doing
+        // the same again to the chroma separates U from V.
+        const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+        for (; i + 16 <= pairs; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(in + 4*i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(in + 4*i + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(in + 4*i + 32));
+            __m128i d = _mm_loadu_si128((const __m128i *)(in + 4*i + 48));
+            _mm_storeu_si128((__m128i *)(y + 2*i),
+                             _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+            _mm_storeu_si128((__m128i *)(y + 2*i + 16),
+                             _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_srli_epi16(d, 8)));
+            __m128i uv0 = _mm_packus_epi16(_mm_and_si128(a, lowBytes), _mm_and_si128(b, lowBytes));
+            __m128i uv1 = _mm_packus_epi16(_mm_and_si128(c, lowBytes), _mm_and_si128(d, lowBytes));
+            _mm_storeu_si128((__m128i *)(u + i),
+                             _mm_packus_epi16(_mm_and_si128(uv0, lowBytes), _mm_and_si128(uv1, lowBytes)));
+            _mm_storeu_si128((__m128i *)(v + i),
+                             _mm_packus_epi16(_mm_srli_epi16(uv0, 8), _mm_srli_epi16(uv1, 8)));
+        }
+#endif
+#ifdef FCAM_ARCH_ARM
+        for (; i + 16 <= pairs; i += 16) {
+            uint8x16x4_t uyvy = vld4q_u8(in + 4*i);
+            uint8x16x2_t yy;
+            yy.val[0] = uyvy.val[1];
+            yy.val[1] = uyvy.val[3];
+            vst2q_u8(y + 2*i, yy);
+            vst1q_u8(u + i, uyvy.val[0]);
+            vst1q_u8(v + i, uyvy.val[2]);
+        }
+#endif
+        for (; i < pairs; i++) {
+            u[i] = in[4*i];
+            y[2*i] = in[4*i+1];
+            v[i] = in[4*i+2];
+            y[2*i+1] = in[4*i+3];
+        }
+    }
+
+}
@@ -0,0 +1,50 @@
+#ifndef FCAM_PACKING_H
+#define FCAM_PACKING_H
+
+// Packing RAW samples into fewer than 16 bits each, as stored in
+// TIFF/DNG files with a BitsPerSample of 10 or 12 and in packed dump
+// files. Samples are packed most significant bit first, in the order
+// the TIFF specification calls for, and each row starts on a byte
+// boundary. Also the byte swapping that 16-bit samples from
+// big-endian files need, and the splitting of UYVY pixels into the
+// separate planes that JPEG compresses.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace FCam {
+
+    // Whether samples can be packed into the given number of bits.
+    // 16 bits is allowed, and means no packing.
+    inline bool validPackedBits(int bits) {return bits == 10 || bits == 12 || bits == 16;}
+
+    // The number of bytes a packed row of width samples takes
+    inline size_t packedBytesPerRow(int width, int bits) {return ((size_t)width * bits + 7) / 8;}
+
+    // Pack a row of samples, clamping each to the largest value that
+    // fits in the given number of bits
+    void packRow(const uint16_t *in, uint8_t *out, int width, int bits);
+
+    // Unpack a row of samples
+    void unpackRow(const uint8_t *in, uint16_t *out, int width, int bits);
+
+    // Swap the bytes of count 16-bit samples, converting between
+    // byte orders. in and out may be the same.
+    void swapBytes16(const uint16_t *in, uint16_t *out, size_t count);
+
+    // Split a row of pairs UYVY pixel pairs into a plane of 2*pairs
+    // luma samples and planes of pairs U and V samples
+    void splitUYVY(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v, int pairs);
+
+#ifdef FCAM_ARCH_X86
+    // Packing and unpacking, vectorized with SSE4.1. They handle as many whole
+    // groups of eight samples as they safely can, given that the
+    // vectors read or write up to six bytes beyond the packed data
+    // of those groups, and return the number of samples done.
+    int packRow_SSE41(const uint16_t *in, uint8_t *out, int width, int bits);
+    int unpackRow_SSE41(const uint8_t *in, uint16_t *out, int width, int bits);
+#endif
+
+}
+
+#endif
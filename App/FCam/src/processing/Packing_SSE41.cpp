@@ -0,0 +1,89 @@
+#ifdef FCAM_ARCH_X86
+#include <smmintrin.h>
+#include "Packing.h"
+
+// SSE4.1 kernels for packing RAW samples. This file is compiled with
+// -msse4.1, so it must not use any inline code shared with the rest
+// of the library.
+
+namespace FCam {
+
+    // The number of whole groups of eight samples whose packed data,
+    // plus the spare bytes a 16-byte vector reaches past it, lies
+    // within a packed row
+    static int safeGroups(int width, int bits) {
+        int rowBytes = ((size_t)width * bits + 7) / 8;
+        int groupBytes = bits;
+        if (rowBytes < 16) return 0;
+        int groups = (rowBytes - 16) / groupBytes + 1;
+        return groups < width / 8 ? groups : width / 8;
+    }
+
+    int packRow_SSE41(const uint16_t *in, uint8_t *out, int width, int bits) {
+        int groups = safeGroups(width, bits);
+        if (bits == 10) {
+            const __m128i largest = _mm_set1_epi16(1023);
+            const __m128i weights = _mm_set1_epi32(1024 | (1 << 16));
+            // The five bytes of each 40-bit group of four samples,
+            // most significant first
+            const __m128i order = _mm_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8,
+                                                -1, -1, -1, -1, -1, -1);
+            for (int g = 0; g < groups; g++) {
+                __m128i s = _mm_min_epu16(_mm_loadu_si128((const __m128i *)(in + 8*g)), largest);
+                // Pairs of samples as 20-bit values
+                __m128i pairs = _mm_madd_epi16(s, weights);
+                // Pairs of pairs as 40-bit values
+                __m128i quads = _mm_or_si128(_mm_srli_epi64(_mm_slli_epi64(pairs, 44), 24),
+                                             _mm_srli_epi64(pairs, 32));
+                _mm_storeu_si128((__m128i *)(out + 10*g), _mm_shuffle_epi8(quads, order));
+            }
+        } else if (bits == 12) {
+            const __m128i largest = _mm_set1_epi16(4095);
+            const __m128i weights = _mm_set1_epi32(4096 | (1 << 16));
+            // The three bytes of each 24-bit pair of samples, most
+            // significant first
+            const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                -1, -1, -1, -1);
+            for (int g = 0; g < groups; g++) {
+                __m128i s = _mm_min_epu16(_mm_loadu_si128((const __m128i *)(in + 8*g)), largest);
+                __m128i pairs = _mm_madd_epi16(s, weights);
+                _mm_storeu_si128((__m128i *)(out + 12*g), _mm_shuffle_epi8(pairs, order));
+            }
+        } else {
+            return 0;
+        }
+        return groups * 8;
+    }
+
+    int unpackRow_SSE41(const uint8_t *in, uint16_t *out, int width, int bits) {
+        int groups = safeGroups(width, bits);
+        if (bits == 10) {
+            // Each sample starts in byte 5q + j of its group of four,
+            // 2j bits in. Gather the 16 bits from there, then shift
+            // the sample to the top and back down.
+            const __m128i gather = _mm_setr_epi8(1, 0, 2, 1, 3, 2, 4, 3,
+                                                 6, 5, 7, 6, 8, 7, 9, 8);
+            const __m128i shifts = _mm_setr_epi16(1, 4, 16, 64, 1, 4, 16, 64);
+            for (int g = 0; g < groups; g++) {
+                __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 10*g)), gather);
+                v = _mm_srli_epi16(_mm_mullo_epi16(v, shifts), 6);
+                _mm_storeu_si128((__m128i *)(out + 8*g), v);
+            }
+        } else if (bits == 12) {
+            const __m128i gather = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                                 7, 6, 8, 7, 10, 9, 11, 10);
+            const __m128i shifts = _mm_setr_epi16(1, 16, 1, 16, 1, 16, 1, 16);
+            for (int g = 0; g < groups; g++) {
+                __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 12*g)), gather);
+                v = _mm_srli_epi16(_mm_mullo_epi16(v, shifts), 4);
+                _mm_storeu_si128((__m128i *)(out + 8*g), v);
+            }
+        } else {
+            return 0;
+        }
+        return groups * 8;
+    }
+
+}
+
+#endif
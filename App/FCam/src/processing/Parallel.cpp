@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "Parallel.h"
+#include "../Debug.h"
+
+namespace FCam {
+
+    namespace {
+        struct ParallelJobs {
+            int count;
+            int next;
+            void (*job)(void *, int);
+            void *context;
+        };
+
+        void *parallelWorker(void *arg) {
+            ParallelJobs *jobs = (ParallelJobs *)arg;
+            while (1) {
+                int i = __sync_fetch_and_add(&jobs->next, 1);
+                if (i >= jobs->count) break;
+                jobs->job(jobs->context, i);
+            }
+            return NULL;
+        }
+    }
+
+    int parallelThreads(int threads) {
+        if (threads > 0) return threads;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return cpus > 0 ? (int)cpus : 1;
+    }
+
+    void parallelFor(int count, int threads, void (*job)(void *, int), void *context) {
+        ParallelJobs jobs;
+        jobs.count = count;
+        jobs.next = 0;
+        jobs.job = job;
+        jobs.context = context;
+
+        threads = parallelThreads(threads);
+        if (threads > count) threads = count;
+
+        // The calling thread is one of the workers. If we can't make
+        // the others, it just ends up doing more of the work.
+        pthread_t *workers = new pthread_t[threads > 1 ? threads-1 : 1];
+        int started = 0;
+        for (int i = 0; i < threads-1; i++) {
+            if (pthread_create(&workers[started], NULL, parallelWorker, &jobs) != 0) {
+                dprintf(DBG_WARN, "parallelFor: Unable to create worker thread %d\n", i);
+                break;
+            }
+            started++;
+        }
+
+        parallelWorker(&jobs);
+
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        delete[] workers;
+    }
+
+}
@@ -0,0 +1,22 @@
+#ifndef FCAM_PARALLEL_H
+#define FCAM_PARALLEL_H
+
+// Helpers for spreading independent pieces of post-processing work
+// across several threads.
+
+namespace FCam {
+
+    // The number of threads to use for a requested thread count. Zero
+    // or less means one per online CPU.
+    int parallelThreads(int threads);
+
+    // Call job(context, i) once for each i in [0, count), spread over
+    // up to the given number of threads, including the calling
+    // thread. Jobs are handed out in increasing order of i, but may
+    // run concurrently and finish in any order. Returns once all of
+    // them are done.
+    void parallelFor(int count, int threads, void (*job)(void *context, int i), void *context);
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef FCAM_SAVE_INTERNAL_H
+#define FCAM_SAVE_INTERNAL_H
+
+#include <stddef.h>
+#include <string>
+
+// The file writers behind saveDNG, saveJPEG and saveDump. Like those,
+// they report problems through the event queue, but they also return
+// whether the whole file was written, and if so put its size in
+// *bytes unless bytes is NULL. The AsyncFileWriter uses them to tell its callers how each
+// save went.
+
+namespace FCam {
+
+    class Frame;
+    class Image;
+    struct DNGOptions;
+
+    bool writeDNG(Frame frame, const std::string &filename, const DNGOptions &options, size_t *bytes);
+
+    bool writeJPEG(Frame frame, const std::string &filename, int quality, int threads, size_t *bytes);
+    bool writeJPEG(Image im, const std::string &filename, int quality, int threads, size_t *bytes);
+
+    bool writeDump(Frame frame, const std::string &filename, int bitsPerSample, size_t *bytes);
+    bool writeDump(Image im, const std::string &filename, int bitsPerSample, size_t *bytes);
+
+}
+
+#endif
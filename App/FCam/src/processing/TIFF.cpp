@@ -1,12 +1,287 @@
 #include <sstream>
 #include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdlib.h>
 #include "string.h"
 
 #include "TIFF.h"
+#include "LosslessJPEG.h"
+#include "Packing.h"
+#include "Parallel.h"
 #include "../Debug.h"
 
 namespace FCam {
 
+    // The part of a rectangle that lies within an image of the given
+    // size
+    static Rect clip(Rect r, Size size) {
+        int x0 = std::max(r.x, 0), y0 = std::max(r.y, 0);
+        int x1 = std::min(r.x + r.width, (int)size.width);
+        int y1 = std::min(r.y + r.height, (int)size.height);
+        return Rect(x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0));
+    }
+
+    // Strip offsets and sizes are stored as a single value when there
+    // is only one strip
+    static std::vector<int> intArray(const TagValue &val) {
+        if (val.type == TagValue::Int) return std::vector<int>(1, (int)val);
+        return val;
+    }
+
+// Gathered writes and preallocation need glibc 2.10 or newer
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 10))
+#define FCAM_TIFF_PWRITEV
+#endif
+
+//
+// Methods for TiffWriter
+//
+
+    TiffWriter::TiffWriter(): size(0) {
+    }
+
+    uint32_t TiffWriter::offset() const {
+        return size;
+    }
+
+    const uint8_t *TiffWriter::base(const Piece &piece) const {
+        return piece.data ? piece.data : &buffer[piece.bufferOffset];
+    }
+
+    void TiffWriter::append(const uint8_t *data, size_t bytes) {
+        if (bytes == 0) return;
+        // Contiguous rows of an image make one piece
+        if (!pieces.empty() && pieces.back().data &&
+            pieces.back().data + pieces.back().bytes == data) {
+            pieces.back().bytes += bytes;
+        } else {
+            Piece piece;
+            piece.offset = size;
+            piece.bytes = bytes;
+            piece.data = data;
+            piece.bufferOffset = 0;
+            pieces.push_back(piece);
+        }
+        size += bytes;
+    }
+
+    size_t TiffWriter::write(const void *data, size_t elementSize, size_t count) {
+        size_t bytes = elementSize * count;
+        if (bytes == 0) return count;
+        if (pieces.empty() || pieces.back().data) {
+            Piece piece;
+            piece.offset = size;
+            piece.bytes = 0;
+            piece.data = NULL;
+            piece.bufferOffset = buffer.size();
+            pieces.push_back(piece);
+        }
+        const uint8_t *src = (const uint8_t *)data;
+        buffer.insert(buffer.end(), src, src + bytes);
+        pieces.back().bytes += bytes;
+        size += bytes;
+        return count;
+    }
+
+    void TiffWriter::reference(Image img, const void *data, size_t bytes) {
+        if (images.empty() || !(images.back() == img)) images.push_back(img);
+        append((const uint8_t *)data, bytes);
+    }
+
+    void TiffWriter::take(std::vector<uint8_t> *data) {
+        if (data->empty()) return;
+        blocks.push_back(std::vector<uint8_t>());
+        blocks.back().swap(*data);
+        append(&blocks.back()[0], blocks.back().size());
+    }
+
+    void TiffWriter::align() {
+        if (size & 0x1) {
+            uint8_t padding = 0x00;
+            write(&padding, sizeof(uint8_t), 1);
+        }
+    }
+
+    bool TiffWriter::patch(uint32_t at, uint32_t value) {
+        for (size_t i = 0; i < pieces.size(); i++) {
+            const Piece &piece = pieces[i];
+            if (at < piece.offset || at + sizeof(value) > piece.offset + piece.bytes) continue;
+            if (piece.data) return false;
+            memcpy(&buffer[piece.bufferOffset + at - piece.offset], &value, sizeof(value));
+            return true;
+        }
+        return false;
+    }
+
+    // Write all of a block at a file offset, retrying short writes
+    static bool writeAll(int fd, const uint8_t *data, size_t bytes, off_t offset) {
+        while (bytes > 0) {
+            ssize_t written = pwrite(fd, data, bytes, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            // Don't spin on a write that makes no progress
+            if (written == 0) {
+                errno = EIO;
+                return false;
+            }
+            data += written;
+            bytes -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    bool TiffWriter::writeGathered(int fd) {
+#ifdef FCAM_TIFF_PWRITEV
+        std::vector<struct iovec> iov(pieces.size());
+        for (size_t i = 0; i < pieces.size(); i++) {
+            iov[i].iov_base = (void *)base(pieces[i]);
+            iov[i].iov_len = pieces[i].bytes;
+        }
+
+        // As few calls as the iovec limit allows, picking up after
+        // any short writes
+        size_t first = 0;
+        off_t offset = 0;
+        while (first < iov.size()) {
+            int count = std::min(iov.size() - first, (size_t)IOV_MAX);
+            ssize_t written = pwritev(fd, &iov[first], count, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            if (written == 0) {
+                errno = EIO;
+                return false;
+            }
+            offset += written;
+            while (first < iov.size() && (size_t)written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                first++;
+            }
+            if (written > 0) {
+                iov[first].iov_base = (uint8_t *)iov[first].iov_base + written;
+                iov[first].iov_len -= written;
+            }
+        }
+        return true;
+#else
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (!writeAll(fd, base(pieces[i]), pieces[i].bytes, pieces[i].offset)) return false;
+        }
+        return true;
+#endif
+    }
+
+    bool TiffWriter::writeStaged(int fd) {
+        // Direct IO needs aligned memory, offsets, and sizes, so the
+        // pieces are gathered into an aligned buffer a chunk at a
+        // time. The last chunk is padded, and the file cut back to
+        // size afterwards.
+        const size_t alignment = 4096;
+        const size_t chunkSize = 4 << 20;
+        void *memory;
+        if (posix_memalign(&memory, alignment, chunkSize) != 0) return false;
+        uint8_t *chunk = (uint8_t *)memory;
+
+        bool success = true;
+        size_t filled = 0;
+        off_t offset = 0;
+        for (size_t i = 0; i < pieces.size() && success; i++) {
+            const uint8_t *src = base(pieces[i]);
+            size_t bytes = pieces[i].bytes;
+            while (bytes > 0 && success) {
+                size_t n = std::min(bytes, chunkSize - filled);
+                memcpy(chunk + filled, src, n);
+                filled += n;
+                src += n;
+                bytes -= n;
+                if (filled == chunkSize) {
+                    success = writeAll(fd, chunk, chunkSize, offset);
+                    offset += chunkSize;
+                    filled = 0;
+                }
+            }
+        }
+        if (success && filled > 0) {
+            size_t padded = (filled + alignment - 1) / alignment * alignment;
+            memset(chunk + filled, 0, padded - filled);
+            success = writeAll(fd, chunk, padded, offset);
+            if (success) success = ftruncate(fd, size) == 0;
+        }
+        free(memory);
+        return success;
+    }
+
+    bool TiffWriter::flush(const std::string &file, bool directIO) {
+        const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        int fd = -1;
+        bool direct = false;
+#ifdef O_DIRECT
+        if (directIO) {
+            // Not all file systems support it, so fall back quietly
+            fd = open(file.c_str(), flags | O_DIRECT, 0666);
+            direct = fd >= 0;
+            if (!direct) dprintf(4, "TiffWriter::flush: %s: No direct IO, using buffered writes\n", file.c_str());
+        }
+#endif
+        if (fd < 0) fd = open(file.c_str(), flags, 0666);
+        if (fd < 0) {
+            error(Event::FileSaveError,
+                  "TiffFile::writeTo: %s: Can't open file for writing",
+                  file.c_str());
+            return false;
+        }
+
+#ifdef FCAM_TIFF_PWRITEV
+        // Reserve the space up front, so that the file system can
+        // allocate it in one go. Just a hint, so failure is fine.
+        fallocate(fd, 0, 0, size);
+#endif
+
+        dprintf(5, "TiffWriter::flush: %s: Writing %d bytes in %d pieces\n", file.c_str(), size, pieces.size());
+        bool success = direct ? writeStaged(fd) : writeGathered(fd);
+        int err = errno;
+
+        // Some file systems accept O_DIRECT at open, but then reject
+        // the writes themselves. Start over with buffered writes.
+        if (!success && direct && err == EINVAL) {
+            dprintf(4, "TiffWriter::flush: %s: Direct IO writes failed, using buffered writes\n", file.c_str());
+            close(fd);
+            fd = open(file.c_str(), flags, 0666);
+            if (fd < 0) {
+                error(Event::FileSaveError,
+                      "TiffFile::writeTo: %s: Can't open file for writing",
+                      file.c_str());
+                return false;
+            }
+#ifdef FCAM_TIFF_PWRITEV
+            fallocate(fd, 0, 0, size);
+#endif
+            success = writeGathered(fd);
+            err = errno;
+        }
+        if (close(fd) != 0 && success) {
+            success = false;
+            err = errno;
+        }
+        if (!success) {
+            error(Event::FileSaveError,
+                  "TiffFile::writeTo: %s: Can't write file: %s",
+                  file.c_str(), strerror(err));
+            return false;
+        }
+        return true;
+    }
+
 //
 // Methods for TiffIfdEntry
 //
@@ -146,7 +421,7 @@ namespace FCam {
         return true;
     }
 
-    bool TiffIfdEntry::writeDataBlock(FILE *fw) {
+    bool TiffIfdEntry::writeDataBlock(TiffWriter &out) {
         const TagValue &v = value();
         if (state == INVALID) {
             error(Event::FileSaveError,
@@ -356,13 +631,9 @@ namespace FCam {
             dprintf(5, "TiffFileEntry::writeDataBlock: Writing tag %d (%s) data block.\n", entry.tag, name());
             #endif
             
-            entry.offset = ftell(fw);
             // Data block must start on word boundary (even offset)
-            if ( (entry.offset & 0x1) == 1) {
-                uint8_t padding = 0x00;
-                fwrite(&padding, sizeof(uint8_t), 1, fw);
-                entry.offset = ftell(fw);
-            }
+            out.align();
+            entry.offset = out.offset();
 
             size_t written = 0;
             switch(entry.type) {
@@ -370,21 +641,21 @@ namespace FCam {
                 if (v.type == TagValue::IntVector) {
                     std::vector<int> &vi = v;
                     std::vector<uint8_t> bytes(vi.begin(), vi.end());
-                    written = fwrite(&bytes[0], sizeof(uint8_t), elements, fw);
+                    written = out.write(&bytes[0], sizeof(uint8_t), elements);
                 } else { // must be std::string
                     std::string &vs = v;
-                    written = fwrite(vs.data(), sizeof(uint8_t), elements, fw);
+                    written = out.write(vs.data(), sizeof(uint8_t), elements);
                 }
                 break;
             }
             case TIFF_ASCII: {
                 if (v.type == TagValue::String) {
                     std::string &ascii = v;
-                    written = fwrite(ascii.c_str(), sizeof(char), elements, fw);
+                    written = out.write(ascii.c_str(), sizeof(char), elements);
                 } else { // must be std::vector<std::string>
                     std::vector<std::string> &asciis = v;
                     for (size_t i=0; i < asciis.size(); i++) {
-                        written += fwrite(asciis[i].c_str(), sizeof(char), asciis[i].size()+1, fw);
+                        written += out.write(asciis[i].c_str(), sizeof(char), asciis[i].size()+1);
                     }
                 }
                 break;
@@ -392,13 +663,13 @@ namespace FCam {
             case TIFF_SHORT: { // v must be std::vector<int>
                 std::vector<int> &vi = v;
                 std::vector<uint16_t> shorts(vi.begin(), vi.end());
-                written = fwrite(&shorts[0], sizeof(uint16_t), shorts.size(), fw);
+                written = out.write(&shorts[0], sizeof(uint16_t), shorts.size());
                 break;
             }
             case TIFF_IFD:
             case TIFF_LONG: { // v must be std::vector<int>
                 std::vector<int> &vi = v;
-                written = fwrite(&vi[0], sizeof(uint32_t), vi.size(), fw);
+                written = out.write(&vi[0], sizeof(uint32_t), vi.size());
                 break;
             }
             case TIFF_SRATIONAL:
@@ -412,8 +683,8 @@ namespace FCam {
                     // \todo Fix Rationals
                     int32_t num = vd * (1 << 20);
                     int32_t den = 1 << 20;
-                    written = fwrite(&num, sizeof(int32_t), 1, fw);
-                    written += fwrite(&den, sizeof(int32_t), 1, fw);
+                    written = out.write(&num, sizeof(int32_t), 1);
+                    written += out.write(&den, sizeof(int32_t), 1);
                     written /= 2;
                 } else {
                     std::vector<double> &vd = v;
@@ -425,8 +696,8 @@ namespace FCam {
                         }
                         int32_t num = vd[i] * (1 << 20);
                         int32_t den = 1 << 20;
-                        written += fwrite(&num, sizeof(int32_t), 1, fw);
-                        written += fwrite(&den, sizeof(int32_t), 1, fw);
+                        written += out.write(&num, sizeof(int32_t), 1);
+                        written += out.write(&den, sizeof(int32_t), 1);
                     }
                     written /= 2;
                 }
@@ -436,41 +707,41 @@ namespace FCam {
                 if (v.type == TagValue::IntVector) {
                     std::vector<int> &vi = v;
                     std::vector<int8_t> bytes(vi.begin(), vi.end());
-                    written = fwrite(&bytes[0], sizeof(int8_t), elements, fw);
+                    written = out.write(&bytes[0], sizeof(int8_t), elements);
                 } else { // must be std::string
                     std::string &vs = v;
-                    written = fwrite(vs.data(), sizeof(int8_t), elements, fw);
+                    written = out.write(vs.data(), sizeof(int8_t), elements);
                 }
                 break;
             }
             case TIFF_UNDEFINED: { // must be std::string
                 std::string &vs = v;
-                written = fwrite(vs.data(), sizeof(int8_t), elements, fw);
+                written = out.write(vs.data(), sizeof(int8_t), elements);
                 break;
             }
             case TIFF_SSHORT: { // v must be std::vector<int>
                 std::vector<int> &vi = v;
                 std::vector<int16_t> shorts(vi.begin(), vi.end());
-                written = fwrite(&shorts[0], sizeof(int16_t), elements, fw);
+                written = out.write(&shorts[0], sizeof(int16_t), elements);
                 break;
             }
             case TIFF_SLONG: { // v must be int vector
                 std::vector<int> &vi = v;
-                written = fwrite(&vi[0], sizeof(uint32_t), elements, fw);
+                written = out.write(&vi[0], sizeof(uint32_t), elements);
                 break;
             }
             case TIFF_FLOAT: { // v must be a float vector
                 std::vector<float> &vf = v;
-                written = fwrite(&vf[0], sizeof(float), elements, fw);
+                written = out.write(&vf[0], sizeof(float), elements);
                 break;
             }
             case TIFF_DOUBLE: {
                 if (elements == 1) {
                     double vd = v;
-                    written = fwrite(&vd, sizeof(double), elements, fw);
+                    written = out.write(&vd, sizeof(double), elements);
                 } else {
                     std::vector<double> &vd = v;
-                    written = fwrite(&vd[0], sizeof(double), elements, fw);
+                    written = out.write(&vd[0], sizeof(double), elements);
                 }
                 break;
             }
@@ -484,7 +755,7 @@ namespace FCam {
         return true;
     }
 
-    bool TiffIfdEntry::write(FILE *fw) {
+    bool TiffIfdEntry::write(TiffWriter &out) {
         dprintf(5, "TIFFile::IfdEntry::write: Writing tag entry %d (%s): %d %d %d\n", tag(), name(), entry.type, entry.count, entry.offset);
         int count;
 
@@ -494,10 +765,10 @@ namespace FCam {
             compatType = TIFF_LONG;
         }
 
-        count = fwrite(&entry.tag, sizeof(entry.tag), 1, fw);
-        if (count == 1) fwrite(&compatType, sizeof(compatType), 1, fw);
-        if (count == 1) fwrite(&entry.count, sizeof(entry.count), 1, fw);
-        if (count == 1) fwrite(&entry.offset, sizeof(entry.offset), 1, fw);
+        count = out.write(&entry.tag, sizeof(entry.tag), 1);
+        if (count == 1) out.write(&compatType, sizeof(compatType), 1);
+        if (count == 1) out.write(&entry.count, sizeof(entry.count), 1);
+        if (count == 1) out.write(&entry.offset, sizeof(entry.offset), 1);
 
         if (count != 1) {
             error(Event::FileSaveError, "TIFFile::IfdEntry::write: Can't write IFD entry to file.");
@@ -749,7 +1020,8 @@ namespace FCam {
 // Methods for TiffIfd
 //
 
-    TiffIfd::TiffIfd(TiffFile *parent): parent(parent), exifIfd(NULL), imgState(UNREAD)  {
+    TiffIfd::TiffIfd(TiffFile *parent): parent(parent), exifIfd(NULL), imgState(UNREAD),
+                                        storage() {
     }
 
     TiffIfd::~TiffIfd() {
@@ -827,25 +1099,19 @@ namespace FCam {
         return _subIfds[index];
     }
 
-    Image TiffIfd::getImage(bool memMap) {
-        if (imgState == NONE || imgState == CACHED) return imgCache;
-
+    bool TiffIfd::getLayout(Layout *layout) {
         const TiffIfdEntry *entry;
 
         const char *file = parent->filename().c_str();
 
         entry = find(TIFF_TAG_PhotometricInterpretation);
-        if (!entry) {
-            imgState = NONE;
-            return imgCache;
-        }
+        if (!entry) return false;
         int photometricInterpretation = entry->value();
 
 #define fatalError(...) \
         do { \
             warning(Event::FileLoadError, __VA_ARGS__);        \
-            imgState = NONE; \
-            return imgCache; \
+            return false; \
         } while(0);
 
         ImageFormat fmt = UNKNOWN;
@@ -885,6 +1151,13 @@ namespace FCam {
         case TIFF_Compression_Uncompressed:
             // ok
             break;
+        case TIFF_Compression_JPEG:
+            // Only lossless JPEG of RAW data, which the decoder checks
+            if (fmt != RAW) {
+                fatalError("TiffIfd::getImage(): %s: Only RAW images can be JPEG compressed.",
+                           file);
+            }
+            break;
         default:
             fatalError("TiffIfd::getImage(): %s: Unsupported compression type %d.",
                        file,
@@ -892,7 +1165,7 @@ namespace FCam {
             break;
         }
 
-        // Now assuming uncompressed RAW or RGB24
+        // Now assuming uncompressed RAW or RGB24, or lossless JPEG RAW
         int samplesPerPixel = TIFF_SamplesPerPixel_DEFAULT;
         entry = find(TIFF_TAG_SamplesPerPixel);
         if (entry) samplesPerPixel = entry->value();
@@ -916,10 +1189,16 @@ namespace FCam {
         entry = find(TIFF_TAG_BitsPerSample);
         if (!entry) fatalError("TiffIfd::getImage(): %s: No BitsPerSample entry found.", file);
 
+        int rawBits = 16;
         switch (fmt) {
         case RAW: {
-            int bitsPerSample = entry->value();
-            if (bitsPerSample != 16) fatalError("TiffIfd::getImage(): %s: Only 16-bpp RAW images supported.", file);
+            rawBits = entry->value();
+            if (compression == TIFF_Compression_JPEG) {
+                // The JPEG data carries its own precision
+                if (rawBits < 2 || rawBits > 16) fatalError("TiffIfd::getImage(): %s: Unsupported lossless JPEG RAW bits per sample %d.", file, rawBits);
+            } else if (!validPackedBits(rawBits)) {
+                fatalError("TiffIfd::getImage(): %s: Only 10, 12, or 16-bpp RAW images supported.", file);
+            }
             break;
         }
         case RGB24: {
@@ -945,32 +1224,190 @@ namespace FCam {
 
         dprintf(4,"TiffIfd::getImage(): %s: Image size is %d x %d\n", file, imageWidth, imageLength);
 
+        layout->fmt = fmt;
+        layout->width = imageWidth;
+        layout->height = imageLength;
+        layout->compression = compression;
+        layout->bitsPerSample = rawBits;
+
+        entry = find(TIFF_TAG_TileOffsets);
+        layout->tiled = entry != NULL;
+        if (layout->tiled) {
+            // Read in image tile information
+            const TiffIfdEntry *widthEntry = find(TIFF_TAG_TileWidth);
+            const TiffIfdEntry *lengthEntry = find(TIFF_TAG_TileLength);
+            if (!widthEntry || !lengthEntry) fatalError("TiffIfd::getImage(): %s: No tile size found.", file);
+            layout->tileWidth = widthEntry->value();
+            layout->tileHeight = lengthEntry->value();
+            if (layout->tileWidth <= 0 || layout->tileHeight <= 0) fatalError("TiffIfd::getImage(): %s: Malformed IFD - empty tiles.", file);
+            layout->offsets = intArray(entry->value());
+            entry = find(TIFF_TAG_TileByteCounts);
+            if (entry) layout->byteCounts = intArray(entry->value());
+        } else {
+            // Read in image strip information. A strip is a tile as
+            // wide as the image, which may be cut short at the
+            // bottom.
+            entry = find(TIFF_TAG_RowsPerStrip);
+            uint32_t rowsPerStrip = TIFF_RowsPerStrip_DEFAULT;
+            if (entry) rowsPerStrip = (int)entry->value();
+            layout->tileWidth = imageWidth;
+            layout->tileHeight = std::max(1, (int)std::min(rowsPerStrip, (uint32_t)imageLength));
+
+            entry = find(TIFF_TAG_StripOffsets);
+            if (!entry) fatalError("TiffIfd::getImage(): %s: No image strip or tile data found.", file);
+            layout->offsets = intArray(entry->value());
+            entry = find(TIFF_TAG_StripByteCounts);
+            if (entry) layout->byteCounts = intArray(entry->value());
+        }
+        layout->tilesAcross = (imageWidth + layout->tileWidth - 1) / layout->tileWidth;
+        layout->tilesDown = (imageLength + layout->tileHeight - 1) / layout->tileHeight;
+
+        size_t tileCount = layout->tilesAcross * layout->tilesDown;
+        if (layout->offsets.size() != tileCount)
+            fatalError("TiffIfd::getImage(): %s: Malformed IFD - conflicting values on number of image strips or tiles.", file);
+        // Compressed data can't be found without its size
+        if (layout->byteCounts.size() != tileCount &&
+            (compression != TIFF_Compression_Uncompressed || !layout->byteCounts.empty()))
+            fatalError("TiffIfd::getImage(): %s: Malformed IFD - conflicting values on number of image strips or tiles.", file);
+
+        dprintf(5, "TiffIfd::getImage(): %s: Image data in %d %s of %d x %d.\n", file, tileCount,
+                layout->tiled ? "tiles" : "strips", layout->tileWidth, layout->tileHeight);
+
+        if (layout->tiled && compression == TIFF_Compression_Uncompressed && layout->byteCounts.empty()) {
+            // Should be there, but it's easy enough to work out
+            layout->byteCounts.assign(tileCount, layout->tileHeight * layout->bytesPerRow());
+        }
+#undef fatalError
+        return true;
+    }
 
-        // Read in image strip information
-        entry = find(TIFF_TAG_RowsPerStrip);
-        int rowsPerStrip = TIFF_RowsPerStrip_DEFAULT;
-        uint32_t stripsPerImage = 1;
-        if (entry) {
-            rowsPerStrip = entry->value();
-            stripsPerImage = imageLength / rowsPerStrip; // Full strips
-            if (imageLength % rowsPerStrip != 0) stripsPerImage++; // Final partial strip
-        }
-        
-        entry = find(TIFF_TAG_StripOffsets);
-        if (!entry) fatalError("TiffIfd::getImage(): %s: No image strip data found, and tiled data is not supported.", file);
-        std::vector<int> stripOffsets = entry->value();
-        if (stripOffsets.size() != stripsPerImage)
-            fatalError("TiffIfd::getImage(): %s: Malformed IFD - conflicting values on number of image strips.", file);
-        
-        dprintf(5, "TiffIfd::getImage(): %s: Image data in %d strips of %d rows each.\n", file, stripsPerImage, rowsPerStrip);
-        
-        uint32_t bytesPerStrip = rowsPerStrip * imageWidth * bytesPerPixel(fmt);
-        uint32_t bytesLeft = imageLength * imageWidth * bytesPerPixel(fmt);
+    size_t TiffIfd::Layout::bytesPerRow() const {
+        if (compression == TIFF_Compression_Uncompressed && fmt == RAW) {
+            return packedBytesPerRow(tileWidth, bitsPerSample);
+        }
+        return tileWidth * bytesPerPixel(fmt);
+    }
+
+    int TiffIfd::Layout::rows(int index) const {
+        // Tiles are always stored whole, but the last strip may be
+        // cut short
+        if (tiled) return tileHeight;
+        return std::min(tileHeight, height - (index / tilesAcross) * tileHeight);
+    }
+
+    bool TiffIfd::decodeTile(const Layout &layout, int index, unsigned char *dst, int dstBytesPerRow) {
+        const char *file = parent->filename().c_str();
+        int rows = layout.rows(index);
+        size_t rowBytes = layout.bytesPerRow();
+        size_t size = rows * rowBytes;
+        if (!layout.byteCounts.empty()) {
+            if (layout.compression == TIFF_Compression_JPEG) {
+                size = layout.byteCounts[index];
+            } else if ((size_t)layout.byteCounts[index] < size) {
+                warning(Event::FileLoadError, "TiffIfd::getImage(): %s: Not enough image data in strip or tile %d.", file, index);
+                return false;
+            }
+        }
+
+        // 16-bit samples from big-endian files are swapped as they're
+        // copied out
+        bool swap = layout.fmt == RAW && layout.bitsPerSample == 16 && !parent->littleEndian;
+        bool direct = layout.compression == TIFF_Compression_Uncompressed &&
+            rowBytes == (size_t)dstBytesPerRow && !swap &&
+            (layout.fmt != RAW || layout.bitsPerSample == 16);
+        if (direct) {
+            // Read straight into the destination
+            if (!parent->readByteArray(layout.offsets[index], size, dst)) {
+                warning(Event::FileLoadError, "TiffIfd::getImage(): %s: Cannot read in all image data.", file);
+                return false;
+            }
+            return true;
+        }
+
+        // Decode straight from the file mapping if there is one
+        const uint8_t *src = parent->mapped(layout.offsets[index], size);
+        std::vector<uint8_t> data;
+        if (!src) {
+            data.resize(size);
+            if (data.empty() || !parent->readByteArray(layout.offsets[index], size, &data[0])) {
+                warning(Event::FileLoadError, "TiffIfd::getImage(): %s: Cannot read in all image data.", file);
+                return false;
+            }
+            src = &data[0];
+        }
+
+        if (layout.compression == TIFF_Compression_JPEG) {
+            if (!decodeLosslessJPEG(src, size, (uint16_t *)dst, dstBytesPerRow / 2,
+                                    layout.tileWidth, rows)) {
+                warning(Event::FileLoadError, "TiffIfd::getImage(): %s: Malformed lossless JPEG data in strip or tile %d.", file, index);
+                return false;
+            }
+        } else if (layout.fmt == RAW && layout.bitsPerSample != 16) {
+            for (int r = 0; r < rows; r++) {
+                unpackRow(src + r * rowBytes, (uint16_t *)(dst + r * dstBytesPerRow),
+                          layout.tileWidth, layout.bitsPerSample);
+            }
+        } else if (swap) {
+            for (int r = 0; r < rows; r++) {
+                swapBytes16((const uint16_t *)(src + r * rowBytes), (uint16_t *)(dst + r * dstBytesPerRow),
+                            layout.tileWidth);
+            }
+        } else {
+            for (int r = 0; r < rows; r++) {
+                memcpy(dst + r * dstBytesPerRow, src + r * rowBytes, rowBytes);
+            }
+        }
+        return true;
+    }
+
+    bool TiffIfd::copyTile(const Layout &layout, int index, Image dst, int dstX, int dstY) {
+        int tx = (index % layout.tilesAcross) * layout.tileWidth;
+        int ty = (index / layout.tilesAcross) * layout.tileHeight;
+        int x0 = std::max(tx, dstX), x1 = std::min(tx + layout.tileWidth, dstX + (int)dst.width());
+        int y0 = std::max(ty, dstY), y1 = std::min(ty + layout.rows(index), dstY + (int)dst.height());
+        if (x0 >= x1 || y0 >= y1) return true;
+
+        Image tile(layout.tileWidth, layout.rows(index), layout.fmt);
+        if (!decodeTile(layout, index, tile(0, 0), tile.bytesPerRow())) return false;
+        for (int y = y0; y < y1; y++) {
+            memcpy(dst(x0 - dstX, y - dstY), tile(x0 - tx, y - ty), (x1 - x0) * tile.bytesPerPixel());
+        }
+        return true;
+    }
+
+    Image TiffIfd::getImage(bool memMap) {
+        if (imgState == NONE || imgState == CACHED) return imgCache;
+
+        Layout layout;
+        if (!getLayout(&layout)) {
+            imgState = NONE;
+            return imgCache;
+        }
+
+        const char *file = parent->filename().c_str();
+
+#define fatalError(...) \
+        do { \
+            warning(Event::FileLoadError, __VA_ARGS__);        \
+            imgState = NONE; \
+            return imgCache; \
+        } while(0);
+
+        // Only plain strips can be memory mapped, in the native byte
+        // order. Anything else has to be decoded.
+        if (layout.tiled ||
+            layout.compression != TIFF_Compression_Uncompressed ||
+            (layout.fmt == RAW && (layout.bitsPerSample != 16 || !parent->littleEndian))) {
+            memMap = false;
+        }
+
+        uint32_t bytesPerStrip = layout.tileHeight * layout.bytesPerRow();
+        size_t tileCount = layout.offsets.size();
 
         // If memmapping requested, first confirm image data is contiguous
         if (memMap) {
-            for (uint32_t strip=0; strip < stripsPerImage-1; strip++) {
-                if (stripOffsets[strip]+(int)bytesPerStrip != stripOffsets[strip+1]) {
+            for (uint32_t strip=0; strip+1 < tileCount; strip++) {
+                if (layout.offsets[strip]+(int)bytesPerStrip != layout.offsets[strip+1]) {
                     memMap = false;
                     warning(Event::FileLoadError, "TiffIfd::getImage(): %s: Memory mapped I/O was requested but TIFF image data is not contiguous.", file);
                     break;
@@ -981,17 +1418,18 @@ namespace FCam {
         if (!memMap) {
             //
             // Read in image data - standard I/O (non-cached)
-            Image img(imageWidth, imageLength, fmt);
-                        
-            for (uint32_t strip=0; strip < stripsPerImage; strip++) {
-                uint32_t bytesToRead = std::min(bytesLeft, bytesPerStrip);
-                bool success = parent->readByteArray(stripOffsets[strip], 
-                                                     bytesToRead, 
-                                                     img(0,rowsPerStrip*strip) );
+            Image img(layout.width, layout.height, layout.fmt);
+
+            for (uint32_t i=0; i < tileCount; i++) {
+                bool success;
+                if (layout.tiled) {
+                    success = copyTile(layout, i, img, 0, 0);
+                } else {
+                    success = decodeTile(layout, i, img(0, layout.tileHeight*i), img.bytesPerRow());
+                }
                 if (!success) {
                     fatalError("TiffIfd::getImage(): %s: Cannot read in all image data.\n", file);
                 }
-                bytesLeft -= bytesToRead;
             }
 
             imgCache = img;
@@ -999,29 +1437,102 @@ namespace FCam {
         } else {
             // Read in image data - Memory mapped IO
             dprintf(5, "TiffIfd::getImage(): %s: Memmapping Image at %x, %x bytes\n",
-                    file, stripOffsets[0], bytesPerPixel(fmt)*imageWidth*imageLength);
-            imgCache = Image(fileno(parent->fp), 
-                             stripOffsets[0], 
-                             Size(imageWidth, imageLength), 
-                             fmt);
+                    file, layout.offsets[0], bytesPerPixel(layout.fmt)*layout.width*layout.height);
+            imgCache = parent->mapImage(layout.offsets[0],
+                                        Size(layout.width, layout.height),
+                                        layout.fmt);
+            if (!imgCache.valid()) {
+                fatalError("TiffIfd::getImage(): %s: Cannot map in all image data.\n", file);
+            }
         }
 #undef fatalError
 
         return imgCache;
     }
 
-    bool TiffIfd::setImage(Image newImg) {
+    std::vector<Rect> TiffIfd::tiles() {
+        std::vector<Rect> rects;
+        Layout layout;
+        if (imgState == NONE || !getLayout(&layout)) return rects;
+        for (size_t i = 0; i < layout.offsets.size(); i++) {
+            int tx = (i % layout.tilesAcross) * layout.tileWidth;
+            int ty = (i / layout.tilesAcross) * layout.tileHeight;
+            rects.push_back(Rect(tx, ty,
+                                 std::min(layout.tileWidth, layout.width - tx),
+                                 std::min(layout.tileHeight, layout.height - ty)));
+        }
+        return rects;
+    }
+
+    Image TiffIfd::getTile(int index) {
+        std::vector<Rect> rects = tiles();
+        if (index < 0 || index >= (int)rects.size()) return Image();
+        return getRegion(rects[index]);
+    }
+
+    Image TiffIfd::getRegion(Rect region) {
+        if (imgState == NONE) return Image();
+
+        if (imgState == CACHED) {
+            // No need to go back to the file
+            region = clip(region, imgCache.size());
+            if (region.width <= 0 || region.height <= 0) return Image();
+            Image img(region.width, region.height, imgCache.type());
+            for (int y = 0; y < region.height; y++) {
+                memcpy(img(0, y), imgCache(region.x, region.y + y), region.width * img.bytesPerPixel());
+            }
+            return img;
+        }
+
+        Layout layout;
+        if (!getLayout(&layout)) return Image();
+
+        region = clip(region, Size(layout.width, layout.height));
+        if (region.width <= 0 || region.height <= 0) return Image();
+        int x0 = region.x, y0 = region.y;
+        int x1 = x0 + region.width, y1 = y0 + region.height;
+
+        Image img(region.width, region.height, layout.fmt);
+        int tx0 = x0 / layout.tileWidth, tx1 = (x1 - 1) / layout.tileWidth;
+        int ty0 = y0 / layout.tileHeight, ty1 = (y1 - 1) / layout.tileHeight;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                if (!copyTile(layout, ty * layout.tilesAcross + tx, img, x0, y0)) return Image();
+            }
+        }
+        return img;
+    }
+
+    bool TiffIfd::setImage(Image newImg, const TiffStorage &storage) {
         if (newImg.type() != RAW &&
             newImg.type() != RGB24) {
             error(Event::FileSaveError, "TiffIfd::setImage(): Can only save RAW or RGB24 images");
             return false;
         }
+        if (storage.compression != TIFF_Compression_Uncompressed &&
+            (storage.compression != TIFF_Compression_JPEG || newImg.type() != RAW)) {
+            error(Event::FileSaveError, "TiffIfd::setImage(): Can only compress RAW images, with lossless JPEG");
+            return false;
+        }
+        if (storage.bitsPerSample != 16 &&
+            (!validPackedBits(storage.bitsPerSample) || newImg.type() != RAW)) {
+            error(Event::FileSaveError, "TiffIfd::setImage(): Can only pack RAW images, into 10 or 12 bits");
+            return false;
+        }
+        if ((storage.tileWidth || storage.tileHeight) &&
+            (newImg.type() != RAW ||
+             storage.tileWidth <= 0 || storage.tileWidth % 16 != 0 ||
+             storage.tileHeight <= 0 || storage.tileHeight % 16 != 0)) {
+            error(Event::FileSaveError, "TiffIfd::setImage(): Can only tile RAW images, with tile sizes that are positive multiples of 16");
+            return false;
+        }
         imgCache = newImg;
         imgState = CACHED;
+        this->storage = storage;
         return true;
     }
 
-    bool TiffIfd::write(FILE *fw, uint32_t nextIfdOffset, uint32_t *offset) {
+    bool TiffIfd::write(TiffWriter &out, uint32_t nextIfdOffset, uint32_t *offset) {
         bool success;
         // First write out all subIFDs, if any
         if (_subIfds.size() > 0) {
@@ -1030,7 +1541,7 @@ namespace FCam {
             for (size_t i=0; i < _subIfds.size(); i++ ) {
                 uint32_t subIfdOffset;
                 dprintf(4, "TiffIfd::write: Writing subIFD %d\n", i);
-                success = _subIfds[i]->write(fw, 0, &subIfdOffset);
+                success = _subIfds[i]->write(out, 0, &subIfdOffset);
                 if (!success) return false;
                 subIfdOffsets.push_back(subIfdOffset);
             }
@@ -1047,51 +1558,107 @@ namespace FCam {
         if (exifIfd != NULL) {
             dprintf(4, "TiffIfd::write:  Writing exif IFD\n\n");
             uint32_t exifIfdOffset;
-            success = exifIfd->write(fw, 0, &exifIfdOffset);
+            success = exifIfd->write(out, 0, &exifIfdOffset);
             if (!success) return false;
             success = add(EXIF_TAG_ExifIfd, (int)exifIfdOffset);
         }            
             
         // Then write out the image, if any
-        success = writeImage(fw);
+        success = writeImage(out);
         if (!success) return false;
 
         // Then write out entry extra data fields
         dprintf(5, "TiffIfd::write: Writing Ifd entry data blocks.\n");
 
         for (entryMap::iterator it=entries.begin(); it != entries.end(); it++) {
-            success = it->second.writeDataBlock(fw);
+            success = it->second.writeDataBlock(out);
             if (!success) return false;
         }
 
-        // Record starting offset for IFD
-        *offset = ftell(fw);
-        // IFD must start on word boundary (even byte offset)
-        if ( (*offset & 0x1) == 1) {
-            uint8_t padding = 0x00;
-            fwrite(&padding, sizeof(uint8_t), 1, fw);
-            *offset = ftell(fw);
-        }
+        // Record starting offset for IFD, which must start on word
+        // boundary (even byte offset)
+        out.align();
+        *offset = out.offset();
 
         // Now write out the IFD itself
         int count;
         uint16_t entryCount = entries.size();
-        count = fwrite(&entryCount, sizeof(uint16_t), 1, fw);
+        count = out.write(&entryCount, sizeof(uint16_t), 1);
         if (count != 1) return false;
 
         dprintf(5, "TiffIfd::write: Writing IFD entries\n");
         for (entryMap::iterator it=entries.begin(); it != entries.end(); it++) {
-            success = it->second.write(fw);
+            success = it->second.write(out);
             if (!success) return false;
         }
-        count = fwrite(&nextIfdOffset, sizeof(uint32_t), 1, fw);
+        count = out.write(&nextIfdOffset, sizeof(uint32_t), 1);
         if (count != 1) return false;
 
         dprintf(5, "TiffIfd::write: IFD written\n");
         return true;
     }
 
-    bool TiffIfd::writeImage(FILE *fw) {
+    // The encoded strips or tiles of a RAW image, in file order
+    struct TileEncodingJob {
+        Image img;
+        TiffStorage storage;
+        bool tiled;
+        int tileWidth, tileHeight, tilesAcross;
+        std::vector<std::vector<uint8_t> > tiles;
+    };
+
+    // Tiles overhanging the image are padded by mirroring the last
+    // two rows or columns, which keeps the bayer pattern intact.
+    static inline int padCoordinate(int x, int size) {
+        if (x < size) return x;
+        return std::max(0, size - 2 + ((x - size) & 1));
+    }
+
+    static void encodeTile(void *context, int index) {
+        TileEncodingJob *job = (TileEncodingJob *)context;
+        const Image &img = job->img;
+        int tx = (index % job->tilesAcross) * job->tileWidth;
+        int ty = (index / job->tilesAcross) * job->tileHeight;
+        int width = job->tileWidth;
+        int rows = job->tiled ? job->tileHeight : std::min(job->tileHeight, (int)img.height() - ty);
+
+        // Gather the samples of the tile, unless they can be used in place
+        const uint16_t *samples;
+        int stride;
+        std::vector<uint16_t> tile;
+        if (tx + width <= (int)img.width() && ty + rows <= (int)img.height()) {
+            samples = (const uint16_t *)img(tx, ty);
+            stride = img.bytesPerRow() / 2;
+        } else {
+            tile.resize(width * rows);
+            for (int y = 0; y < rows; y++) {
+                const uint16_t *src = (const uint16_t *)img(0, padCoordinate(ty + y, img.height()));
+                for (int x = 0; x < width; x++) {
+                    tile[y * width + x] = src[padCoordinate(tx + x, img.width())];
+                }
+            }
+            samples = &tile[0];
+            stride = width;
+        }
+
+        std::vector<uint8_t> &out = job->tiles[index];
+        if (job->storage.compression == TIFF_Compression_JPEG) {
+            encodeLosslessJPEG(samples, stride, width, rows, &out);
+        } else {
+            int bits = job->storage.bitsPerSample;
+            size_t bytesPerRow = packedBytesPerRow(width, bits);
+            out.resize(rows * bytesPerRow);
+            for (int y = 0; y < rows; y++) {
+                if (bits == 16) {
+                    memcpy(&out[y * bytesPerRow], samples + y * stride, bytesPerRow);
+                } else {
+                    packRow(samples + y * stride, &out[y * bytesPerRow], width, bits);
+                }
+            }
+        }
+    }
+
+    bool TiffIfd::writeImage(TiffWriter &out) {
         Image img = getImage();
         if (imgState == NONE) return true;
         dprintf(5, "TiffIfd::writeImage: Beginning image write\n");
@@ -1124,7 +1691,7 @@ namespace FCam {
         case RAW:
             photometricInterpretation = TIFF_PhotometricInterpretation_CFA;
             samplesPerPixel = 1;
-            bitsPerSample.push_back(16);
+            bitsPerSample.push_back(storage.compression == TIFF_Compression_JPEG ? 16 : storage.bitsPerSample);
             break;
         case UNKNOWN:
             error(Event::FileSaveError,
@@ -1136,36 +1703,61 @@ namespace FCam {
         int width = img.width();
         int height = img.height();
 
-        const uint32_t targetBytesPerStrip = 64 * 1024; // 64 K strips if possible
+        // 64 K strips if possible. Compressed strips are larger, to
+        // spread the JPEG headers and the restart of prediction at
+        // the top of each strip over more data.
+        bool compressed = storage.compression == TIFF_Compression_JPEG;
+        bool packed = !compressed && img.type() == RAW && storage.bitsPerSample != 16;
+        bool tiled = storage.tileWidth > 0;
+        const uint32_t targetBytesPerStrip = (compressed ? 512 : 64) * 1024;
         const uint32_t minRowsPerStrip = 10; // But at least 10 rows per strip
 
         uint32_t bytesPerRow = img.bytesPerPixel() * width;
+        if (packed) bytesPerRow = packedBytesPerRow(width, storage.bitsPerSample);
         int rowsPerStrip;
         if (minRowsPerStrip*bytesPerRow > targetBytesPerStrip) {
             rowsPerStrip = minRowsPerStrip;
         } else {
             rowsPerStrip = targetBytesPerStrip / bytesPerRow;
         }
-        uint32_t stripsPerImage = height / rowsPerStrip;
-        if (height % rowsPerStrip != 0) stripsPerImage++;
 
-        std::vector<int> stripOffsets;
-        std::vector<int> stripByteCounts;
-
-        for (int ys=0; ys < height; ys += rowsPerStrip) {
-            size_t lastRow = std::min(height, ys + rowsPerStrip);
-            int bytesToWrite = (lastRow - ys) * bytesPerRow;
+        // Strips are handled as tiles as wide as the image
+        int tileWidth = tiled ? storage.tileWidth : width;
+        int tileHeight = tiled ? storage.tileHeight : rowsPerStrip;
+        int tilesAcross = (width + tileWidth - 1) / tileWidth;
+        int tilesDown = (height + tileHeight - 1) / tileHeight;
+        uint32_t tileCount = tilesAcross * tilesDown;
+
+        std::vector<int> tileOffsets;
+        std::vector<int> tileByteCounts;
+
+        if (compressed || packed || tiled) {
+            TileEncodingJob job;
+            job.img = img;
+            job.storage = storage;
+            job.tiled = tiled;
+            job.tileWidth = tileWidth;
+            job.tileHeight = tileHeight;
+            job.tilesAcross = tilesAcross;
+            job.tiles.resize(tileCount);
+            parallelFor(tileCount, storage.threads, encodeTile, &job);
+
+            for (uint32_t tile=0; tile < tileCount; tile++) {
+                tileOffsets.push_back(out.offset());
+                tileByteCounts.push_back(job.tiles[tile].size());
+                out.take(&job.tiles[tile]);
+            }
+        } else {
+            // The rows are written straight from the image
+            for (int ys=0; ys < height; ys += rowsPerStrip) {
+                size_t lastRow = std::min(height, ys + rowsPerStrip);
 
-            stripOffsets.push_back(ftell(fw));
-            stripByteCounts.push_back(bytesToWrite);
+                tileOffsets.push_back(out.offset());
+                tileByteCounts.push_back((lastRow - ys) * bytesPerRow);
 
-            int bytesWritten = 0;
-            for (size_t y=ys; y < lastRow; y++) {
-                bytesWritten += fwrite(img(0,y), sizeof(uint8_t), bytesPerRow, fw);
-            }
-            if (bytesWritten != bytesToWrite) {
-                error(Event::FileSaveError, "TiffIfd::writeImage: Unable to write image data to file (wanted to write %d bytes, able to write %d).", bytesToWrite, bytesWritten);
-                return false;
+                for (size_t y=ys; y < lastRow; y++) {
+                    out.reference(img, img(0,y), bytesPerRow);
+                }
             }
         }
 
@@ -1176,12 +1768,18 @@ namespace FCam {
 
         if (success) success = add(TIFF_TAG_ImageWidth, width);
         if (success) success = add(TIFF_TAG_ImageLength, height);
-        if (success) success = add(TIFF_TAG_RowsPerStrip, rowsPerStrip);
-
-        if (success) success = add(TIFF_TAG_StripOffsets, stripOffsets);
-        if (success) success = add(TIFF_TAG_StripByteCounts, stripByteCounts);
+        if (tiled) {
+            if (success) success = add(TIFF_TAG_TileWidth, tileWidth);
+            if (success) success = add(TIFF_TAG_TileLength, tileHeight);
+            if (success) success = add(TIFF_TAG_TileOffsets, tileOffsets);
+            if (success) success = add(TIFF_TAG_TileByteCounts, tileByteCounts);
+        } else {
+            if (success) success = add(TIFF_TAG_RowsPerStrip, rowsPerStrip);
+            if (success) success = add(TIFF_TAG_StripOffsets, tileOffsets);
+            if (success) success = add(TIFF_TAG_StripByteCounts, tileByteCounts);
+        }
         // Not needed per spec, but dcraw seems to need this for thumbnails
-        if (success) success = add(TIFF_TAG_Compression, TIFF_Compression_Uncompressed);
+        if (success) success = add(TIFF_TAG_Compression, storage.compression);
 
         if (!success) {
             error(Event::FileSaveError,
@@ -1196,33 +1794,57 @@ namespace FCam {
 // Methods for TiffFile
 //
 
-    TiffFile::TiffFile(): valid(false), fp(NULL), offsetToIfd0(0) {
+    TiffFile::TiffFile(): valid(false), fp(NULL), fileSize(0), offsetToIfd0(0) {
     }
 
-    TiffFile::TiffFile(const std::string &file): valid(false), fp(NULL), offsetToIfd0(0) {
+    TiffFile::TiffFile(const std::string &file): valid(false), fp(NULL), fileSize(0), offsetToIfd0(0) {
         readFrom(file);
     }
 
     TiffFile::~TiffFile() {
         eraseIfds();
+        closeFile();
+    }
+
+    void TiffFile::closeFile() {
         if (fp) fclose(fp);
+        fp = NULL;
+        mapping = Image();
+        fileSize = 0;
     }
 
-    bool TiffFile::readFrom(const std::string &file) {
+    bool TiffFile::readFrom(const std::string &file, bool memMap) {
         dprintf(DBG_MINOR, "TiffFile::readFrom(): Starting read of %s\n", file.c_str());
 
         // Make sure we start with a blank slate here
-        if (fp) {
-            fclose(fp); fp = NULL;
-        }
+        closeFile();
         eraseIfds();
 
         valid = false;
-
-        // Try to open the file
-        fp = fopen(file.c_str(), "rb");
         _filename = file;
-        if (fp == NULL) {
+
+        if (memMap) {
+            // Map the whole file once. The mapping holds its own
+            // reference to the file, so it can be closed right away.
+            int fd = open(file.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd >= 0 && fstat(fd, &st) == 0 &&
+                st.st_size >= 8 && st.st_size <= 0xFFFFFFFFLL) {
+                fileSize = st.st_size;
+                // Mapped as a 16-bit image, rounded up to cover any
+                // odd last byte, which is still in the last page
+                mapping = Image(fd, 0, Size((fileSize + 1) / 2, 1), RAW);
+                if (!mapping.valid()) fileSize = 0;
+            }
+            if (fd >= 0) ::close(fd);
+            if (mapping.valid()) {
+                dprintf(4, "TiffFile::readFrom(): %s: Memory mapped %d bytes\n", file.c_str(), fileSize);
+            }
+        }
+
+        // Otherwise, try to open the file for stdio
+        if (!mapping.valid()) fp = fopen(file.c_str(), "rb");
+        if (!mapping.valid() && fp == NULL) {
             std::stringstream errMsg;
             errMsg << "Unable to open file: "<<strerror(errno);
             setError("readFrom", errMsg.str());
@@ -1249,7 +1871,7 @@ namespace FCam {
         return true;
     }
 
-    bool TiffFile::writeTo(const std::string &file) {
+    bool TiffFile::writeTo(const std::string &file, bool directIO, size_t *bytes) {
         dprintf(4, "TIFFile::writeTo: %s: Beginning write\n", file.c_str());
         // Check that we have enough of an image to write
         if (ifds().size() == 0) {
@@ -1258,60 +1880,38 @@ namespace FCam {
                   file.c_str());
             return false;
         }
-        FILE *fw = NULL;
-        fw = fopen(file.c_str(), "wb");
-        if (!fw) {
-            error(Event::FileSaveError,
-                  "TiffFile::writeTo: %s: Can't open file for writing",
-                  file.c_str());
-            return false;
-        }
+
+        // Lay out the whole file in memory first
+        TiffWriter out;
 
         // Write out TIFF header
-        int count = 0;
         uint32_t headerOffset = 0;
-        count = fwrite(&littleEndianMarker, sizeof(littleEndianMarker), 1, fw);
-        if (count == 1)
-            count = fwrite(&tiffMagicNumber, sizeof(tiffMagicNumber), 1 , fw);
+        out.write(&littleEndianMarker, sizeof(littleEndianMarker), 1);
+        out.write(&tiffMagicNumber, sizeof(tiffMagicNumber), 1);
         // Write a dummy value for IFD0 offset for now. Will come back later, so store offset
-        uint32_t headerIfd0Offset = ftell(fw);
-        if (count == 1)
-            count = fwrite(&headerOffset, sizeof(headerOffset), 1, fw);
-        if (count != 1) {
-            error(Event::FileSaveError,
-                  "TiffFile::writeTo: %s: Can't write TIFF file header",
-                  file.c_str());
-            fclose(fw);
-            return false;
-        }
+        uint32_t headerIfd0Offset = out.offset();
+        out.write(&headerOffset, sizeof(headerOffset), 1);
 
-        // Write out all the IFDs, reverse order to minimize fseeks
+        // Write out all the IFDs, reverse order so each knows the offset of the next
         bool success;
         uint32_t nextIfdOffset = 0;
         for (size_t i=ifds().size(); i > 0; i--) {
             dprintf(4, "TIFFile::writeTo: %s: Writing IFD %d\n", file.c_str(), i-1);
-            success = ifds(i-1)->write(fw, nextIfdOffset, &nextIfdOffset);
+            success = ifds(i-1)->write(out, nextIfdOffset, &nextIfdOffset);
             if (!success) {
                 error(Event::FileSaveError,
                       "TiffFile::writeTo: %s: Can't write entry data blocks",
                       file.c_str());
-                fclose(fw);
                 return false;
             }
         }
 
-        // Go back to the start and write the offset to the first IFD (last written)
-        fseek(fw, headerIfd0Offset, SEEK_SET);
-        count = fwrite(&nextIfdOffset, sizeof(uint32_t), 1, fw);
-        if (count != 1) {
-            error(Event::FileSaveError,
-                  "TiffFile::writeTo: %s: Can't write Ifd offset into header",
-                  file.c_str());
-            fclose(fw);
-            return false;
-        }
+        // Go back to the start and fill in the offset to the first IFD (last written)
+        out.patch(headerIfd0Offset, nextIfdOffset);
 
-        fclose(fw);
+        // Then put it all on disk in one go
+        if (!out.flush(file, directIO)) return false;
+        if (bytes) *bytes = out.offset();
         return true;
     }
 
@@ -1345,20 +1945,16 @@ namespace FCam {
 
     bool TiffFile::readHeader() {
         // Read in the TIFF header at start of file
-        fseek(fp, 0, SEEK_SET);
-
-        int count;
+        uint8_t header[8];
         uint16_t byteOrder, tiffHeaderNumber;
-        count = fread(&byteOrder, sizeof(byteOrder), 1, fp);
-        if (count == 1)
-            count = fread(&tiffHeaderNumber, sizeof(tiffHeaderNumber), 1, fp);
-        if (count == 1)
-            count = fread(&offsetToIfd0, sizeof(offsetToIfd0), 1, fp);
-        if (count != 1) {
+        if (!readByteArray(0, sizeof(header), header)) {
             setError("readHeader", "Unable to read TIFF header!");
-            fclose(fp); fp = NULL;
+            closeFile();
             return false;
         }
+        memcpy(&byteOrder, header, sizeof(byteOrder));
+        memcpy(&tiffHeaderNumber, header + 2, sizeof(tiffHeaderNumber));
+        memcpy(&offsetToIfd0, header + 4, sizeof(offsetToIfd0));
 
         // Then find out the endianness of the TIFF file.
         if (byteOrder == littleEndianMarker) {
@@ -1367,7 +1963,7 @@ namespace FCam {
             littleEndian = false;
         } else {
             setError("readHeader", "Malformed TIFF header");
-            fclose(fp); fp = NULL;
+            closeFile();
             return false;
         }
         dprintf(4, "TiffFile::readHeader(): %s is %s-endian\n", filename().c_str(), littleEndian ? "little" : "big");
@@ -1379,7 +1975,7 @@ namespace FCam {
             errMsg << "TIFF header magic number is incorrect. This is not a valid TIFF or DNG file. (got "
                    <<tiffHeaderNumber<<", expected "<<tiffMagicNumber;
             setError("readHeader", errMsg.str());
-            fclose(fp); fp = NULL;
+            closeFile();
             return false;
         }
 
@@ -1393,7 +1989,7 @@ namespace FCam {
             errMsg << "Offset to first IFD in TIFF file is " << offsetToIfd0 
                    << ". This is not a valid TIFF or DNG file.";
             setError("readHeader", errMsg.str());
-            fclose(fp); fp = NULL;
+            closeFile();
             return false;
         }
 
@@ -1401,48 +1997,47 @@ namespace FCam {
     }
 
     bool TiffFile::readIfd(uint32_t offsetToIFD, TiffIfd *ifd, uint32_t *offsetToNextIFD) {
-        int err;
-
-        err = fseek(fp, offsetToIFD, SEEK_SET);
-        if (err != 0) {
-            std::stringstream errMsg;
-            errMsg << "Unable to seek to IFD at "<<offsetToIFD << ": "<<strerror(errno);
-            setError("readIfd", errMsg.str());
-            fclose(fp); fp = NULL;
-            return false;
-        }
-
         // Read in number of entries in IFD
-        int count;
         uint16_t ifdEntries;
-        count = fread(&ifdEntries, sizeof(uint16_t), 1, fp);
-        if (count != 1) {
+        if (!readByteArray(offsetToIFD, sizeof(uint16_t), (uint8_t *)&ifdEntries)) {
             std::stringstream errMsg;
             errMsg << "Unable to read header for IFD at "<<offsetToIFD;
             setError("readIfd", errMsg.str());
-            fclose(fp); fp = NULL;
+            closeFile();
             return false;
         }
         ifdEntries = convShort(&ifdEntries);
         dprintf(4, "TiffFile::readIfd(): In %s, IFD at 0x%x contains %d entries\n", filename().c_str(), (int)offsetToIFD, (int)ifdEntries);
 
+        // Then get all the entries, and the next IFD offset, in one
+        // go. They're parsed straight from the mapping if there is
+        // one.
+        const uint32_t entryBytes = 12;
+        uint32_t bytes = ifdEntries * entryBytes + (offsetToNextIFD ? sizeof(uint32_t) : 0);
+        const uint8_t *data = mapped(offsetToIFD + sizeof(uint16_t), bytes);
+        std::vector<uint8_t> buffer;
+        if (!data) {
+            buffer.resize(bytes);
+            if (bytes > 0 && readByteArray(offsetToIFD + sizeof(uint16_t), bytes, &buffer[0])) {
+                data = &buffer[0];
+            }
+        }
+        if (!data && bytes > 0) {
+            std::stringstream errMsg;
+            errMsg << "Unable to read IFD entries for IFD at "<<offsetToIFD;
+            setError("readIfd", errMsg.str());
+            closeFile();
+            return false;
+        }
+
         // Read in IFD entries
         for (int i=0; i < ifdEntries; i++) {
             RawTiffIfdEntry entry;
-            count = fread(&entry.tag, sizeof(entry.tag), 1, fp);
-            if (count == 1)
-                count = fread(&entry.type, sizeof(entry.type), 1, fp);
-            if (count == 1)
-                count = fread(&entry.count, sizeof(entry.count), 1, fp);
-            if (count == 1)
-                count = fread(&entry.offset, sizeof(entry.offset), 1, fp);
-            if (count != 1) {
-                std::stringstream errMsg;
-                errMsg << "Unable to read IFD entry "<<i <<" for IFD at "<<offsetToIFD;
-                setError("readIfd", errMsg.str());
-                fclose(fp); fp = NULL;
-                return false;
-            }
+            const uint8_t *src = data + i * entryBytes;
+            memcpy(&entry.tag, src, sizeof(entry.tag));
+            memcpy(&entry.type, src + 2, sizeof(entry.type));
+            memcpy(&entry.count, src + 4, sizeof(entry.count));
+            memcpy(&entry.offset, src + 8, sizeof(entry.offset));
             entry.tag = convShort(&entry.tag);
             entry.type = convShort(&entry.type);
             entry.count = convLong(&entry.count);
@@ -1454,14 +2049,7 @@ namespace FCam {
 
         // Read in next IFD offset
         if (offsetToNextIFD) {
-            count = fread(offsetToNextIFD, sizeof(uint32_t), 1, fp);
-            if (count != 1) {
-                std::stringstream errMsg;
-                errMsg << "Unable to read next-IFD offset field for IFD at "<<offsetToIFD;
-                setError("readIfd", errMsg.str());
-                fclose(fp); fp = NULL;
-                return false;
-            }
+            memcpy(offsetToNextIFD, data + ifdEntries * entryBytes, sizeof(uint32_t));
             *offsetToNextIFD = convLong(offsetToNextIFD);
             dprintf(DBG_MINOR, "TiffFile::readIfd(): In file %s, IFD at %x has next-IFD offset field of %x\n",
                     filename().c_str(), offsetToIFD, *offsetToNextIFD);
@@ -1482,7 +2070,7 @@ namespace FCam {
             TagValue val = subIfdEntry->value();
             if (!val.valid()) {
                 setError("readSubIfds", "Unable to read TIFF subIFDs");
-                fclose(fp); fp = NULL;
+                closeFile();
                 return false;
             }
             std::vector<int> subIfdOffsets;
@@ -1507,22 +2095,27 @@ namespace FCam {
     }
 
     uint16_t TiffFile::convShort(void const *src) {
-        uint16_t s = *(uint16_t const *)src;
-        if (!littleEndian) s = (s << 8) || (s >> 8);
+        uint16_t s;
+        memcpy(&s, src, sizeof(s));
+        if (!littleEndian) s = (uint16_t)((s << 8) | (s >> 8));
         return s;
     }
 
     uint32_t TiffFile::convLong(void const *src) {
-        uint32_t l = *(uint32_t const *)src;
-        if (!littleEndian) l = ((l & 0x000000FF) << 24) ||
-                               ((l & 0x0000FF00) << 8 ) ||
-                               ((l & 0x00FF0000) >> 8 ) ||
+        uint32_t l;
+        memcpy(&l, src, sizeof(l));
+        if (!littleEndian) l = ((l & 0x000000FF) << 24) |
+                               ((l & 0x0000FF00) << 8 ) |
+                               ((l & 0x00FF0000) >> 8 ) |
                                ((l & 0xFF000000) >> 24 );
         return l;
     }
 
     float TiffFile::convFloat(void const *src) {
-        return *reinterpret_cast<float *>(convLong(src));
+        uint32_t l = convLong(src);
+        float f;
+        memcpy(&f, &l, sizeof(f));
+        return f;
     }
 
     double TiffFile::convDouble(void const *src) {
@@ -1538,9 +2131,34 @@ namespace FCam {
         return d;
     }
 
+    const uint8_t *TiffFile::mapped(uint32_t offset, uint32_t count) const {
+        if (!mapping.valid()) return NULL;
+        // Careful of offsets near the top of the 32-bit range
+        if (offset > fileSize || count > fileSize - offset) return NULL;
+        return mapping(0, 0) + offset;
+    }
+
+    Image TiffFile::mapImage(uint32_t offset, Size size, ImageFormat fmt) {
+        if (mapping.valid()) {
+            uint64_t bytes = (uint64_t)size.width * size.height * bytesPerPixel(fmt);
+            if (bytes > 0xFFFFFFFFu || !mapped(offset, bytes)) return Image();
+            return mapping.view(offset, size, fmt);
+        }
+        if (!fp) return Image();
+        return Image(fileno(fp), offset, size, fmt);
+    }
+
     bool TiffFile::readByteArray(uint32_t offset, uint32_t count, uint8_t *dest) {
         if (!dest) return false;
 
+        if (mapping.valid()) {
+            const uint8_t *src = mapped(offset, count);
+            if (!src) return false;
+            memcpy(dest, src, count);
+            return true;
+        }
+        if (!fp) return false;
+
         int err = fseek(fp, offset, SEEK_SET);
         if (err != 0) {
             return false;
@@ -1552,21 +2170,11 @@ namespace FCam {
     }
 
     bool TiffFile::readShortArray(uint32_t offset, uint32_t count, uint16_t *dest) {
-        if (!dest) return false;
+        if (!dest || count > 0x7FFFFFFF) return false;
 
-        int err = fseek(fp, offset, SEEK_SET);
-        if (err != 0) {
-            return false;
-        }
-        size_t trueCount = fread(dest, sizeof(uint16_t), count, fp);
-        if (trueCount != count) return false;
+        if (!readByteArray(offset, count * sizeof(uint16_t), (uint8_t *)dest)) return false;
 
-        if (!littleEndian) {
-            for (size_t i=0; i < count; i++) {
-                uint16_t s = dest[i];
-                dest[i] = (s << 8) || (s >> 8);
-            }
-        }
+        if (!littleEndian) swapBytes16(dest, dest, count);
         return true;
     }
 
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <list>
 #include <vector>
 
 #include <FCam/Image.h>
@@ -17,6 +18,58 @@ namespace FCam {
     class TiffIfd;
     class TiffIfdEntry;
 
+    // Collects the contents of a TIFF file in file order, so that the
+    // layout of the whole file is known before any of it is
+    // written. Small pieces such as IFDs and tag data are copied into
+    // a buffer, while image data is referenced where it already
+    // is. flush then writes the file in one gathered pass straight
+    // from those buffers, without going through stdio.
+    class TiffWriter {
+    public:
+        TiffWriter();
+
+        // The file offset the next piece will be written at
+        uint32_t offset() const;
+
+        // Append a copy of count elements of size bytes each. Mirrors
+        // fwrite, and returns count.
+        size_t write(const void *data, size_t size, size_t count);
+        // Append bytes of the image without copying them. The image
+        // is kept alive until the writer is destroyed.
+        void reference(Image img, const void *data, size_t bytes);
+        // Append a block of data, taking over its contents and
+        // leaving the vector empty
+        void take(std::vector<uint8_t> *data);
+        // Pad to an even offset, which TIFF requires for data blocks
+        // and IFDs
+        void align();
+        // Overwrite a 32-bit value already appended with write
+        bool patch(uint32_t at, uint32_t value);
+
+        // Write everything out as a new file. With directIO, the data
+        // bypasses the page cache through an aligned staging buffer,
+        // if the platform and file system allow it.
+        bool flush(const std::string &file, bool directIO);
+    private:
+        struct Piece {
+            uint32_t offset;
+            size_t bytes;
+            // NULL for pieces copied into buffer, at bufferOffset
+            const uint8_t *data;
+            size_t bufferOffset;
+        };
+        std::vector<Piece> pieces;
+        std::vector<uint8_t> buffer;
+        std::vector<Image> images;
+        std::list<std::vector<uint8_t> > blocks;
+        uint32_t size;
+
+        const uint8_t *base(const Piece &piece) const;
+        void append(const uint8_t *data, size_t bytes);
+        bool writeGathered(int fd);
+        bool writeStaged(int fd);
+    };
+
     // A class representing a TIFF directory entry
     // Only reads in its data when asked for, which may require file IO
     class TiffIfdEntry {
@@ -47,9 +100,9 @@ namespace FCam {
         // Change the value of this entry
         bool setValue(const TagValue &);
         // Writes excess data to file, and updates local offset pointer
-        bool writeDataBlock(FILE *fw);
+        bool writeDataBlock(TiffWriter &out);
         // Writes entry to file. Assumes writeDataBlock has already been done to update entry offset field.
-        bool write(FILE *fw);
+        bool write(TiffWriter &out);
 
         bool operator<(const TiffIfdEntry &other) const;
     private:
@@ -69,6 +122,24 @@ namespace FCam {
         mutable TagValue val; // Cached value
     };
 
+    // How the image of a TIFF directory is stored in the file
+    struct TiffStorage {
+        TiffStorage(): compression(TIFF_Compression_Uncompressed), bitsPerSample(16),
+                       tileWidth(0), tileHeight(0), threads(1) {}
+
+        // TIFF_Compression_Uncompressed, or TIFF_Compression_JPEG
+        // for lossless JPEG. Only RAW images can be compressed.
+        uint16_t compression;
+        // The bits each uncompressed RAW sample is packed into: 10,
+        // 12, or 16. Larger values are clamped.
+        int bitsPerSample;
+        // The size of the tiles to store a RAW image in, which must be
+        // multiples of 16. Zero for strips.
+        int tileWidth, tileHeight;
+        // How many threads to compress strips or tiles with
+        int threads;
+    };
+
     // An object representing a TIFF directory, with accessors for
     // interpreting/constructing them
     class TiffIfd {
@@ -115,13 +186,26 @@ namespace FCam {
         // hasn't been read already. Optionally, use memory mapped IO to manage the image memory.
 	// This is only allowable for images that have been stored contiguously in the source file.
         Image getImage(bool memMap = true);
-        // Sets the image to be saved in this Ifd.
-        bool setImage(Image newImg);
+        // The rectangles of the image that are stored, and so can
+        // be decoded, as a unit. These are the tiles of a tiled
+        // image, and the strips of a striped one. Empty if there is
+        // no image.
+        std::vector<Rect> tiles();
+        // Decodes just one of the tiles or strips.
+        Image getTile(int index);
+        // Decodes just the part of the image within the given
+        // region, clipped to the image. Only the tiles or strips that
+        // overlap the region are read from the file.
+        Image getRegion(Rect region);
+
+        // Sets the image to be saved in this Ifd, and how to store
+        // it.
+        bool setImage(Image newImg, const TiffStorage &storage = TiffStorage());
 
         // Write all entries, subIFds, and image data to file
         // Retuns success/failure, and the starting location of the Ifd in
         // the file in offset.
-        bool write(FILE *fw, uint32_t prevIfdOffset, uint32_t *offset);
+        bool write(TiffWriter &out, uint32_t prevIfdOffset, uint32_t *offset);
     private:
         TiffFile * const parent;
 
@@ -137,16 +221,45 @@ namespace FCam {
             CACHED
         } imgState;
         Image imgCache;
+        TiffStorage storage;
+
+        // Where and how the image data is laid out in the file.
+        // Strips are treated as tiles as wide as the image, where the
+        // last may be cut short.
+        struct Layout {
+            ImageFormat fmt;
+            int width, height;
+            int compression;
+            int bitsPerSample; // Of RAW data
+            bool tiled;
+            int tileWidth, tileHeight;
+            int tilesAcross, tilesDown;
+            std::vector<int> offsets, byteCounts;
+
+            // The bytes in each row of an uncompressed tile
+            size_t bytesPerRow() const;
+            // The rows stored for a tile
+            int rows(int index) const;
+        };
+
+        // Reads the layout of the image, posting a warning if it
+        // can't be handled
+        bool getLayout(Layout *layout);
+        // Decodes the rows stored for a tile into dst
+        bool decodeTile(const Layout &layout, int index, unsigned char *dst, int dstBytesPerRow);
+        // Decodes a tile, and copies the part of it that overlaps an
+        // image at (dstX, dstY) into that image
+        bool copyTile(const Layout &layout, int index, Image dst, int dstX, int dstY);
 
         // Subfunction to write image data out, and to update the IFD
         // entry offsets for it
-        bool writeImage(FILE *fw);
+        bool writeImage(TiffWriter &out);
     };
 
     // High-level interface to reading and writing TIFF
     // files. Implemented functionality limited to those needed for
-    // DNG file access (uncompressed striped data, only a few color
-    // spaces)
+    // DNG file access (uncompressed, packed, or lossless JPEG striped
+    // data, only a few color spaces)
     class TiffFile {
     public:
 
@@ -154,8 +267,17 @@ namespace FCam {
         TiffFile();
         ~TiffFile();
 
-        bool readFrom(const std::string &file);
-        bool writeTo(const std::string &file);
+        // Reads in the directories of a TIFF file. With memMap, the
+        // whole file is memory mapped once, directories and tags are
+        // parsed straight from the mapping, and plain image data is
+        // handed out as views into it. Otherwise, or if mapping
+        // fails, the file is read through stdio.
+        bool readFrom(const std::string &file, bool memMap = true);
+        // Lays out the whole file, and then writes it in one
+        // pass. With directIO, the page cache is bypassed where
+        // possible. On success, the size of the file goes in *bytes,
+        // if given.
+        bool writeTo(const std::string &file, bool directIO = false, size_t *bytes = NULL);
 
         bool valid;
         const std::string &filename() const;
@@ -173,6 +295,9 @@ namespace FCam {
         Event lastEvent;
     private:
         FILE *fp;
+        // The whole file, when memory mapped
+        Image mapping;
+        uint32_t fileSize;
         std::string _filename;
 
         bool littleEndian;
@@ -189,6 +314,17 @@ namespace FCam {
         // Read an array of bytes from the file.
         bool readByteArray(uint32_t offset, uint32_t count, uint8_t *data);
 
+        // Get a pointer to count bytes of a memory mapped file, or
+        // NULL if the file isn't mapped, or the bytes aren't all in it
+        const uint8_t *mapped(uint32_t offset, uint32_t count) const;
+
+        // An image stored contiguously in the file, memory mapped
+        // rather than read in
+        Image mapImage(uint32_t offset, Size size, ImageFormat fmt);
+
+        // Close the file, and drop the mapping
+        void closeFile();
+
         // Read an array of shorts (probably image data) from the file into dest
         bool readShortArray(uint32_t offset, uint32_t count, uint16_t *dest);
 
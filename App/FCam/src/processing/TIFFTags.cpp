@@ -661,7 +661,7 @@ namespace FCam {
         },{
             "TileByteCounts",
             325,
-            TIFF_SHORT // or LONG
+            TIFF_LONG // or SHORT, but make sure to write LONG
             // N = TilesPerImage for PlanarConfiguration = 1
             // = SamplesPerPixel * TilesPerImage for PlanarConfiguration = 2
             // For each tile, the number of (compressed) bytes in that tile.
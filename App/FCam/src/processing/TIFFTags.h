@@ -69,6 +69,10 @@ namespace FCam {
     const uint16_t        TIFF_TAG_RowsPerStrip                        = 278;
     const uint16_t        TIFF_TAG_StripByteCounts                     = 279;
     const uint16_t        TIFF_TAG_PlanarConfiguration                 = 284;
+    const uint16_t        TIFF_TAG_TileWidth                           = 322;
+    const uint16_t        TIFF_TAG_TileLength                          = 323;
+    const uint16_t        TIFF_TAG_TileOffsets                         = 324;
+    const uint16_t        TIFF_TAG_TileByteCounts                      = 325;
     const uint16_t        TIFF_TAG_ResolutionUnit                      = 296;
     const uint16_t        TIFF_TAG_Software                            = 305;
     const uint16_t        TIFF_TAG_DateTime                            = 306;
@@ -0,0 +1,161 @@
+// benchmark.cpp - Throughput of the post-processing pipeline on
+// synthetic RAW frames.
+//
+// Every input is generated from a fixed seed, so runs on different
+// builds or machines see exactly the same data. Each operation is
+// timed on each frame size and bayer pattern, and the results are
+// printed one JSON object per line, for example:
+//
+// {"op": "demosaic", "width": 2592, "height": 1968, "pattern": "GRBG", "iterations": 10,
+//  "mpix_per_s": 180.52, "p50_ms": 28.26, "p99_ms": 30.12}
+//
+// Throughput is in megapixels of RAW input per second, at the median
+// time. Usage: benchmark [-n iterations] [-d directory for saved files]
+
+#include "FCam/FCam.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+using namespace FCam;
+
+Shot _shot;
+
+const std::string _string = "Benchmark";
+
+FCam::BayerPattern _bayerPattern = FCam::GRBG;
+
+class BenchmarkPlatform : public Platform {
+public:
+    FCam::BayerPattern bayerPattern() const {return _bayerPattern;}
+    unsigned short minRawValue() const {return 0;}
+    unsigned short maxRawValue() const {return 1023;}
+    void rawToRGBColorMatrix(int, float *m) const {
+        for (int i = 0; i < 12; i++) m[i] = (i % 5 == 0) ? 1 : 0;
+    }
+    const std::string &manufacturer() const {return _string;}
+    const std::string &model() const {return _string;}
+};
+
+BenchmarkPlatform _platform;
+
+class BenchmarkFrame : public _Frame {
+public:
+    const FCam::Shot &baseShot() const {return _shot;}
+    const FCam::Platform &platform() const {return _platform;}
+};
+
+// Fill a RAW image with a smooth gradient, some edges, and a little
+// noise, all from a fixed seed
+void makeInput(Image im, unsigned int seed) {
+    unsigned int state = seed;
+    for (unsigned int y = 0; y < im.height(); y++) {
+        unsigned short *px = (unsigned short *)im(0, y);
+        for (unsigned int x = 0; x < im.width(); x++) {
+            state = state * 1664525u + 1013904223u;
+            int v = (x * 512) / im.width() + (y * 256) / im.height();
+            if (((x / 64) + (y / 64)) & 1) v += 200;
+            v += (state >> 28) - 8;
+            px[x] = std::min(1023, std::max(0, v));
+        }
+    }
+}
+
+// The times taken by one operation, in microseconds
+struct Samples {
+    std::vector<int> times;
+
+    // The nearest-rank percentile, in milliseconds
+    float percentile(int p) {
+        std::sort(times.begin(), times.end());
+        int rank = (p * (int)times.size() + 99) / 100;
+        return times[std::max(rank, 1) - 1] / 1000.0f;
+    }
+};
+
+void report(const char *op, const Image &im, const char *pattern, Samples &s) {
+    float p50 = s.percentile(50);
+    float p99 = s.percentile(99);
+    float mpix = im.width() * im.height() / 1000000.0f;
+    printf("{\"op\": \"%s\", \"width\": %d, \"height\": %d, \"pattern\": \"%s\", \"iterations\": %d, "
+           "\"mpix_per_s\": %.2f, \"p50_ms\": %.2f, \"p99_ms\": %.2f}\n",
+           op, im.width(), im.height(), pattern, (int)s.times.size(),
+           p50 > 0 ? mpix / (p50 / 1000.0f) : 0.0f, p50, p99);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 10;
+    std::string dir = "/tmp";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-d directory for saved files]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const Size sizes[] = {Size(640, 480), Size(2592, 1968), Size(4000, 3000)};
+    const FCam::BayerPattern patterns[] = {RGGB, BGGR, GRBG, GBRG};
+    const char *patternNames[] = {"RGGB", "BGGR", "GRBG", "GBRG"};
+    std::string jpegName = dir + "/fcamBenchmark.jpg";
+    std::string dngName = dir + "/fcamBenchmark.dng";
+
+    for (int i = 0; i < 3; i++) {
+        Image input(sizes[i], RAW);
+        makeInput(input, 1 + i);
+
+        BenchmarkFrame *_f = new BenchmarkFrame;
+        _f->image = input;
+        Frame f(_f);
+
+        for (int p = 0; p < 4; p++) {
+            _bayerPattern = patterns[p];
+            Samples demosaicTimes, thumbnailTimes, jpegTimes, dngTimes;
+            for (int n = 0; n < iterations; n++) {
+                Time t = Time::now();
+                demosaic(f);
+                demosaicTimes.times.push_back(Time::now() - t);
+
+                t = Time::now();
+                makeThumbnail(f);
+                thumbnailTimes.times.push_back(Time::now() - t);
+
+                t = Time::now();
+                saveJPEG(f, jpegName);
+                jpegTimes.times.push_back(Time::now() - t);
+
+                t = Time::now();
+                saveDNG(f, dngName);
+                dngTimes.times.push_back(Time::now() - t);
+            }
+            report("demosaic", input, patternNames[p], demosaicTimes);
+            report("makeThumbnail", input, patternNames[p], thumbnailTimes);
+            report("saveJPEG", input, patternNames[p], jpegTimes);
+            report("saveDNG", input, patternNames[p], dngTimes);
+        }
+    }
+
+    unlink(jpegName.c_str());
+    unlink(dngName.c_str());
+
+    // Report anything that went wrong, since a failed operation
+    // would otherwise just look fast
+    Event e;
+    bool errors = false;
+    while (getNextEvent(&e, Event::Error)) {
+        errors = true;
+        fprintf(stderr, "** FCam error %d: %s\n", e.data, e.description.c_str());
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+// benchmarkQueue.cpp - Contention between threads passing items
+// through TSQueue and the lock-free ring queues.
+//
+// Each run has some producer threads pushing timestamped items as
+// fast as they can, and some consumer threads pulling them. The
+// throughput and the latency from push to pull are printed one JSON
+// object per line, for example:
+//
+// {"queue": "MPMCQueue", "producers": 4, "consumers": 4, "items": 1000000,
+//  "mitems_per_s": 5.12, "p50_us": 3, "p99_us": 41}
+//
+// Usage: benchmarkQueue [-n items per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+
+#include <FCam/TSQueue.h>
+#include <FCam/RingQueue.h>
+
+long long now() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+template<typename Q>
+struct Worker {
+    Q *queue;
+    int items;
+    // Latencies seen by a consumer, in microseconds
+    std::vector<int> latencies;
+};
+
+template<typename Q>
+void *produce(void *arg) {
+    Worker<Q> *w = (Worker<Q> *)arg;
+    for (int i = 0; i < w->items; i++) w->queue->push(now());
+    return NULL;
+}
+
+template<typename Q>
+void *consume(void *arg) {
+    Worker<Q> *w = (Worker<Q> *)arg;
+    while (1) {
+        long long sent = w->queue->pull();
+        if (sent < 0) break;
+        w->latencies.push_back((int)(now() - sent));
+    }
+    return NULL;
+}
+
+template<typename Q>
+void run(const char *name, Q *queue, int producers, int consumers, int items) {
+    std::vector<Worker<Q> > p(producers), c(consumers);
+    std::vector<pthread_t> pt(producers), ct(consumers);
+
+    long long start = now();
+    for (int i = 0; i < consumers; i++) {
+        c[i].queue = queue;
+        c[i].latencies.reserve(items);
+        pthread_create(&ct[i], NULL, consume<Q>, &c[i]);
+    }
+    for (int i = 0; i < producers; i++) {
+        p[i].queue = queue;
+        p[i].items = items / producers;
+        pthread_create(&pt[i], NULL, produce<Q>, &p[i]);
+    }
+    for (int i = 0; i < producers; i++) pthread_join(pt[i], NULL);
+    for (int i = 0; i < consumers; i++) queue->push(-1);
+    for (int i = 0; i < consumers; i++) pthread_join(ct[i], NULL);
+    long long elapsed = now() - start;
+
+    std::vector<int> latencies;
+    for (int i = 0; i < consumers; i++) {
+        latencies.insert(latencies.end(), c[i].latencies.begin(), c[i].latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    int n = latencies.size();
+    printf("{\"queue\": \"%s\", \"producers\": %d, \"consumers\": %d, \"items\": %d, "
+           "\"mitems_per_s\": %.2f, \"p50_us\": %d, \"p99_us\": %d}\n",
+           name, producers, consumers, n, n / (double)std::max(elapsed, 1LL),
+           n ? latencies[n/2] : 0, n ? latencies[(n*99)/100] : 0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    int items = 1000000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            items = std::max(1, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n items per run]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const int configs[][2] = {{1, 1}, {4, 1}, {1, 4}, {4, 4}};
+    for (int i = 0; i < 4; i++) {
+        int producers = configs[i][0], consumers = configs[i][1];
+        {
+            FCam::TSQueue<long long> q;
+            run("TSQueue", &q, producers, consumers, items);
+        }
+        {
+            FCam::MPMCQueue<long long> q(1024);
+            run("MPMCQueue", &q, producers, consumers, items);
+        }
+        if (producers == 1 && consumers == 1) {
+            FCam::SPSCQueue<long long> q(1024);
+            run("SPSCQueue", &q, producers, consumers, items);
+        }
+    }
+
+    return 0;
+}
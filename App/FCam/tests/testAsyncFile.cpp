@@ -0,0 +1,316 @@
+// testAsyncFile.cpp - Checks the AsyncFileWriter worker pool and its
+// byte budget, and the handles on each save's outcome
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <FCam/AsyncFile.h>
+#include <FCam/Event.h>
+
+// Wait for a writer to finish everything it has been given
+void drain(FCam::AsyncFileWriter &writer) {
+    while (writer.savesPending()) usleep(1000);
+}
+
+bool exists(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    fclose(f);
+    return true;
+}
+
+FCam::Image testImage(int width, int height, int seed) {
+    FCam::Image im(width, height, FCam::RGB24);
+    for (unsigned y = 0; y < im.height(); y++) {
+        for (unsigned x = 0; x < im.width()*3; x++) {
+            im(0, y)[x] = (unsigned char)(x*7 + y*3 + seed);
+        }
+    }
+    return im;
+}
+
+struct Completions {
+    Completions() : saved(0), failed(0), cancelled(0) {}
+    int saved, failed, cancelled;
+};
+
+// Callbacks run after a request stops counting as pending, so
+// wait for them separately
+void waitForCallbacks(const Completions &c, int count) {
+    for (int i = 0; i < 10000 && c.saved + c.failed + c.cancelled < count; i++) usleep(1000);
+}
+
+void countCompletion(FCam::AsyncSave save, void *context) {
+    Completions *c = (Completions *)context;
+    if (!save.done()) printf("Callback for %s ran before the save was done\n", save.filename().c_str());
+    switch (save.status()) {
+    case FCam::AsyncSave::Saved: __sync_fetch_and_add(&c->saved, 1); break;
+    case FCam::AsyncSave::Failed: __sync_fetch_and_add(&c->failed, 1); break;
+    case FCam::AsyncSave::Cancelled: __sync_fetch_and_add(&c->cancelled, 1); break;
+    default: break;
+    }
+}
+
+// Saves another image from each completion callback, until count
+// saves have finished
+struct Chain {
+    FCam::AsyncFileWriter *writer;
+    FCam::Image image;
+    int count, finished;
+};
+
+void chainSave(FCam::AsyncSave save, void *context) {
+    Chain *c = (Chain *)context;
+    if (save.status() != FCam::AsyncSave::Saved) {
+        printf("Chained save of %s finished with status %d\n", save.filename().c_str(), save.status());
+    }
+    if (__sync_add_and_fetch(&c->finished, 1) < c->count) {
+        c->writer->saveDump(c->image, "testAsyncFile_chain.dmp", chainSave, c);
+    }
+}
+
+int main(int argc, char **argv) {
+    bool failed = false;
+    char name[64];
+
+    // Several workers save a burst in parallel
+    {
+        FCam::AsyncFileWriterOptions options;
+        options.workers = 4;
+        FCam::AsyncFileWriter writer(options);
+        for (int i = 0; i < 8; i++) {
+            snprintf(name, 64, "testAsyncFile_%d.dmp", i);
+            unlink(name);
+            if (writer.saveDump(testImage(640, 480, i), name).status() == FCam::AsyncSave::Dropped) {
+                printf("Save %d was dropped with no budget set\n", i);
+                failed = true;
+            }
+        }
+        drain(writer);
+        if (writer.bytesPending()) {
+            printf("%d bytes still pending with no saves pending\n", (int)writer.bytesPending());
+            failed = true;
+        }
+        for (int i = 0; i < 8; i++) {
+            snprintf(name, 64, "testAsyncFile_%d.dmp", i);
+            if (!exists(name)) {
+                printf("%s was not saved\n", name);
+                failed = true;
+            }
+        }
+    }
+
+    FCam::Image big = testImage(2560, 1920, 0);
+    size_t bigBytes = big.bytesPerRow() * big.height();
+
+    // Blocking keeps the memory held within the budget
+    {
+        FCam::AsyncFileWriterOptions options;
+        options.workers = 2;
+        options.maxBytesPending = 2*bigBytes;
+        FCam::AsyncFileWriter writer(options);
+        for (int i = 0; i < 6; i++) {
+            snprintf(name, 64, "testAsyncFile_block_%d.jpg", i);
+            if (writer.saveJPEG(big, name).status() == FCam::AsyncSave::Dropped) {
+                printf("Blocking save %d was dropped\n", i);
+                failed = true;
+            }
+            if (writer.bytesPending() > options.maxBytesPending) {
+                printf("%d bytes pending, over the budget of %d\n",
+                       (int)writer.bytesPending(), (int)options.maxBytesPending);
+                failed = true;
+            }
+        }
+        drain(writer);
+        for (int i = 0; i < 6; i++) {
+            snprintf(name, 64, "testAsyncFile_block_%d.jpg", i);
+            if (!exists(name)) {
+                printf("%s was not saved\n", name);
+                failed = true;
+            }
+        }
+    }
+
+    // Dropping turns away what doesn't fit, with a warning each
+    {
+        FCam::Event e;
+        while (FCam::getNextEvent(&e));
+
+        FCam::AsyncFileWriterOptions options;
+        options.maxBytesPending = bigBytes;
+        options.overflow = FCam::AsyncFileWriterOptions::Drop;
+        FCam::AsyncFileWriter writer(options);
+        int dropped = 0;
+        for (int i = 0; i < 4; i++) {
+            snprintf(name, 64, "testAsyncFile_drop_%d.jpg", i);
+            FCam::AsyncSave save = writer.saveJPEG(big, name);
+            if (save.status() == FCam::AsyncSave::Dropped) {
+                if (!save.done() || save.bytesWritten()) {
+                    printf("Dropped save of %s isn't finished with nothing written\n", name);
+                    failed = true;
+                }
+                dropped++;
+            }
+        }
+        drain(writer);
+        if (dropped == 0) {
+            printf("No saves were dropped over the budget\n");
+            failed = true;
+        }
+        int warnings = 0;
+        while (FCam::getNextEvent(&e, FCam::Event::Warning)) {
+            if (e.data == FCam::Event::FileSaveWarning) warnings++;
+        }
+        if (warnings != dropped) {
+            printf("%d saves dropped, but %d warnings posted\n", dropped, warnings);
+            failed = true;
+        }
+    }
+
+    // Handles and callbacks report how each save went
+    {
+        FCam::AsyncFileWriterOptions options;
+        options.workers = 2;
+        Completions completions;
+        FCam::AsyncFileWriter writer(options);
+        FCam::AsyncSave saves[4];
+        for (int i = 0; i < 4; i++) {
+            snprintf(name, 64, "testAsyncFile_handle_%d.jpg", i);
+            saves[i] = writer.saveJPEG(big, name, 90, countCompletion, &completions);
+        }
+        FCam::AsyncSave missing = writer.saveDump(big, "no/such/directory/testAsyncFile.dmp",
+                                                  countCompletion, &completions);
+        for (int i = 0; i < 4; i++) {
+            if (saves[i].wait() != FCam::AsyncSave::Saved) {
+                printf("Save of %s finished with status %d\n", saves[i].filename().c_str(), saves[i].status());
+                failed = true;
+            }
+            FILE *f = fopen(saves[i].filename().c_str(), "rb");
+            long size = 0;
+            if (f) {
+                fseek(f, 0, SEEK_END);
+                size = ftell(f);
+                fclose(f);
+            }
+            if (size == 0 || (size_t)size != saves[i].bytesWritten()) {
+                printf("%s is %d bytes, but the handle says %d were written\n",
+                       saves[i].filename().c_str(), (int)size, (int)saves[i].bytesWritten());
+                failed = true;
+            }
+            if (saves[i].elapsed() <= 0) {
+                printf("Save of %s took no time\n", saves[i].filename().c_str());
+                failed = true;
+            }
+        }
+        if (missing.wait() != FCam::AsyncSave::Failed) {
+            printf("Save into a missing directory finished with status %d\n", missing.status());
+            failed = true;
+        }
+        drain(writer);
+        waitForCallbacks(completions, 5);
+        if (completions.saved != 4 || completions.failed != 1) {
+            printf("Callbacks saw %d saved and %d failed, expected 4 and 1\n",
+                   completions.saved, completions.failed);
+            failed = true;
+        }
+        // The failed save posts its reason as an error
+        FCam::Event e;
+        while (FCam::getNextEvent(&e, FCam::Event::Error));
+    }
+
+    // A callback can save again, even when the save that finished
+    // used the whole budget and there is only one worker to run both
+    {
+        FCam::AsyncFileWriterOptions options;
+        options.workers = 1;
+        FCam::Image small = testImage(640, 480, 0);
+        options.maxBytesPending = small.bytesPerRow() * small.height();
+        FCam::AsyncFileWriter writer(options);
+        Chain chain;
+        chain.writer = &writer;
+        chain.image = small;
+        chain.count = 4;
+        chain.finished = 0;
+        writer.saveDump(small, "testAsyncFile_chain.dmp", chainSave, &chain);
+        // A deadlock would never finish, so give up after a while
+        for (int i = 0; i < 30000 && __sync_fetch_and_add(&chain.finished, 0) < chain.count; i++) {
+            usleep(1000);
+        }
+        if (chain.finished < chain.count) {
+            printf("Only %d of %d chained saves finished\n", chain.finished, chain.count);
+            failed = true;
+            // The worker is stuck, and joining it would hang too
+            printf("AsyncFileWriter test failed\n");
+            fflush(stdout);
+            _exit(1);
+        }
+        drain(writer);
+        unlink("testAsyncFile_chain.dmp");
+    }
+
+    // The status comes from the writer itself rather than from how
+    // the file looks afterwards, so writing the same file again still
+    // counts as a save, and a write that fails once the file is open
+    // doesn't
+    {
+        FCam::AsyncFileWriter writer;
+        FCam::AsyncSave first = writer.saveDump(big, "testAsyncFile_again.dmp");
+        first.wait();
+        FCam::AsyncSave again = writer.saveDump(big, "testAsyncFile_again.dmp");
+        if (first.status() != FCam::AsyncSave::Saved || again.wait() != FCam::AsyncSave::Saved ||
+            again.bytesWritten() != first.bytesWritten()) {
+            printf("Saving the same file twice finished with status %d then %d, %d then %d bytes\n",
+                   first.status(), again.status(), (int)first.bytesWritten(), (int)again.bytesWritten());
+            failed = true;
+        }
+        if (access("/dev/full", W_OK) == 0) {
+            FCam::AsyncSave full = writer.saveDump(big, "/dev/full");
+            if (full.wait() != FCam::AsyncSave::Failed) {
+                printf("Save to a full device finished with status %d\n", full.status());
+                failed = true;
+            }
+        }
+        drain(writer);
+        unlink("testAsyncFile_again.dmp");
+        FCam::Event e;
+        while (FCam::getNextEvent(&e, FCam::Event::Error));
+    }
+
+    // Cancelling forgets the queued requests
+    {
+        Completions completions;
+        FCam::AsyncFileWriter writer;
+        for (int i = 0; i < 4; i++) {
+            snprintf(name, 64, "testAsyncFile_cancel_%d.jpg", i);
+            writer.saveJPEG(big, name, 75, countCompletion, &completions);
+        }
+        writer.cancel();
+        if (completions.cancelled < 3) {
+            printf("Only %d callbacks ran for cancelled saves\n", completions.cancelled);
+            failed = true;
+        }
+        if (writer.savesPending() > 1) {
+            printf("%d saves pending after cancelling\n", writer.savesPending());
+            failed = true;
+        }
+        drain(writer);
+        if (writer.bytesPending()) {
+            printf("%d bytes still pending after cancelling\n", (int)writer.bytesPending());
+            failed = true;
+        }
+    }
+
+    FCam::Event e;
+    while (FCam::getNextEvent(&e, FCam::Event::Error)) {
+        printf("** FCam error [%d] %d at %s: %s\n", e.type, e.data, e.time.toString().c_str(), e.description.c_str());
+        failed = true;
+    }
+
+    if (failed) {
+        printf("AsyncFileWriter test failed\n");
+        return 1;
+    }
+    printf("AsyncFileWriter test passed\n");
+    return 0;
+}
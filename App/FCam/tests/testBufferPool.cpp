@@ -0,0 +1,104 @@
+// testBufferPool.cpp - Checks that AutoAllocate frames from the
+// dummy sensor come out of its buffer pool, go back to it when the
+// last reference is dropped, and fall back to normal allocation when
+// the pool runs dry or a frame doesn't fit.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+#include <FCam/Dummy.h>
+
+bool check(bool ok, const char *what, const FCam::Sensor::BufferPoolStats &s) {
+    if (!ok) {
+        printf("%s: %d buffers, %d available, %u hits, %u waits, %u misses\n",
+               what, s.buffers, s.available, s.hits, s.waits, s.misses);
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    FCam::Dummy::Sensor sensor;
+    FCam::Size size(640, 480);
+    sensor.setBufferPool(3, size, FCam::RAW, true, 1000);
+
+    FCam::Sensor::BufferPoolStats s = sensor.bufferPoolStats();
+    ok &= check(s.buffers == 3 && s.available == 3, "New pool", s);
+
+    FCam::Dummy::Shot shot;
+    shot.testPattern = FCam::Dummy::BARS;
+    shot.exposure = 1000;
+    shot.frameTime = 1000;
+    shot.image = FCam::Image(size, FCam::RAW, FCam::Image::AutoAllocate);
+
+    // Frames dropped straight away keep reusing the same buffers
+    std::vector<unsigned char *> seen;
+    for (int i = 0; i < 10; i++) {
+        sensor.capture(shot);
+        FCam::Dummy::Frame f = sensor.getFrame();
+        if (!f.image().valid() || (uintptr_t)f.image()(0, 0) % getpagesize()) {
+            printf("Frame %d has no page-aligned image\n", i);
+            ok = false;
+        }
+        bool known = false;
+        for (size_t j = 0; j < seen.size(); j++) known |= (seen[j] == f.image()(0, 0));
+        if (!known) seen.push_back(f.image()(0, 0));
+    }
+    s = sensor.bufferPoolStats();
+    ok &= check(s.hits == 10 && s.misses == 0 && s.available == 3 && seen.size() <= 3,
+                "Dropping frames", s);
+
+    // Holding on to frames drains the pool, after which frames are
+    // allocated normally
+    {
+        std::vector<FCam::Frame> held;
+        for (int i = 0; i < 5; i++) {
+            sensor.capture(shot);
+            held.push_back(sensor.getFrame());
+            if (!held.back().image().valid()) {
+                printf("Held frame %d has no image\n", i);
+                ok = false;
+            }
+        }
+        s = sensor.bufferPoolStats();
+        ok &= check(s.hits == 13 && s.misses == 2 && s.waits == 2 && s.available == 0,
+                    "Holding frames", s);
+
+        // A copy of the image keeps the buffer out after the frame goes
+        FCam::Image kept = held[0].image();
+        held.clear();
+        s = sensor.bufferPoolStats();
+        ok &= check(s.available == 2, "Keeping an image", s);
+    }
+    s = sensor.bufferPoolStats();
+    ok &= check(s.available == 3, "Releasing everything", s);
+
+    // Frames bigger than the buffers don't come from the pool
+    shot.image = FCam::Image(FCam::Size(1280, 960), FCam::RAW, FCam::Image::AutoAllocate);
+    sensor.capture(shot);
+    FCam::Frame big = sensor.getFrame();
+    s = sensor.bufferPoolStats();
+    ok &= check(big.image().valid() && s.misses == 3 && s.waits == 2, "Oversized frame", s);
+
+    // Frames outlive the pool that made them
+    shot.image = FCam::Image(size, FCam::RAW, FCam::Image::AutoAllocate);
+    sensor.capture(shot);
+    FCam::Frame last = sensor.getFrame();
+    sensor.setBufferPool(0, size, FCam::RAW);
+    s = sensor.bufferPoolStats();
+    ok &= check(s.buffers == 0 && last.image().valid(), "Removing the pool", s);
+    *last.image()(0, 0) = 1;
+
+    FCam::Event e;
+    while (FCam::getNextEvent(&e)) {
+        printf("Event: %s\n", e.description.c_str());
+    }
+
+    if (!ok) {
+        printf("Buffer pool test failed\n");
+        return 1;
+    }
+    printf("Buffer pool test passed\n");
+    return 0;
+}
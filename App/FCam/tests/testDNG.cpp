@@ -1,5 +1,221 @@
 #include <FCam/Dummy.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../src/processing/TIFF.h"
+#include "../src/processing/LosslessJPEG.h"
+
+// Check that two RAW images are identical
+bool sameRaw(FCam::Image a, FCam::Image b, const std::string &filename) {
+    if (a.size() != b.size() || b.type() != FCam::RAW) {
+        printf("%s has the wrong image size or type\n", filename.c_str());
+        return false;
+    }
+    for (unsigned y = 0; y < a.height(); y++) {
+        unsigned short *pa = (unsigned short *)a(0, y), *pb = (unsigned short *)b(0, y);
+        for (unsigned x = 0; x < a.width(); x++) {
+            if (pa[x] != pb[x]) {
+                printf("%s differs at %d %d: %d instead of %d\n",
+                       filename.c_str(), x, y, pb[x], pa[x]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Save a frame as a compressed or packed DNG, load it back both
+// eagerly and lazily, and check that the RAW data survived exactly. Returns the size of the file, or
+// zero on failure.
+long roundTrip(FCam::Frame frame, const std::string &filename, const FCam::DNGOptions &options) {
+    FCam::saveDNG(frame, filename, options);
+
+    FCam::DNGFrame loaded = FCam::loadDNG(filename);
+    if (!loaded.valid()) {
+        printf("Error loading DNG %s\n", filename.c_str());
+        return 0;
+    }
+    if (!sameRaw(frame.image(), loaded.image(), filename)) return 0;
+
+    // And again with the RAW data read on demand
+    FCam::DNGFrame lazy = FCam::loadDNGMetadata(filename);
+    if (!lazy.valid() || !lazy.thumbnail().valid()) {
+        printf("Error loading DNG metadata from %s\n", filename.c_str());
+        return 0;
+    }
+    if (!sameRaw(frame.image(), lazy.image(), filename + " (lazy)")) return 0;
+
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return 0;
+    return st.st_size;
+}
+
+// Load a region of a DNG, and check it matches the same region of
+// the RAW image it was saved from
+bool sameRegion(FCam::Image full, const std::string &filename, FCam::Rect region) {
+    FCam::Image loaded = FCam::loadDNGRegion(filename, region);
+    if (!loaded.valid()) {
+        printf("Error loading a region of DNG %s\n", filename.c_str());
+        return false;
+    }
+    FCam::Image expected(region.width, region.height, FCam::RAW);
+    for (int y = 0; y < region.height; y++) {
+        memcpy(expected(0, y), full(region.x, region.y + y), region.width * 2);
+    }
+    return sameRaw(expected, loaded, filename + " region");
+}
+
+// Writers of big-endian TIFF fields
+void putShort(std::vector<unsigned char> &out, unsigned short v) {
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+void putLong(std::vector<unsigned char> &out, unsigned int v) {
+    putShort(out, v >> 16);
+    putShort(out, v);
+}
+
+void putEntry(std::vector<unsigned char> &out, unsigned short tag, unsigned short type,
+              unsigned int count, unsigned int value) {
+    putShort(out, tag);
+    putShort(out, type);
+    putLong(out, count);
+    // Short values sit at the start of the value field
+    if (type == FCam::TIFF_SHORT && count == 1) {
+        putShort(out, value);
+        putShort(out, 0);
+    } else {
+        putLong(out, value);
+    }
+}
+
+// Write a big-endian TIFF, as other tools may, with a 16-bit RAW
+// image in two strips in IFD0 and an RGB thumbnail in IFD1. Then
+// check that it reads back right, memory mapped or not.
+bool testBigEndian(const std::string &filename) {
+    const int width = 64, height = 10, rowsPerStrip = 5;
+    const int thumbWidth = 4, thumbHeight = 2;
+    const unsigned int rawOffset = 8, rawBytes = width * height * 2;
+    const unsigned int thumbOffset = rawOffset + rawBytes, thumbBytes = thumbWidth * thumbHeight * 3;
+    const unsigned int arraysOffset = thumbOffset + thumbBytes;
+    const unsigned int ifd0Offset = arraysOffset + 4 * 4 + 3 * 2;
+    const unsigned int ifd1Offset = ifd0Offset + 2 + 10 * 12 + 4;
+
+    std::vector<unsigned char> out;
+    out.push_back('M');
+    out.push_back('M');
+    putShort(out, 42);
+    putLong(out, ifd0Offset);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) putShort(out, x * 97 + y * 1031);
+    }
+    for (unsigned int i = 0; i < thumbBytes; i++) out.push_back(i * 11);
+
+    // Strip offsets and byte counts, and the thumbnail bits per sample
+    putLong(out, rawOffset);
+    putLong(out, rawOffset + rawBytes / 2);
+    putLong(out, rawBytes / 2);
+    putLong(out, rawBytes / 2);
+    for (int i = 0; i < 3; i++) putShort(out, 8);
+
+    putShort(out, 10);
+    putEntry(out, FCam::TIFF_TAG_NewSubFileType, FCam::TIFF_LONG, 1, FCam::TIFF_NewSubfileType_FullRAW);
+    putEntry(out, FCam::TIFF_TAG_ImageWidth, FCam::TIFF_LONG, 1, width);
+    putEntry(out, FCam::TIFF_TAG_ImageLength, FCam::TIFF_LONG, 1, height);
+    putEntry(out, FCam::TIFF_TAG_BitsPerSample, FCam::TIFF_SHORT, 1, 16);
+    putEntry(out, FCam::TIFF_TAG_Compression, FCam::TIFF_SHORT, 1, FCam::TIFF_Compression_Uncompressed);
+    putEntry(out, FCam::TIFF_TAG_PhotometricInterpretation, FCam::TIFF_SHORT, 1, FCam::TIFF_PhotometricInterpretation_CFA);
+    putEntry(out, FCam::TIFF_TAG_StripOffsets, FCam::TIFF_LONG, 2, arraysOffset);
+    putEntry(out, FCam::TIFF_TAG_SamplesPerPixel, FCam::TIFF_SHORT, 1, 1);
+    putEntry(out, FCam::TIFF_TAG_RowsPerStrip, FCam::TIFF_LONG, 1, rowsPerStrip);
+    putEntry(out, FCam::TIFF_TAG_StripByteCounts, FCam::TIFF_LONG, 2, arraysOffset + 8);
+    putLong(out, ifd1Offset);
+
+    putShort(out, 9);
+    putEntry(out, FCam::TIFF_TAG_NewSubFileType, FCam::TIFF_LONG, 1, FCam::TIFF_NewSubfileType_MainPreview);
+    putEntry(out, FCam::TIFF_TAG_ImageWidth, FCam::TIFF_SHORT, 1, thumbWidth);
+    putEntry(out, FCam::TIFF_TAG_ImageLength, FCam::TIFF_SHORT, 1, thumbHeight);
+    putEntry(out, FCam::TIFF_TAG_BitsPerSample, FCam::TIFF_SHORT, 3, arraysOffset + 16);
+    putEntry(out, FCam::TIFF_TAG_Compression, FCam::TIFF_SHORT, 1, FCam::TIFF_Compression_Uncompressed);
+    putEntry(out, FCam::TIFF_TAG_PhotometricInterpretation, FCam::TIFF_SHORT, 1, FCam::TIFF_PhotometricInterpretation_RGB);
+    putEntry(out, FCam::TIFF_TAG_StripOffsets, FCam::TIFF_LONG, 1, thumbOffset);
+    putEntry(out, FCam::TIFF_TAG_SamplesPerPixel, FCam::TIFF_SHORT, 1, 3);
+    putEntry(out, FCam::TIFF_TAG_StripByteCounts, FCam::TIFF_LONG, 1, thumbBytes);
+    putLong(out, 0);
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+    fwrite(&out[0], 1, out.size(), f);
+    fclose(f);
+
+    FCam::Image expected(width, height, FCam::RAW);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            ((unsigned short *)expected(x, y))[0] = x * 97 + y * 1031;
+        }
+    }
+
+    for (int memMap = 0; memMap < 2; memMap++) {
+        FCam::TiffFile tiff;
+        if (!tiff.readFrom(filename, memMap) || tiff.ifds().size() != 2) {
+            printf("Error reading big-endian TIFF %s\n", filename.c_str());
+            return false;
+        }
+        if (!sameRaw(expected, tiff.ifds(0)->getImage(), filename)) return false;
+        FCam::Image thumb = tiff.ifds(1)->getImage();
+        if (thumb.size() != FCam::Size(thumbWidth, thumbHeight) || thumb.type() != FCam::RGB24) {
+            printf("%s has the wrong thumbnail size or type\n", filename.c_str());
+            return false;
+        }
+        for (unsigned int i = 0; i < thumbBytes; i++) {
+            if (thumb(0, 0)[i] != (unsigned char)(i * 11)) {
+                printf("%s has the wrong thumbnail data\n", filename.c_str());
+                return false;
+            }
+        }
+    }
+
+    // Across the strip boundary
+    FCam::Rect region(10, 3, 20, 5);
+    return sameRegion(expected, filename, region);
+}
+
+// Check that lossless JPEG streams whose scan selects a Huffman table
+// out of range, or one no DHT defined, are rejected instead of read
+bool testHuffmanSelectors() {
+    const int width = 16, height = 4;
+    uint16_t in[width * height], out[width * height];
+    for (int i = 0; i < width * height; i++) in[i] = i * 37;
+    std::vector<uint8_t> jpeg;
+    FCam::encodeLosslessJPEG(in, width, width, height, &jpeg);
+    if (!FCam::decodeLosslessJPEG(&jpeg[0], jpeg.size(), out, width, width, height) ||
+        memcmp(in, out, sizeof(in))) {
+        printf("Lossless JPEG round trip failed\n");
+        return false;
+    }
+
+    size_t sos = 0;
+    while (sos + 1 < jpeg.size() && !(jpeg[sos] == 0xFF && jpeg[sos + 1] == 0xDA)) sos++;
+    if (sos + 7 > jpeg.size()) {
+        printf("Lossless JPEG stream has no scan\n");
+        return false;
+    }
+    // The table selector of the first component of the scan
+    uint8_t selectors[] = {0x10, 0x30, 0x50, 0xF0};
+    for (size_t i = 0; i < sizeof(selectors); i++) {
+        std::vector<uint8_t> bad = jpeg;
+        bad[sos + 6] = selectors[i];
+        if (FCam::decodeLosslessJPEG(&bad[0], bad.size(), out, width, width, height)) {
+            printf("Lossless JPEG with Huffman table selector %d was not rejected\n", selectors[i] >> 4);
+            return false;
+        }
+    }
+    return true;
+}
 
 int main(int argc, char **argv) {
 
@@ -131,6 +347,108 @@ int main(int argc, char **argv) {
         }
     }
 
+    printf("Testing lossless JPEG compressed DNGs\n");
+    FCam::DNGOptions compressed;
+    compressed.compress = true;
+    compressed.threads = 0;
+    struct stat uncompressed;
+    stat(test1DNGName.c_str(), &uncompressed);
+    long size = roundTrip(frame, "testDNG_3.dng", compressed);
+    if (!size) return 1;
+    printf("Checkerboard: %ld bytes, uncompressed %ld bytes\n", size, (long)uncompressed.st_size);
+    if (size >= uncompressed.st_size) {
+        printf("Compression made the DNG no smaller\n");
+        return 1;
+    }
+
+    // Noise in 10 bits, which compresses a little, and alternating
+    // extremes of 16 bits, which exercise the largest differences
+    FCam::Image raw = frame.image();
+    unsigned int state = 1;
+    for (unsigned y = 0; y < raw.height(); y++) {
+        unsigned short *px = (unsigned short *)raw(0, y);
+        for (unsigned x = 0; x < raw.width(); x++) {
+            state = state * 1664525u + 1013904223u;
+            px[x] = state >> 22;
+        }
+    }
+    size = roundTrip(frame, "testDNG_4.dng", compressed);
+    if (!size) return 1;
+    printf("10-bit noise: %ld bytes\n", size);
+
+    if (!testHuffmanSelectors()) return 1;
+
+    printf("Testing packed DNGs and dumps\n");
+    FCam::DNGOptions packed;
+    packed.pack = true;
+    size = roundTrip(frame, "testDNG_6.dng", packed);
+    if (!size) return 1;
+    printf("10-bit noise, packed: %ld bytes\n", size);
+    if (size >= uncompressed.st_size) {
+        printf("Packing made the DNG no smaller\n");
+        return 1;
+    }
+    for (int bits = 10; bits <= 12; bits += 2) {
+        FCam::saveDump(frame, "testDump_3.tmp", bits);
+        if (!sameRaw(raw, FCam::loadDump("testDump_3.tmp"), "Packed dump")) return 1;
+    }
+
+    printf("Testing tiled DNGs and regions\n");
+    // The image size isn't a multiple of the tile size, so the
+    // right and bottom tiles are padded
+    FCam::Rect regions[] = {FCam::Rect(0, 0, 256, 256),
+                            FCam::Rect(250, 500, 300, 20),
+                            FCam::Rect(2900, 1900, 100, 100),
+                            FCam::Rect(1000, 1000, 1, 1)};
+    FCam::DNGOptions tiled = compressed;
+    tiled.tileWidth = tiled.tileHeight = 256;
+    size = roundTrip(frame, "testDNG_7.dng", tiled);
+    if (!size) return 1;
+    printf("10-bit noise, compressed in tiles: %ld bytes\n", size);
+    tiled.compress = false;
+    tiled.pack = true;
+    size = roundTrip(frame, "testDNG_8.dng", tiled);
+    if (!size) return 1;
+    printf("10-bit noise, packed in tiles: %ld bytes\n", size);
+
+    printf("Testing big-endian files\n");
+    if (!testBigEndian("testDNG_10.tif")) return 1;
+
+    printf("Testing direct IO DNGs\n");
+    // Falls back to buffered writes where direct IO isn't supported
+    FCam::DNGOptions direct;
+    direct.directIO = true;
+    size = roundTrip(frame, "testDNG_9.dng", direct);
+    if (!size) return 1;
+    printf("10-bit noise, direct IO: %ld bytes\n", size);
+    if (!sameRegion(raw, "testDNG_9.dng", regions[1])) return 1;
+
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        if (!sameRegion(raw, "testDNG_4.dng", regions[i])) return 1;
+        if (!sameRegion(raw, "testDNG_6.dng", regions[i])) return 1;
+        if (!sameRegion(raw, "testDNG_7.dng", regions[i])) return 1;
+        if (!sameRegion(raw, "testDNG_8.dng", regions[i])) return 1;
+    }
+
+    for (unsigned y = 0; y < raw.height(); y++) {
+        unsigned short *px = (unsigned short *)raw(0, y);
+        for (unsigned x = 0; x < raw.width(); x++) {
+            px[x] = ((x + y) & 2) ? 65535 : 0;
+        }
+    }
+    size = roundTrip(frame, "testDNG_5.dng", compressed);
+    if (!size) return 1;
+    printf("16-bit extremes: %ld bytes\n", size);
+
+    while (FCam::getNextEvent(&e, FCam::Event::Error)) {
+        errors = true;
+        printf("** FCam error [%d] %d at %s: %s\n", e.type, e.data, e.time.toString().c_str(), e.description.c_str());
+    }
+    if (errors) {
+        printf("Error saving or loading compressed or packed files.\n");
+        return 1;
+    }
+
     printf("Done with test. Compare two DNGs for equality.\n");
 
     return 0;
@@ -1,6 +1,13 @@
 #include "FCam/FCam.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef FCAM_ARCH_X86
+#include "../src/processing/Demosaic_X86.h"
+#endif
 
 using namespace FCam;
 
@@ -13,10 +20,12 @@ float _colorMatrix[12] = {
 
 const std::string _string = "Test";
 
-class TestFrame : public _Frame {
+FCam::BayerPattern _bayerPattern = FCam::GRBG;
+
+class TestPlatform : public Platform {
 public:
-    const FCam::Shot &baseShot() const {return _shot;}
-    FCam::BayerPattern bayerPattern() const {return FCam::GRBG;}
+    FCam::BayerPattern bayerPattern() const {return _bayerPattern;}
+    unsigned short minRawValue() const {return 0;}
     unsigned short maxRawValue() const {return 1023;}
     void rawToRGBColorMatrix(int, float *m) const {
         for (int i = 0; i < 12; i++) m[i] = _colorMatrix[i];
@@ -25,6 +34,14 @@ public:
     const std::string &model() const {return _string;}
 };
 
+TestPlatform _platform;
+
+class TestFrame : public _Frame {
+public:
+    const FCam::Shot &baseShot() const {return _shot;}
+    const FCam::Platform &platform() const {return _platform;}
+};
+
 int main(int argc, const char **argv) {
     
     TestFrame *_f = new TestFrame;
@@ -86,6 +103,280 @@ int main(int argc, const char **argv) {
     
     printf("%d\n", (Time::now() - t1)/4000);
 
+    printf("Testing threaded demosaic matches serial demosaic\n");
+    data = (short *)in(0,0);
+    for (unsigned int i = 0; i < in.width()*in.height(); i++) {
+        *data++ = (i * 2654435761u) >> 22;
+    }
+    Image serial = demosaic(f);
+    DemosaicOptions options;
+    options.threads = 0;
+    Image threaded = demosaic(f, options);
+    for (unsigned int y = 0; y < serial.height(); y++) {
+        if (memcmp(serial(0, y), threaded(0, y), serial.width()*3)) {
+            printf("Threaded demosaic differs from serial demosaic on row %d\n", y);
+            return 1;
+        }
+    }
+
+    printf("Testing threaded demosaic speed\n");
+    t1 = Time::now();
+    for (int i = 0; i < 4; i++) {
+        demosaic(f, options);
+    }
+    printf("%d\n", (Time::now() - t1)/4000);
+
+    printf("Testing fixed point demosaic is within 1 LSB of floating point\n");
+    // Once with a linear response curve, where one step of linear
+    // value is a quarter of an output LSB, and once with the default
+    // curve, which is much steeper than that in the shadows
+    DemosaicOptions curves[2];
+    curves[0].contrast = 0;
+    curves[0].gamma = 1;
+    curves[0].blackLevel = 0;
+    const char *curveNames[] = {"linear", "default"};
+    // The high quality methods take the option too, and must keep to
+    // the same bound
+    DemosaicMethod curveMethods[] = {DemosaicFast, DemosaicAHD, DemosaicVNG};
+    const char *curveMethodNames[] = {"fast", "AHD", "VNG"};
+#ifdef FCAM_ARCH_X86
+    // The vector kernels always convert in floating point, so only
+    // the scalar code has a fixed point path to test
+    forceDemosaicKernel_X86(ForceScalar_X86);
+#endif
+    for (int c = 0; c < 6; c++) {
+        DemosaicOptions curveFloat = curves[c % 2];
+        curveFloat.method = curveMethods[c / 2];
+        DemosaicOptions curveFixed = curveFloat;
+        curveFixed.fixedPoint = true;
+        _colorMatrix[1] = -0.3f;
+        _colorMatrix[3] = 7.5f;
+        _colorMatrix[6] = 0.45f;
+        _colorMatrix[8] = 0.2f;
+        Image floating = demosaic(f, curveFloat);
+        Image fixed = demosaic(f, curveFixed);
+        for (int i = 0; i < 12; i++) _colorMatrix[i] = (i % 5 == 0) ? 1 : 0;
+        if (fixed.size() != floating.size()) {
+            printf("Fixed point %s demosaic produced a different size image\n", curveMethodNames[c / 2]);
+            return 1;
+        }
+        for (unsigned int y = 0; y < fixed.height(); y++) {
+            for (unsigned int x = 0; x < fixed.width()*3; x++) {
+                if (abs(fixed(0, y)[x] - floating(0, y)[x]) > 1) {
+                    printf("Fixed point %s demosaic with the %s curve differs by %d at byte %d of row %d\n", 
+                           curveMethodNames[c / 2], curveNames[c % 2],
+                           fixed(0, y)[x] - floating(0, y)[x], x, y);
+                    return 1;
+                }
+            }
+        }
+    }
+#ifdef FCAM_ARCH_X86
+    forceDemosaicKernel_X86(ForceDefault_X86);
+#endif
+
+#ifdef FCAM_ARCH_X86
+    printf("Testing vectorized demosaic kernels match the scalar demosaic\n");
+    {
+        // The dispatch always picks a vector kernel on a CPU that has
+        // one, so force each in turn. They ignore the fixed point
+        // option, so they must match the floating point scalar
+        // output either way.
+        const ForcedDemosaicKernel_X86 kernels[] = {ForceSSE41_X86, ForceAVX2_X86};
+        const char *kernelNames[] = {"SSE4.1", "AVX2"};
+        FCam::BayerPattern allPatterns[] = {GRBG, RGGB, BGGR, GBRG};
+        _colorMatrix[1] = -0.3f;
+        _colorMatrix[3] = 7.5f;
+        _colorMatrix[6] = 0.45f;
+        _colorMatrix[8] = 0.2f;
+        for (int p = 0; p < 4; p++) {
+            _bayerPattern = allPatterns[p];
+            for (int mode = 0; mode < 4; mode++) {
+                DemosaicOptions kernelOptions;
+                kernelOptions.fixedPoint = mode & 1;
+                kernelOptions.denoise = mode & 2;
+                DemosaicOptions scalarOptions = kernelOptions;
+                scalarOptions.fixedPoint = false;
+                forceDemosaicKernel_X86(ForceScalar_X86);
+                Image scalar = demosaic(f, scalarOptions);
+                for (int k = 0; k < 2; k++) {
+                    if (!forceDemosaicKernel_X86(kernels[k])) continue;
+                    Image vector = demosaic(f, kernelOptions);
+                    for (unsigned int y = 0; y < scalar.height(); y++) {
+                        if (memcmp(scalar(0, y), vector(0, y), scalar.width()*3)) {
+                            printf("%s demosaic of bayer pattern %d with%s fixed point and%s denoising "
+                                   "differs from scalar on row %d\n", kernelNames[k], allPatterns[p],
+                                   kernelOptions.fixedPoint ? "" : "out",
+                                   kernelOptions.denoise ? "" : " no", y);
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+        forceDemosaicKernel_X86(ForceDefault_X86);
+        _bayerPattern = GRBG;
+        for (int i = 0; i < 12; i++) _colorMatrix[i] = (i % 5 == 0) ? 1 : 0;
+    }
+#endif
+
+    printf("Testing fixed point demosaic speed\n");
+    DemosaicOptions fixedOptions;
+    fixedOptions.fixedPoint = true;
+    t1 = Time::now();
+    for (int i = 0; i < 4; i++) {
+        demosaic(f, fixedOptions);
+    }
+    printf("%d\n", (Time::now() - t1)/4000);
+
+    printf("Testing other bayer patterns match mirrored GRBG\n");
+    // RGGB is GRBG flipped horizontally, BGGR is GRBG flipped
+    // vertically, and GBRG is GRBG flipped both ways
+    FCam::BayerPattern patterns[] = {RGGB, BGGR, GBRG};
+    Image mirrored(in.size(), RAW);
+    for (int i = 0; i < 3; i++) {
+        bool flipX = patterns[i] != BGGR;
+        bool flipY = patterns[i] != RGGB;
+        for (unsigned int y = 0; y < in.height(); y++) {
+            for (unsigned int x = 0; x < in.width(); x++) {
+                ((short *)mirrored(flipX ? in.width()-1-x : x, flipY ? in.height()-1-y : y))[0] = 
+                    ((short *)in(x, y))[0];
+            }
+        }
+        _bayerPattern = patterns[i];
+        _f->image = mirrored;
+        Image out = demosaic(f);
+        _bayerPattern = GRBG;
+        _f->image = in;
+        if (out.size() != serial.size()) {
+            printf("Bayer pattern %d produced a %dx%d image instead of %dx%d\n", 
+                   patterns[i], out.width(), out.height(), serial.width(), serial.height());
+            return 1;
+        }
+        for (unsigned int y = 0; y < out.height(); y++) {
+            for (unsigned int x = 0; x < out.width(); x++) {
+                unsigned char *expected = serial(flipX ? out.width()-1-x : x, 
+                                                 flipY ? out.height()-1-y : y);
+                if (memcmp(out(x, y), expected, 3)) {
+                    printf("Bayer pattern %d differs from mirrored GRBG at %d, %d\n", patterns[i], x, y);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    printf("Testing strip demosaic matches whole frame demosaic\n");
+    DemosaicStream stream(f, DemosaicOptions(), 48);
+    if (stream.size() != serial.size() || stream.stripHeight() != 48) {
+        printf("Strip demosaic has the wrong geometry\n");
+        return 1;
+    }
+    Image ring(stream.size().width, 2*stream.stripHeight(), RGB24);
+    int y = 0;
+    while (int rows = stream.next(ring)) {
+        for (int i = 0; i < rows; i++) {
+            if (memcmp(ring(0, (y+i) % ring.height()), serial(0, y+i), serial.width()*3)) {
+                printf("Strip demosaic differs from whole frame demosaic on row %d\n", y+i);
+                return 1;
+            }
+        }
+        y += rows;
+    }
+    if (y != (int)serial.height()) {
+        printf("Strip demosaic produced %d rows instead of %d\n", y, serial.height());
+        return 1;
+    }
+
+    printf("Testing region of interest demosaic matches a crop of the full demosaic\n");
+    Rect rois[] = {Rect(0, 0, 40, 24), Rect(1001, 333, 517, 61), 
+                   Rect(-10, 1800, 100, 1000), Rect(2500, 7, 1000, 1)};
+    for (int i = 0; i < 4; i++) {
+        Image roi = demosaic(f, rois[i]);
+        int x0 = std::max(rois[i].x, 0), y0 = std::max(rois[i].y, 0);
+        int x1 = std::min(rois[i].x + rois[i].width, (int)serial.width());
+        int y1 = std::min(rois[i].y + rois[i].height, (int)serial.height());
+        if (roi.size() != Size(x1 - x0, y1 - y0)) {
+            printf("Region of interest demosaic %d produced a %dx%d image\n", i, roi.width(), roi.height());
+            return 1;
+        }
+        for (unsigned int y = 0; y < roi.height(); y++) {
+            if (memcmp(roi(0, y), serial(x0, y0 + y), roi.width()*3)) {
+                printf("Region of interest demosaic %d differs on row %d\n", i, y);
+                return 1;
+            }
+        }
+    }
+
+    printf("Testing high quality demosaic methods\n");
+    DemosaicMethod methods[] = {DemosaicAHD, DemosaicVNG};
+    const char *methodNames[] = {"AHD", "VNG"};
+    for (int i = 0; i < 2; i++) {
+        DemosaicOptions hq;
+        hq.method = methods[i];
+        Image out = demosaic(f, hq);
+        if (out.size() != serial.size()) {
+            printf("%s demosaic produced a %dx%d image\n", methodNames[i], out.width(), out.height());
+            return 1;
+        }
+
+        // Each row of blocks reads past its apron, which must not
+        // depend on how the frame is split up
+        Image roi = demosaic(f, rois[1], hq);
+        for (unsigned int y = 0; y < roi.height(); y++) {
+            if (memcmp(roi(0, y), out(rois[1].x, rois[1].y + y), roi.width()*3)) {
+                printf("%s region of interest demosaic differs on row %d\n", methodNames[i], y);
+                return 1;
+            }
+        }
+
+        // GBRG is GRBG flipped both ways
+        for (unsigned int y = 0; y < in.height(); y++) {
+            for (unsigned int x = 0; x < in.width(); x++) {
+                ((short *)mirrored(in.width()-1-x, in.height()-1-y))[0] = ((short *)in(x, y))[0];
+            }
+        }
+        _bayerPattern = GBRG;
+        _f->image = mirrored;
+        Image flipped = demosaic(f, hq);
+        _bayerPattern = GRBG;
+        _f->image = in;
+        for (unsigned int y = 0; y < out.height(); y++) {
+            for (unsigned int x = 0; x < out.width(); x++) {
+                if (memcmp(flipped(x, y), out(out.width()-1-x, out.height()-1-y), 3)) {
+                    printf("%s demosaic of GBRG differs from mirrored GRBG at %d, %d\n", methodNames[i], x, y);
+                    return 1;
+                }
+            }
+        }
+
+        t1 = Time::now();
+        for (int j = 0; j < 4; j++) {
+            demosaic(f, hq);
+        }
+        printf("%s: %d\n", methodNames[i], (Time::now() - t1)/4000);
+    }
+
+    printf("Testing all demosaic methods agree on a flat image\n");
+    Image flat(in.size(), RAW);
+    data = (short *)flat(0, 0);
+    for (unsigned int i = 0; i < flat.width()*flat.height(); i++) {
+        *data++ = 400;
+    }
+    _f->image = flat;
+    Image flatFast = demosaic(f);
+    for (int i = 0; i < 2; i++) {
+        DemosaicOptions hq;
+        hq.method = methods[i];
+        Image out = demosaic(f, hq);
+        for (unsigned int y = 0; y < out.height(); y++) {
+            if (memcmp(out(0, y), flatFast(0, y), out.width()*3)) {
+                printf("%s demosaic of a flat image differs on row %d\n", methodNames[i], y);
+                return 1;
+            }
+        }
+    }
+    _f->image = in;
+
     printf("Testing basic thumbnail generation \n");
 
     Image in2(2592,1968, RAW);
@@ -99,7 +390,38 @@ int main(int argc, const char **argv) {
     }
     saveDump(in2, "thumb_in.tmp");
     _f->image = in2;
-    saveDump(makeThumbnail(f), "thumb_out.tmp");
+    Image thumb = makeThumbnail(f);
+    saveDump(thumb, "thumb_out.tmp");
+
+    printf("Testing threaded thumbnail matches serial thumbnail\n");
+    {
+        // Every bayer pattern, both scaled down and at a scale of one,
+        // which averages a 2x2 box instead of a scale x scale one. Ask
+        // for four threads, so the work is split even on one CPU.
+        FCam::BayerPattern thumbPatterns[] = {GRBG, RGGB, BGGR, GBRG};
+        Size thumbSizes[] = {Size(640, 480), Size(1600, 1200)};
+        for (int p = 0; p < 4; p++) {
+            _bayerPattern = thumbPatterns[p];
+            for (int s = 0; s < 2; s++) {
+                Image serialThumb = makeThumbnail(f, thumbSizes[s], 50.0f, 25, 2.2f, 1);
+                Image threadedThumb = makeThumbnail(f, thumbSizes[s], 50.0f, 25, 2.2f, 4);
+                if (!serialThumb.valid() || threadedThumb.size() != serialThumb.size()) {
+                    printf("Threaded %dx%d thumbnail of bayer pattern %d has the wrong size\n",
+                           thumbSizes[s].width, thumbSizes[s].height, thumbPatterns[p]);
+                    return 1;
+                }
+                for (unsigned int y = 0; y < serialThumb.height(); y++) {
+                    if (memcmp(serialThumb(0, y), threadedThumb(0, y), serialThumb.width()*3)) {
+                        printf("Threaded %dx%d thumbnail of bayer pattern %d differs from serial "
+                               "thumbnail on row %d\n", thumbSizes[s].width, thumbSizes[s].height,
+                               thumbPatterns[p], y);
+                        return 1;
+                    }
+                }
+            }
+        }
+        _bayerPattern = GRBG;
+    }
 
     #ifdef FCAM_ARCH_ARM
     printf("Testing thumbnail speed, N900-asm 2592x1968 GRBG -> 640x480 \n");
@@ -112,6 +434,28 @@ int main(int argc, const char **argv) {
     printf("%d\n", (Time::now() - t3)/10000);
     #endif
 
+    printf("Testing pyramid matches thumbnails\n");
+    std::vector<Image> pyramid = makePyramid(f, 20, 50.0f, 25, 2.2f, 0);
+    // 2592x1968 halves cleanly four times, then gets rounded down
+    if (pyramid.size() != 10 || pyramid[4].size() != Size(81, 61) || pyramid[9].size() != Size(2, 1)) {
+        printf("Pyramid has the wrong levels\n");
+        return 1;
+    }
+    // The first level is exactly a half size thumbnail, and the
+    // others are within rounding of the matching thumbnail
+    for (int l = 0; l < 3; l++) {
+        Image level = makeThumbnail(f, pyramid[l].size());
+        for (unsigned int y = 0; y < level.height(); y++) {
+            for (unsigned int x = 0; x < level.width()*3; x++) {
+                if (abs(level(0, y)[x] - pyramid[l](0, y)[x]) > (l == 0 ? 0 : 1)) {
+                    printf("Pyramid level %d differs from thumbnail by %d at byte %d of row %d\n", 
+                           l, pyramid[l](0, y)[x] - level(0, y)[x], x, y);
+                    return 1;
+                }
+            }
+        }
+    }
+
     printf("Testing thumbnail speed, generic 2591x1967 GRBG -> 640x480 \n");
     Image in3(2591,1967, RAW);
     _f->image = in3;
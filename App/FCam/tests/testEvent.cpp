@@ -0,0 +1,73 @@
+// testEvent.cpp - Checks that filtered event polling returns the
+// oldest matching event and leaves the rest in order, and that it
+// isn't slowed down by a flood of other events.
+
+#include <stdio.h>
+#include <FCam/Event.h>
+
+FCam::EventGenerator a, b;
+
+bool expect(bool found, const FCam::Event &e, int type, int data, FCam::EventGenerator *creator,
+            const char *what) {
+    if (!found || e.type != type || e.data != data || e.creator != creator) {
+        printf("%s: got %s event type %d data %d\n", what, found ? "an" : "no", e.type, e.data);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool ok = true;
+    FCam::Event e;
+
+    FCam::postEvent(FCam::Event::Warning, 1, "w1", &a);
+    FCam::postEvent(FCam::Event::Error, 2, "e2", &b);
+    FCam::postEvent(FCam::Event::Error, 3, "e3", &a);
+    FCam::postEvent(FCam::Event::Warning, 2, "w2", &b);
+    FCam::postEvent(FCam::Event::Error, 2, "e2a", &a);
+    FCam::postEvent(FCam::Event::ShutterPressed, 0, "s", NULL);
+
+    ok &= expect(FCam::getNextEvent(&e, FCam::Event::Error, 2, &a), e, FCam::Event::Error, 2, &a, "type, data and creator");
+    ok &= expect(FCam::getNextEvent(&e, FCam::Event::Error, &a), e, FCam::Event::Error, 3, &a, "type and creator");
+    ok &= expect(FCam::getNextEvent(&e, FCam::Event::Warning, 2), e, FCam::Event::Warning, 2, &b, "type and data");
+    ok &= expect(FCam::getNextEvent(&e, &b), e, FCam::Event::Error, 2, &b, "creator");
+    ok &= expect(!FCam::getNextEvent(&e, &b), e, FCam::Event::Error, 2, &b, "creator, none left");
+    ok &= expect(FCam::getNextEvent(&e, FCam::Event::ShutterPressed), e, FCam::Event::ShutterPressed, 0, NULL, "type");
+    ok &= expect(FCam::getNextEvent(&e), e, FCam::Event::Warning, 1, &a, "unfiltered");
+    if (FCam::getNextEvent(&e)) {
+        printf("An event was left over: %s\n", e.description.c_str());
+        ok = false;
+    }
+
+    // A storm of warnings shouldn't get in the way of picking out an
+    // error
+    const int storm = 100000;
+    for (int i = 0; i < storm; i++) {
+        FCam::postEvent(FCam::Event::Warning, FCam::Event::FrameLimitHit, "Frame limit hit", &a);
+    }
+    FCam::postEvent(FCam::Event::Error, FCam::Event::InternalError, "The one error", &b);
+    FCam::Time start = FCam::Time::now();
+    for (int i = 0; i < 1000; i++) {
+        FCam::postEvent(FCam::Event::ShutterPressed, i, "s", NULL);
+        FCam::getNextEvent(&e, FCam::Event::ShutterPressed);
+    }
+    ok &= expect(FCam::getNextEvent(&e, FCam::Event::Error), e, FCam::Event::Error, FCam::Event::InternalError, &b, "error after storm");
+    int elapsed = FCam::Time::now() - start;
+    if (elapsed > 100000) {
+        printf("Filtered polling took %d us behind %d other events\n", elapsed, storm);
+        ok = false;
+    }
+    int left = 0;
+    while (FCam::getNextEvent(&e)) left++;
+    if (left != storm) {
+        printf("%d of the %d storm events were left\n", left, storm);
+        ok = false;
+    }
+
+    if (!ok) {
+        printf("Event test failed\n");
+        return 1;
+    }
+    printf("Event test passed\n");
+    return 0;
+}
@@ -1,10 +1,24 @@
 #include "FCam/FCam.h"
 
 #include "../src/Debug.h"
+#include "../src/BufferPool.h"
 #include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
 
 using namespace FCam;
 
+// Make and drop lots of references to a shared image
+void *churnReferences(void *arg) {
+    Image *image = (Image *)arg;
+    for (int i = 0; i < 100000; i++) {
+        Image a(*image);
+        Image b = a.subImage(1, 1, Size(10, 10));
+        a = b;
+    }
+    return NULL;
+}
+
 int main(int argc, const char **argv) {
     printf("Testing the image class\n");
     
@@ -191,6 +205,20 @@ int main(int argc, const char **argv) {
     printf("  subImage2 = big.subImage(500,100,Size(big.size.width,100));\n");
     Image subImage2 = big.subImage(500,100,Size(big.width(),100));
     FCAM_IMAGE_DEBUG(subImage2);
+
+    printf("\nTesting views\n");
+    printf("  view = big.view(3, Size(10,10), RGB24, big.bytesPerRow())\n");
+    Image view = big.view(3, Size(10,10), RGB24, big.bytesPerRow());
+    FCAM_IMAGE_DEBUG(view);
+    if (!view.valid() || view(0, 1) != big(0, 1) + 3) {
+        printf("View doesn't point into the right place\n");
+        return 1;
+    }
+    printf("  big.view(1, big.size(), big.type()) should fail\n");
+    if (big.view(1, big.size(), big.type()).valid()) {
+        printf("View past the end of the image was allowed\n");
+        return 1;
+    }
     
     printf("\nTesting image copy\n");
     FCAM_IMAGE_DEBUG(small);
@@ -221,6 +249,69 @@ int main(int argc, const char **argv) {
     FCAM_IMAGE_DEBUG(subImage2);
     FCAM_IMAGE_DEBUG(small);
 
+    printf("\nTesting sharing references across threads\n");
+    {
+        Image shared(640, 480, UYVY);
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            pthread_create(&threads[i], NULL, churnReferences, &shared);
+        }
+        for (int i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        Image extra(shared);
+        if (!extra.lock(0)) {
+            printf("ERROR: image lock was left held after threaded reference churn\n");
+            return 1;
+        }
+        extra.unlock();
+        FCAM_IMAGE_DEBUG(shared);
+    }
+
+    printf("\nTesting buffer reuse\n");
+    {
+        unsigned char *first;
+        {
+            Image frame(2592, 1968, RAW);
+            first = frame(0, 0);
+        }
+        BufferPool::Stats before = imageBufferPool().stats();
+        for (int i = 0; i < 100; i++) {
+            Image frame(2592, 1968, RAW);
+            if (frame(0, 0) != first) {
+                printf("ERROR: a freed frame buffer was not reused\n");
+                return 1;
+            }
+        }
+        BufferPool::Stats after = imageBufferPool().stats();
+        printf("  %d hits and %d misses for 100 frames\n", 
+               after.hits - before.hits, after.misses - before.misses);
+        if (after.misses != before.misses) {
+            printf("ERROR: frame allocations went to the system allocator\n");
+            return 1;
+        }
+        if (((size_t)first) % getpagesize()) {
+            printf("ERROR: frame buffer isn't page aligned\n");
+            return 1;
+        }
+
+        Image::setBufferCacheLimit(0);
+        if (imageBufferPool().stats().cachedBytes != 0) {
+            printf("ERROR: turning off the buffer cache didn't empty it\n");
+            return 1;
+        }
+        Image::setBufferCacheLimit(32*1024*1024);
+
+        // Classes are at most a quarter of a power of two apart
+        for (size_t n = 1; n < 100000000; n = n*3+1) {
+            size_t c = BufferPool::classSize(n);
+            if (c < n || (n > 64 && c > n + n/4 + 64)) {
+                printf("ERROR: bad size class %d for %d bytes\n", (int)c, (int)n);
+                return 1;
+            }
+        }
+    }
+
     printf("Success!\n");
     return 0; 
 }
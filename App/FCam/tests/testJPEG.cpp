@@ -1,9 +1,80 @@
 // TestJPEG.cpp - Simple JPEG saving code test
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <vector>
 #include <FCam/Dummy.h>
 
+extern "C" {
+#include <jpeglib.h>
+}
+
+// Decode a JPEG into interleaved samples of the given color
+// space. Returns false if it couldn't be read, or libjpeg found
+// anything wrong with it.
+bool decodeJPEG(const char *filename, J_COLOR_SPACE colorSpace,
+                std::vector<unsigned char> *out, int *width, int *height) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = colorSpace;
+    jpeg_start_decompress(&cinfo);
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    out->resize(cinfo.output_width * cinfo.output_height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPLE *row = &(*out)[cinfo.output_scanline * cinfo.output_width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(f);
+    return jerr.num_warnings == 0;
+}
+
+// Check that saving with several threads decodes to exactly the
+// same image as saving with one
+bool sameDecoded(const char *serial, const char *parallel) {
+    std::vector<unsigned char> a, b;
+    int aw, ah, bw, bh;
+    if (!decodeJPEG(serial, JCS_RGB, &a, &aw, &ah)) {
+        printf("Could not decode %s\n", serial);
+        return false;
+    }
+    if (!decodeJPEG(parallel, JCS_RGB, &b, &bw, &bh)) {
+        printf("Could not decode %s cleanly\n", parallel);
+        return false;
+    }
+    if (aw != bw || ah != bh || a != b) {
+        printf("%s (%dx%d) does not decode to the same image as %s (%dx%d)\n",
+               parallel, bw, bh, serial, aw, ah);
+        return false;
+    }
+    return true;
+}
+
+// Check whether a JPEG has restart markers, which only compressing
+// in bands on several threads puts in
+bool hasRestarts(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    bool found = false;
+    int last = 0, c;
+    while (!found && (c = fgetc(f)) != EOF) {
+        found = last == 0xff && c >= 0xd0 && c <= 0xd7;
+        last = c;
+    }
+    fclose(f);
+    return found;
+}
+
 int main(int argc, char **argv) {
+    bool failed = false;
     
     FCam::Dummy::Sensor sensor;
 
@@ -20,6 +91,80 @@ int main(int argc, char **argv) {
 
     saveJPEG(frame, testName);
 
+    // RAW frames get demosaicked a strip at a time on the way out
+    shot.image = FCam::Image(sensor.maxImageSize(), FCam::RAW);
+    sensor.capture(shot);
+    frame = sensor.getFrame();
+
+    saveJPEG(frame, std::string("testJPG_2.jpg"));
+
+    // Compressing in bands on several threads changes only the
+    // bitstream, not the decoded image
+    saveJPEG(frame, std::string("testJPG_3.jpg"), 80, 4);
+    if (!sameDecoded("testJPG_2.jpg", "testJPG_3.jpg")) failed = true;
+
+    // A frame shorter than a band per thread is still split between
+    // the threads
+    shot.image = FCam::Image(640, 480, FCam::RAW);
+    sensor.capture(shot);
+    FCam::Dummy::Frame shortFrame = sensor.getFrame();
+    saveJPEG(shortFrame, std::string("testJPG_8.jpg"));
+    saveJPEG(shortFrame, std::string("testJPG_9.jpg"), 80, 4);
+    if (!sameDecoded("testJPG_8.jpg", "testJPG_9.jpg")) failed = true;
+    if (!hasRestarts("testJPG_9.jpg")) {
+        printf("testJPG_9.jpg was not compressed in bands\n");
+        failed = true;
+    }
+
+    // Sizes that aren't a whole number of MCUs or bands
+    FCam::Image rgb(1001, 777, FCam::RGB24);
+    for (unsigned y = 0; y < rgb.height(); y++) {
+        for (unsigned x = 0; x < rgb.width()*3; x++) {
+            rgb(0, y)[x] = (unsigned char)((x*x + y*7) >> 3);
+        }
+    }
+    saveJPEG(rgb, std::string("testJPG_4.jpg"), 90);
+    saveJPEG(rgb, std::string("testJPG_5.jpg"), 90, 3);
+    if (!sameDecoded("testJPG_4.jpg", "testJPG_5.jpg")) failed = true;
+
+    // UYVY goes in as 4:2:2 planes, so decoding gives back close to
+    // the original samples
+    FCam::Image uyvy(1002, 777, FCam::UYVY);
+    for (unsigned y = 0; y < uyvy.height(); y++) {
+        for (unsigned x = 0; x < uyvy.width(); x += 2) {
+            unsigned char *p = uyvy(x, y);
+            p[0] = (unsigned char)(128 + (x/8) % 64);
+            p[1] = (unsigned char)(x/4 + y/4);
+            p[2] = (unsigned char)(96 + (y/8) % 64);
+            p[3] = (unsigned char)(x/4 + y/4 + 1);
+        }
+    }
+    saveJPEG(uyvy, std::string("testJPG_6.jpg"), 95);
+    saveJPEG(uyvy, std::string("testJPG_7.jpg"), 95, 4);
+    if (!sameDecoded("testJPG_6.jpg", "testJPG_7.jpg")) failed = true;
+
+    std::vector<unsigned char> ycc;
+    int w, h;
+    if (!decodeJPEG("testJPG_7.jpg", JCS_YCbCr, &ycc, &w, &h) || 
+        w != (int)uyvy.width() || h != (int)uyvy.height()) {
+        printf("Could not decode UYVY JPEG\n");
+        failed = true;
+    } else {
+        double error = 0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                unsigned char *p = uyvy(x & ~1, y);
+                unsigned char *q = &ycc[(y*w + x)*3];
+                error += abs(q[0] - p[1 + 2*(x & 1)]) + abs(q[1] - p[0]) + abs(q[2] - p[2]);
+            }
+        }
+        error /= 3.0 * w * h;
+        if (error > 2) {
+            printf("UYVY JPEG decodes with a mean error of %f\n", error);
+            failed = true;
+        }
+    }
+
     FCam::Event e;
     bool errors = false;
     if (FCam::getNextEvent(&e, FCam::Event::Error)) {
@@ -29,12 +174,13 @@ int main(int argc, char **argv) {
                 printf("** FCam error [%d] %d at %s: %s\n", e.type, e.data, e.time.toString().c_str(), e.description.c_str());
             }
         } while (FCam::getNextEvent(&e, FCam::Event::Error));
-        if (errors) {
-            printf ("Error during JPEG testing\n");
-            return 1;
-        }
+        if (errors) failed = true;
     }
 
-    
-
+    if (failed) {
+        printf ("Error during JPEG testing\n");
+        return 1;
+    }
+    printf("JPEG test passed\n");
+    return 0;
 }
@@ -0,0 +1,213 @@
+// testRingQueue.cpp - Checks that the lock-free ring queues deliver
+// every item exactly once, in order from each producer, when full,
+// empty, and contended, and that the Dummy sensor which uses them
+// copes with bursts longer than its queues.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <vector>
+#include <FCam/RingQueue.h>
+#include <FCam/Time.h>
+#include <FCam/Dummy.h>
+
+const int itemsPerProducer = 200000;
+const int producers = 4;
+const int consumers = 4;
+
+// Items encode their producer in the top bits and a count in the
+// rest
+struct Run {
+    FCam::MPMCQueue<int> *mpmc;
+    FCam::SPSCQueue<int> *spsc;
+    int id;
+    std::vector<int> seen;
+    bool outOfOrder;
+};
+
+void *produce(void *arg) {
+    Run *r = (Run *)arg;
+    for (int i = 0; i < itemsPerProducer; i++) {
+        if (r->mpmc) r->mpmc->push((r->id << 24) | i);
+        else r->spsc->push((r->id << 24) | i);
+    }
+    return NULL;
+}
+
+void *consume(void *arg) {
+    Run *r = (Run *)arg;
+    std::vector<int> last(producers, -1);
+    r->outOfOrder = false;
+    r->seen.assign(producers, 0);
+    while (1) {
+        int v = r->mpmc ? r->mpmc->pull() : r->spsc->pull();
+        if (v < 0) break;
+        int p = v >> 24, i = v & 0xffffff;
+        // Each consumer sees a given producer's items in the order
+        // they were pushed
+        if (i <= last[p]) r->outOfOrder = true;
+        last[p] = i;
+        r->seen[p]++;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    bool failed = false;
+
+    // Single producer, single consumer, through a small ring so that
+    // both sides have to wait
+    {
+        FCam::SPSCQueue<int> q(16);
+        Run prod, cons;
+        prod.mpmc = cons.mpmc = NULL;
+        prod.spsc = cons.spsc = &q;
+        prod.id = 0;
+        pthread_t pt, ct;
+        pthread_create(&ct, NULL, consume, &cons);
+        pthread_create(&pt, NULL, produce, &prod);
+        pthread_join(pt, NULL);
+        q.push(-1);
+        pthread_join(ct, NULL);
+        if (cons.seen[0] != itemsPerProducer || cons.outOfOrder) {
+            printf("SPSC queue delivered %d of %d items%s\n", cons.seen[0], itemsPerProducer,
+                   cons.outOfOrder ? ", out of order" : "");
+            failed = true;
+        }
+    }
+
+    // Many producers and consumers
+    {
+        FCam::MPMCQueue<int> q(64);
+        Run prod[producers], cons[consumers];
+        pthread_t pt[producers], ct[consumers];
+        for (int i = 0; i < consumers; i++) {
+            cons[i].mpmc = &q;
+            cons[i].spsc = NULL;
+            pthread_create(&ct[i], NULL, consume, &cons[i]);
+        }
+        for (int i = 0; i < producers; i++) {
+            prod[i].mpmc = &q;
+            prod[i].spsc = NULL;
+            prod[i].id = i;
+            pthread_create(&pt[i], NULL, produce, &prod[i]);
+        }
+        for (int i = 0; i < producers; i++) pthread_join(pt[i], NULL);
+        for (int i = 0; i < consumers; i++) q.push(-1);
+        for (int i = 0; i < consumers; i++) pthread_join(ct[i], NULL);
+        for (int p = 0; p < producers; p++) {
+            int total = 0;
+            for (int i = 0; i < consumers; i++) {
+                total += cons[i].seen[p];
+                if (cons[i].outOfOrder) {
+                    printf("MPMC consumer %d saw items out of order\n", i);
+                    failed = true;
+                }
+            }
+            if (total != itemsPerProducer) {
+                printf("MPMC queue delivered %d of %d items from producer %d\n", total, itemsPerProducer, p);
+                failed = true;
+            }
+        }
+        if (!q.empty()) {
+            printf("MPMC queue has %d items left over\n", (int)q.size());
+            failed = true;
+        }
+    }
+
+    // Full and empty, without blocking
+    {
+        FCam::MPMCQueue<int> q(5);
+        int v;
+        if (q.capacity() != 8 || q.tryPull(&v)) {
+            printf("New MPMC queue has capacity %d, or isn't empty\n", (int)q.capacity());
+            failed = true;
+        }
+        for (int i = 0; i < 8; i++) {
+            if (!q.tryPush(i)) {
+                printf("MPMC push %d failed before the queue was full\n", i);
+                failed = true;
+            }
+        }
+        if (q.tryPush(8) || q.size() != 8) {
+            printf("MPMC push succeeded on a full queue\n");
+            failed = true;
+        }
+        if (!q.tryPull(&v) || v != 0 || !q.tryPush(8)) {
+            printf("MPMC queue didn't make room after a pull\n");
+            failed = true;
+        }
+
+        FCam::SPSCQueue<int> s(4);
+        for (int i = 0; i < 4; i++) s.tryPush(i);
+        if (s.tryPush(4) || s.front() != 0) {
+            printf("SPSC push succeeded on a full queue\n");
+            failed = true;
+        }
+        s.pop();
+        if (s.front() != 1 || s.size() != 3) {
+            printf("SPSC pop didn't remove the front item\n");
+            failed = true;
+        }
+    }
+
+    // Timeouts
+    {
+        FCam::MPMCQueue<int> q(2);
+        FCam::Time start = FCam::Time::now();
+        bool got = q.wait(20000);
+        int waited = FCam::Time::now() - start;
+        if (got || waited < 20000 || waited > 500000) {
+            printf("Waiting 20 ms on an empty queue returned %d after %d us\n", got, waited);
+            failed = true;
+        }
+        q.push(1);
+        q.push(2);
+        if (q.waitForRoom(1000) || !q.wait(1000)) {
+            printf("Waits on a full queue gave the wrong answer\n");
+            failed = true;
+        }
+    }
+
+    // A burst longer than the Dummy sensor's request and frame queues
+    // put together, collected only once it has all been captured,
+    // then a streaming burst longer than the request queue
+    {
+        FCam::Dummy::Sensor sensor;
+        FCam::Dummy::Shot shot;
+        shot.exposure = 50;
+        shot.frameTime = 50;
+        std::vector<FCam::Dummy::Shot> burst(1400, shot);
+        sensor.capture(burst);
+        int inOrder = 0;
+        for (size_t i = 0; i < burst.size(); i++) {
+            FCam::Dummy::Frame f = sensor.getFrame();
+            if (f.shot().id == burst[i].id) inOrder++;
+        }
+        if (inOrder != (int)burst.size()) {
+            printf("Dummy sensor returned %d of a %d shot burst in order\n", inOrder, (int)burst.size());
+            failed = true;
+        }
+
+        burst.resize(1100);
+        sensor.stream(burst);
+        inOrder = 0;
+        for (size_t i = 0; i < 2 * burst.size(); i++) {
+            FCam::Dummy::Frame f = sensor.getFrame();
+            if (f.shot().id == burst[i % burst.size()].id) inOrder++;
+        }
+        sensor.stopStreaming();
+        if (inOrder != 2 * (int)burst.size()) {
+            printf("Dummy sensor streamed %d of %d frames of a %d shot burst in order\n",
+                   inOrder, 2 * (int)burst.size(), (int)burst.size());
+            failed = true;
+        }
+        sensor.stop();
+    }
+
+    if (failed) {
+        printf("Ring queue test failed\n");
+        return 1;
+    }
+    printf("Ring queue test passed\n");
+    return 0;
+}
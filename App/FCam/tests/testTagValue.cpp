@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
 
 template<typename T>
 std::ostream &operator<<(std::ostream &out, std::vector<T> v) {
@@ -208,6 +210,45 @@ int main() {
     bad[3] = 'y';
     testParse(bad);
 
+    std::cout << std::endl << "Testing in-place storage" << std::endl;
+    {
+        FCam::TagValue a = 42;
+        FCam::TagValue b = a;
+        if ((char *)a.data < (char *)&a || (char *)a.data >= (char *)(&a + 1) ||
+            b.data == a.data || (int)b != 42) {
+            std::cout << "ERROR: an int tag isn't stored in place" << std::endl;
+            return 1;
+        }
+
+        // Assigning part of a tag's own value to it
+        a = std::vector<int>(3, 7);
+        a = a.asIntVector()[1];
+        FCam::TagValue s = std::vector<std::string>(2, std::string("a string too long for the small string buffer"));
+        s = s.asStringVector()[0];
+        if (a.type != FCam::TagValue::Int || (int)a != 7 ||
+            s.type != FCam::TagValue::String || s.asString().size() != 45) {
+            std::cout << "ERROR: assigning a tag part of its own value went wrong" << std::endl;
+            return 1;
+        }
+
+        // Swapping hands over the contents without copying them
+        FCam::TagValue big = std::vector<double>(1000, 1.5);
+        double *contents = &big.asDoubleVector()[0];
+        FCam::TagValue when = FCam::Time(12, 34);
+        big.swap(when);
+        if (big.type != FCam::TagValue::Time || big.asTime() != FCam::Time(12, 34) ||
+            when.type != FCam::TagValue::DoubleVector || &when.asDoubleVector()[0] != contents) {
+            std::cout << "ERROR: swapping tags went wrong" << std::endl;
+            return 1;
+        }
+        when.swap(when);
+        if (when.asDoubleVector().size() != 1000) {
+            std::cout << "ERROR: swapping a tag with itself went wrong" << std::endl;
+            return 1;
+        }
+        std::cout << "In-place storage OK" << std::endl;
+    }
+
     std::vector<double> v;
     FCam::TagValue bigVec = v;
     std::vector<double> &bv = bigVec;
@@ -116,9 +116,9 @@ int main(int argc, char **argv) {
 
     FCam::DNGFrame f = FCam::loadDNG(inputFile);
 
-    if (FCam::_eventQueue.size() > 0) {
+    if (getNextEvent(&e)) {
         printf("  Events reported while loading DNG:\n");
-        while (getNextEvent(&e)) {
+        do {
             switch (e.type) {
             case FCam::Event::Error:
                 printf("    Error code: %d. Description: %s\n", e.data, e.description.c_str());
@@ -130,7 +130,7 @@ int main(int argc, char **argv) {
                 printf("    Event type %d, code: %d. Description: %s\n", e.type, e.data, e.description.c_str());
                 break;
             }
-        }
+        } while (getNextEvent(&e));
     }
 
     if (!f.valid()) {
@@ -145,9 +145,9 @@ int main(int argc, char **argv) {
     if (writeJPEG) {
         printf("  Demosaicing with contrast %d, black level %d, gamma %f %s\n", contrast, blackLevel, gamma, denoise ? "":"(Denoising off)");
         FCam::Image jpegImg = FCam::demosaic(f, contrast, denoise, blackLevel, gamma);        
-        if (FCam::_eventQueue.size() > 0) {
+        if (getNextEvent(&e)) {
             printf("Events reported while demosaicing DNG:\n");
-            while (getNextEvent(&e)) {
+            do {
                 switch (e.type) {
                 case FCam::Event::Error:
                     printf("  Error code: %d. Description: %s\n", e.data, e.description.c_str());
@@ -159,7 +159,7 @@ int main(int argc, char **argv) {
                     printf("  Event type %d, code: %d. Description: %s\n", e.type, e.data, e.description.c_str());
                     break;
                 }
-            }
+            } while (getNextEvent(&e));
         }        
         if (!jpegImg.valid()) {
             printf("!! Error: Unable to demosaic input file %s\n", inputFile.c_str());
@@ -168,9 +168,9 @@ int main(int argc, char **argv) {
         printf("  Writing to %s, quality %d\n", outputFile.c_str(), quality);
         saveJPEG(jpegImg, outputFile, quality);
 
-        if (FCam::_eventQueue.size() > 0) {
+        if (getNextEvent(&e)) {
             printf("Events reported while saving JPEG:\n");
-            while (getNextEvent(&e)) {
+            do {
                 switch (e.type) {
                 case FCam::Event::Error:
                     printf("  Error code: %d. Description: %s\n", e.data, e.description.c_str());
@@ -182,16 +182,16 @@ int main(int argc, char **argv) {
                     printf("  Event type %d, code: %d. Description: %s\n", e.type, e.data, e.description.c_str());
                     break;
                 }
-            }
+            } while (getNextEvent(&e));
         }
               
     } else if (writeDNG) {
         printf("  Writing updated DNG to %s\n", outputFile.c_str());
         FCam::saveDNG(f, outputFile);
         
-        if (FCam::_eventQueue.size() > 0) {
+        if (getNextEvent(&e)) {
             printf("  Events reported while saving to %s:\n", outputFile.c_str());
-            while (getNextEvent(&e)) {
+            do {
                 switch (e.type) {
                 case FCam::Event::Error:
                     printf("    Error code: %d. Description: %s\n", e.data, e.description.c_str());
@@ -203,7 +203,7 @@ int main(int argc, char **argv) {
                     printf("    Event type %d, code: %d. Description: %s\n", e.type, e.data, e.description.c_str());
                     break;
                 }
-            }
+            } while (getNextEvent(&e));
         }
     }
     printf("  Done!\n");
@@ -131,7 +131,9 @@ void ImageItem::loadThumbnail() {
         lock.unlock();
         return;
     }
-    FCam::DNGFrame frame = FCam::loadDNG(this->fullPath().toStdString());
+    // Only the thumbnail is needed, so leave the RAW data on disk
+    // unless there's no thumbnail to be found
+    FCam::DNGFrame frame = FCam::loadDNGMetadata(this->fullPath().toStdString());
     if (frame.valid()) {
         thumb = frame.thumbnail();
         if (!thumb.valid()) {